@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+/*
+ * Measures how fast many small encrypted databases are opened, queried for the first time and closed, as in a
+ * multi-tenant service that keeps no connections open. Each phase is timed on its own: opening covers the VFS setup,
+ * the codec and the registry, the first query reads the keyfile and unwraps the key, closing unregisters the database.
+ * Databases are opened with the thread-safe sqlite3_open_encrypted_v2(), and once single-threaded with
+ * sqlite3_open_encrypted(), which makes the VFS the default for each open and releases it again.
+ *
+ * Usage: CryptoSQLite_ChurnBench [databases] [max threads] [rounds]
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include <cryptosqlite/cryptosqlite.h>
+#include "TestCrypt.h"
+
+namespace {
+    const char *DIRECTORY = "bench-churn";
+    const char *KEY = "benchmarkkey";
+
+    using Clock = std::chrono::steady_clock;
+
+    struct Options {
+        int databases;
+        unsigned maxThreads;
+        int rounds;
+    };
+
+    struct Result {
+        uint64_t errors = 0;
+        // per database, in nanoseconds
+        std::vector<uint64_t> open, query, close;
+    };
+
+    void check(int rc, sqlite3 *db, const char *what) {
+        if (rc != SQLITE_OK && rc != SQLITE_ROW && rc != SQLITE_DONE) {
+            fprintf(stderr, "%s failed: %s\n", what, db ? sqlite3_errmsg(db) : sqlite3_errstr(rc));
+            exit(1);
+        }
+    }
+
+    std::string databaseName(int i) {
+        return std::string(DIRECTORY) + "/tenant-" + std::to_string(i) + ".db";
+    }
+
+    void removeDatabases(int databases) {
+        for (int i = 0; i < databases; i++) {
+            for (const char *suffix : {"", "-keyfile", "-journal", "-redo"})
+                std::remove((databaseName(i) + suffix).c_str());
+        }
+        std::remove(DIRECTORY);
+    }
+
+    uint64_t elapsed(Clock::time_point start, Clock::time_point end) {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+    }
+
+    /**
+     * Runs the given function for every database, distributed over the given number of threads
+     */
+    template<typename F>
+    double forEachDatabase(int databases, unsigned threads, F &&function) {
+        std::atomic<int> next {0};
+        std::vector<std::thread> workers;
+
+        Clock::time_point start = Clock::now();
+        for (unsigned t = 0; t < threads; t++) {
+            workers.emplace_back([&, t] {
+                for (int i; (i = next++) < databases; )
+                    function(t, i);
+            });
+        }
+        for (auto &worker : workers)
+            worker.join();
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    void populate(const Options &options) {
+        removeDatabases(options.databases);
+        mkdir(DIRECTORY, 0755);
+
+        double seconds = forEachDatabase(options.databases, options.maxThreads, [] (unsigned, int i) {
+            sqlite3 *db = nullptr;
+            std::string name = databaseName(i);
+            check(sqlite3_open_encrypted_v2(name.c_str(), &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, KEY,
+                                            static_cast<int>(strlen(KEY)), nullptr), db, "create");
+            check(sqlite3_exec(db, "CREATE TABLE kv (id INTEGER PRIMARY KEY, value TEXT);"
+                                   "INSERT INTO kv VALUES (1, 'tenant'), (2, hex(randomblob(32)));",
+                               nullptr, nullptr, nullptr), db, "populate");
+            check(sqlite3_close(db), nullptr, "close");
+        });
+        printf("created %d databases in %.2f s (%.0f/s)\n\n", options.databases, seconds, options.databases / seconds);
+    }
+
+    /**
+     * @param named Open with sqlite3_open_encrypted_v2(), otherwise with sqlite3_open_encrypted() which is not
+     * thread-safe
+     */
+    void run(const Options &options, unsigned threads, bool named) {
+        cryptosqlite::resetLockStats();
+        std::vector<Result> results(threads);
+
+        double seconds = 0;
+        for (int round = 0; round < options.rounds; round++) {
+            seconds += forEachDatabase(options.databases, threads, [&results, named] (unsigned t, int i) {
+                Result &result = results[t];
+                sqlite3 *db = nullptr;
+                std::string name = databaseName(i);
+
+                Clock::time_point start = Clock::now();
+                int rc = named ? sqlite3_open_encrypted_v2(name.c_str(), &db, SQLITE_OPEN_READWRITE, KEY,
+                                                           static_cast<int>(strlen(KEY)), nullptr)
+                               : sqlite3_open_encrypted(name.c_str(), &db, KEY, static_cast<int>(strlen(KEY)));
+                Clock::time_point opened = Clock::now();
+
+                sqlite3_stmt *stmt = nullptr;
+                if (rc == SQLITE_OK)
+                    rc = sqlite3_prepare_v2(db, "SELECT value FROM kv WHERE id = 1;", -1, &stmt, nullptr);
+                if (rc == SQLITE_OK)
+                    rc = sqlite3_step(stmt) == SQLITE_ROW ? SQLITE_OK : SQLITE_ERROR;
+                sqlite3_finalize(stmt);
+                Clock::time_point queried = Clock::now();
+
+                if (sqlite3_close(db) != SQLITE_OK)
+                    rc = SQLITE_ERROR;
+                Clock::time_point closed = Clock::now();
+
+                result.open.push_back(elapsed(start, opened));
+                result.query.push_back(elapsed(opened, queried));
+                result.close.push_back(elapsed(queried, closed));
+                if (rc != SQLITE_OK)
+                    result.errors++;
+            });
+        }
+
+        cryptosqlite::LockContention registry {}, connection {};
+        cryptosqlite::lockStats(registry, connection);
+
+        Result total;
+        for (auto &result : results) {
+            total.errors += result.errors;
+            total.open.insert(total.open.end(), result.open.begin(), result.open.end());
+            total.query.insert(total.query.end(), result.query.begin(), result.query.end());
+            total.close.insert(total.close.end(), result.close.begin(), result.close.end());
+        }
+        auto percentile = [] (std::vector<uint64_t> &latencies, double p) {
+            if (latencies.empty())
+                return 0.0;
+            auto nth = latencies.begin() + static_cast<ptrdiff_t>(p * (latencies.size() - 1));
+            std::nth_element(latencies.begin(), nth, latencies.end());
+            return *nth / 1000.0;
+        };
+
+        printf("%7s %7u %10.0f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %7llu %14llu/%-9llu %9.3f\n",
+               named ? "v2" : "default", threads, options.databases * options.rounds / seconds,
+               percentile(total.open, 0.5), percentile(total.open, 0.99), percentile(total.query, 0.5),
+               percentile(total.query, 0.99),
+               percentile(total.close, 0.5), percentile(total.close, 0.99),
+               static_cast<unsigned long long>(total.errors), static_cast<unsigned long long>(registry.contended),
+               static_cast<unsigned long long>(registry.acquisitions), registry.waitNanoseconds / 1e6);
+        fflush(stdout);
+    }
+}
+
+int main(int argc, char **argv) {
+    Options options {};
+    options.databases = argc > 1 ? atoi(argv[1]) : 10000;
+    options.maxThreads = argc > 2 ? static_cast<unsigned>(atoi(argv[2])) : std::thread::hardware_concurrency();
+    options.rounds = argc > 3 ? atoi(argv[3]) : 1;
+    if (options.databases <= 0 || options.maxThreads == 0 || options.rounds <= 0) {
+        fprintf(stderr, "usage: %s [databases] [max threads] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+    populate(options);
+
+    // thread counts double up to the maximum
+    std::vector<unsigned> threadCounts;
+    for (unsigned threads = 1; threads < options.maxThreads; threads *= 2)
+        threadCounts.push_back(threads);
+    threadCounts.push_back(options.maxThreads);
+
+    printf("%7s %7s %10s %9s %9s %9s %9s %9s %9s %7s %24s %9s\n", "open", "threads", "dbs/s", "open p50", "open p99",
+           "query p50", "query p99", "close p50", "close p99", "errors", "registry waits/locks", "wait ms");
+    printf("%7s %7s %10s %9s %9s %9s %9s %9s %9s\n", "", "", "", "us", "us", "us", "us", "us", "us");
+    // the default VFS is switched for every open, which only one thread may do at a time
+    run(options, 1, false);
+    for (unsigned threads : threadCounts)
+        run(options, threads, true);
+
+    removeDatabases(options.databases);
+    return 0;
+}
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Measures how reads through the codec scale with threads, on one shared connection and on one connection per thread.
+ * Reports throughput, latency percentiles and the contention of the codec's own locks for each run.
+ *
+ * Usage: CryptoSQLite_ConcurrencyBench [max threads] [seconds per run] [rows] [write percent]
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cryptosqlite/cryptosqlite.h>
+#include "TestCrypt.h"
+
+namespace {
+    const char *DB_NAME = "bench-concurrency.db";
+    const char *KEY = "benchmarkkey";
+
+    using Clock = std::chrono::steady_clock;
+
+    struct Options {
+        unsigned maxThreads;
+        double seconds;
+        int rows;
+        int writePercent;
+    };
+
+    struct Result {
+        uint64_t ops = 0;
+        uint64_t errors = 0;
+        // per operation, in nanoseconds
+        std::vector<uint32_t> latencies;
+    };
+
+    void check(int rc, sqlite3 *db, const char *what) {
+        if (rc != SQLITE_OK && rc != SQLITE_ROW && rc != SQLITE_DONE) {
+            fprintf(stderr, "%s failed: %s\n", what, db ? sqlite3_errmsg(db) : sqlite3_errstr(rc));
+            exit(1);
+        }
+    }
+
+    void removeDatabase() {
+        for (const char *suffix : {"", "-keyfile", "-wal", "-shm", "-journal", "-redo"})
+            std::remove((std::string(DB_NAME) + suffix).c_str());
+    }
+
+    sqlite3 *open() {
+        sqlite3 *db = nullptr;
+        int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX;
+        check(sqlite3_open_encrypted_v2(DB_NAME, &db, flags, KEY, static_cast<int>(strlen(KEY)), nullptr), db, "open");
+        // a small page cache, so most reads go through the codec
+        check(sqlite3_exec(db, "PRAGMA cache_size=-256; PRAGMA busy_timeout=10000;", nullptr, nullptr, nullptr), db,
+              "configure");
+        return db;
+    }
+
+    void populate(int rows) {
+        removeDatabase();
+        sqlite3 *db = open();
+        std::string sql = "PRAGMA journal_mode=WAL; CREATE TABLE kv (id INTEGER PRIMARY KEY, value TEXT);"
+                          "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < " +
+                          std::to_string(rows) + ") INSERT INTO kv SELECT i, hex(randomblob(48)) FROM n;";
+        check(sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr), db, "populate");
+        check(sqlite3_close(db), nullptr, "close");
+    }
+
+    /**
+     * Runs point reads, and writes for the given share of operations, until the deadline
+     */
+    void work(sqlite3 *db, const Options &options, unsigned seed, const std::atomic<bool> &start,
+              const Clock::time_point &deadline, Result &result) {
+        sqlite3_stmt *read, *write;
+        check(sqlite3_prepare_v2(db, "SELECT value FROM kv WHERE id = ?1;", -1, &read, nullptr), db, "prepare");
+        check(sqlite3_prepare_v2(db, "UPDATE kv SET value = hex(randomblob(48)) WHERE id = ?1;", -1, &write, nullptr),
+              db, "prepare");
+
+        std::mt19937 random(seed);
+        std::uniform_int_distribution<int> ids(1, options.rows), percent(0, 99);
+        while (!start.load(std::memory_order_acquire))
+            std::this_thread::yield();
+
+        for (Clock::time_point now = Clock::now(); now < deadline; ) {
+            sqlite3_stmt *stmt = percent(random) < options.writePercent ? write : read;
+            sqlite3_bind_int(stmt, 1, ids(random));
+            int rc;
+            while ((rc = sqlite3_step(stmt)) == SQLITE_ROW);
+            sqlite3_reset(stmt);
+
+            Clock::time_point end = Clock::now();
+            result.latencies.push_back(static_cast<uint32_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(end - now).count()));
+            if (rc == SQLITE_DONE)
+                result.ops++;
+            else
+                result.errors++;
+            now = end;
+        }
+
+        sqlite3_finalize(read);
+        sqlite3_finalize(write);
+    }
+
+    void run(const Options &options, bool shared, unsigned threads) {
+        // counts opens as well, connections of their own are opened concurrently by the workers
+        cryptosqlite::resetLockStats();
+        std::vector<sqlite3 *> connections(shared ? 1 : threads, nullptr);
+        if (shared)
+            connections[0] = open();
+
+        std::vector<Result> results(threads);
+        std::vector<std::thread> workers;
+        std::atomic<unsigned> ready {0};
+        std::atomic<bool> start {false};
+        Clock::time_point deadline;
+        for (unsigned i = 0; i < threads; i++) {
+            workers.emplace_back([&, i] {
+                if (!shared)
+                    connections[i] = open();
+                ready++;
+                work(connections[shared ? 0 : i], options, i + 1, start, deadline, results[i]);
+            });
+        }
+
+        while (ready < threads)
+            std::this_thread::yield();
+        deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(options.seconds));
+        start.store(true, std::memory_order_release);
+        for (auto &worker : workers)
+            worker.join();
+
+        cryptosqlite::LockContention registry {}, connection {};
+        cryptosqlite::lockStats(registry, connection);
+        for (sqlite3 *db : connections)
+            check(sqlite3_close(db), nullptr, "close");
+
+        Result total;
+        for (auto &result : results) {
+            total.ops += result.ops;
+            total.errors += result.errors;
+            total.latencies.insert(total.latencies.end(), result.latencies.begin(), result.latencies.end());
+        }
+        std::sort(total.latencies.begin(), total.latencies.end());
+        auto percentile = [&total] (double p) {
+            if (total.latencies.empty())
+                return 0.0;
+            return total.latencies[static_cast<size_t>(p * (total.latencies.size() - 1))] / 1000.0;
+        };
+
+        printf("%-11s %7u %12.0f %9.1f %9.1f %9.1f %7llu %14llu/%-9llu %9.3f %14llu/%-9llu %9.3f\n",
+               shared ? "shared" : "per-thread", threads, total.ops / options.seconds, percentile(0.5),
+               percentile(0.99), percentile(0.999), static_cast<unsigned long long>(total.errors),
+               static_cast<unsigned long long>(registry.contended),
+               static_cast<unsigned long long>(registry.acquisitions), registry.waitNanoseconds / 1e6,
+               static_cast<unsigned long long>(connection.contended),
+               static_cast<unsigned long long>(connection.acquisitions), connection.waitNanoseconds / 1e6);
+        fflush(stdout);
+    }
+}
+
+int main(int argc, char **argv) {
+    Options options {};
+    options.maxThreads = argc > 1 ? static_cast<unsigned>(atoi(argv[1])) : std::thread::hardware_concurrency();
+    options.seconds = argc > 2 ? atof(argv[2]) : 2.0;
+    options.rows = argc > 3 ? atoi(argv[3]) : 100000;
+    options.writePercent = argc > 4 ? atoi(argv[4]) : 0;
+    if (options.maxThreads == 0 || options.seconds <= 0 || options.rows <= 0) {
+        fprintf(stderr, "usage: %s [max threads] [seconds per run] [rows] [write percent]\n", argv[0]);
+        return 1;
+    }
+
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+    populate(options.rows);
+
+    // thread counts double up to the maximum
+    std::vector<unsigned> threadCounts;
+    for (unsigned threads = 1; threads < options.maxThreads; threads *= 2)
+        threadCounts.push_back(threads);
+    threadCounts.push_back(options.maxThreads);
+
+    printf("%-11s %7s %12s %9s %9s %9s %7s %24s %9s %24s %9s\n", "mode", "threads", "ops/s", "p50 us",
+           "p99 us", "p99.9 us", "errors", "registry waits/locks", "wait ms", "connection waits/locks", "wait ms");
+    for (bool shared : {true, false}) {
+        for (unsigned threads : threadCounts)
+            run(options, shared, threads);
+    }
+
+    removeDatabase();
+    return 0;
+}
@@ -0,0 +1,347 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+/*
+ * Replays an I/O trace recorded with cryptosqlite::setIOTrace against local files, to benchmark a production access
+ * pattern offline. Main database operations go through the codec on a scratch database encrypted with the test cipher,
+ * so they pay for encryption, decryption and authentication. Journals and WALs are replayed as plain reads and writes
+ * of the same size and offset on scratch files. Operations run in trace order on one thread, either back to back or
+ * paced like the trace.
+ *
+ * Prints count, volume and latency per file role and operation, as traced and as replayed.
+ *
+ * Usage: CryptoSQLite_TraceReplay <trace> [speed, 0 replays back to back]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cryptosqlite/cryptosqlite.h>
+#include "TestCrypt.h"
+
+namespace {
+    const char *KEY = "benchmarkkey";
+    const char *PREFIX = "trace-replay-";
+
+    using Clock = std::chrono::steady_clock;
+
+    // trace format, see src/util/IOTrace.h
+    const uint32_t TRACE_VERSION = 1;
+    const uint32_t HEADER_SIZE = 16;
+    const uint32_t RECORD_SIZE = 40;
+
+    enum Role : uint8_t {
+        ROLE_MAIN_DB = 1,
+        ROLE_JOURNAL = 2,
+        ROLE_SUBJOURNAL = 3,
+        ROLE_WAL = 4,
+    };
+
+    enum Op : uint8_t {
+        OP_OPEN = 1,
+        OP_CLOSE = 2,
+        OP_READ = 3,
+        OP_WRITE = 4,
+        OP_SYNC = 5,
+        OP_TRUNCATE = 6,
+    };
+
+    const char *ROLE_NAMES[] = {"?", "main db", "journal", "subjournal", "wal"};
+    const char *OP_NAMES[] = {"?", "open", "close", "read", "write", "sync", "truncate"};
+
+    struct Record {
+        uint64_t time;
+        uint32_t id;
+        uint8_t role;
+        uint8_t op;
+        uint16_t flags;
+        uint32_t pageNo;
+        uint32_t size;
+        int64_t offset;
+        uint32_t duration;
+        uint32_t cipher;
+    };
+
+    /**
+     * A file of the trace and the scratch file it is replayed on
+     */
+    struct Target {
+        uint8_t role = 0;
+        // main db: scratch database and its page size
+        sqlite3 *db = nullptr;
+        int pageSize = 0;
+        // the file operations are replayed on
+        sqlite3_file *file = nullptr;
+        // journals and WALs: memory of the raw file
+        std::vector<uint8_t> raw;
+        std::string name;
+    };
+
+    struct Stats {
+        uint64_t bytes = 0, errors = 0, cipherNs = 0;
+        std::vector<uint32_t> traced, replayed;
+    };
+
+    uint64_t get(const uint8_t *&in, int bytes) {
+        uint64_t value = 0;
+        for (int i = 0; i < bytes; i++)
+            value = (value << 8) | *in++;
+        return value;
+    }
+
+    bool load(const char *path, std::vector<Record> &records) {
+        FILE *file = fopen(path, "rb");
+        if (!file)
+            return false;
+        std::vector<uint8_t> data;
+        uint8_t block[1 << 16];
+        for (size_t read; (read = fread(block, 1, sizeof(block), file)) > 0; )
+            data.insert(data.end(), block, block + read);
+        fclose(file);
+
+        const uint8_t *in = data.data() + 8;
+        if (data.size() < HEADER_SIZE || memcmp(data.data(), "CSQTRACE", 8) != 0 || get(in, 4) != TRACE_VERSION ||
+            get(in, 4) != RECORD_SIZE)
+            return false;
+
+        // an incomplete last record is dropped
+        for (size_t i = HEADER_SIZE; i + RECORD_SIZE <= data.size(); i += RECORD_SIZE) {
+            in = data.data() + i;
+            Record record {};
+            record.time = get(in, 8);
+            record.id = static_cast<uint32_t>(get(in, 4));
+            record.role = static_cast<uint8_t>(get(in, 1));
+            record.op = static_cast<uint8_t>(get(in, 1));
+            record.flags = static_cast<uint16_t>(get(in, 2));
+            record.pageNo = static_cast<uint32_t>(get(in, 4));
+            record.size = static_cast<uint32_t>(get(in, 4));
+            record.offset = static_cast<int64_t>(get(in, 8));
+            record.duration = static_cast<uint32_t>(get(in, 4));
+            record.cipher = static_cast<uint32_t>(get(in, 4));
+            if (record.role >= ROLE_MAIN_DB && record.role <= ROLE_WAL && record.op >= OP_OPEN &&
+                record.op <= OP_TRUNCATE)
+                records.push_back(record);
+        }
+        return true;
+    }
+
+    void removeScratch(const std::string &name) {
+        for (const char *suffix : {"", "-keyfile", "-journal", "-wal", "-shm", "-redo"})
+            std::remove((name + suffix).c_str());
+    }
+
+    /**
+     * Creates the scratch database of a traced main database, with as many encrypted pages as the trace touches
+     */
+    bool openMainDB(uint32_t id, const std::vector<Record> &records, Target &target) {
+        target.name = PREFIX + std::to_string(id) + ".db";
+        removeScratch(target.name);
+        if (sqlite3_open_encrypted_v2(target.name.c_str(), &target.db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                                      KEY, static_cast<int>(strlen(KEY)), nullptr) != SQLITE_OK ||
+            sqlite3_exec(target.db, "CREATE TABLE replay (x);", nullptr, nullptr, nullptr) != SQLITE_OK ||
+            sqlite3_file_control(target.db, "main", SQLITE_FCNTL_FILE_POINTER, &target.file) != SQLITE_OK) {
+            fprintf(stderr, "creating %s failed: %s\n", target.name.c_str(), sqlite3_errmsg(target.db));
+            return false;
+        }
+
+        sqlite3_stmt *stmt;
+        sqlite3_prepare_v2(target.db, "PRAGMA page_size;", -1, &stmt, nullptr);
+        sqlite3_step(stmt);
+        target.pageSize = sqlite3_column_int(stmt, 0);
+        sqlite3_finalize(stmt);
+
+        sqlite3_int64 end = 0;
+        for (const Record &record : records) {
+            if (record.id == id && (record.op == OP_READ || record.op == OP_WRITE))
+                end = (std::max)(end, static_cast<sqlite3_int64>(record.offset + record.size));
+        }
+
+        // pages read before they are written must decrypt, so every page is written through the codec once
+        std::vector<uint8_t> page(target.pageSize, 0);
+        sqlite3_int64 size = 0;
+        target.file->pMethods->xFileSize(target.file, &size);
+        for (sqlite3_int64 offset = size; offset < end; offset += target.pageSize) {
+            if (target.file->pMethods->xWrite(target.file, page.data(), target.pageSize, offset) != SQLITE_OK) {
+                fprintf(stderr, "extending %s failed\n", target.name.c_str());
+                return false;
+            }
+        }
+        target.file->pMethods->xSync(target.file, SQLITE_SYNC_NORMAL);
+        return true;
+    }
+
+    bool openRaw(sqlite3_vfs *vfs, const Record &record, Target &target) {
+        target.name = PREFIX + std::to_string(record.pageNo) + "-" + std::to_string(record.id) + "." +
+                      ROLE_NAMES[record.role];
+        target.raw.assign(static_cast<size_t>(vfs->szOsFile), 0);
+        target.file = reinterpret_cast<sqlite3_file *>(target.raw.data());
+
+        // a temporary journal is not tied to a database file, it is deleted on close
+        int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_DELETEONCLOSE | SQLITE_OPEN_TEMP_JOURNAL;
+        if (vfs->xOpen(vfs, target.name.c_str(), target.file, flags, nullptr) != SQLITE_OK) {
+            fprintf(stderr, "creating %s failed\n", target.name.c_str());
+            target.file = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    void closeTarget(Target &target) {
+        if (target.db) {
+            sqlite3_close(target.db);
+            removeScratch(target.name);
+        }
+        else if (target.file && target.file->pMethods) {
+            target.file->pMethods->xClose(target.file);
+        }
+        target.file = nullptr;
+        target.db = nullptr;
+    }
+
+    double percentile(std::vector<uint32_t> &values, double p) {
+        if (values.empty())
+            return 0.0;
+        auto nth = values.begin() + static_cast<ptrdiff_t>(p * (values.size() - 1));
+        std::nth_element(values.begin(), nth, values.end());
+        return *nth / 1000.0;
+    }
+
+    double sum(const std::vector<uint32_t> &values) {
+        double total = 0;
+        for (uint32_t value : values)
+            total += value;
+        return total / 1e6;
+    }
+}
+
+int main(int argc, char **argv) {
+    double speed = argc > 2 ? atof(argv[2]) : 0.0;
+    std::vector<Record> records;
+    if (argc < 2 || speed < 0) {
+        fprintf(stderr, "usage: %s <trace> [speed, 0 replays back to back]\n", argv[0]);
+        return 1;
+    }
+    if (!load(argv[1], records)) {
+        fprintf(stderr, "%s is not a readable trace\n", argv[1]);
+        return 1;
+    }
+
+    // journals and WALs are written without the codec
+    sqlite3_vfs *vfs = sqlite3_vfs_find(nullptr);
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+
+    std::map<uint32_t, Target> targets;
+    std::map<std::pair<uint8_t, uint8_t>, Stats> stats;
+    std::vector<uint8_t> buffer;
+    uint64_t skipped = 0;
+
+    Clock::time_point start = Clock::now();
+    for (const Record &record : records) {
+        if (speed > 0)
+            std::this_thread::sleep_until(start + std::chrono::nanoseconds(static_cast<int64_t>(record.time / speed)));
+
+        Target &target = targets[record.id];
+        if (record.op == OP_OPEN) {
+            // a main database stays open until the end, other files are recreated on every open
+            if (target.file)
+                continue;
+            target.role = record.role;
+            if (record.role == ROLE_MAIN_DB ? !openMainDB(record.id, records, target) : !openRaw(vfs, record, target))
+                return 1;
+            continue;
+        }
+        if (!target.file) {
+            skipped++;
+            continue;
+        }
+        if (record.op == OP_CLOSE) {
+            if (target.role != ROLE_MAIN_DB)
+                closeTarget(target);
+            continue;
+        }
+        // the codec only handles whole pages of its own size
+        if (target.db && record.op == OP_WRITE && static_cast<int>(record.size) != target.pageSize) {
+            skipped++;
+            continue;
+        }
+
+        buffer.assign(record.size, 0);
+        Clock::time_point opStart = Clock::now();
+        int rc = SQLITE_OK;
+        switch (record.op) {
+            case OP_READ:
+                rc = target.file->pMethods->xRead(target.file, buffer.data(), static_cast<int>(record.size),
+                                                  record.offset);
+                // reads beyond the end are short like in the trace
+                if (rc == SQLITE_IOERR_SHORT_READ)
+                    rc = SQLITE_OK;
+                break;
+            case OP_WRITE:
+                rc = target.file->pMethods->xWrite(target.file, buffer.data(), static_cast<int>(record.size),
+                                                   record.offset);
+                break;
+            case OP_SYNC:
+                rc = target.file->pMethods->xSync(target.file, record.flags ? record.flags : SQLITE_SYNC_NORMAL);
+                break;
+            case OP_TRUNCATE:
+                rc = target.file->pMethods->xTruncate(target.file, record.offset);
+                break;
+            default:
+                break;
+        }
+        auto replayed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - opStart).count();
+
+        Stats &stat = stats[std::make_pair(record.role, record.op)];
+        stat.bytes += record.size;
+        stat.cipherNs += record.cipher;
+        stat.traced.push_back(record.duration);
+        stat.replayed.push_back(static_cast<uint32_t>((std::min)(replayed, static_cast<decltype(replayed)>(UINT32_MAX))));
+        if (rc != SQLITE_OK)
+            stat.errors++;
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    for (auto &target : targets)
+        closeTarget(target.second);
+
+    printf("%u records, %.3f s traced, %.3f s replayed, %llu skipped\n\n", static_cast<unsigned>(records.size()),
+           records.empty() ? 0.0 : records.back().time / 1e9, seconds, static_cast<unsigned long long>(skipped));
+    printf("%-10s %-8s %9s %9s %12s %9s %9s %12s %9s %9s %10s %7s\n", "file", "op", "count", "MiB", "traced ms",
+           "p50 us", "p99 us", "replayed ms", "p50 us", "p99 us", "cipher ms", "errors");
+    for (auto &entry : stats) {
+        Stats &stat = entry.second;
+        double traced = sum(stat.traced), replayed = sum(stat.replayed);
+        printf("%-10s %-8s %9zu %9.2f %12.3f %9.1f %9.1f %12.3f %9.1f %9.1f %10.3f %7llu\n",
+               ROLE_NAMES[entry.first.first], OP_NAMES[entry.first.second], stat.traced.size(),
+               stat.bytes / 1048576.0, traced, percentile(stat.traced, 0.5), percentile(stat.traced, 0.99), replayed,
+               percentile(stat.replayed, 0.5), percentile(stat.replayed, 0.99), stat.cipherNs / 1e6,
+               static_cast<unsigned long long>(stat.errors));
+    }
+    return 0;
+}
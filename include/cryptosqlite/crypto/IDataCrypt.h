@@ -35,6 +35,23 @@ public:
     virtual void wrapKey(Buffer &wrappedKey, const Buffer &key, const Buffer &wrappingKey) const = 0;
 
     virtual uint32_t extraSize() const = 0;
+
+    /**
+     * Optional variant of encrypt() receiving a nonce from a per-database counter, unique for every page write under
+     * the same key. Plugins enable it by returning true from usesNonce() and store the nonce in the reserved bytes.
+     */
+    virtual bool usesNonce() const { return false; }
+    virtual void encryptWithNonce(uint32_t page, uint64_t nonce, const Buffer &source, Buffer &destination,
+                                  const Buffer &key) const {
+        encrypt(page, source, destination, key);
+    }
+
+    /**
+     * Optional keyed digest used for the page integrity tree. Plugins enable the tree by returning a non-zero size,
+     * and must then store a per-page authentication tag in the extraSize() reserved bytes of each encrypted page.
+     */
+    virtual uint32_t digestSize() const { return 0; }
+    virtual void digest(const Buffer &source, Buffer &destination, const Buffer &key) const { }
 };
 
 #endif //CRYPTOSQLITE_IDATACRYPT_H
@@ -20,6 +20,8 @@
 #ifndef CRYPTOSQLITE_CRYPTOSQLITE_H
 #define CRYPTOSQLITE_CRYPTOSQLITE_H
 
+#include <chrono>
+#include <map>
 #include <memory>
 #include <functional>
 #include <secure_memory/Buffer.h>
@@ -34,26 +36,259 @@ class cryptosqlite {
 public:
     using CryptoFactory = std::function<void(std::unique_ptr<IDataCrypt>&)>;
 
-    static void setCryptoFactory(CryptoFactory factory) {
-        sFactoryCrypt = std::move(factory);
-    }
+    static void setCryptoFactory(CryptoFactory factory);
+    static void makeDataCrypt(std::unique_ptr<IDataCrypt> &out);
 
-    static void makeDataCrypt(std::unique_ptr<IDataCrypt> &out) {
-        if (!sFactoryCrypt)
-            throw cryptosqlite_exception("No crypto factory set.");
+    /**
+     * Registers a named cipher. New databases can select it on open, existing ones record it in their keyfile and
+     * always use it. Databases that do not name a cipher use the factory set by setCryptoFactory().
+     * Register all ciphers before opening databases.
+     *
+     * @param name Non-empty cipher name
+     * @param factory Factory creating instances of the cipher
+     */
+    static void registerCipher(const std::string &name, CryptoFactory factory);
 
-        sFactoryCrypt(out);
-    }
+    /**
+     * Removes a named cipher. Databases using it can no longer be opened, connections already open keep the factory
+     * they were opened with.
+     *
+     * @param name Registered cipher name
+     */
+    static void unregisterCipher(const std::string &name);
+
+    /**
+     * @param cipher Registered cipher name, empty for the default factory
+     */
+    static void makeDataCrypt(std::unique_ptr<IDataCrypt> &out, const std::string &cipher);
+
+    /**
+     * @param cipher Registered cipher name, empty for the default factory
+     * @return Factory of the cipher, which stays valid when the cipher is replaced or removed
+     */
+    static std::shared_ptr<const CryptoFactory> factory(const std::string &cipher);
+
+    /**
+     * @return True if any named cipher is registered
+     */
+    static bool hasCiphers();
+
+    /**
+     * Sets a process-wide ceiling for memory used by the codec (page buffers, caches, queues).
+     * Caches and read-ahead are shrunk to stay below the limit.
+     *
+     * @param limit Maximum number of bytes, 0 for unlimited (default)
+     */
+    static void setMemoryLimit(size_t limit);
+
+    /**
+     * @return Number of bytes currently used by the codec
+     */
+    static size_t memoryUsage();
+
+    /**
+     * Contention of a codec lock since the last resetLockStats()
+     */
+    struct LockContention {
+        uint64_t acquisitions;
+        // acquisitions that found the lock held by another thread, and the time they waited for it
+        uint64_t contended;
+        uint64_t waitNanoseconds;
+    };
+
+    /**
+     * @param registry Lock of the VFS guarding the list of open databases, taken when opening and closing files
+     * @param connection Connection mutexes taken by the codec itself, e.g. when attaching a database
+     */
+    static void lockStats(LockContention &registry, LockContention &connection);
+    static void resetLockStats();
+
+    /**
+     * Enables caching of unwrapped keys, so reopening recently used databases skips reading the keyfile and
+     * unwrapping the key. Cached keys are held in secure memory and only used if the same key is presented.
+     *
+     * @param capacity Maximum number of cached databases, 0 disables the cache (default)
+     * @param idleTimeout Keys of databases not opened for this duration are evicted
+     */
+    static void setKeyCache(size_t capacity, std::chrono::seconds idleTimeout = std::chrono::seconds(300));
+
+    /**
+     * @param hits Opens that took their key from the key cache
+     * @param misses Opens with the key cache enabled that read the keyfile
+     */
+    static void keyCacheStats(uint64_t &hits, uint64_t &misses);
+
+    /**
+     * Sets how many pages of an overflow chain are read and decrypted ahead of sqlite while it reads a large value.
+     * Applies to connections opened afterwards, databases with an integrity tree are never read ahead.
+     *
+     * @param pages Pages per connection, 0 disables read-ahead. Default 0
+     */
+    static void setReadAhead(uint32_t pages);
+
+    /**
+     * Sets how many sibling pages are read and decrypted ahead of sqlite once a scan descends from an interior B-tree
+     * page into one of its children. Applies to connections opened afterwards, like setReadAhead.
+     *
+     * @param pages Pages per connection, 0 disables B-tree read-ahead. Default 0
+     */
+    static void setBTreeReadAhead(uint32_t pages);
+
+    /**
+     * @param read Pages read and decrypted ahead of sqlite since the process started, by both kinds of read-ahead
+     * @param used Pages of those that sqlite read afterwards, the others were dropped
+     */
+    static void readAheadStats(uint64_t &read, uint64_t &used);
+
+    /**
+     * Keeps pages of main databases in a cache file on a fast local device, so pages dropped from sqlite's page cache
+     * are not read from slow storage again. Pages are cached encrypted. Applies to connections opened afterwards, each
+     * with its own cache file that is deleted on close.
+     *
+     * @param directory Directory of the cache files, empty disables the cache (default)
+     * @param pages Maximum pages per connection, 0 disables the cache
+     */
+    static void setPageCache(const std::string &directory, uint32_t pages);
+
+    /**
+     * Records reads, writes, syncs and truncations of all encrypted files with their duration and cipher time into
+     * a binary trace, which CryptoSQLite_TraceReplay replays against a local database. The trace is complete once
+     * tracing is stopped.
+     *
+     * @param path Trace file to create, empty stops tracing (default)
+     * @return False if the trace file could not be created
+     */
+    static bool setIOTrace(const std::string &path);
 
 protected:
-    static CryptoFactory sFactoryCrypt;
+    // guarded by a mutex, factories are copied out before they are called
+    static std::shared_ptr<const CryptoFactory> sFactoryCrypt;
+    static std::map<std::string, std::shared_ptr<const CryptoFactory>> sCiphers;
 };
 
 extern "C" {
 #include <sqlite3.h>
+
+/* One database of a batch open, see sqlite3_open_encrypted_batch */
+typedef struct sqlite3_encrypted_open {
+    const char *zFilename;  /* in: database file name */
+    const void *zKey;       /* in: key, NULL to open without encryption */
+    int nKey;               /* in: key size */
+    sqlite3 *pDb;           /* out: database handle, NULL if opening failed */
+    int rc;                 /* out: result code of opening this database */
+} sqlite3_encrypted_open;
+
+/* Flags for sqlite3_rekey_encrypted_async: also generate a new data key and re-encrypt all pages. Replaces the database
+ * file, so no other process may have the database open. */
+#define CRYPTOSQLITE_REKEY_ROTATE 0x01
+
+/* Handle of an asynchronous rekey */
+typedef struct sqlite3_rekey_task sqlite3_rekey_task;
+/* Progress callback of an asynchronous rekey, called on a codec worker thread. Return non-zero to cancel. */
+typedef int (*sqlite3_rekey_progress)(void *pArg, int nDone, int nTotal);
+
+/* Reports a bad page found by sqlite3_verify_encrypted: a page number of the database file, or a frame number
+ * counted from 1 if bWal is set */
+typedef void (*sqlite3_verify_report)(void *pArg, int bWal, sqlite3_int64 iPage);
+
+/* Column value of a row produced by sqlite3_parallel_scan */
+typedef struct sqlite3_scan_value {
+    int eType;              /* SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT, SQLITE_BLOB or SQLITE_NULL */
+    sqlite3_int64 iValue;   /* value of SQLITE_INTEGER */
+    double rValue;          /* value of SQLITE_FLOAT */
+    const void *pData;      /* SQLITE_TEXT in the database encoding without terminator, or SQLITE_BLOB */
+    int nData;              /* bytes in pData */
+} sqlite3_scan_value;
+/* Receives the rows of one leaf page from sqlite3_parallel_scan: nRow rowids and nRow * nCol values in row-major
+ * order, valid until the callback returns. Called concurrently on codec worker threads and the calling thread, in
+ * no particular order. Return non-zero to abort the scan. */
+typedef int (*sqlite3_scan_rows)(void *pArg, int nRow, int nCol, const sqlite3_int64 *aRowid,
+        const sqlite3_scan_value *aValue);
+
+/* Writes nData bytes of a sync stream. Return SQLITE_OK, or an error code to abort the sync. */
+typedef int (*sqlite3_sync_write)(void *pArg, const void *pData, int nData);
+/* Reads exactly nData bytes of a sync stream. Return SQLITE_OK, or an error code to abort the sync. */
+typedef int (*sqlite3_sync_read)(void *pArg, void *pData, int nData);
+
+/* Receives nFrame committed WAL frames starting at frame iFrame of the log, encrypted as on disk, and the current WAL
+ * header. Each frame is a 24 byte frame header and nPageSize bytes of the page. Called on the writing thread after a
+ * transaction. Return SQLITE_OK, or an error code to receive the frames again after the next transaction. */
+typedef int (*sqlite3_wal_frames)(void *pArg, const void *pHeader, const void *pFrames, int iFrame, int nFrame,
+        int nPageSize);
+
 SQLITE_API void sqlite3_prepare_open_encrypted(const void *zKey, int nKey);
 SQLITE_API int sqlite3_open_encrypted(const char *zFilename, sqlite3 **ppDb, const void *zKey, int nKey);
+/* Opens like sqlite3_open_v2 with the cryptoSQLite VFS. zCipher names a registered cipher for a new database, NULL
+ * selects the "cipher" URI parameter or the default. Thread-safe. */
+SQLITE_API int sqlite3_open_encrypted_v2(const char *zFilename, sqlite3 **ppDb, int flags, const void *zKey, int nKey,
+        const char *zCipher);
+SQLITE_API int sqlite3_open_encrypted_batch(sqlite3_encrypted_open *aOpen, int nOpen, int nThreads);
 SQLITE_API int sqlite3_rekey_encrypted(const char *zFilename, const void *zKeyOld, int nKeyOld, const void *zKeyNew, int nKeyNew);
+SQLITE_API sqlite3_rekey_task *sqlite3_rekey_encrypted_async(const char *zFilename, const void *zKeyOld, int nKeyOld,
+        const void *zKeyNew, int nKeyNew, int flags, int nPagesPerSecond, sqlite3_rekey_progress xProgress, void *pArg);
+SQLITE_API int sqlite3_rekey_status(sqlite3_rekey_task *pTask, int *pnDone, int *pnTotal);
+SQLITE_API void sqlite3_rekey_cancel(sqlite3_rekey_task *pTask);
+SQLITE_API int sqlite3_rekey_wait(sqlite3_rekey_task *pTask);
+SQLITE_API int sqlite3_verify_encrypted(const char *zFilename, const void *zKey, int nKey, int nThreads,
+        sqlite3_verify_report xReport, void *pArg);
+/* Databases whose plugin provides a digest keep an integrity tree. A database with a missing or damaged tree fails to
+ * open with SQLITE_CORRUPT. Such databases can not be scanned in parallel, replicated through the WAL, cloned or
+ * copied with sqlite3_vacuum_into_encrypted. */
+SQLITE_API int sqlite3_integrity_root(sqlite3 *db, void *pRoot, int nRoot);
+/* Rebuilds the integrity tree of a database that must not be open from its pages as they are on disk. Compare the
+ * new root with one kept elsewhere, the pages are trusted without checking. */
+SQLITE_API int sqlite3_integrity_rebuild(const char *zFilename, const void *zKey, int nKey);
+/* Stores the pages of the comma-separated tables and their indices without encryption from now on, NULL or "" stores
+ * all pages encrypted again. Requires a database created with the "selective" URI parameter. Call again after
+ * changing the schema, until then all pages are encrypted. Only pages recorded in the keyfile as written in plaintext
+ * are read as such. */
+SQLITE_API int sqlite3_plaintext_tables(sqlite3 *db, const char *zTables);
+/* Stores a large value outside the B-tree in an encrypted side file and returns its id in piBlob. The id references
+ * the value from application tables. The side file is written before the id is returned and is not part of the
+ * current transaction; side files of rolled back transactions are removed by a later write. */
+SQLITE_API int sqlite3_blob_store_write(sqlite3 *db, const void *pData, sqlite3_int64 nData, sqlite3_int64 *piBlob);
+/* Reads nData bytes of a stored value starting at iOffset */
+SQLITE_API int sqlite3_blob_store_read(sqlite3 *db, sqlite3_int64 iBlob, void *pData, sqlite3_int64 nData,
+        sqlite3_int64 iOffset);
+SQLITE_API int sqlite3_blob_store_size(sqlite3 *db, sqlite3_int64 iBlob, sqlite3_int64 *pnSize);
+/* Removes a stored value and its side file immediately, also if the current transaction is rolled back */
+SQLITE_API int sqlite3_blob_store_delete(sqlite3 *db, sqlite3_int64 iBlob);
+/* Reads all rows of a rowid table in parallel, bypassing the pager. Scans the snapshot of the read transaction open on
+ * db, or of a new one for the duration of the call; transactions with changes can not be scanned. Values are the
+ * stored columns in declaration order, without defaults of columns added later. Decrypts on the shared pool unless
+ * nThreads is given. */
+SQLITE_API int sqlite3_parallel_scan(sqlite3 *db, const char *zTable, int nThreads, sqlite3_scan_rows xRows,
+        void *pArg);
+/* Brings a standby copy of an encrypted database up to date with its primary by transferring only the pages that
+ * differ, rsync-style and without the key. The standby writes a signature of its pages, the primary reads it and writes
+ * a delta, and the standby applies the delta to a copy that then replaces it. The standby must not be open while
+ * applying, and a primary in WAL mode must be idle and checkpointed with TRUNCATE. Digests are computed on the shared
+ * pool unless nThreads is given. Databases with values of sqlite3_blob_store_write are rejected with SQLITE_MISUSE. */
+SQLITE_API int sqlite3_sync_signature(const char *zStandby, int nThreads, sqlite3_sync_write xWrite, void *pArg);
+SQLITE_API int sqlite3_sync_delta(const char *zPrimary, int nThreads, sqlite3_sync_read xRead, void *pReadArg,
+        sqlite3_sync_write xWrite, void *pWriteArg);
+SQLITE_API int sqlite3_sync_apply(const char *zStandby, sqlite3_sync_read xRead, void *pArg);
+/* Brings a standby copy on a local file system up to date in one step, without streams */
+SQLITE_API int sqlite3_sync_encrypted(const char *zPrimary, const char *zStandby, int nThreads);
+/* Streams the frames committed to the WAL through db to xFrames, for log shipping without cipher work. NULL removes
+ * the tap. Frames written by other connections or in exclusive locking mode are not seen. */
+SQLITE_API int sqlite3_wal_tap(sqlite3 *db, sqlite3_wal_frames xFrames, void *pArg);
+/* Applies frames received from sqlite3_wal_tap to a replica, which was seeded with a copy of the checkpointed primary
+ * and its keyfile, e.g. by sqlite3_sync_encrypted. The replica must not be open while applying and may only be opened
+ * read-only, a checkpoint would remove frames it needs. Returns SQLITE_ERROR if earlier frames of the log are missing,
+ * the replica has to be seeded again then. */
+SQLITE_API int sqlite3_wal_apply(const char *zReplica, const void *pHeader, const void *pFrames, int iFrame, int nFrame,
+        int nPageSize);
+/* Copies the database of db to zTarget without decrypting, from the snapshot of the open read transaction or after a
+ * checkpoint in a new one. Uses reflinks where the file system supports them, a kernel copy or a parallel copy on the
+ * shared pool unless nThreads is given otherwise. The copy shares the data key, wrapped by zKeyNew if given, and gets
+ * copies of the side files of sqlite3_blob_store_write. zTarget must not exist. */
+SQLITE_API int sqlite3_clone_encrypted(sqlite3 *db, const char *zTarget, const void *zKeyNew, int nKeyNew, int nThreads);
+/* Writes a compacted copy of the database of db to zTarget like VACUUM INTO, encrypted with a fresh data key under
+ * zKey, or sharing the data key and file key of db if zKey is NULL. Pages are encrypted in large batches on the shared
+ * pool unless nThreads is given otherwise. Side files of sqlite3_blob_store_write are copied along. A plain VACUUM INTO
+ * statement has no key for its target and must not be used on encrypted databases. */
+SQLITE_API int sqlite3_vacuum_into_encrypted(sqlite3 *db, const char *zTarget, const void *zKey, int nKey, int nThreads);
 SQLITE_API int sqlite3_key(sqlite3* db, const void* zKey, int nKey);
 };
 
@@ -0,0 +1,365 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <vector>
+#include <cryptosqlite/cryptosqlite.h>
+#include "BlobStore.h"
+#include "FileWrapper.h"
+#include "../file/File.h"
+#include "../file/RawFile.h"
+#include "../memory/MemoryBudget.h"
+#include "../util/ThreadPool.h"
+#include "../vfs/VFS.h"
+
+namespace {
+    // plaintext bytes per chunk of new values
+    const sqlite3_int64 BLOB_CHUNK_SIZE = 1024 * 1024;
+    // minimum chunks read or written at once
+    const sqlite3_int64 BLOB_BATCH_CHUNKS = 4;
+    // page number flag of the last chunk
+    const uint32_t LAST_CHUNK = 0x80000000u;
+    const int BLOB_FILE_FLAGS = SQLITE_OPEN_MAIN_DB;
+
+    const char *BLOB_SUFFIX = "-blob-";
+
+    const char *CREATE_TABLE = "CREATE TABLE IF NOT EXISTS main.cryptosqlite_blobs "
+                               "(id INTEGER PRIMARY KEY, size INTEGER NOT NULL, chunk INTEGER NOT NULL, "
+                               "key BLOB NOT NULL);";
+}
+
+BlobStore::BlobStore(sqlite3 *db, ThreadPool *pool) : mDB(db), mPool(pool) { }
+
+int BlobStore::init() {
+    File *mainDB = File::fromDatabase(mDB);
+    if (!mainDB || !mainDB->mCrypto)
+        return SQLITE_MISUSE;
+
+    try {
+        mFactory = mainDB->mCrypto->factory();
+        (*mFactory)(mDataCrypt);
+    } catch (const std::exception &) {
+        return SQLITE_ERROR;
+    }
+    mExtraSize = mDataCrypt->extraSize();
+    return SQLITE_OK;
+}
+
+int BlobStore::write(const void *data, sqlite3_int64 size, sqlite3_int64 &id) {
+    if (size < 0 || (size > 0 && !data))
+        return SQLITE_MISUSE;
+
+    int rc = init();
+    if (rc != SQLITE_OK)
+        return rc;
+
+    Entry entry;
+    entry.size = size;
+    entry.chunkSize = BLOB_CHUNK_SIZE;
+    if (chunkCount(entry) >= LAST_CHUNK)
+        return SQLITE_TOOBIG;
+
+    try {
+        mDataCrypt->generateKey(entry.key);
+    } catch (const std::exception &) {
+        return SQLITE_ERROR;
+    }
+
+    // reference row first, its id names the side file
+    sqlite3_stmt *stmt = nullptr;
+    rc = sqlite3_exec(mDB, CREATE_TABLE, nullptr, nullptr, nullptr);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_prepare_v2(mDB, "INSERT INTO main.cryptosqlite_blobs (size, chunk, key) VALUES (?1, ?2, ?3);",
+                                -1, &stmt, nullptr);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, entry.size);
+        sqlite3_bind_int64(stmt, 2, entry.chunkSize);
+        sqlite3_bind_blob(stmt, 3, entry.key.const_data(), static_cast<int>(entry.key.size()), SQLITE_STATIC);
+        rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(mDB);
+        id = sqlite3_last_insert_rowid(mDB);
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    // no other connection has uncommitted values while the insert holds the write lock
+    collect();
+
+    {
+        RawFile file(fileName(id), BLOB_FILE_FLAGS | SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+        rc = file.rc();
+        if (rc == SQLITE_OK)
+            rc = file.truncate(0);
+
+        // encrypt a batch in parallel, then write it sequentially
+        sqlite3_int64 chunks = chunkCount(entry);
+        sqlite3_int64 batch = (std::max)(BLOB_BATCH_CHUNKS, sqlite3_int64(mPool->size() + 1));
+        auto *plain = static_cast<uint8_t *>(const_cast<void *>(data));
+        for (sqlite3_int64 first = 0; rc == SQLITE_OK && first < chunks; first += batch) {
+            sqlite3_int64 count = (std::min)(batch, chunks - first);
+            sqlite3_int64 plainSize = (std::min)(count * entry.chunkSize, size - first * entry.chunkSize);
+            auto cipherSize = static_cast<int>(plainSize + count * mExtraSize);
+
+            MemoryBudget::instance()->acquire(cipherSize, MemoryBudget::PRIORITY_BUFFER);
+            std::vector<uint8_t> cipher(cipherSize);
+            rc = crypt(true, entry, first, count, plain ? plain + first * entry.chunkSize : nullptr, cipher.data());
+            if (rc == SQLITE_OK)
+                rc = file.write(cipher.data(), cipherSize, first * (entry.chunkSize + mExtraSize));
+            MemoryBudget::instance()->release(cipherSize, MemoryBudget::PRIORITY_BUFFER);
+        }
+
+        // the value is durable before its id is handed out
+        if (rc == SQLITE_OK)
+            rc = file.sync();
+    }
+    entry.key.clear(true);
+
+    if (rc != SQLITE_OK)
+        remove(id);
+    return rc;
+}
+
+int BlobStore::read(sqlite3_int64 id, void *data, sqlite3_int64 size, sqlite3_int64 offset) {
+    Entry entry;
+    int rc = init();
+    if (rc == SQLITE_OK)
+        rc = lookup(id, entry);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    // like sqlite3_blob_read()
+    if (size < 0 || offset < 0 || offset + size > entry.size || (size > 0 && !data))
+        return SQLITE_ERROR;
+    if (size == 0)
+        return SQLITE_OK;
+
+    RawFile file(fileName(id), BLOB_FILE_FLAGS | SQLITE_OPEN_READONLY);
+    sqlite3_int64 fileSize = 0;
+    rc = file.rc();
+    if (rc == SQLITE_OK)
+        rc = file.size(&fileSize);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    // size is taken from the database, a truncated or extended side file was tampered with
+    if (fileSize != entry.size + chunkCount(entry) * mExtraSize)
+        return SQLITE_CORRUPT;
+
+    // read a batch sequentially, then decrypt it in parallel
+    sqlite3_int64 end = (offset + size - 1) / entry.chunkSize + 1;
+    sqlite3_int64 batch = (std::max)(BLOB_BATCH_CHUNKS, sqlite3_int64(mPool->size() + 1));
+    auto *out = static_cast<uint8_t *>(data);
+    for (sqlite3_int64 first = offset / entry.chunkSize; rc == SQLITE_OK && first < end; first += batch) {
+        sqlite3_int64 count = (std::min)(batch, end - first);
+        sqlite3_int64 plainSize = (std::min)(count * entry.chunkSize, entry.size - first * entry.chunkSize);
+        auto cipherSize = static_cast<int>(plainSize + count * mExtraSize);
+
+        MemoryBudget::instance()->acquire(cipherSize + plainSize, MemoryBudget::PRIORITY_BUFFER);
+        std::vector<uint8_t> cipher(cipherSize), plain(plainSize);
+        rc = file.read(cipher.data(), cipherSize, first * (entry.chunkSize + mExtraSize));
+        if (rc == SQLITE_OK)
+            rc = crypt(false, entry, first, count, plain.data(), cipher.data());
+
+        // copy the requested part of the batch
+        if (rc == SQLITE_OK) {
+            sqlite3_int64 begin = first * entry.chunkSize;
+            sqlite3_int64 from = (std::max)(offset, begin), to = (std::min)(offset + size, begin + plainSize);
+            memcpy(out + (from - offset), plain.data() + (from - begin), to - from);
+        }
+        MemoryBudget::instance()->release(cipherSize + plainSize, MemoryBudget::PRIORITY_BUFFER);
+    }
+    return rc;
+}
+
+int BlobStore::size(sqlite3_int64 id, sqlite3_int64 &size) {
+    Entry entry;
+    int rc = lookup(id, entry);
+    entry.key.clear(true);
+    if (rc == SQLITE_OK)
+        size = entry.size;
+    return rc;
+}
+
+int BlobStore::remove(sqlite3_int64 id) {
+    sqlite3_stmt *stmt = nullptr;
+    int rc = sqlite3_prepare_v2(mDB, "DELETE FROM main.cryptosqlite_blobs WHERE id = ?1;", -1, &stmt, nullptr);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, id);
+        rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(mDB);
+    }
+    sqlite3_finalize(stmt);
+    if (rc == SQLITE_OK && sqlite3_changes(mDB) == 0)
+        rc = SQLITE_NOTFOUND;
+
+    // a missing side file is not an error, it may not have been created yet
+    sqlite3_vfs *vfs = VFS::instance()->underlying();
+    vfs->xDelete(vfs, fileName(id).c_str(), 0);
+    return rc;
+}
+
+int BlobStore::lookup(sqlite3_int64 id, Entry &entry) {
+    sqlite3_stmt *stmt = nullptr;
+    int rc = sqlite3_prepare_v2(mDB, "SELECT size, chunk, key FROM main.cryptosqlite_blobs WHERE id = ?1;", -1,
+                                &stmt, nullptr);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, id);
+        int step = sqlite3_step(stmt);
+        if (step == SQLITE_ROW) {
+            entry.size = sqlite3_column_int64(stmt, 0);
+            entry.chunkSize = sqlite3_column_int64(stmt, 1);
+            entry.key.write(sqlite3_column_blob(stmt, 2), sqlite3_column_bytes(stmt, 2), 0);
+            if (entry.size < 0 || entry.chunkSize <= 0)
+                rc = SQLITE_CORRUPT;
+        }
+        else
+            rc = step == SQLITE_DONE ? SQLITE_NOTFOUND : sqlite3_errcode(mDB);
+    }
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+std::string BlobStore::fileName(sqlite3_int64 id) const {
+    return std::string(sqlite3_db_filename(mDB, "main")) + BLOB_SUFFIX + std::to_string(id);
+}
+
+void BlobStore::collect() {
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(mDB, "SELECT 1 FROM main.cryptosqlite_blobs WHERE id = ?1;", -1, &stmt, nullptr) !=
+        SQLITE_OK)
+        return;
+
+    std::string prefix = std::string(sqlite3_db_filename(mDB, "main")) + BLOB_SUFFIX;
+    sqlite3_vfs *vfs = VFS::instance()->underlying();
+    for (const std::string &name : FileWrapper::list(prefix)) {
+        // ids are written in decimal, anything else only shares the prefix
+        std::string id = name.substr(prefix.size());
+        if (id.empty() || id.size() > 18 || id.find_first_not_of("0123456789") != std::string::npos)
+            continue;
+
+        sqlite3_bind_int64(stmt, 1, std::stoll(id));
+        if (sqlite3_step(stmt) == SQLITE_DONE)
+            vfs->xDelete(vfs, name.c_str(), 0);
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+}
+
+int BlobStore::copyFiles(sqlite3 *db, const std::string &target, std::vector<std::string> &copied) {
+    // databases without values have no table
+    sqlite3_stmt *stmt = nullptr;
+    int rc = sqlite3_prepare_v2(db, "SELECT name FROM main.sqlite_master WHERE name = 'cryptosqlite_blobs';", -1,
+                                &stmt, nullptr);
+    int step = rc == SQLITE_OK ? sqlite3_step(stmt) : rc;
+    sqlite3_finalize(stmt);
+    if (step != SQLITE_ROW)
+        return step == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(db);
+
+    std::string source = std::string(sqlite3_db_filename(db, "main")) + BLOB_SUFFIX;
+    rc = sqlite3_prepare_v2(db, "SELECT id FROM main.cryptosqlite_blobs;", -1, &stmt, nullptr);
+    while (rc == SQLITE_OK && (step = sqlite3_step(stmt)) == SQLITE_ROW) {
+        std::string id = std::to_string(sqlite3_column_int64(stmt, 0));
+        RawFile in(source + id, BLOB_FILE_FLAGS | SQLITE_OPEN_READONLY);
+        RawFile out(target + BLOB_SUFFIX + id, BLOB_FILE_FLAGS | SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+        if (out.rc() == SQLITE_OK)
+            copied.push_back(target + BLOB_SUFFIX + id);
+
+        // values are encrypted under their own keys, the copy does not depend on the keys of the database
+        sqlite3_int64 size = 0;
+        rc = in.rc() != SQLITE_OK ? in.rc() : out.rc();
+        if (rc == SQLITE_OK)
+            rc = in.size(&size);
+        if (rc == SQLITE_OK)
+            rc = out.truncate(0);
+        for (sqlite3_int64 offset = 0; rc == SQLITE_OK && offset < size; offset += BLOB_CHUNK_SIZE) {
+            auto length = static_cast<int>((std::min)(BLOB_CHUNK_SIZE, size - offset));
+
+            MemoryBudget::instance()->acquire(length, MemoryBudget::PRIORITY_BUFFER);
+            std::vector<uint8_t> data(length);
+            rc = in.read(data.data(), length, offset);
+            if (rc == SQLITE_OK)
+                rc = out.write(data.data(), length, offset);
+            MemoryBudget::instance()->release(length, MemoryBudget::PRIORITY_BUFFER);
+        }
+        if (rc == SQLITE_OK)
+            rc = out.sync();
+    }
+    if (rc == SQLITE_OK && step != SQLITE_DONE)
+        rc = sqlite3_errcode(db);
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+bool BlobStore::hasFiles(const std::string &fileName) {
+    return !FileWrapper::list(fileName + BLOB_SUFFIX).empty();
+}
+
+int BlobStore::crypt(bool encrypt, const Entry &entry, sqlite3_int64 first, sqlite3_int64 count, uint8_t *plain,
+                     uint8_t *cipher) {
+    sqlite3_int64 chunks = chunkCount(entry);
+
+    std::atomic<int> error {SQLITE_OK};
+    mPool->parallelFor(static_cast<size_t>(count), [&] (size_t i) {
+        sqlite3_int64 chunk = first + i;
+        auto length = static_cast<uint32_t>(chunkLength(entry, chunk));
+        uint8_t *plainChunk = plain ? plain + i * entry.chunkSize : nullptr;
+        uint8_t *cipherChunk = cipher + i * (entry.chunkSize + mExtraSize);
+        auto pageNo = static_cast<uint32_t>(chunk + 1) | (chunk + 1 == chunks ? LAST_CHUNK : 0);
+
+        try {
+            // own plugin instance and buffers per task, plaintext chunks leave room for the plugin's extra bytes
+            std::unique_ptr<IDataCrypt> dataCrypt;
+            (*mFactory)(dataCrypt);
+
+            Buffer in, out;
+            in.padd(length + mExtraSize, 0);
+            out.padd(length + mExtraSize, 0);
+            if (encrypt) {
+                if (length > 0)
+                    in.write(plainChunk, length, 0);
+                // every value has its own key, so the chunk number is a unique nonce
+                if (dataCrypt->usesNonce())
+                    dataCrypt->encryptWithNonce(pageNo, static_cast<uint64_t>(chunk), in, out, entry.key);
+                else
+                    dataCrypt->encrypt(pageNo, in, out, entry.key);
+                memcpy(cipherChunk, out.const_data(), length + mExtraSize);
+            }
+            else {
+                in.write(cipherChunk, length + mExtraSize, 0);
+                dataCrypt->decrypt(pageNo, in, out, entry.key);
+                memcpy(plainChunk, out.const_data(), length);
+            }
+        } catch (const std::exception &) {
+            // plugin rejected the chunk
+            int expected = SQLITE_OK;
+            error.compare_exchange_strong(expected, encrypt ? SQLITE_ERROR : SQLITE_CORRUPT);
+        }
+    });
+    return error;
+}
+
+sqlite3_int64 BlobStore::chunkCount(const Entry &entry) const {
+    // an empty value still has one chunk, which marks its end
+    return (std::max)((entry.size + entry.chunkSize - 1) / entry.chunkSize, sqlite3_int64(1));
+}
+
+sqlite3_int64 BlobStore::chunkLength(const Entry &entry, sqlite3_int64 chunk) const {
+    return (std::min)(entry.chunkSize, entry.size - chunk * entry.chunkSize);
+}
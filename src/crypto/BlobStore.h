@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRYPTOSQLITE_BLOBSTORE_H
+#define CRYPTOSQLITE_BLOBSTORE_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cryptosqlite/cryptosqlite.h>
+#include <cryptosqlite/crypto/IDataCrypt.h>
+
+extern "C" {
+#include <sqlite3.h>
+};
+
+class ThreadPool;
+
+/**
+ * Stores large values outside the B-tree in side files next to the database.
+ *
+ * Each value gets a fresh key from the crypto plugin and is encrypted in large chunks, which are read and written
+ * sequentially and encrypted or decrypted in parallel. Chunk i is encrypted as page i + 1, the last chunk with
+ * the top bit set, so chunks can not be reordered or dropped. Key, size and chunk size are kept in a small table of
+ * the database itself, so they are encrypted like all other pages and survive key rotation. Side files of values
+ * whose transaction was rolled back are removed by the next write, which holds the write lock of the database.
+ */
+class BlobStore {
+public:
+    /**
+     * @param db Connection of the database the values belong to
+     * @param pool Pool to encrypt and decrypt chunks on, the calling thread takes part
+     */
+    BlobStore(sqlite3 *db, ThreadPool *pool);
+
+    /**
+     * @param id Output of the id to reference the value with
+     * @return Standard sqlite error code
+     */
+    int write(const void *data, sqlite3_int64 size, sqlite3_int64 &id);
+
+    /**
+     * Reads size bytes of a value starting at offset
+     *
+     * @return Standard sqlite error code, SQLITE_NOTFOUND for an unknown id, SQLITE_CORRUPT if the side file does not
+     *         authenticate
+     */
+    int read(sqlite3_int64 id, void *data, sqlite3_int64 size, sqlite3_int64 offset);
+
+    int size(sqlite3_int64 id, sqlite3_int64 &size);
+
+    /**
+     * Removes a value and its side file
+     */
+    int remove(sqlite3_int64 id);
+
+    /**
+     * Copies the side files of all values of the snapshot read by db next to a copy of the database
+     *
+     * @param target Name of the copy
+     * @param copied Output of the names of the files written, also on failure
+     * @return Standard sqlite error code
+     */
+    static int copyFiles(sqlite3 *db, const std::string &target, std::vector<std::string> &copied);
+
+    /**
+     * @return True if side files exist next to the database, which copies on the page level would miss
+     */
+    static bool hasFiles(const std::string &fileName);
+
+protected:
+    struct Entry {
+        sqlite3_int64 size;
+        sqlite3_int64 chunkSize;
+        Buffer key;
+    };
+
+    int init();
+    int lookup(sqlite3_int64 id, Entry &entry);
+    std::string fileName(sqlite3_int64 id) const;
+
+    /**
+     * Removes side files without a reference row, left behind by rolled back transactions
+     */
+    void collect();
+
+    /**
+     * Encrypts or decrypts count consecutive chunks starting at chunk first. Plaintext chunks are chunkSize apart in
+     * plain, ciphertext chunks chunkSize + extra bytes apart in cipher.
+     */
+    int crypt(bool encrypt, const Entry &entry, sqlite3_int64 first, sqlite3_int64 count, uint8_t *plain,
+              uint8_t *cipher);
+
+    sqlite3_int64 chunkCount(const Entry &entry) const;
+    sqlite3_int64 chunkLength(const Entry &entry, sqlite3_int64 chunk) const;
+
+    sqlite3 *mDB;
+    ThreadPool *mPool;
+    // plugin factory of the database, tasks on the pool create their own instances
+    std::shared_ptr<const cryptosqlite::CryptoFactory> mFactory;
+    std::unique_ptr<IDataCrypt> mDataCrypt;
+    uint32_t mExtraSize = 0;
+};
+
+#endif //CRYPTOSQLITE_BLOBSTORE_H
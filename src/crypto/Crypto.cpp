@@ -18,28 +18,155 @@
  */
 #include "Crypto.h"
 
+#include <algorithm>
+#include <atomic>
+#include <numeric>
 #include "FileWrapper.h"
+#include "KeyCache.h"
+#include "../file/RawFile.h"
+#include "../memory/MemoryBudget.h"
+#include "../util/IOTrace.h"
+#include "../util/ThreadPool.h"
 #include <cryptosqlite/cryptosqlite.h>
 
-Crypto::Crypto(const std::string &dbFileName, const void *fileKey, int keylen, int exists)
-        : mFileName(dbFileName + "-keyfile") {
-    cryptosqlite::makeDataCrypt(mDataCrypt);
+namespace {
+    // nonces reserved in the keyfile at once
+    const uint64_t NONCE_BLOCK = 1 << 16;
+    // keyfile options
+    const uint8_t OPTION_PAGE_FLAGS = 0x01;
+    // stripe count minus one in the upper bits, older keyfiles have a single file
+    const int OPTION_STRIPES_SHIFT = 4;
+    const uint32_t MAX_STRIPES = 16;
+    // last byte of each page if page flags are enabled
+    const uint8_t PAGE_ENCRYPTED = 0, PAGE_PLAINTEXT = 1;
+    // bytes encrypted per task by encryptPages
+    const uint32_t ENCRYPT_CHUNK_SIZE = 256 * 1024;
 
-    if (!exists) {
+    /**
+     * @return Random start of the nonces of a database sharing the data key of another one, in the upper half
+     */
+    uint64_t sharedKeyNonceOffset() {
+        uint64_t counter = 0;
+        sqlite3_randomness(sizeof(counter), &counter);
+        return (counter >> 2) | (1ull << 63);
+    }
+}
+
+Crypto::Crypto(const std::string &dbFileName, const void *fileKey, int keylen, int exists, const std::string &cipher,
+               bool pageFlags, uint32_t stripes)
+        : mCipher(cipher), mDBFileName(dbFileName), mFileName(dbFileName + "-keyfile"), mPageFlags(!exists && pageFlags),
+          mStripes(exists ? 1 : (std::min)((std::max)(stripes, 1u), MAX_STRIPES)), mTreeFileName(dbFileName + "-merkle"),
+          mExists(exists) {
+    // the plugin is needed before the key, so the cipher of an existing database opened without a cipher name is
+    // looked up early if it may name one. the layout of a striped database is needed before its first read. a cached
+    // key records both, the keyfile is only read without one.
+    bool striped = exists && FileWrapper::exists(dbFileName + "-stripe1");
+    if (exists && ((mCipher.empty() && cryptosqlite::hasCiphers()) || striped)) {
+        recoverRotation(dbFileName);
+
+        std::string keyFileCipher;
+        uint8_t options;
+        if (KeyCache::instance()->peek(mFileName, fileKey, keylen, keyFileCipher, options))
+            setKeyFileOptions(options);
+        else
+            keyFileCipher = readKeyFile();
+
+        if (mCipher.empty())
+            mCipher = keyFileCipher;
+    }
+    mFactory = cryptosqlite::factory(mCipher);
+    makeDataCrypt(mDataCrypt);
+
+    // keyfile I/O and key derivation are deferred, handles may be opened without ever reading a page
+    mFileKey.write(fileKey, keylen, 0);
+
+    if (mDataCrypt->digestSize() > 0)
+        mTree.reset(new MerkleTree(*mDataCrypt, mKey));
+}
+
+Crypto::~Crypto() {
+    MemoryBudget::instance()->release(mBudgetSize, MemoryBudget::PRIORITY_BUFFER);
+    // idle keys do not wait for the next open to be evicted
+    KeyCache::instance()->expire();
+}
+
+void Crypto::loadKey() {
+    if (mKeyLoaded)
+        return;
+
+    // finish an interrupted key rotation before reading the keyfile
+    if (mExists)
+        recoverRotation(mDBFileName);
+    // the layout was chosen when opening, from the stripe files present
+    uint32_t stripes = mStripes;
+
+    if (!mExists) {
+        // a database created at the path of a deleted one must not get its cached key
+        KeyCache::instance()->invalidate(mFileName);
         // generate new key and wrap it to buffer
         mDataCrypt->generateKey(mKey);
-        wrapKey(fileKey, keylen);
+        wrapKey(mFileKey.const_data(), mFileKey.size());
     }
     else {
-        // read existing keyfile and unwrap key
-        readKeyFile();
-        unwrapKey(fileKey, keylen);
+        uint8_t options;
+        if (KeyCache::instance()->lookup(mFileName, mFileKey.const_data(), mFileKey.size(), mCipher, mKey,
+                                         mWrappedKey, mFirstPage, options)) {
+            setKeyFileOptions(options);
+        }
+        else {
+            // read existing keyfile and unwrap key, the key of another cipher can not be used
+            if (readKeyFile() != mCipher)
+                throw cryptosqlite_exception("Database uses a different cipher");
+            unwrapKey(mFileKey.const_data(), mFileKey.size());
+            KeyCache::instance()->insert(mFileName, mFileKey.const_data(), mFileKey.size(), mCipher, mKey,
+                                         mWrappedKey, mFirstPage, keyFileOptions());
+        }
+        if (mStripes != stripes)
+            throw cryptosqlite_exception("Stripe files of the database are missing");
+    }
+
+    // file key is no longer needed
+    mFileKey.clear(true);
+    mKeyLoaded = true;
+}
+
+void Crypto::recoverRotation(const std::string &dbFileName) {
+    // database file was already replaced by the rotated one, but the keyfile was not
+    std::string rotatedKeyFile = dbFileName + "-rotate-keyfile";
+    if (FileWrapper::exists(rotatedKeyFile) && !FileWrapper::exists(dbFileName + "-rotate")) {
+        std::string keyFile = dbFileName + "-keyfile", treeFile = dbFileName + "-merkle";
+        std::string rotatedTreeFile = dbFileName + "-rotate-merkle";
+        std::remove((treeFile + "-journal").c_str());
+        if (FileWrapper::exists(rotatedTreeFile) && std::rename(rotatedTreeFile.c_str(), treeFile.c_str()) != 0)
+            throw cryptosqlite_exception("Failed to recover page tree file of key rotation");
+        KeyCache::instance()->invalidate(keyFile);
+        if (std::rename(rotatedKeyFile.c_str(), keyFile.c_str()) != 0 || !FileWrapper::syncDirectory(keyFile))
+            throw cryptosqlite_exception("Failed to recover keyfile of key rotation");
     }
 }
 
 void Crypto::rekey(const void *newFileKey, int keylen) {
+    loadKey();
     wrapKey(newFileKey, keylen);
     writeKeyFile();
+    // cached entry is bound to the old file key
+    KeyCache::instance()->invalidate(mFileName);
+}
+
+void Crypto::shareKey(Crypto &source) {
+    source.loadKey();
+    if (source.mCipher != mCipher)
+        throw cryptosqlite_exception("Database uses a different cipher");
+
+    mKey.clear();
+    mKey.write(source.mKey, 0);
+    mWrappedKey.clear();
+    mWrappedKey.write(source.mWrappedKey, 0);
+    mFileKey.clear(true);
+    mKeyLoaded = true;
+
+    // reserved from the random offset on the first page written
+    mNonceNext = mNonceEnd = sharedKeyNonceOffset();
 }
 
 void Crypto::wrapKey(const void *fileKey, int keylen) {
@@ -58,30 +185,216 @@ void Crypto::unwrapKey(const void *fileKey, int keylen) {
     mDataCrypt->unwrapKey(mKey, mWrappedKey, wrappingKey);
 }
 
-void Crypto::writeKeyFile() {
+void Crypto::wrapStoredKey(Buffer &wrappedKey, const Buffer &key) {
+    loadKey();
+    wrappedKey.clear();
+    mDataCrypt->wrapKey(wrappedKey, key, mKey);
+}
+
+void Crypto::unwrapStoredKey(Buffer &key, const Buffer &wrappedKey) {
+    loadKey();
+    key.clear(true);
+    mDataCrypt->unwrapKey(key, wrappedKey, mKey);
+}
+
+void Crypto::writeKeyFile(uint64_t reserveNonces, const std::vector<uint32_t> &allowPlaintext) {
+    // read-modify-write under an exclusive lock, so concurrent connections never lower the nonce counter
+    RawFile keyfile(mFileName, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MAIN_DB);
+    if (keyfile.rc() != SQLITE_OK || keyfile.lock(true) != SQLITE_OK)
+        throw cryptosqlite_exception("Failed to lock keyfile");
+
+    Buffer content, wrappedKey, firstPage, wrappedPlaintext;
+    uint64_t counter = 0;
+    std::string cipher;
+    uint8_t options;
+    if (keyfile.readAll(content) != SQLITE_OK)
+        throw cryptosqlite_exception("Failed to read keyfile");
+    bool parsed = parseKeyFile(content, wrappedKey, firstPage, counter, cipher, options, wrappedPlaintext);
+
+    // pages allowed in plaintext by other connections stay allowed
+    std::vector<uint32_t> pages;
+    if (wrappedPlaintext.size() > 0)
+        unwrapPlaintextPages(*mDataCrypt, wrappedPlaintext, pages);
+    {
+        std::lock_guard<std::mutex> lock(mPlaintextMutex);
+        pages.insert(pages.end(), mPlaintextPages.begin(), mPlaintextPages.end());
+        pages.insert(pages.end(), allowPlaintext.begin(), allowPlaintext.end());
+        std::sort(pages.begin(), pages.end());
+        pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+
+        if (pages.size() != mPlaintextPages.size()) {
+            Buffer list;
+            list.padd(static_cast<uint32_t>(pages.size() * sizeof(uint32_t)), 0);
+            for (size_t i = 0; i < pages.size(); i++)
+                for (size_t j = 0; j < sizeof(uint32_t); j++)
+                    *list.data(i * sizeof(uint32_t) + j) = static_cast<uint8_t>(pages[i] >> (8 * j));
+            mWrappedPlaintext.clear();
+            mDataCrypt->wrapKey(mWrappedPlaintext, list, mKey);
+            mPlaintextPages = pages;
+        }
+        wrappedPlaintext.clear();
+        wrappedPlaintext.write(mWrappedPlaintext, 0);
+    }
+
+    counter = (std::max)(counter, mNonceEnd);
+    if (reserveNonces > 0) {
+        mNonceNext = counter;
+        mNonceEnd = counter += reserveNonces;
+    }
+
+    // a reservation keeps the contents written by other connections
+    bool own = reserveNonces == 0 || !parsed;
+    const Buffer &newWrappedKey = own ? mWrappedKey : wrappedKey, &newFirstPage = own ? mFirstPage : firstPage;
+
+    serializeKeyFile(content, newWrappedKey, newFirstPage, counter, mCipher, keyFileOptions(), wrappedPlaintext);
+
+    // reserved nonces must be durable before they are used, allowed pages before they are written
+    int rc = keyfile.writeAll(content);
+    if (rc == SQLITE_OK && (reserveNonces > 0 || !allowPlaintext.empty()))
+        rc = keyfile.sync();
+    if (rc != SQLITE_OK)
+        throw cryptosqlite_exception("Failed to write keyfile");
+
+    KeyCache::instance()->update(mFileName, mKey, newWrappedKey, newFirstPage);
+}
+
+void Crypto::writeCloneKeyFile(const std::string &dbFileName, const void *fileKey, int keylen) {
+    loadKey();
+
+    Buffer wrappedKey;
+    if (fileKey) {
+        Buffer wrappingKey;
+        wrappingKey.write(fileKey, keylen, 0);
+        mDataCrypt->wrapKey(wrappedKey, mKey, wrappingKey);
+    }
+    else
+        wrappedKey.write(mWrappedKey, 0);
+
+    // pages are copied as they are, including those stored in plaintext by other connections
+    reloadPlaintextPages(*mDataCrypt);
+    Buffer wrappedPlaintext;
+    {
+        std::lock_guard<std::mutex> lock(mPlaintextMutex);
+        wrappedPlaintext.write(mWrappedPlaintext, 0);
+    }
+
+    // both databases share the data key, the copy counts its nonces from elsewhere
     Buffer content;
-    mWrappedKey.serializeAppend(content);
-    mFirstPage.serializeAppend(content);
+    serializeKeyFile(content, wrappedKey, mFirstPage, sharedKeyNonceOffset(), mCipher, keyFileOptions(),
+                     wrappedPlaintext);
 
-    FileWrapper keyfile(mFileName);
-    keyfile.writeFile(content);
+    RawFile keyfile(dbFileName + "-keyfile", SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MAIN_DB);
+    int rc = keyfile.rc();
+    if (rc == SQLITE_OK)
+        rc = keyfile.lock(true);
+    if (rc == SQLITE_OK)
+        rc = keyfile.writeAll(content);
+    if (rc == SQLITE_OK)
+        rc = keyfile.sync();
+    if (rc != SQLITE_OK)
+        throw cryptosqlite_exception("Failed to write keyfile");
 }
 
-void Crypto::readKeyFile() {
+void Crypto::serializeKeyFile(Buffer &content, const Buffer &wrappedKey, const Buffer &firstPage, uint64_t counter,
+                              const std::string &cipher, uint8_t options, const Buffer &wrappedPlaintext) {
+    content.clear();
+    wrappedKey.serializeAppend(content);
+    firstPage.serializeAppend(content);
+    Buffer counterBytes;
+    counterBytes.padd(sizeof(counter), 0);
+    for (size_t i = 0; i < sizeof(counter); i++)
+        *counterBytes.data(i) = static_cast<uint8_t>(counter >> (8 * i));
+    counterBytes.serializeAppend(content);
+    Buffer cipherName;
+    cipherName.write(cipher.data(), cipher.size(), 0);
+    cipherName.serializeAppend(content);
+    Buffer optionBytes;
+    optionBytes.padd(1, options);
+    optionBytes.serializeAppend(content);
+    wrappedPlaintext.serializeAppend(content);
+}
+
+std::string Crypto::readKeyFile() {
     Buffer content;
-    FileWrapper keyfile(mFileName);
-    keyfile.readFile(content);
+    RawFile keyfile(mFileName, SQLITE_OPEN_READONLY | SQLITE_OPEN_MAIN_DB);
+    if (keyfile.rc() != SQLITE_OK || keyfile.lock(false) != SQLITE_OK || keyfile.readAll(content) != SQLITE_OK)
+        throw cryptosqlite_exception("File could not be read");
+
+    Buffer wrappedPlaintext;
+    uint64_t counter;
+    std::string cipher;
+    uint8_t options;
+    parseKeyFile(content, mWrappedKey, mFirstPage, counter, cipher, options, wrappedPlaintext);
+    setKeyFileOptions(options);
+    return cipher;
+}
+
+uint8_t Crypto::keyFileOptions() const {
+    return static_cast<uint8_t>((mPageFlags ? OPTION_PAGE_FLAGS : 0) | ((mStripes - 1) << OPTION_STRIPES_SHIFT));
+}
+
+void Crypto::setKeyFileOptions(uint8_t options) {
+    mPageFlags = (options & OPTION_PAGE_FLAGS) != 0;
+    mStripes = (options >> OPTION_STRIPES_SHIFT) + 1u;
+}
 
+bool Crypto::parseKeyFile(const Buffer &content, Buffer &wrappedKey, Buffer &firstPage, uint64_t &counter,
+                          std::string &cipher, uint8_t &options, Buffer &wrappedPlaintext) {
     BufferRangeConst chain(content);
-    mWrappedKey.deserialize(chain);
-    mFirstPage.deserialize(chain);
+    if (!wrappedKey.deserialize(chain) || !firstPage.deserialize(chain))
+        return false;
+
+    // older keyfiles end before the counter, cipher name, options or plaintext pages
+    Buffer counterBytes, cipherName, optionBytes;
+    counter = 0;
+    if (counterBytes.deserialize(chain) && counterBytes.size() == sizeof(counter))
+        for (size_t i = 0; i < sizeof(counter); i++)
+            counter |= static_cast<uint64_t>(*counterBytes.const_data(i)) << (8 * i);
+
+    cipher.clear();
+    if (cipherName.deserialize(chain) && cipherName.size() > 0)
+        cipher.assign(reinterpret_cast<const char *>(cipherName.const_data()), cipherName.size());
+
+    options = 0;
+    if (optionBytes.deserialize(chain) && optionBytes.size() == 1)
+        options = *optionBytes.const_data();
+
+    wrappedPlaintext.clear();
+    if (!wrappedPlaintext.deserialize(chain))
+        wrappedPlaintext.clear();
+    return true;
+}
+
+bool Crypto::separateNonces(Buffer &content) {
+    Buffer wrappedKey, firstPage, wrappedPlaintext;
+    uint64_t counter;
+    std::string cipher;
+    uint8_t options;
+    if (!parseKeyFile(content, wrappedKey, firstPage, counter, cipher, options, wrappedPlaintext))
+        return false;
+
+    serializeKeyFile(content, wrappedKey, firstPage, sharedKeyNonceOffset(), cipher, options, wrappedPlaintext);
+    return true;
+}
+
+uint32_t Crypto::keyFilePageSize(const Buffer &content) {
+    Buffer wrappedKey, firstPage, wrappedPlaintext;
+    uint64_t counter;
+    std::string cipher;
+    uint8_t options;
+    return parseKeyFile(content, wrappedKey, firstPage, counter, cipher, options, wrappedPlaintext) ?
+           firstPage.size() : 0;
+}
+
+uint64_t Crypto::nextNonce() {
+    if (mNonceNext == mNonceEnd)
+        writeKeyFile(NONCE_BLOCK);
+    return mNonceNext++;
 }
 
-const void *Crypto::encryptPage(const void *page, uint32_t pageSize, int pageNo) {
-    // copy plaintext to input buffer
-    mPageBufferIn.write(page, pageSize, 0);
-    // encrypt to output buffer
-    mDataCrypt->encrypt(pageNo, mPageBufferIn, mPageBufferOut, mKey);
+const void *Crypto::encryptPage(const void *page, uint32_t pageSize, int pageNo, bool plaintext) {
+    encryptLogPage(page, pageSize, pageNo, plaintext);
+
     // cache encrypted first page and write it to keyfile
     if (pageNo == 1) {
         mFirstPage.clear();
@@ -92,23 +405,244 @@ const void *Crypto::encryptPage(const void *page, uint32_t pageSize, int pageNo)
     return pageBufferOut();
 }
 
+const void *Crypto::encryptLogPage(const void *page, uint32_t pageSize, int pageNo, bool plaintext) {
+    loadKey();
+    IOTrace::CipherScope cipherTime;
+
+    if (!mPageFlags) {
+        // copy plaintext to input buffer
+        mPageBufferIn.write(page, pageSize, 0);
+        // encrypt to output buffer
+        encrypt(mPageBufferIn, mPageBufferOut, pageNo);
+    }
+    else if (plaintext) {
+        allowPlaintext({static_cast<uint32_t>(pageNo)});
+        mPageBufferOut.write(page, pageSize, 0);
+        *mPageBufferOut.data(pageSize - 1) = PAGE_PLAINTEXT;
+    }
+    else {
+        // the plugin sees the page without the flag byte
+        fitBuffer(mFlaggedIn, pageSize - 1);
+        fitBuffer(mFlaggedOut, pageSize - 1);
+        mFlaggedIn.write(page, pageSize - 1, 0);
+        encrypt(mFlaggedIn, mFlaggedOut, pageNo);
+        mPageBufferOut.write(mFlaggedOut, 0);
+        *mPageBufferOut.data(pageSize - 1) = PAGE_ENCRYPTED;
+    }
+
+    return pageBufferOut();
+}
+
+void Crypto::encryptPages(ThreadPool *pool, uint8_t *pages, uint32_t count, uint32_t pageSize, int firstPageNo) {
+    std::vector<int> pageNos(count);
+    std::iota(pageNos.begin(), pageNos.end(), firstPageNo);
+    encryptPages(pool, pages, pageSize, pageNos, {});
+}
+
+void Crypto::encryptPages(ThreadPool *pool, uint8_t *pages, uint32_t pageSize, const std::vector<int> &pageNos,
+                          const std::vector<bool> &plaintext) {
+    loadKey();
+    IOTrace::CipherScope cipherTime;
+    auto count = static_cast<uint32_t>(pageNos.size());
+    auto isPlaintext = [&] (uint32_t i) {
+        return mPageFlags && !plaintext.empty() && plaintext[i];
+    };
+
+    std::vector<uint32_t> plaintextPages;
+    for (uint32_t i = 0; i < count; i++)
+        if (isPlaintext(i))
+            plaintextPages.push_back(static_cast<uint32_t>(pageNos[i]));
+    allowPlaintext(plaintextPages);
+
+    // nonces are handed out in page order, the plugin instances run concurrently
+    std::vector<uint64_t> nonces(mDataCrypt->usesNonce() ? count : 0);
+    for (uint32_t i = 0; i < nonces.size(); i++)
+        if (!isPlaintext(i))
+            nonces[i] = nextNonce();
+
+    uint32_t pagesPerTask = (std::max)(ENCRYPT_CHUNK_SIZE / pageSize, 1u);
+    size_t tasks = (count + pagesPerTask - 1) / pagesPerTask;
+    // the plugin sees the page without the flag byte
+    uint32_t dataSize = mPageFlags ? pageSize - 1 : pageSize;
+
+    std::atomic<bool> failed {false};
+    pool->parallelFor(tasks, [&] (size_t task) {
+        uint32_t first = static_cast<uint32_t>(task) * pagesPerTask, last = (std::min)(first + pagesPerTask, count);
+        try {
+            std::unique_ptr<IDataCrypt> dataCrypt;
+            makeDataCrypt(dataCrypt);
+
+            Buffer in, out;
+            fitBuffer(in, dataSize);
+            fitBuffer(out, dataSize);
+            for (uint32_t i = first; i < last; i++) {
+                uint8_t *page = pages + static_cast<size_t>(i) * pageSize;
+                if (isPlaintext(i)) {
+                    page[pageSize - 1] = PAGE_PLAINTEXT;
+                    continue;
+                }
+
+                in.write(page, dataSize, 0);
+                if (nonces.empty())
+                    dataCrypt->encrypt(pageNos[i], in, out, mKey);
+                else
+                    dataCrypt->encryptWithNonce(pageNos[i], nonces[i], in, out, mKey);
+
+                memcpy(page, out.const_data(), dataSize);
+                if (mPageFlags)
+                    page[pageSize - 1] = PAGE_ENCRYPTED;
+            }
+        } catch (const std::exception &) {
+            failed = true;
+        }
+    });
+    if (failed)
+        throw cryptosqlite_exception("Failed to encrypt pages");
+
+    for (uint32_t i = 0; mTree && i < count; i++)
+        updatePage(pages + static_cast<size_t>(i) * pageSize, pageSize, pageNos[i]);
+
+    // cache encrypted first page and write it to keyfile
+    auto first = std::find(pageNos.begin(), pageNos.end(), 1);
+    if (first != pageNos.end()) {
+        mFirstPage.clear();
+        mFirstPage.write(pages + static_cast<size_t>(first - pageNos.begin()) * pageSize, pageSize, 0);
+        writeKeyFile();
+    }
+}
+
 void Crypto::decryptPage(void *pageInOut, uint32_t pageSize, int pageNo) {
+    loadKey();
+    IOTrace::CipherScope cipherTime;
+
     // copy ciphertext to input buffer
     if (pageInOut) mPageBufferIn.write(pageInOut, pageSize, 0);
     // decrypt to output buffer
-    mDataCrypt->decrypt(pageNo, mPageBufferIn, mPageBufferOut, mKey);
+    decrypt(*mDataCrypt, mPageBufferIn, mPageBufferOut, mFlaggedIn, mFlaggedOut, pageNo);
     // overwrite ciphertext with plaintext
     if (pageInOut) memcpy(pageInOut, pageBufferOut(), pageSize);
 }
 
+void Crypto::decryptPage(const IDataCrypt &dataCrypt, const Buffer &pageIn, Buffer &pageOut, int pageNo) const {
+    Buffer flaggedIn, flaggedOut;
+    decrypt(dataCrypt, pageIn, pageOut, flaggedIn, flaggedOut, pageNo);
+}
+
 void Crypto::decryptFirstPageCache() {
+    loadKey();
+    IOTrace::CipherScope cipherTime;
+
     // fit page buffers to cache or minimum page size if cache empty
     resizePageBuffers((std::max)(mFirstPage.size(), 512u));
     // decrypt first page from cache or leave 0-bytes if cache empty
-    if (mFirstPage.size() > 0) mDataCrypt->decrypt(1, mFirstPage, mPageBufferOut, mKey);
+    if (mFirstPage.size() > 0) decrypt(*mDataCrypt, mFirstPage, mPageBufferOut, mFlaggedIn, mFlaggedOut, 1);
+}
+
+void Crypto::encrypt(const Buffer &in, Buffer &out, int pageNo) {
+    if (mDataCrypt->usesNonce())
+        mDataCrypt->encryptWithNonce(pageNo, nextNonce(), in, out, mKey);
+    else
+        mDataCrypt->encrypt(pageNo, in, out, mKey);
+}
+
+void Crypto::decrypt(const IDataCrypt &dataCrypt, const Buffer &in, Buffer &out, Buffer &flaggedIn,
+                     Buffer &flaggedOut, int pageNo) const {
+    if (!mPageFlags)
+        return dataCrypt.decrypt(pageNo, in, out, mKey);
+
+    uint32_t pageSize = in.size();
+    if (*in.const_data(pageSize - 1) == PAGE_PLAINTEXT) {
+        // anyone can set the flag, it only counts for pages the keyfile allows
+        if (!plaintextAllowed(dataCrypt, static_cast<uint32_t>(pageNo)))
+            throw cryptosqlite_exception("Page is not allowed to be stored in plaintext");
+        out.write(in, 0);
+        return;
+    }
+
+    fitBuffer(flaggedIn, pageSize - 1);
+    fitBuffer(flaggedOut, pageSize - 1);
+    flaggedIn.write(in.const_data(), pageSize - 1, 0);
+    dataCrypt.decrypt(pageNo, flaggedIn, flaggedOut, mKey);
+    out.write(flaggedOut, 0);
+    *out.data(pageSize - 1) = 0;
+}
+
+void Crypto::allowPlaintext(const std::vector<uint32_t> &pageNos) {
+    {
+        std::lock_guard<std::mutex> lock(mPlaintextMutex);
+        if (std::all_of(pageNos.begin(), pageNos.end(), [this] (uint32_t pageNo) {
+            return std::binary_search(mPlaintextPages.begin(), mPlaintextPages.end(), pageNo);
+        }))
+            return;
+    }
+    writeKeyFile(0, pageNos);
+}
+
+bool Crypto::plaintextAllowed(const IDataCrypt &dataCrypt, uint32_t pageNo) const {
+    {
+        std::lock_guard<std::mutex> lock(mPlaintextMutex);
+        if (std::binary_search(mPlaintextPages.begin(), mPlaintextPages.end(), pageNo))
+            return true;
+    }
+
+    reloadPlaintextPages(dataCrypt);
+    std::lock_guard<std::mutex> lock(mPlaintextMutex);
+    return std::binary_search(mPlaintextPages.begin(), mPlaintextPages.end(), pageNo);
+}
+
+void Crypto::reloadPlaintextPages(const IDataCrypt &dataCrypt) const {
+    Buffer content, wrappedKey, firstPage, wrappedPlaintext;
+    uint64_t counter;
+    std::string cipher;
+    uint8_t options;
+    {
+        RawFile keyfile(mFileName, SQLITE_OPEN_READONLY | SQLITE_OPEN_MAIN_DB);
+        if (keyfile.rc() != SQLITE_OK || keyfile.lock(false) != SQLITE_OK || keyfile.readAll(content) != SQLITE_OK)
+            throw cryptosqlite_exception("File could not be read");
+    }
+    parseKeyFile(content, wrappedKey, firstPage, counter, cipher, options, wrappedPlaintext);
+
+    // the list in the keyfile only grows, an older one read concurrently must not replace a newer one
+    std::vector<uint32_t> pages;
+    if (wrappedPlaintext.size() > 0)
+        unwrapPlaintextPages(dataCrypt, wrappedPlaintext, pages);
+    std::lock_guard<std::mutex> lock(mPlaintextMutex);
+    if (pages.size() > mPlaintextPages.size()) {
+        mPlaintextPages = pages;
+        mWrappedPlaintext.clear();
+        mWrappedPlaintext.write(wrappedPlaintext, 0);
+    }
+}
+
+void Crypto::unwrapPlaintextPages(const IDataCrypt &dataCrypt, const Buffer &wrapped,
+                                  std::vector<uint32_t> &pages) const {
+    // authenticated by the plugin like wrapped keys
+    Buffer list;
+    dataCrypt.unwrapKey(list, wrapped, mKey);
+    if (list.size() % sizeof(uint32_t) != 0)
+        throw cryptosqlite_exception("Malformed list of plaintext pages");
+
+    pages.assign(list.size() / sizeof(uint32_t), 0);
+    for (size_t i = 0; i < pages.size(); i++)
+        for (size_t j = 0; j < sizeof(uint32_t); j++)
+            pages[i] |= static_cast<uint32_t>(*list.const_data(i * sizeof(uint32_t) + j)) << (8 * j);
+    if (!std::is_sorted(pages.begin(), pages.end()))
+        throw cryptosqlite_exception("Malformed list of plaintext pages");
+}
+
+void Crypto::fitBuffer(Buffer &buffer, uint32_t size) {
+    if (buffer.size() != size) {
+        buffer.clear();
+        buffer.padd(size, 0);
+    }
 }
 
 void Crypto::resizePageBuffers(uint32_t size) {
+    // account input and output buffer, working buffers are always granted
+    MemoryBudget::instance()->release(mBudgetSize, MemoryBudget::PRIORITY_BUFFER);
+    mBudgetSize = 2 * size;
+    MemoryBudget::instance()->acquire(mBudgetSize, MemoryBudget::PRIORITY_BUFFER);
+
     mPageBufferIn.clear();
     mPageBufferIn.padd(size, 0);
 
@@ -119,3 +653,141 @@ void Crypto::resizePageBuffers(uint32_t size) {
 uint32_t Crypto::extraSize() {
     return mDataCrypt->extraSize();
 }
+
+uint32_t Crypto::reservedSize() {
+    return extraSize() + (mPageFlags ? 1 : 0);
+}
+
+bool Crypto::isPlaintextPage(const void *page, uint32_t pageSize) const {
+    return mPageFlags && static_cast<const uint8_t *>(page)[pageSize - 1] == PAGE_PLAINTEXT;
+}
+
+void Crypto::setPlaintextPolicy(std::unique_ptr<PlaintextPolicy> policy) {
+    mPolicy = std::move(policy);
+}
+
+bool Crypto::isPlaintext(uint32_t pageNo, uint32_t pageSize, const PlaintextPolicy::PageLookup &lookup) {
+    return mPageFlags && mPolicy && mPolicy->isPlaintext(pageNo, pageSize - reservedSize(), lookup);
+}
+
+void Crypto::observePage(const void *page, uint32_t pageSize, int pageNo) {
+    if (mPolicy)
+        mPolicy->observe(pageNo, static_cast<const uint8_t *>(page), pageSize - reservedSize());
+}
+
+const uint8_t *Crypto::pageTag(const void *page, uint32_t pageSize, uint32_t &tagSize) const {
+    auto *data = static_cast<const uint8_t *>(page);
+
+    // plaintext pages have no tag, the flag byte is not part of it
+    if (isPlaintextPage(page, pageSize)) {
+        tagSize = pageSize;
+        return data;
+    }
+    uint32_t end = mPageFlags ? pageSize - 1 : pageSize;
+
+    // the reserved bytes hold the tag, without reserved bytes the whole page is the tag
+    tagSize = mDataCrypt->extraSize() > 0 ? mDataCrypt->extraSize() : end;
+    return data + end - tagSize;
+}
+
+bool Crypto::loadTree() {
+    // a new database starts with an empty tree, a leftover file belongs to a deleted database
+    if (!mTree || !mExists)
+        return true;
+
+    loadKey();
+    return readTree();
+}
+
+bool Crypto::readTree() {
+    mTreeStamp = FileWrapper::stamp(mTreeFileName);
+
+    // keep the current tree if the file does not authenticate
+    std::unique_ptr<MerkleTree> tree(new MerkleTree(*mDataCrypt, mKey));
+    if (!tree->load(mTreeFileName))
+        return false;
+
+    mTree = std::move(tree);
+    return true;
+}
+
+void Crypto::rebuildTree() {
+    loadKey();
+    mTree.reset(new MerkleTree(*mDataCrypt, mKey));
+    mTreeStamp = FileWrapper::stamp(mTreeFileName);
+    mTreeDirty = true;
+}
+
+bool Crypto::refreshTree() {
+    // never drop own changes, other connections can not write at the same time
+    int64_t stamp = FileWrapper::stamp(mTreeFileName);
+    if (mTreeDirty || stamp == mTreeStamp)
+        return false;
+
+    // loading costs a digest per page, skip it if the tree is the one in memory
+    try {
+        if (mTree->matches(mTreeFileName)) {
+            mTreeStamp = stamp;
+            return false;
+        }
+        return readTree();
+    } catch (const std::exception &) {
+        return false;
+    }
+}
+
+bool Crypto::checkPage(const void *page, uint32_t pageSize, int pageNo) {
+    if (!mTree)
+        return true;
+    loadKey();
+
+    uint32_t tagSize;
+    const uint8_t *tag = pageTag(page, pageSize, tagSize);
+    if (mTree->check(pageNo, tag, tagSize))
+        return true;
+
+    // page may have been written by another connection
+    return refreshTree() && mTree->check(pageNo, tag, tagSize);
+}
+
+void Crypto::updatePage(const void *page, uint32_t pageSize, int pageNo) {
+    if (!mTree)
+        return;
+    loadKey();
+
+    // first write since the last sync, pick up changes of other connections
+    if (!mTreeDirty) {
+        refreshTree();
+        mTreeDirty = true;
+    }
+
+    uint32_t tagSize;
+    const uint8_t *tag = pageTag(page, pageSize, tagSize);
+    mTree->update(pageNo, tag, tagSize);
+}
+
+void Crypto::truncatePages(uint32_t pageCount) {
+    if (!mTree)
+        return;
+    loadKey();
+
+    if (!mTreeDirty) {
+        refreshTree();
+        mTreeDirty = true;
+    }
+    mTree->truncate(pageCount);
+}
+
+void Crypto::syncTree() {
+    if (!mTree || !mTreeDirty)
+        return;
+
+    mTree->save(mTreeFileName);
+    mTreeStamp = FileWrapper::stamp(mTreeFileName);
+    mTreeDirty = false;
+}
+
+const Buffer &Crypto::treeRoot() {
+    loadKey();
+    return mTree->root();
+}
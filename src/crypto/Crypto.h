@@ -19,19 +19,211 @@
 #ifndef CRYPTOSQLITE_CRYPTO_H
 #define CRYPTOSQLITE_CRYPTO_H
 
+#include <mutex>
+#include <vector>
+#include <cryptosqlite/cryptosqlite.h>
 #include <cryptosqlite/crypto/IDataCrypt.h>
+#include "MerkleTree.h"
+#include "PlaintextPolicy.h"
+
+class ThreadPool;
 
 class Crypto {
 public:
-    Crypto(const std::string &dbFileName, const void *fileKey, int keylen, int exists);
+    /**
+     * Only creates the plugin, the key is loaded on first use
+     *
+     * @param cipher Registered cipher for a new database. Empty selects the one named in the keyfile of an existing
+     *        database, or the default.
+     * @param pageFlags Reserve a byte per page of a new database marking it as encrypted or plaintext, which is
+     *        required for plaintext tables
+     * @param stripes Number of files the pages of a new database are distributed over, see StripedFile. An existing
+     *        database with stripe files has its keyfile read right away, as the number is stored there.
+     */
+    Crypto(const std::string &dbFileName, const void *fileKey, int keylen, int exists, const std::string &cipher = "",
+           bool pageFlags = false, uint32_t stripes = 1);
+    ~Crypto();
+
+    /**
+     * Reads the keyfile and unwraps the data key, or generates it for a new database. Does nothing if already loaded.
+     * Called implicitly by all operations needing the key.
+     */
+    void loadKey();
+    bool keyLoaded() const {
+        return mKeyLoaded;
+    }
 
     void rekey(const void *newFileKey, int keylen);
-    const void *encryptPage(const void *pageIn, uint32_t pageSize, int pageNo);
+
+    /**
+     * Writes the keyfile of a copy of the database sharing its data key. The copy draws nonces from a random offset,
+     * so the two databases do not reuse a nonce when written independently.
+     *
+     * @param fileKey File key wrapping the data key of the copy, nullptr to keep the current wrapping
+     */
+    void writeCloneKeyFile(const std::string &dbFileName, const void *fileKey, int keylen);
+
+    /**
+     * Uses the data key of another database instead of generating one for this new database, wrapped by the same file
+     * key. Nonces start at a random offset like for a copy.
+     */
+    void shareKey(Crypto &source);
+    /**
+     * @param plaintext Store the page without encryption, requires page flags
+     */
+    const void *encryptPage(const void *pageIn, uint32_t pageSize, int pageNo, bool plaintext = false);
+    /**
+     * Encrypts a page for the rollback journal or WAL like above. Such a copy of page 1 is not the database's first
+     * page, so the cached first page and the keyfile are left alone.
+     */
+    const void *encryptLogPage(const void *pageIn, uint32_t pageSize, int pageNo, bool plaintext = false);
     void decryptPage(void *pageInOut, uint32_t pageSize, int pageNo);
     void decryptFirstPageCache();
 
+    /**
+     * Encrypts consecutive pages in place, concurrently on a pool with a plugin instance per task
+     *
+     * @param pages Plaintext of count pages, replaced by their ciphertext
+     */
+    void encryptPages(ThreadPool *pool, uint8_t *pages, uint32_t count, uint32_t pageSize, int firstPageNo);
+    /**
+     * Encrypts pages in place like above, which need not be consecutive
+     *
+     * @param pages Plaintext of a page per page number, replaced by their ciphertext
+     * @param plaintext Per page number: store the page without encryption, requires page flags. Empty to encrypt all.
+     */
+    void encryptPages(ThreadPool *pool, uint8_t *pages, uint32_t pageSize, const std::vector<int> &pageNos,
+                      const std::vector<bool> &plaintext);
+
+    /**
+     * Decrypts a page using a caller owned plugin instance and buffers, so pages can be decrypted concurrently.
+     * The key must have been loaded before.
+     */
+    void decryptPage(const IDataCrypt &dataCrypt, const Buffer &pageIn, Buffer &pageOut, int pageNo) const;
+
     uint32_t extraSize();
 
+    /**
+     * @return Nonce from the database's counter, never returned before for this database
+     */
+    uint64_t nextNonce();
+    bool usesNonce() const {
+        return mDataCrypt->usesNonce();
+    }
+
+    /**
+     * Wraps a key kept inside the database, like the field key, with the data key so it is never stored in plaintext
+     */
+    void wrapStoredKey(Buffer &wrappedKey, const Buffer &key);
+    void unwrapStoredKey(Buffer &key, const Buffer &wrappedKey);
+
+    /**
+     * @return Bytes to reserve at the end of each page, the plugin's extra bytes and the page flag
+     */
+    uint32_t reservedSize();
+
+    /**
+     * @return True if each page carries a flag whether it is encrypted, known once the key is loaded
+     */
+    bool pageFlags() const {
+        return mPageFlags;
+    }
+    /**
+     * @return Number of files the pages are distributed over
+     */
+    uint32_t stripes() const {
+        return mStripes;
+    }
+
+    /**
+     * @return True if the stored page is flagged as plaintext
+     */
+    bool isPlaintextPage(const void *page, uint32_t pageSize) const;
+
+    void setPlaintextPolicy(std::unique_ptr<PlaintextPolicy> policy);
+
+    /**
+     * Reads the page size from keyfile contents without the key, from the size of the encrypted first page they hold
+     *
+     * @return Page size, 0 for malformed contents or a database without pages
+     */
+    static uint32_t keyFilePageSize(const Buffer &content);
+
+    /**
+     * Moves the nonce counter of keyfile contents copied from a database that keeps using the same data key to a
+     * random offset, like the keyfile of a clone
+     *
+     * @return False for malformed contents
+     */
+    static bool separateNonces(Buffer &content);
+
+    /**
+     * Finishes a key rotation or standby sync interrupted after the database file was replaced, by replacing the
+     * keyfile and integrity tree as well
+     */
+    static void recoverRotation(const std::string &dbFileName);
+
+    /**
+     * @return True if the page may be written without encryption according to the plaintext policy
+     */
+    bool isPlaintext(uint32_t pageNo, uint32_t pageSize, const PlaintextPolicy::PageLookup &lookup);
+
+    /**
+     * Lets the plaintext policy learn page ownership from a full plaintext page read or written
+     */
+    void observePage(const void *page, uint32_t pageSize, int pageNo);
+    const std::string &cipher() const {
+        return mCipher;
+    }
+
+    /**
+     * @return Factory of the plugin, captured on open so the database keeps working if the cipher is unregistered
+     */
+    const std::shared_ptr<const cryptosqlite::CryptoFactory> &factory() const {
+        return mFactory;
+    }
+    /**
+     * Creates another plugin instance, e.g. for a task on a pool
+     */
+    void makeDataCrypt(std::unique_ptr<IDataCrypt> &out) const {
+        (*mFactory)(out);
+    }
+
+    /**
+     * @return True if pages are covered by the integrity tree, which requires a plugin providing a digest
+     */
+    bool hasTree() const {
+        return mTree != nullptr;
+    }
+
+    /**
+     * Loads the integrity tree of an existing database. This recomputes the inner nodes, one digest per page, as
+     * does every reload after another connection committed.
+     *
+     * @return False if there is no tree file, throws if the stored tree does not authenticate
+     */
+    bool loadTree();
+
+    /**
+     * Replaces the integrity tree with an empty one, to be built from the pages on disk by updatePage
+     */
+    void rebuildTree();
+
+    /**
+     * @param page Encrypted page
+     * @return True if the page tag matches the integrity tree, reloads the tree once if it was changed by another
+     *         connection
+     */
+    bool checkPage(const void *page, uint32_t pageSize, int pageNo);
+    void updatePage(const void *page, uint32_t pageSize, int pageNo);
+    void truncatePages(uint32_t pageCount);
+
+    /**
+     * Persists the integrity tree if it changed since the last call
+     */
+    void syncTree();
+    const Buffer &treeRoot();
+
     void resizePageBuffers(uint32_t size);
     uint8_t *pageBufferIn() { return mPageBufferIn.data(); }
     const uint8_t *pageBufferOut() { return mPageBufferOut.const_data(); }
@@ -39,17 +231,83 @@ public:
 protected:
     void wrapKey(const void *fileKey, int keylen);
     void unwrapKey(const void *fileKey, int keylen);
-    void writeKeyFile();
-    void readKeyFile();
+    /**
+     * Writes the keyfile, optionally reserving a block of nonces for this connection or allowing pages to be stored
+     * in plaintext. Both are durable when it returns.
+     */
+    void writeKeyFile(uint64_t reserveNonces = 0, const std::vector<uint32_t> &allowPlaintext = {});
+    static void serializeKeyFile(Buffer &content, const Buffer &wrappedKey, const Buffer &firstPage, uint64_t counter,
+                                 const std::string &cipher, uint8_t options, const Buffer &wrappedPlaintext);
+    /**
+     * @return Cipher named in the keyfile
+     */
+    std::string readKeyFile();
+    /**
+     * Keyfile options byte: page flags and stripe count
+     */
+    uint8_t keyFileOptions() const;
+    void setKeyFileOptions(uint8_t options);
+    static bool parseKeyFile(const Buffer &content, Buffer &wrappedKey, Buffer &firstPage, uint64_t &counter,
+                             std::string &cipher, uint8_t &options, Buffer &wrappedPlaintext);
+    /**
+     * Records pages as allowed in plaintext in the keyfile before they are written so
+     */
+    void allowPlaintext(const std::vector<uint32_t> &pageNos);
+    /**
+     * @return True if a page flagged as plaintext may be accepted, the flag byte itself is not authenticated
+     */
+    bool plaintextAllowed(const IDataCrypt &dataCrypt, uint32_t pageNo) const;
+    /**
+     * Reads the pages allowed in plaintext from the keyfile, which other connections may have added to
+     */
+    void reloadPlaintextPages(const IDataCrypt &dataCrypt) const;
+    void unwrapPlaintextPages(const IDataCrypt &dataCrypt, const Buffer &wrapped, std::vector<uint32_t> &pages) const;
+    void encrypt(const Buffer &in, Buffer &out, int pageNo);
+    /**
+     * Decrypts a page, passing the page without its flag byte to the plugin using the given buffers
+     */
+    void decrypt(const IDataCrypt &dataCrypt, const Buffer &in, Buffer &out, Buffer &flaggedIn, Buffer &flaggedOut,
+                 int pageNo) const;
+    static void fitBuffer(Buffer &buffer, uint32_t size);
+    const uint8_t *pageTag(const void *page, uint32_t pageSize, uint32_t &tagSize) const;
+    bool readTree();
+    bool refreshTree();
 
-    // extern crypto plugin
+    // extern crypto plugin and its registered name
     std::unique_ptr<IDataCrypt> mDataCrypt;
-    // keyfile name
-    std::string mFileName;
+    std::string mCipher;
+    std::shared_ptr<const cryptosqlite::CryptoFactory> mFactory;
+    // database and keyfile name
+    std::string mDBFileName, mFileName;
+    // file key until the data key is loaded
+    Buffer mFileKey;
+    bool mKeyLoaded = false;
+    // pages end in a flag byte, plugin input and output without it
+    bool mPageFlags;
+    uint32_t mStripes;
+    Buffer mFlaggedIn, mFlaggedOut;
+    std::unique_ptr<PlaintextPolicy> mPolicy;
+    // sorted pages allowed in plaintext and their list wrapped with the data key as kept in the keyfile, the list
+    // only grows. reloaded by readers on other threads when it misses a page.
+    mutable std::mutex mPlaintextMutex;
+    mutable std::vector<uint32_t> mPlaintextPages;
+    mutable Buffer mWrappedPlaintext;
     // cache
     Buffer mWrappedKey, mFirstPage;
     // state, input, output
     Buffer mKey, mPageBufferIn, mPageBufferOut;
+    // page buffer bytes registered with the memory budget
+    uint32_t mBudgetSize = 0;
+
+    // nonces reserved by this connection, [next, end)
+    uint64_t mNonceNext = 0, mNonceEnd = 0;
+
+    // integrity tree, its file and state when last loaded or saved
+    std::unique_ptr<MerkleTree> mTree;
+    std::string mTreeFileName;
+    int64_t mTreeStamp = -1;
+    bool mTreeDirty = false;
+    int mExists;
 };
 
 #endif //CRYPTOSQLITE_CRYPTO_H
@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <climits>
+#include <cstring>
+#include <cryptosqlite/cryptosqlite.h>
+#include "FieldCrypt.h"
+#include "../csqlite/csqlite.h"
+#include "../file/File.h"
+
+namespace {
+    // first byte of an encrypted value, followed by its nonce
+    const uint8_t FIELD_FORMAT = 1;
+    const uint32_t FIELD_HEADER_SIZE = 9;
+    // type and length in front of the plaintext, which is padded to hide its exact length
+    const uint32_t PAYLOAD_HEADER_SIZE = 5;
+    const uint32_t PAYLOAD_PADDING = 16;
+
+    const char *CREATE_TABLE = "CREATE TABLE IF NOT EXISTS main.cryptosqlite_fields "
+                               "(id INTEGER PRIMARY KEY, key BLOB NOT NULL);";
+    const char *SELECT_KEY = "SELECT key FROM main.cryptosqlite_fields WHERE id = 1;";
+
+    void put32(uint8_t *out, uint32_t value) {
+        for (int i = 0; i < 4; i++)
+            out[i] = static_cast<uint8_t>(value >> (24 - 8 * i));
+    }
+    void put64(uint8_t *out, uint64_t value) {
+        put32(out, static_cast<uint32_t>(value >> 32));
+        put32(out + 4, static_cast<uint32_t>(value));
+    }
+    uint64_t get64(const uint8_t *in) {
+        return (static_cast<uint64_t>(csqlite3_get4byte(in)) << 32) | csqlite3_get4byte(in + 4);
+    }
+
+    void fit(Buffer &buffer, uint32_t size) {
+        buffer.clear(true);
+        buffer.padd(size, 0);
+    }
+}
+
+int FieldCrypt::registerFunctions(sqlite3 *db) {
+    // decrypted values must not be produced by triggers or views of a database from elsewhere
+    int rc = sqlite3_create_function_v2(db, "csq_encrypt", 1, SQLITE_UTF8, new FieldCrypt(db), sEncrypt, nullptr,
+                                        nullptr, sDestroy);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_create_function_v2(db, "csq_decrypt", 1, SQLITE_UTF8 | SQLITE_DIRECTONLY, new FieldCrypt(db),
+                                        sDecrypt, nullptr, nullptr, sDestroy);
+
+    // the key must not depend on a transaction of the caller that may be rolled back. a database that can not be
+    // read yet, e.g. with a wrong key, reports that on its first statement.
+    if (rc == SQLITE_OK && !sqlite3_db_readonly(db, "main"))
+        createKey(db);
+    return rc;
+}
+
+int FieldCrypt::rewrapKey(sqlite3 *source, sqlite3 *target) {
+    File *targetDB = File::fromDatabase(target);
+    if (!targetDB || !targetDB->mCrypto)
+        return SQLITE_MISUSE;
+
+    FieldCrypt fields(source);
+    int rc = fields.loadKey();
+    if (rc == SQLITE_NOTFOUND)
+        return SQLITE_OK;
+    if (rc == SQLITE_OK)
+        rc = storeKey(target, fields.mKey, "UPDATE main.cryptosqlite_fields SET key = ?1 WHERE id = 1;");
+    return rc;
+}
+
+FieldCrypt::FieldCrypt(sqlite3 *db) : mDB(db) { }
+
+int FieldCrypt::encrypt(sqlite3_context *context, sqlite3_value *value) {
+    int type = sqlite3_value_type(value);
+    if (type == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return SQLITE_OK;
+    }
+
+    // the counter's nonces do not fit the page number of plugins without nonces
+    File *mainDB = File::fromDatabase(mDB);
+    if (mainDB && mainDB->mCrypto && !mainDB->mCrypto->usesNonce()) {
+        sqlite3_result_error(context, "the cipher does not support nonces", -1);
+        return SQLITE_MISUSE;
+    }
+
+    int rc = loadKey();
+    if (rc == SQLITE_NOTFOUND) {
+        sqlite3_result_error(context, "the database has no field key, open it writable once", -1);
+        return SQLITE_ERROR;
+    }
+    if (rc != SQLITE_OK)
+        return rc;
+
+    // numbers are stored big endian, so values can be decrypted on any platform
+    uint8_t number[8];
+    const void *data = number;
+    int size = sizeof(number);
+    if (type == SQLITE_INTEGER)
+        put64(number, static_cast<uint64_t>(sqlite3_value_int64(value)));
+    else if (type == SQLITE_FLOAT) {
+        double real = sqlite3_value_double(value);
+        uint64_t bits;
+        memcpy(&bits, &real, sizeof(bits));
+        put64(number, bits);
+    }
+    else {
+        data = type == SQLITE_TEXT ? static_cast<const void *>(sqlite3_value_text(value)) : sqlite3_value_blob(value);
+        size = sqlite3_value_bytes(value);
+    }
+
+    auto padded = (static_cast<uint64_t>(size) + PAYLOAD_HEADER_SIZE + PAYLOAD_PADDING - 1) / PAYLOAD_PADDING *
+                  PAYLOAD_PADDING;
+    if (padded + mExtraSize + FIELD_HEADER_SIZE > INT_MAX)
+        return SQLITE_TOOBIG;
+
+    fit(mIn, static_cast<uint32_t>(padded) + mExtraSize);
+    *mIn.data(0) = static_cast<uint8_t>(type);
+    put32(mIn.data(1), static_cast<uint32_t>(size));
+    if (size > 0)
+        mIn.write(data, static_cast<uint32_t>(size), PAYLOAD_HEADER_SIZE);
+
+    uint64_t nonce = mainDB->mCrypto->nextNonce();
+    crypt(true, nonce);
+
+    auto resultSize = FIELD_HEADER_SIZE + mOut.size();
+    auto *result = static_cast<uint8_t *>(sqlite3_malloc64(resultSize));
+    if (!result)
+        return SQLITE_NOMEM;
+    result[0] = FIELD_FORMAT;
+    put64(result + 1, nonce);
+    memcpy(result + FIELD_HEADER_SIZE, mOut.const_data(), mOut.size());
+    sqlite3_result_blob64(context, result, resultSize, sqlite3_free);
+    return SQLITE_OK;
+}
+
+int FieldCrypt::decrypt(sqlite3_context *context, sqlite3_value *value) {
+    int type = sqlite3_value_type(value);
+    if (type == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return SQLITE_OK;
+    }
+
+    int rc = loadKey();
+    if (rc == SQLITE_NOTFOUND) {
+        sqlite3_result_error(context, "no value was encrypted in this database", -1);
+        return SQLITE_ERROR;
+    }
+    if (rc != SQLITE_OK)
+        return rc;
+
+    // a valid value holds at least the payload header, padded, and the plugin's extra bytes
+    auto *field = static_cast<const uint8_t *>(sqlite3_value_blob(value));
+    auto size = static_cast<uint32_t>(sqlite3_value_bytes(value));
+    if (type != SQLITE_BLOB || size < FIELD_HEADER_SIZE + PAYLOAD_PADDING + mExtraSize || field[0] != FIELD_FORMAT ||
+        (size - FIELD_HEADER_SIZE - mExtraSize) % PAYLOAD_PADDING != 0) {
+        sqlite3_result_error(context, "not an encrypted value", -1);
+        return SQLITE_MISMATCH;
+    }
+
+    fit(mIn, size - FIELD_HEADER_SIZE);
+    mIn.write(field + FIELD_HEADER_SIZE, size - FIELD_HEADER_SIZE, 0);
+    crypt(false, get64(field + 1));
+
+    const uint8_t *payload = mOut.const_data();
+    uint32_t length = csqlite3_get4byte(payload + 1);
+    if (length > size - FIELD_HEADER_SIZE - mExtraSize - PAYLOAD_HEADER_SIZE)
+        return SQLITE_CORRUPT;
+
+    const uint8_t *data = payload + PAYLOAD_HEADER_SIZE;
+    switch (payload[0]) {
+        case SQLITE_INTEGER:
+            if (length != 8)
+                return SQLITE_CORRUPT;
+            sqlite3_result_int64(context, static_cast<sqlite3_int64>(get64(data)));
+            break;
+        case SQLITE_FLOAT: {
+            if (length != 8)
+                return SQLITE_CORRUPT;
+            uint64_t bits = get64(data);
+            double real;
+            memcpy(&real, &bits, sizeof(real));
+            sqlite3_result_double(context, real);
+            break;
+        }
+        case SQLITE_TEXT:
+            sqlite3_result_text64(context, reinterpret_cast<const char *>(data), length, SQLITE_TRANSIENT,
+                                  SQLITE_UTF8);
+            break;
+        case SQLITE_BLOB:
+            sqlite3_result_blob64(context, data, length, SQLITE_TRANSIENT);
+            break;
+        default:
+            return SQLITE_CORRUPT;
+    }
+
+    // plaintext does not stay around until the next call
+    fit(mOut, 0);
+    return SQLITE_OK;
+}
+
+int FieldCrypt::loadKey() {
+    File *mainDB = File::fromDatabase(mDB);
+    if (!mainDB || !mainDB->mCrypto)
+        return SQLITE_MISUSE;
+
+    // a copy replacing the database, e.g. by key rotation, also changes the schema
+    uint64_t schemaVersion = csqlite3_schema_version(mDB, 0);
+    if (mKeyLoaded && schemaVersion == mSchemaVersion)
+        return SQLITE_OK;
+
+    if (!mDataCrypt) {
+        mainDB->mCrypto->makeDataCrypt(mDataCrypt);
+        mExtraSize = mDataCrypt->extraSize();
+    }
+    mKeyLoaded = false;
+    mKey.clear(true);
+
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(mDB, SELECT_KEY, -1, &stmt, nullptr) != SQLITE_OK)
+        return SQLITE_NOTFOUND;
+
+    int rc = SQLITE_OK, step = sqlite3_step(stmt);
+    if (step == SQLITE_ROW && sqlite3_column_bytes(stmt, 0) > 0) {
+        Buffer wrappedKey;
+        wrappedKey.write(sqlite3_column_blob(stmt, 0), static_cast<uint32_t>(sqlite3_column_bytes(stmt, 0)), 0);
+        mainDB->mCrypto->unwrapStoredKey(mKey, wrappedKey);
+    }
+    else if (step == SQLITE_DONE)
+        rc = SQLITE_NOTFOUND;
+    else
+        rc = step == SQLITE_ROW ? SQLITE_CORRUPT : sqlite3_errcode(mDB);
+    sqlite3_finalize(stmt);
+
+    if (rc == SQLITE_OK) {
+        mKeyLoaded = true;
+        mSchemaVersion = schemaVersion;
+    }
+    return rc;
+}
+
+int FieldCrypt::createKey(sqlite3 *db) {
+    File *mainDB = File::fromDatabase(db);
+    if (!mainDB || !mainDB->mCrypto || !mainDB->mCrypto->usesNonce())
+        return SQLITE_MISUSE;
+
+    // usually there is one, which only needs a read
+    sqlite3_stmt *stmt = nullptr;
+    int rc = sqlite3_prepare_v2(db, SELECT_KEY, -1, &stmt, nullptr);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_step(stmt) == SQLITE_ROW ? SQLITE_DONE : SQLITE_OK;
+    sqlite3_finalize(stmt);
+    if (rc == SQLITE_DONE)
+        return SQLITE_OK;
+
+    try {
+        std::unique_ptr<IDataCrypt> dataCrypt;
+        mainDB->mCrypto->makeDataCrypt(dataCrypt);
+        Buffer key;
+        dataCrypt->generateKey(key);
+
+        // another connection may have created it meanwhile
+        rc = sqlite3_exec(db, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr);
+        if (rc == SQLITE_OK)
+            rc = sqlite3_exec(db, CREATE_TABLE, nullptr, nullptr, nullptr);
+        if (rc == SQLITE_OK)
+            rc = storeKey(db, key, "INSERT OR IGNORE INTO main.cryptosqlite_fields (id, key) VALUES (1, ?1);");
+        if (rc == SQLITE_OK)
+            rc = sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+        key.clear(true);
+    } catch (const std::exception &) {
+        rc = SQLITE_ERROR;
+    }
+
+    if (rc != SQLITE_OK && !sqlite3_get_autocommit(db))
+        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+    return rc;
+}
+
+int FieldCrypt::storeKey(sqlite3 *db, const Buffer &key, const char *sql) {
+    Buffer wrappedKey;
+    File::fromDatabase(db)->mCrypto->wrapStoredKey(wrappedKey, key);
+
+    sqlite3_stmt *stmt = nullptr;
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_blob(stmt, 1, wrappedKey.const_data(), static_cast<int>(wrappedKey.size()), SQLITE_STATIC);
+        rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(db);
+    }
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+void FieldCrypt::crypt(bool encrypt, uint64_t nonce) {
+    // values are not bound to a page, the plugin takes the full nonce from the reserved bytes
+    fit(mOut, mIn.size());
+    if (encrypt)
+        mDataCrypt->encryptWithNonce(0, nonce, mIn, mOut, mKey);
+    else
+        mDataCrypt->decrypt(0, mIn, mOut, mKey);
+    fit(mIn, 0);
+}
+
+void FieldCrypt::sEncrypt(sqlite3_context *context, int, sqlite3_value **argv) {
+    int rc;
+    try {
+        rc = static_cast<FieldCrypt *>(sqlite3_user_data(context))->encrypt(context, argv[0]);
+    } catch (const std::exception &) {
+        // plugin or keyfile failure, do not unwind through sqlite
+        rc = SQLITE_ERROR;
+    }
+    if (rc != SQLITE_OK)
+        sqlite3_result_error_code(context, rc);
+}
+
+void FieldCrypt::sDecrypt(sqlite3_context *context, int, sqlite3_value **argv) {
+    int rc;
+    try {
+        rc = static_cast<FieldCrypt *>(sqlite3_user_data(context))->decrypt(context, argv[0]);
+    } catch (const std::exception &) {
+        // the plugin rejected the value
+        rc = SQLITE_CORRUPT;
+    }
+    if (rc != SQLITE_OK)
+        sqlite3_result_error_code(context, rc);
+}
+
+void FieldCrypt::sDestroy(void *fieldCrypt) {
+    delete static_cast<FieldCrypt *>(fieldCrypt);
+}
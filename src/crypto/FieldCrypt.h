@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CRYPTOSQLITE_FIELDCRYPT_H
+#define CRYPTOSQLITE_FIELDCRYPT_H
+
+#include <memory>
+#include <cryptosqlite/crypto/IDataCrypt.h>
+
+extern "C" {
+#include <sqlite3.h>
+};
+
+/**
+ * SQL functions encrypting single values inside sqlite, for columns that must stay encrypted beyond the database file,
+ * e.g. in query results passed on or in SQL dumps. csq_encrypt(value) returns a blob, csq_decrypt(blob) the original
+ * value with its type. NULL stays NULL.
+ *
+ * Values are encrypted with a field key generated by the crypto plugin when a writable connection registers the
+ * functions, in a transaction of its own. It is kept in the table cryptosqlite_fields, wrapped with the data key, and
+ * is thus copied along with the database; copies with a new data key wrap it again. Each function keeps its plugin
+ * instance, key and buffers per connection and only reads the key again after a schema change. Every value gets a
+ * fresh nonce from the database's counter, stored in front of its ciphertext, so plugins must support nonces.
+ */
+class FieldCrypt {
+public:
+    /**
+     * Registers the functions on a connection to an encrypted database
+     *
+     * @return Standard sqlite error code
+     */
+    static int registerFunctions(sqlite3 *db);
+
+    /**
+     * Stores the field key of source in target, a copy of source with a different data key
+     *
+     * @return Standard sqlite error code
+     */
+    static int rewrapKey(sqlite3 *source, sqlite3 *target);
+
+protected:
+    explicit FieldCrypt(sqlite3 *db);
+
+    int encrypt(sqlite3_context *context, sqlite3_value *value);
+    int decrypt(sqlite3_context *context, sqlite3_value *value);
+
+    /**
+     * Reads the field key if not done since the last schema change
+     *
+     * @return Standard sqlite error code, SQLITE_NOTFOUND if there is no key
+     */
+    int loadKey();
+
+    /**
+     * Generates and stores the field key in a transaction of its own, unless the database has one
+     *
+     * @return Standard sqlite error code
+     */
+    static int createKey(sqlite3 *db);
+    static int storeKey(sqlite3 *db, const Buffer &key, const char *sql);
+
+    /**
+     * Runs the plugin on the payload in mIn, padded with its extra bytes, into mOut
+     */
+    void crypt(bool encrypt, uint64_t nonce);
+
+    static void sEncrypt(sqlite3_context *context, int argc, sqlite3_value **argv);
+    static void sDecrypt(sqlite3_context *context, int argc, sqlite3_value **argv);
+    static void sDestroy(void *fieldCrypt);
+
+    sqlite3 *mDB;
+    std::unique_ptr<IDataCrypt> mDataCrypt;
+    uint32_t mExtraSize = 0;
+    Buffer mKey, mIn, mOut;
+    // schema the key was read with
+    uint64_t mSchemaVersion = 0;
+    bool mKeyLoaded = false;
+};
+
+#endif //CRYPTOSQLITE_FIELDCRYPT_H
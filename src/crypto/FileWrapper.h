@@ -22,6 +22,16 @@
 
 #include <cryptosqlite/cryptosqlite.h>
 #include <cstdio>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <windows.h>
+#endif
 
 class FileWrapper {
 public:
@@ -51,6 +61,86 @@ public:
         return mEmpty;
     }
 
+    static bool exists(const std::string &filename) {
+        // no descriptor, closing one would drop the process' POSIX locks on the file
+        struct stat st {};
+        return stat(filename.c_str(), &st) == 0;
+    }
+
+    /**
+     * @return Value that changes whenever the file is modified or replaced, -1 if it does not exist
+     */
+    static int64_t stamp(const std::string &filename) {
+        struct stat st {};
+        if (stat(filename.c_str(), &st) != 0)
+            return -1;
+
+        // combine modification time, size and inode, use nanosecond resolution where available
+#if defined(__linux__)
+        int64_t mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+        int64_t mtime = static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+        int64_t mtime = static_cast<int64_t>(st.st_mtime) * 1000000000;
+#endif
+        return mtime ^ (static_cast<int64_t>(st.st_size) << 48) ^ (static_cast<int64_t>(st.st_ino) << 24);
+    }
+
+    /**
+     * Makes a rename within the directory of a file durable
+     */
+    static bool syncDirectory(const std::string &fileName) {
+#ifndef _WIN32
+        size_t slash = fileName.find_last_of('/');
+        std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : fileName.substr(0, slash);
+
+        int fd = open(directory.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        bool synced = fsync(fd) == 0;
+        close(fd);
+        return synced;
+#else
+        // directories can not be opened for syncing
+        (void) fileName;
+        return true;
+#endif
+    }
+
+    /**
+     * @return Names of the files in the directory of prefix whose names start with prefix, including the directory
+     */
+    static std::vector<std::string> list(const std::string &prefix) {
+        std::vector<std::string> names;
+#ifndef _WIN32
+        size_t slash = prefix.find_last_of('/');
+        std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : prefix.substr(0, slash);
+        std::string base = slash == std::string::npos ? prefix : prefix.substr(slash + 1);
+
+        DIR *dir = opendir(directory.c_str());
+        if (!dir)
+            return names;
+        while (dirent *entry = readdir(dir)) {
+            if (std::string(entry->d_name).compare(0, base.size(), base) == 0)
+                names.push_back(prefix.substr(0, prefix.size() - base.size()) + entry->d_name);
+        }
+        closedir(dir);
+#else
+        size_t slash = prefix.find_last_of("/\\");
+        std::string directory = slash == std::string::npos ? "" : prefix.substr(0, slash + 1);
+
+        WIN32_FIND_DATAA data;
+        HANDLE find = FindFirstFileA((prefix + "*").c_str(), &data);
+        if (find == INVALID_HANDLE_VALUE)
+            return names;
+        do
+            names.push_back(directory + data.cFileName);
+        while (FindNextFileA(find, &data));
+        FindClose(find);
+#endif
+        return names;
+    }
+
     void writeFile(const Buffer &data) {
         // rewind
         fseek(mFile, 0, SEEK_SET);
@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "KeyCache.h"
+#include "FileWrapper.h"
+#include "../util/Sha256.h"
+
+KeyCache KeyCache::sInstance;
+
+namespace {
+    bool equalsDigest(const Buffer &cached, const Buffer &presented) {
+        if (cached.size() != presented.size())
+            return false;
+
+        // constant time comparison
+        auto *a = cached.const_data(), *b = presented.const_data();
+        uint8_t diff = 0;
+        for (uint32_t i = 0; i < cached.size(); i++)
+            diff |= a[i] ^ b[i];
+        return diff == 0;
+    }
+}
+
+void KeyCache::configure(size_t capacity, std::chrono::seconds idleTimeout) {
+    bool addConsumer = false;
+    {
+        SQLite3LockGuard lock(mMutex);
+        mCapacity = capacity;
+        mIdleTimeout = idleTimeout;
+
+        // drop entries exceeding new capacity
+        while (mEntries.size() > mCapacity)
+            evict(std::prev(mEntries.end()));
+
+        // register lazily, the cache only holds memory once configured
+        addConsumer = !mRegistered && capacity > 0;
+        mRegistered = mRegistered || addConsumer;
+    }
+
+    // the budget calls shrink() under its own lock, so it is not called under ours
+    if (addConsumer)
+        MemoryBudget::instance()->addConsumer(this, MemoryBudget::PRIORITY_CACHE);
+}
+
+bool KeyCache::lookup(const std::string &keyFileName, const void *fileKey, int keylen, const std::string &cipher,
+                      Buffer &key, Buffer &wrappedKey, Buffer &firstPage, uint8_t &options) {
+    SQLite3LockGuard lock(mMutex);
+    evictIdle();
+
+    if (mCapacity == 0)
+        return false;
+
+    auto found = mIndex.find(keyFileName);
+    if (found == mIndex.end()) {
+        mMisses++;
+        return false;
+    }
+
+    auto it = found->second;
+    // keyfile changed on disk, e.g. rekeyed by another process
+    if (it->stamp != FileWrapper::stamp(keyFileName)) {
+        evict(it);
+        mMisses++;
+        return false;
+    }
+    // different file key, do not reveal anything. opened with another cipher, let the keyfile check report it
+    if (keylen < 0 || !equalsDigest(it->keyDigest, digestKey(fileKey, keylen)) || it->cipher != cipher) {
+        mMisses++;
+        return false;
+    }
+
+    key.clear();
+    key.write(it->key, 0);
+    wrappedKey.clear();
+    wrappedKey.write(it->wrappedKey, 0);
+    firstPage.clear();
+    firstPage.write(it->firstPage, 0);
+    options = it->options;
+
+    // mark most recently used
+    it->lastUse = Clock::now();
+    mEntries.splice(mEntries.begin(), mEntries, it);
+    mHits++;
+    return true;
+}
+
+bool KeyCache::peek(const std::string &keyFileName, const void *fileKey, int keylen, std::string &cipher,
+                    uint8_t &options) {
+    SQLite3LockGuard lock(mMutex);
+    if (mCapacity == 0 || keylen < 0)
+        return false;
+
+    auto found = mIndex.find(keyFileName);
+    if (found == mIndex.end())
+        return false;
+
+    auto it = found->second;
+    if (it->stamp != FileWrapper::stamp(keyFileName) || !equalsDigest(it->keyDigest, digestKey(fileKey, keylen)))
+        return false;
+
+    cipher = it->cipher;
+    options = it->options;
+    return true;
+}
+
+void KeyCache::insert(const std::string &keyFileName, const void *fileKey, int keylen, const std::string &cipher,
+                      const Buffer &key, const Buffer &wrappedKey, const Buffer &firstPage, uint8_t options) {
+    if (keylen < 0)
+        return;
+    {
+        SQLite3LockGuard lock(mMutex);
+        evictIdle();
+        if (mCapacity == 0)
+            return;
+    }
+
+    // account memory before taking the lock, the budget may ask other consumers to shrink
+    size_t size = keyFileName.size() + cipher.size() + Sha256::DIGEST_SIZE + key.size() + wrappedKey.size() +
+                  firstPage.size();
+    if (!MemoryBudget::instance()->acquire(size, MemoryBudget::PRIORITY_CACHE, this))
+        return;
+
+    SQLite3LockGuard lock(mMutex);
+    // disabled meanwhile
+    if (mCapacity == 0) {
+        MemoryBudget::instance()->release(size, MemoryBudget::PRIORITY_CACHE);
+        return;
+    }
+
+    auto found = mIndex.find(keyFileName);
+    if (found != mIndex.end())
+        evict(found->second);
+
+    mEntries.emplace_front();
+    Entry &entry = mEntries.front();
+    entry.keyFileName = keyFileName;
+    entry.cipher = cipher;
+    entry.keyDigest = digestKey(fileKey, keylen);
+    entry.key.write(key, 0);
+    entry.wrappedKey.write(wrappedKey, 0);
+    entry.firstPage.write(firstPage, 0);
+    entry.options = options;
+    entry.lastUse = Clock::now();
+    entry.stamp = FileWrapper::stamp(keyFileName);
+    entry.size = size;
+    mIndex[keyFileName] = mEntries.begin();
+
+    // enforce capacity
+    while (mEntries.size() > mCapacity)
+        evict(std::prev(mEntries.end()));
+}
+
+void KeyCache::update(const std::string &keyFileName, const Buffer &key, const Buffer &wrappedKey,
+                      const Buffer &firstPage) {
+    SQLite3LockGuard lock(mMutex);
+
+    auto found = mIndex.find(keyFileName);
+    if (found == mIndex.end())
+        return;
+
+    // the budget can not be asked for more under the lock, drop entries that would change their size
+    Entry &entry = *found->second;
+    if (key.size() != entry.key.size() || wrappedKey.size() != entry.wrappedKey.size() ||
+        firstPage.size() != entry.firstPage.size()) {
+        evict(found->second);
+        return;
+    }
+
+    entry.key.clear(true);
+    entry.key.write(key, 0);
+    entry.wrappedKey.clear();
+    entry.wrappedKey.write(wrappedKey, 0);
+    entry.firstPage.clear();
+    entry.firstPage.write(firstPage, 0);
+    entry.stamp = FileWrapper::stamp(keyFileName);
+}
+
+void KeyCache::invalidate(const std::string &keyFileName) {
+    SQLite3LockGuard lock(mMutex);
+
+    auto found = mIndex.find(keyFileName);
+    if (found != mIndex.end())
+        evict(found->second);
+}
+
+void KeyCache::expire() {
+    SQLite3LockGuard lock(mMutex);
+    evictIdle();
+}
+
+void KeyCache::stats(uint64_t &hits, uint64_t &misses) {
+    SQLite3LockGuard lock(mMutex);
+    hits = mHits;
+    misses = mMisses;
+}
+
+void KeyCache::shrink(size_t bytes) {
+    SQLite3LockGuard lock(mMutex);
+
+    // drop least recently used entries until enough memory was released
+    size_t released = 0;
+    while (released < bytes && !mEntries.empty()) {
+        released += mEntries.back().size;
+        evict(std::prev(mEntries.end()));
+    }
+}
+
+void KeyCache::evict(std::list<Entry>::iterator it) {
+    // wipe key material before freeing
+    it->keyDigest.clear(true);
+    it->key.clear(true);
+
+    MemoryBudget::instance()->release(it->size, MemoryBudget::PRIORITY_CACHE);
+    mIndex.erase(it->keyFileName);
+    mEntries.erase(it);
+}
+
+Buffer KeyCache::digestKey(const void *fileKey, int keylen) {
+    if (!mSalted) {
+        sqlite3_randomness(sizeof(mSalt), mSalt);
+        mSalted = true;
+    }
+
+    Sha256 sha;
+    sha.update(mSalt, sizeof(mSalt));
+    sha.update(fileKey, static_cast<size_t>(keylen));
+    Buffer digest;
+    digest.padd(Sha256::DIGEST_SIZE, 0);
+    sha.finish(digest.data());
+    return digest;
+}
+
+void KeyCache::evictIdle() {
+    auto now = Clock::now();
+    while (!mEntries.empty() && now - mEntries.back().lastUse > mIdleTimeout)
+        evict(std::prev(mEntries.end()));
+}
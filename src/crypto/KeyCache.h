@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRYPTOSQLITE_KEYCACHE_H
+#define CRYPTOSQLITE_KEYCACHE_H
+
+#include <chrono>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <secure_memory/Buffer.h>
+#include "../memory/MemoryBudget.h"
+
+/**
+ * Bounded LRU cache of unwrapped key state, keyed by keyfile name.
+ *
+ * Reopening a recently used database skips reading the keyfile and unwrapping the key. Entries are only returned if
+ * the same file key is presented and the keyfile was not modified since. The file key itself is not kept, only a
+ * salted digest of it. They are evicted under memory pressure and once idle for longer than a timeout, which is checked
+ * whenever a key is looked up or inserted and when a database is closed.
+ */
+class KeyCache : public MemoryBudget::Consumer {
+public:
+    static KeyCache *instance() {
+        return &sInstance;
+    }
+
+    /**
+     * @param capacity Maximum number of cached keys, 0 disables the cache (default)
+     * @param idleTimeout Entries not used for this duration are evicted
+     */
+    void configure(size_t capacity, std::chrono::seconds idleTimeout);
+
+    /**
+     * Looks up cached key state for a keyfile
+     *
+     * @param cipher Name of the cipher the key is used with
+     * @return True if found, in which case key, wrappedKey, firstPage and the keyfile options are filled
+     */
+    bool lookup(const std::string &keyFileName, const void *fileKey, int keylen, const std::string &cipher,
+                Buffer &key, Buffer &wrappedKey, Buffer &firstPage, uint8_t &options);
+
+    /**
+     * Returns the cipher and keyfile options of a cached key without using it, so opening a database can choose its
+     * plugin without reading the keyfile. Does not count as a lookup.
+     *
+     * @return True if a key for this file key is cached
+     */
+    bool peek(const std::string &keyFileName, const void *fileKey, int keylen, std::string &cipher, uint8_t &options);
+
+    void insert(const std::string &keyFileName, const void *fileKey, int keylen, const std::string &cipher,
+                const Buffer &key, const Buffer &wrappedKey, const Buffer &firstPage, uint8_t options);
+
+    /**
+     * Replaces the cached key and keyfile contents after the keyfile has been written, if the keyfile is cached
+     */
+    void update(const std::string &keyFileName, const Buffer &key, const Buffer &wrappedKey, const Buffer &firstPage);
+    void invalidate(const std::string &keyFileName);
+
+    /**
+     * Evicts entries idle for longer than the timeout
+     */
+    void expire();
+
+    /**
+     * @param hits Lookups answered from the cache since the process started
+     * @param misses Lookups of an enabled cache that had to read the keyfile
+     */
+    void stats(uint64_t &hits, uint64_t &misses);
+
+    void shrink(size_t bytes) override;
+
+protected:
+    using Clock = std::chrono::steady_clock;
+
+    struct Entry {
+        std::string keyFileName, cipher;
+        Buffer keyDigest, key, wrappedKey, firstPage;
+        uint8_t options;
+        Clock::time_point lastUse;
+        int64_t stamp;
+        size_t size;
+    };
+
+    KeyCache() = default;
+
+    /**
+     * @return Salted digest of a file key, to compare presented keys without keeping them
+     */
+    Buffer digestKey(const void *fileKey, int keylen);
+    void evict(std::list<Entry>::iterator it);
+    void evictIdle();
+
+    SQLite3Mutex mMutex;
+    // most recently used first
+    std::list<Entry> mEntries;
+    std::unordered_map<std::string, std::list<Entry>::iterator> mIndex;
+    size_t mCapacity = 0;
+    std::chrono::seconds mIdleTimeout {0};
+    bool mRegistered = false;
+    uint64_t mHits = 0, mMisses = 0;
+    // random per process, so digests can not be looked up in precomputed tables
+    uint8_t mSalt[16] {};
+    bool mSalted = false;
+
+    static KeyCache sInstance;
+};
+
+#endif //CRYPTOSQLITE_KEYCACHE_H
@@ -0,0 +1,434 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include "MerkleTree.h"
+#include "FileWrapper.h"
+#include "../file/RawFile.h"
+#include "../memory/MemoryBudget.h"
+
+namespace {
+    // tree files are opened like keyfiles
+    const int TREE_FILE_FLAGS = SQLITE_OPEN_MAIN_DB;
+    // digest size and page count, followed by the root and the leaves
+    const uint32_t HEADER_SIZE = 8;
+    // changes of an in-place save, written and synced before the tree file
+    const char JOURNAL_SUFFIX[] = "-journal";
+    const char JOURNAL_MAGIC[] = "cSQLmkj1";
+    // magic, size of the saved file, entry count and checksum, followed by entries of offset, size and bytes
+    const size_t JOURNAL_HEADER_SIZE = 8 + 8 + 4 + 8;
+    const size_t ENTRY_HEADER_SIZE = 8 + 4;
+
+    void put4byte(uint8_t *out, uint32_t value) {
+        out[0] = static_cast<uint8_t>(value >> 24);
+        out[1] = static_cast<uint8_t>(value >> 16);
+        out[2] = static_cast<uint8_t>(value >> 8);
+        out[3] = static_cast<uint8_t>(value);
+    }
+
+    uint32_t get4byte(const uint8_t *in) {
+        return (uint32_t(in[0]) << 24) | (uint32_t(in[1]) << 16) | (uint32_t(in[2]) << 8) | uint32_t(in[3]);
+    }
+
+    void put8byte(uint8_t *out, uint64_t value) {
+        put4byte(out, static_cast<uint32_t>(value >> 32));
+        put4byte(out + 4, static_cast<uint32_t>(value));
+    }
+
+    uint64_t get8byte(const uint8_t *in) {
+        return (static_cast<uint64_t>(get4byte(in)) << 32) | get4byte(in + 4);
+    }
+
+    // FNV-1a, detects a journal torn by a crash while writing it
+    uint64_t checksum(const uint8_t *data, size_t size) {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (size_t i = 0; i < size; i++)
+            hash = (hash ^ data[i]) * 0x100000001b3ull;
+        return hash;
+    }
+
+    /**
+     * Applies a complete journal to the contents of a tree file
+     *
+     * @return False if the journal is empty, torn or malformed
+     */
+    bool applyJournal(const Buffer &journal, const Buffer &content, Buffer &patched) {
+        const uint8_t *in = journal.const_data();
+        if (journal.size() < JOURNAL_HEADER_SIZE || memcmp(in, JOURNAL_MAGIC, 8) != 0 ||
+            checksum(in + JOURNAL_HEADER_SIZE, journal.size() - JOURNAL_HEADER_SIZE) != get8byte(in + 20))
+            return false;
+
+        uint64_t size = get8byte(in + 8);
+        uint32_t count = get4byte(in + 16);
+        if (size > UINT32_MAX)
+            return false;
+
+        patched.padd(static_cast<uint32_t>(size), 0);
+        size_t kept = (std::min)(static_cast<size_t>(size), static_cast<size_t>(content.size()));
+        memcpy(patched.data(), content.const_data(), kept);
+
+        size_t offset = JOURNAL_HEADER_SIZE;
+        for (uint32_t i = 0; i < count; i++) {
+            if (journal.size() - offset < ENTRY_HEADER_SIZE)
+                return false;
+            uint64_t target = get8byte(in + offset);
+            uint32_t length = get4byte(in + offset + 8);
+            offset += ENTRY_HEADER_SIZE;
+            if (journal.size() - offset < length || target > size || size - target < length)
+                return false;
+
+            memcpy(patched.data(static_cast<uint32_t>(target)), in + offset, length);
+            offset += length;
+        }
+        return offset == journal.size();
+    }
+}
+
+MerkleTree::MerkleTree(const IDataCrypt &dataCrypt, const Buffer &key)
+        : mDataCrypt(dataCrypt), mKey(key), mDigestSize(dataCrypt.digestSize()), mLevels(1) {
+    if (mDigestSize == 0)
+        throw cryptosqlite_exception("Crypto plugin provides no digest");
+}
+
+MerkleTree::~MerkleTree() {
+    MemoryBudget::instance()->release(mBudgetSize, MemoryBudget::PRIORITY_BUFFER);
+}
+
+bool MerkleTree::check(uint32_t pageNo, const uint8_t *tag, uint32_t tagSize) {
+    if (pageNo == 0 || pageNo > pageCount())
+        return false;
+
+    std::vector<uint8_t> expected(mDigestSize);
+    leaf(pageNo, tag, tagSize, expected.data());
+    return memcmp(expected.data(), &mLevels[0][(pageNo - 1) * mDigestSize], mDigestSize) == 0;
+}
+
+void MerkleTree::update(uint32_t pageNo, const uint8_t *tag, uint32_t tagSize) {
+    if (pageNo == 0)
+        return;
+
+    // pages skipped when growing keep an empty leaf until written
+    for (uint32_t count = pageCount(); count < pageNo; count++) {
+        mDirty.push_back(count);
+        mUnsaved.push_back(count);
+    }
+    if (pageNo > pageCount()) {
+        mLevels[0].resize(pageNo * mDigestSize);
+        charge();
+    }
+
+    leaf(pageNo, tag, tagSize, &mLevels[0][(pageNo - 1) * mDigestSize]);
+    mDirty.push_back(pageNo - 1);
+    mUnsaved.push_back(pageNo - 1);
+    mRootValid = false;
+}
+
+void MerkleTree::truncate(uint32_t pageCount) {
+    if (pageCount >= this->pageCount())
+        return;
+
+    mLevels[0].resize(pageCount * mDigestSize);
+    mRootValid = false;
+    charge();
+}
+
+const Buffer &MerkleTree::root() {
+    if (mRootValid)
+        return mRoot;
+
+    // recompute parents of changed nodes level by level
+    std::vector<uint32_t> dirty, next;
+    dirty.swap(mDirty);
+
+    size_t level = 0;
+    for (; mLevels[level].size() > mDigestSize; level++) {
+        auto count = static_cast<uint32_t>(mLevels[level].size() / mDigestSize);
+        if (mLevels.size() <= level + 1)
+            mLevels.emplace_back();
+        mLevels[level + 1].resize((count + 1) / 2 * mDigestSize);
+
+        // last node may have gained or lost its sibling
+        dirty.push_back(count - 1);
+        std::sort(dirty.begin(), dirty.end());
+
+        next.clear();
+        for (uint32_t index : dirty) {
+            uint32_t parent = index / 2;
+            if (index >= count || (!next.empty() && next.back() == parent))
+                continue;
+
+            const uint8_t *left = &mLevels[level][parent * 2 * mDigestSize];
+            const uint8_t *right = parent * 2 + 1 < count ? left + mDigestSize : nullptr;
+            node(left, right, &mLevels[level + 1][parent * mDigestSize]);
+            next.push_back(parent);
+        }
+        dirty.swap(next);
+    }
+    mLevels.resize(level + 1);
+
+    // bind the page count, so truncating the file changes the root
+    uint8_t count[4];
+    put4byte(count, pageCount());
+    mInput.clear();
+    mInput.write(count, sizeof(count), 0);
+    if (!mLevels[level].empty())
+        mInput.write(mLevels[level].data(), mDigestSize, sizeof(count));
+
+    mRoot.clear();
+    mRoot.padd(mDigestSize, 0);
+    digest(mRoot.data());
+
+    mRootValid = true;
+    return mRoot;
+}
+
+bool MerkleTree::load(const std::string &fileName) {
+    if (!FileWrapper::exists(fileName))
+        return false;
+
+    // a shared lock keeps saves of other connections out while both files are read
+    Buffer content, journal;
+    {
+        RawFile file(fileName, TREE_FILE_FLAGS | SQLITE_OPEN_READONLY);
+        int rc = file.rc();
+        if (rc == SQLITE_OK)
+            rc = file.lock(false);
+        if (rc == SQLITE_OK)
+            rc = file.readAll(content);
+
+        std::string journalName = fileName + JOURNAL_SUFFIX;
+        if (rc == SQLITE_OK && FileWrapper::exists(journalName)) {
+            RawFile log(journalName, TREE_FILE_FLAGS | SQLITE_OPEN_READONLY);
+            rc = log.rc();
+            if (rc == SQLITE_OK)
+                rc = log.readAll(journal);
+        }
+        if (rc != SQLITE_OK)
+            throw cryptosqlite_exception("Failed to read page tree file");
+    }
+
+    // a crash may have stopped an in-place save halfway, its journal then holds the tree that was being saved
+    Buffer patched;
+    if (applyJournal(journal, content, patched) && parse(patched)) {
+        // the file on disk is torn, the next save replaces it
+        mSaveAll = patched.size() != content.size() ||
+                   memcmp(patched.const_data(), content.const_data(), content.size()) != 0;
+        return true;
+    }
+    if (!parse(content))
+        throw cryptosqlite_exception("Page tree does not authenticate");
+    return true;
+}
+
+bool MerkleTree::parse(const Buffer &content) {
+    // header, root and leaves, a damaged file has the wrong size or does not authenticate
+    if (content.size() < HEADER_SIZE)
+        return false;
+    uint32_t digestSize = get4byte(content.const_data()), count = get4byte(content.const_data(4));
+    if (digestSize != mDigestSize || content.size() != HEADER_SIZE + (uint64_t(count) + 1) * mDigestSize)
+        return false;
+
+    // rebuild inner nodes from the leaves
+    const uint8_t *stored = content.const_data(HEADER_SIZE), *leaves = stored + mDigestSize;
+    mLevels.assign(1, std::vector<uint8_t>(leaves, leaves + static_cast<size_t>(count) * mDigestSize));
+    mDirty.resize(count);
+    for (uint32_t i = 0; i < count; i++)
+        mDirty[i] = i;
+    mRootValid = false;
+    charge();
+
+    const Buffer &computed = root();
+    if (computed.size() != mDigestSize || memcmp(stored, computed.const_data(), mDigestSize) != 0)
+        return false;
+
+    mUnsaved.clear();
+    mSavedCount = count;
+    mSaveAll = false;
+    return true;
+}
+
+bool MerkleTree::matches(const std::string &fileName) {
+    Buffer stored;
+    stored.padd(HEADER_SIZE + mDigestSize, 0);
+    RawFile file(fileName, TREE_FILE_FLAGS | SQLITE_OPEN_READONLY);
+    int rc = file.rc();
+    if (rc == SQLITE_OK)
+        rc = file.lock(false);
+    if (rc == SQLITE_OK)
+        rc = file.read(stored.data(), static_cast<int>(stored.size()), 0);
+    if (rc != SQLITE_OK)
+        return false;
+
+    Buffer current;
+    header(current);
+    return memcmp(stored.const_data(), current.const_data(), current.size()) == 0;
+}
+
+void MerkleTree::save(const std::string &fileName) {
+    if (mSaveAll || !FileWrapper::exists(fileName))
+        saveAll(fileName);
+    else
+        saveChanged(fileName);
+
+    mUnsaved.clear();
+    mSavedCount = pageCount();
+    mSaveAll = false;
+}
+
+void MerkleTree::saveAll(const std::string &fileName) {
+    Buffer content;
+    header(content);
+    content.write(mLevels[0].data(), static_cast<uint32_t>(mLevels[0].size()), content.size());
+
+    // replace atomically, readers see either the old or the new tree. the new file and its name must be durable
+    // before the old one goes away.
+    std::string tempName = fileName + "-tmp";
+    {
+        RawFile file(tempName, TREE_FILE_FLAGS | SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+        if (file.rc() != SQLITE_OK || file.writeAll(content) != SQLITE_OK || file.sync() != SQLITE_OK)
+            throw cryptosqlite_exception("Failed to write page tree file");
+    }
+    if (std::rename(tempName.c_str(), fileName.c_str()) != 0 || !FileWrapper::syncDirectory(fileName))
+        throw cryptosqlite_exception("Failed to replace page tree file");
+
+    // the journal of a save interrupted earlier would bring back leaves of the replaced tree
+    std::remove((fileName + JOURNAL_SUFFIX).c_str());
+}
+
+void MerkleTree::saveChanged(const std::string &fileName) {
+    // exclusive, so loads of other connections never see the file half written
+    RawFile file(fileName, TREE_FILE_FLAGS | SQLITE_OPEN_READWRITE);
+    int rc = file.rc();
+    if (rc == SQLITE_OK)
+        rc = file.lock(true);
+
+    std::sort(mUnsaved.begin(), mUnsaved.end());
+    mUnsaved.erase(std::unique(mUnsaved.begin(), mUnsaved.end()), mUnsaved.end());
+
+    // runs of consecutive changed leaves, skipping those truncated since, then header and root
+    struct Entry {
+        sqlite3_int64 offset;
+        const uint8_t *data;
+        uint32_t size;
+    };
+    std::vector<Entry> entries;
+    uint32_t count = pageCount();
+    for (size_t i = 0; i < mUnsaved.size() && mUnsaved[i] < count; ) {
+        size_t end = i + 1;
+        while (end < mUnsaved.size() && mUnsaved[end] == mUnsaved[end - 1] + 1 && mUnsaved[end] < count)
+            end++;
+
+        entries.push_back({HEADER_SIZE + (static_cast<sqlite3_int64>(mUnsaved[i]) + 1) * mDigestSize,
+                           &mLevels[0][static_cast<size_t>(mUnsaved[i]) * mDigestSize],
+                           static_cast<uint32_t>((end - i) * mDigestSize)});
+        i = end;
+    }
+    Buffer content;
+    header(content);
+    entries.push_back({0, content.const_data(), content.size()});
+
+    std::vector<uint8_t> journal(JOURNAL_HEADER_SIZE);
+    for (const Entry &entry : entries) {
+        size_t offset = journal.size();
+        journal.resize(offset + ENTRY_HEADER_SIZE + entry.size);
+        put8byte(&journal[offset], static_cast<uint64_t>(entry.offset));
+        put4byte(&journal[offset + 8], entry.size);
+        memcpy(&journal[offset + ENTRY_HEADER_SIZE], entry.data, entry.size);
+    }
+    sqlite3_int64 size = HEADER_SIZE + (static_cast<sqlite3_int64>(count) + 1) * mDigestSize;
+    memcpy(journal.data(), JOURNAL_MAGIC, 8);
+    put8byte(&journal[8], static_cast<uint64_t>(size));
+    put4byte(&journal[16], static_cast<uint32_t>(entries.size()));
+    put8byte(&journal[20], checksum(&journal[JOURNAL_HEADER_SIZE], journal.size() - JOURNAL_HEADER_SIZE));
+
+    // the journal is durable before the file is touched, so a crash never leaves a torn tree without it
+    RawFile log(fileName + JOURNAL_SUFFIX, TREE_FILE_FLAGS | SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+    if (rc == SQLITE_OK)
+        rc = log.rc();
+    if (rc == SQLITE_OK)
+        rc = log.write(journal.data(), static_cast<int>(journal.size()), 0);
+    if (rc == SQLITE_OK)
+        rc = log.truncate(static_cast<sqlite3_int64>(journal.size()));
+    if (rc == SQLITE_OK)
+        rc = log.sync();
+
+    for (size_t i = 0; rc == SQLITE_OK && i < entries.size(); i++)
+        rc = file.write(entries[i].data, static_cast<int>(entries[i].size), entries[i].offset);
+    if (rc == SQLITE_OK && count < mSavedCount)
+        rc = file.truncate(size);
+    if (rc == SQLITE_OK)
+        rc = file.sync();
+
+    // the save is complete, an older tree file restored later must not be rolled forward
+    if (rc == SQLITE_OK)
+        rc = log.truncate(0);
+
+    if (rc != SQLITE_OK)
+        throw cryptosqlite_exception("Failed to write page tree file");
+}
+
+void MerkleTree::header(Buffer &out) {
+    uint8_t fields[HEADER_SIZE];
+    put4byte(fields, mDigestSize);
+    put4byte(fields + 4, pageCount());
+
+    out.clear();
+    out.write(fields, HEADER_SIZE, 0);
+    out.write(root().const_data(), mDigestSize, HEADER_SIZE);
+}
+
+void MerkleTree::leaf(uint32_t pageNo, const uint8_t *tag, uint32_t tagSize, uint8_t *out) {
+    uint8_t number[4];
+    put4byte(number, pageNo);
+
+    mInput.clear();
+    mInput.write(number, sizeof(number), 0);
+    mInput.write(tag, tagSize, sizeof(number));
+    digest(out);
+}
+
+void MerkleTree::node(const uint8_t *left, const uint8_t *right, uint8_t *out) {
+    mInput.clear();
+    mInput.write(left, mDigestSize, 0);
+    if (right)
+        mInput.write(right, mDigestSize, mDigestSize);
+    digest(out);
+}
+
+void MerkleTree::digest(uint8_t *out) {
+    mOutput.clear();
+    mDataCrypt.digest(mInput, mOutput, mKey);
+    if (mOutput.size() < mDigestSize)
+        throw cryptosqlite_exception("Crypto plugin returned a short digest");
+
+    memcpy(out, mOutput.const_data(), mDigestSize);
+}
+
+void MerkleTree::charge() {
+    // inner nodes take about as much memory as the leaves
+    size_t size = 2 * mLevels[0].size();
+    if (size == mBudgetSize)
+        return;
+
+    MemoryBudget::instance()->release(mBudgetSize, MemoryBudget::PRIORITY_BUFFER);
+    mBudgetSize = size;
+    MemoryBudget::instance()->acquire(mBudgetSize, MemoryBudget::PRIORITY_BUFFER);
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRYPTOSQLITE_MERKLETREE_H
+#define CRYPTOSQLITE_MERKLETREE_H
+
+#include <string>
+#include <vector>
+#include <cryptosqlite/crypto/IDataCrypt.h>
+
+/**
+ * Hash tree over the authentication tags of all pages of a database file.
+ *
+ * Leaves bind a page number to its tag, inner nodes hash their children and the root additionally covers the page
+ * count. All digests are keyed with the data key, so a tree whose root authenticates can be trusted without reading
+ * the pages. Updates only recompute the paths of changed leaves.
+ *
+ * Only the root and the leaves are stored, so loading a tree recomputes all inner nodes from the leaves, which costs
+ * one digest per page. The tree in memory, about twice the size of the leaves, is charged to the MemoryBudget.
+ */
+class MerkleTree {
+public:
+    /**
+     * @param dataCrypt Plugin providing the keyed digest, must outlive the tree
+     * @param key Data key, must outlive the tree
+     */
+    MerkleTree(const IDataCrypt &dataCrypt, const Buffer &key);
+    ~MerkleTree();
+
+    /**
+     * @return True if the tag matches the one recorded for the page
+     */
+    bool check(uint32_t pageNo, const uint8_t *tag, uint32_t tagSize);
+
+    /**
+     * Records a new tag for the page, growing the tree if necessary
+     */
+    void update(uint32_t pageNo, const uint8_t *tag, uint32_t tagSize);
+    void truncate(uint32_t pageCount);
+
+    uint32_t pageCount() const {
+        return static_cast<uint32_t>(mLevels[0].size() / mDigestSize);
+    }
+
+    /**
+     * @return Root digest, covering all leaves and the page count
+     */
+    const Buffer &root();
+
+    /**
+     * Replaces the tree with the one stored in a file, completing a save that a crash interrupted
+     *
+     * @return False if the file is missing, throws if its root does not authenticate which leaves the tree undefined
+     */
+    bool load(const std::string &fileName);
+
+    /**
+     * Reads only the header and root of a tree file
+     *
+     * @return True if the file holds this tree, so loading it would not change anything
+     */
+    bool matches(const std::string &fileName);
+
+    /**
+     * Writes the tree to a file. Once the tree was loaded from or saved to the file, only the leaves changed since
+     * are written in place, followed by the header and root, after a journal of these writes was synced. A tree that
+     * is new to the file is written to a temporary file that replaces it, so a crash never leaves a torn tree.
+     */
+    void save(const std::string &fileName);
+
+protected:
+    void leaf(uint32_t pageNo, const uint8_t *tag, uint32_t tagSize, uint8_t *out);
+    void node(const uint8_t *left, const uint8_t *right, uint8_t *out);
+    void digest(uint8_t *out);
+
+    void saveAll(const std::string &fileName);
+    void saveChanged(const std::string &fileName);
+    void header(Buffer &out);
+    bool parse(const Buffer &content);
+    void charge();
+
+    const IDataCrypt &mDataCrypt;
+    const Buffer &mKey;
+    uint32_t mDigestSize;
+
+    // digests of all nodes, leaves at level 0
+    std::vector<std::vector<uint8_t>> mLevels;
+    // leaves changed since the root was computed
+    std::vector<uint32_t> mDirty;
+    bool mRootValid = false;
+    // leaves changed since the tree was saved, page count of the saved tree, whether it has to be written in full
+    std::vector<uint32_t> mUnsaved;
+    uint32_t mSavedCount = 0;
+    bool mSaveAll = true;
+    // bytes charged to the MemoryBudget
+    size_t mBudgetSize = 0;
+    Buffer mRoot, mInput, mOutput;
+};
+
+#endif //CRYPTOSQLITE_MERKLETREE_H
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include "PlaintextPolicy.h"
+#include "../file/BTreePage.h"
+
+namespace {
+    // offset of the schema cookie in the database header
+    const uint32_t SCHEMA_COOKIE_OFFSET = 40;
+}
+
+PlaintextPolicy::PlaintextPolicy(const std::vector<uint32_t> &roots, uint32_t schemaCookie)
+        : mRoots(roots.begin(), roots.end()), mSchemaCookie(schemaCookie) {
+    // page 1 holds the schema and the database header
+    mRoots.erase(0);
+    mRoots.erase(1);
+}
+
+void PlaintextPolicy::observe(uint32_t pageNo, const uint8_t *page, uint32_t usableSize) {
+    bool overflow;
+    if (!member(pageNo, overflow))
+        return;
+
+    std::vector<BTreePage::Link> current;
+    BTreePage::links(page, pageNo, overflow, usableSize, current);
+
+    // forget links to children that moved away, unless they were linked elsewhere since
+    std::vector<uint32_t> &previous = mChildren[pageNo];
+    for (uint32_t child : previous) {
+        auto it = mLinks.find(child);
+        if (it != mLinks.end() && it->second.parent == pageNo)
+            mLinks.erase(it);
+    }
+
+    previous.clear();
+    for (auto &child : current) {
+        mLinks[child.first] = {pageNo, child.second};
+        previous.push_back(child.first);
+    }
+}
+
+bool PlaintextPolicy::isPlaintext(uint32_t pageNo, uint32_t usableSize, const PageLookup &lookup) const {
+    // roots are only valid for the schema they were resolved from
+    const uint8_t *first = lookup(1);
+    if (!first || BTreePage::get4byte(first + SCHEMA_COOKIE_OFFSET) != mSchemaCookie)
+        return false;
+
+    std::vector<BTreePage::Link> current;
+    uint32_t child = pageNo;
+
+    // bounded by the number of links, so corrupt pages can not cause a cycle
+    for (size_t depth = 0; depth <= mLinks.size(); depth++) {
+        if (mRoots.count(child))
+            return true;
+
+        auto link = mLinks.find(child);
+        if (link == mLinks.end())
+            return false;
+
+        // the parent must be cached, otherwise its current content is unknown
+        uint32_t parent = link->second.parent;
+        bool parentOverflow;
+        const uint8_t *parentPage = lookup(parent);
+        if (!parentPage || !member(parent, parentOverflow))
+            return false;
+
+        current.clear();
+        BTreePage::links(parentPage, parent, parentOverflow, usableSize, current);
+        if (std::find(current.begin(), current.end(), std::make_pair(child, link->second.overflow)) == current.end())
+            return false;
+
+        child = parent;
+    }
+    return false;
+}
+
+bool PlaintextPolicy::member(uint32_t pageNo, bool &overflow) const {
+    if (mRoots.count(pageNo)) {
+        overflow = false;
+        return true;
+    }
+
+    auto link = mLinks.find(pageNo);
+    if (link == mLinks.end())
+        return false;
+
+    overflow = link->second.overflow;
+    return true;
+}
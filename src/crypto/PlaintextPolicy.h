@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRYPTOSQLITE_PLAINTEXTPOLICY_H
+#define CRYPTOSQLITE_PLAINTEXTPOLICY_H
+
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * Decides which pages belong to B-trees that are stored without encryption.
+ *
+ * The codec only sees pages, so ownership is learned from the child and overflow pointers of pages read and written
+ * below the plaintext roots. Learned links are only candidates: a page is plaintext if every ancestor up to a root
+ * is cached by sqlite and its current content still points to the page, and the schema was not changed since the
+ * roots were resolved. Anything that can not be confirmed is encrypted.
+ */
+class PlaintextPolicy {
+public:
+    /**
+     * Returns the current plaintext content of a page cached by sqlite, nullptr if it is not cached
+     */
+    using PageLookup = std::function<const uint8_t *(uint32_t pageNo)>;
+
+    /**
+     * @param roots Root pages of plaintext tables and indices
+     * @param schemaCookie Schema cookie of the database when the roots were resolved
+     */
+    PlaintextPolicy(const std::vector<uint32_t> &roots, uint32_t schemaCookie);
+
+    /**
+     * Learns the children of a page below a plaintext root
+     *
+     * @param page Plaintext of a full page
+     * @param usableSize Page size without reserved bytes
+     */
+    void observe(uint32_t pageNo, const uint8_t *page, uint32_t usableSize);
+
+    /**
+     * @return True if the page may be written without encryption
+     */
+    bool isPlaintext(uint32_t pageNo, uint32_t usableSize, const PageLookup &lookup) const;
+
+protected:
+    struct Link {
+        uint32_t parent;
+        bool overflow;
+    };
+
+    /**
+     * @return True if the page is a root or linked below one, in which case overflow is set
+     */
+    bool member(uint32_t pageNo, bool &overflow) const;
+
+    std::unordered_set<uint32_t> mRoots;
+    uint32_t mSchemaCookie;
+    // candidate parent of each page below a root, and the children last seen on each parent
+    std::unordered_map<uint32_t, Link> mLinks;
+    std::unordered_map<uint32_t, std::vector<uint32_t>> mChildren;
+};
+
+#endif //CRYPTOSQLITE_PLAINTEXTPOLICY_H
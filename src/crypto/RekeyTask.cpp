@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include "RekeyTask.h"
+#include "FieldCrypt.h"
+#include "FileWrapper.h"
+#include "KeyCache.h"
+#include "../vfs/VFS.h"
+
+namespace {
+    // pages copied per step if not throttled, determines progress and cancellation granularity
+    const int ROTATE_STEP_PAGES = 256;
+
+    void removeDatabaseFiles(const std::string &fileName) {
+        for (auto *suffix : {"", "-keyfile", "-merkle", "-merkle-journal", "-journal", "-wal", "-shm"})
+            std::remove((fileName + suffix).c_str());
+    }
+}
+
+RekeyTask::RekeyTask(const char *fileName, const void *oldKey, int oldKeyLen, const void *newKey, int newKeyLen,
+                     int flags, int pagesPerSecond, sqlite3_rekey_progress progress, void *progressArg)
+        : mFileName(fileName), mFlags(flags), mPagesPerSecond(pagesPerSecond), mProgress(progress),
+          mProgressArg(progressArg) {
+    // copy keys, caller's buffers may be gone before the task runs
+    mOldKey.write(oldKey, oldKeyLen, 0);
+    mNewKey.write(newKey, newKeyLen, 0);
+}
+
+RekeyTask::~RekeyTask() {
+    if (mThread.joinable())
+        mThread.join();
+}
+
+void RekeyTask::start() {
+    mThread = std::thread([this] { run(); });
+}
+
+void RekeyTask::cancel() {
+    mCancel = true;
+    mCondition.notify_all();
+}
+
+int RekeyTask::wait() {
+    if (mThread.joinable())
+        mThread.join();
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mResult;
+}
+
+bool RekeyTask::status(int *done, int *total) const {
+    if (done) *done = mDone;
+    if (total) *total = mTotal;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mFinished;
+}
+
+void RekeyTask::run() {
+    sqlite3 *db = nullptr;
+
+    // open with old key and probe it by reading the schema
+    int rc = VFS::instance()->openNamed(mFileName.c_str(), &db, mOldKey.const_data(), mOldKey.size());
+    if (rc == SQLITE_OK)
+        rc = sqlite3_exec(db, "SELECT count(*) FROM sqlite_schema;", nullptr, nullptr, nullptr);
+
+    if (rc == SQLITE_OK)
+        rc = (mFlags & CRYPTOSQLITE_REKEY_ROTATE) ? rotate(db) : rewrap(db);
+
+    int closeRc = sqlite3_close(db);
+    if (rc == SQLITE_OK)
+        rc = closeRc;
+
+    // wipe keys
+    mOldKey.clear(true);
+    mNewKey.clear(true);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    mResult = rc;
+    mFinished = true;
+}
+
+int RekeyTask::rewrap(sqlite3 *db) {
+    File *mainDB = File::fromDatabase(db);
+    if (!mainDB || !mainDB->mCrypto)
+        return SQLITE_ERROR;
+
+    if (!progress(0, 1, Clock::now()))
+        return SQLITE_INTERRUPT;
+
+    // write keyfile with new file key
+    try {
+        mainDB->mCrypto->rekey(mNewKey.const_data(), mNewKey.size());
+    } catch (const std::exception &) {
+        return SQLITE_IOERR;
+    }
+
+    progress(1, 1, Clock::now());
+    return SQLITE_OK;
+}
+
+int RekeyTask::rotate(sqlite3 *db) {
+    const char *dbFileName = sqlite3_db_filename(db, "main");
+    std::string fileName = dbFileName, target = fileName + "-rotate";
+
+    // the database file is replaced at the end, which requires exclusive use. connections of this process are
+    // rejected even if idle, as they would keep using the replaced file. idle connections of other processes hold no
+    // lock and can not be detected, rotation is only supported for databases used by a single process.
+    if (VFS::instance()->countMainDatabases(dbFileName) > 1)
+        return SQLITE_BUSY;
+
+    // the exclusive lock is kept until the connection is closed after the rename, so no connection in any process
+    // reads or writes the database in between
+    int rc = sqlite3_exec(db, "PRAGMA locking_mode=EXCLUSIVE; BEGIN EXCLUSIVE; COMMIT;", nullptr, nullptr, nullptr);
+
+    // move WAL contents to the database file, so the replaced database does not leave a stale WAL behind
+    if (rc == SQLITE_OK)
+        rc = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE, nullptr, nullptr);
+
+    // start with an empty target encrypted with a fresh data key under the new file key, keeping the cipher
+    removeDatabaseFiles(target);
+    sqlite3 *targetDB = nullptr;
+    File *mainDB = File::fromDatabase(db);
+    if (rc == SQLITE_OK && (!mainDB || !mainDB->mCrypto))
+        rc = SQLITE_ERROR;
+    // the database file is replaced by renaming it, which would leave stripes behind
+    if (rc == SQLITE_OK && mainDB->mCrypto->stripes() > 1)
+        rc = SQLITE_MISUSE;
+
+    // pages are copied with their reserved bytes, so the target needs the same layout
+    if (rc == SQLITE_OK) {
+        try {
+            mainDB->mCrypto->loadKey();
+        } catch (const std::exception &) {
+            rc = SQLITE_CANTOPEN;
+        }
+    }
+    if (rc == SQLITE_OK)
+        rc = VFS::instance()->openNamed(target.c_str(), &targetDB, mNewKey.const_data(), mNewKey.size(),
+                                        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, mainDB->mCrypto->cipher().c_str(),
+                                        mainDB->mCrypto->pageFlags());
+    if (rc == SQLITE_OK)
+        rc = copyPages(db, targetDB);
+    // the copied field key is still wrapped with the old data key
+    if (rc == SQLITE_OK)
+        rc = FieldCrypt::rewrapKey(db, targetDB);
+
+    // closing flushes the target keyfile
+    int closeRc = sqlite3_close(targetDB);
+    if (rc == SQLITE_OK)
+        rc = closeRc;
+
+    if (rc == SQLITE_OK) {
+        // replace database first and make that durable, Crypto finishes the other renames when interrupted after it
+        if (std::rename(target.c_str(), fileName.c_str()) != 0 || !FileWrapper::syncDirectory(fileName))
+            rc = SQLITE_IOERR;
+        // the journal of the old tree must not be applied to the new one
+        if (rc == SQLITE_OK)
+            std::remove((fileName + "-merkle-journal").c_str());
+        if (rc == SQLITE_OK && FileWrapper::exists(target + "-merkle") &&
+            std::rename((target + "-merkle").c_str(), (fileName + "-merkle").c_str()) != 0)
+            rc = SQLITE_IOERR;
+        if (rc == SQLITE_OK && (std::rename((target + "-keyfile").c_str(), (fileName + "-keyfile").c_str()) != 0 ||
+                                !FileWrapper::syncDirectory(fileName)))
+            rc = SQLITE_IOERR;
+
+        KeyCache::instance()->invalidate(fileName + "-keyfile");
+    }
+    else
+        removeDatabaseFiles(target);
+
+    return rc;
+}
+
+int RekeyTask::copyPages(sqlite3 *source, sqlite3 *target) {
+    sqlite3_backup *backup = sqlite3_backup_init(target, "main", source, "main");
+    if (!backup)
+        return sqlite3_errcode(target);
+
+    int stepPages = mPagesPerSecond > 0 ? (std::max)(1, (std::min)(mPagesPerSecond / 10, ROTATE_STEP_PAGES))
+                                        : ROTATE_STEP_PAGES;
+    auto start = Clock::now();
+    int rc;
+
+    do {
+        rc = sqlite3_backup_step(backup, stepPages);
+
+        // the last step may copy fewer pages, throttle by the pages actually copied
+        int total = sqlite3_backup_pagecount(backup);
+        if (!progress(total - sqlite3_backup_remaining(backup), total, start)) {
+            rc = SQLITE_INTERRUPT;
+            break;
+        }
+
+        // source locked by another connection, retry
+        if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+            sqlite3_sleep(50);
+            rc = SQLITE_OK;
+        }
+    } while (rc == SQLITE_OK);
+
+    int finishRc = sqlite3_backup_finish(backup);
+    if (rc == SQLITE_DONE)
+        rc = finishRc;
+
+    return rc;
+}
+
+bool RekeyTask::progress(int done, int total, Clock::time_point start) {
+    mDone = done;
+    mTotal = total;
+
+    if (mProgress && mProgress(mProgressArg, done, total) != 0)
+        mCancel = true;
+
+    // sleep until the copied pages are due, wake up early on cancel
+    if (mPagesPerSecond > 0 && done > 0) {
+        auto due = start + std::chrono::microseconds(static_cast<int64_t>(done) * 1000000 / mPagesPerSecond);
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCondition.wait_until(lock, due, [this] { return mCancel.load(); });
+    }
+
+    return !mCancel;
+}
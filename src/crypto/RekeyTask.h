@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRYPTOSQLITE_REKEYTASK_H
+#define CRYPTOSQLITE_REKEYTASK_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <cryptosqlite/cryptosqlite.h>
+
+/**
+ * Rekey running on a thread of its own, so a throttled rotation does not hold a worker of the shared pool.
+ *
+ * Rewraps the data key with a new file key. With CRYPTOSQLITE_REKEY_ROTATE, a new data key is generated and all pages
+ * are re-encrypted by copying the database to "<name>-rotate", which then replaces the database and its keyfile.
+ * Page copying reports progress, can be cancelled and is throttled to a maximum number of pages per second.
+ */
+class RekeyTask {
+public:
+    RekeyTask(const char *fileName, const void *oldKey, int oldKeyLen, const void *newKey, int newKeyLen, int flags,
+              int pagesPerSecond, sqlite3_rekey_progress progress, void *progressArg);
+
+    ~RekeyTask();
+
+    void start();
+    void cancel();
+
+    /**
+     * Blocks until the task finished
+     *
+     * @return Standard sqlite error code of the rekey
+     */
+    int wait();
+
+    /**
+     * @return True if the task finished
+     */
+    bool status(int *done, int *total) const;
+
+protected:
+    using Clock = std::chrono::steady_clock;
+
+    void run();
+    int rewrap(sqlite3 *db);
+    int rotate(sqlite3 *db);
+    int copyPages(sqlite3 *source, sqlite3 *target);
+
+    /**
+     * Reports progress and waits to stay below the configured page rate
+     *
+     * @return False if the task was cancelled
+     */
+    bool progress(int done, int total, Clock::time_point start);
+
+    std::string mFileName;
+    Buffer mOldKey, mNewKey;
+    int mFlags, mPagesPerSecond;
+    sqlite3_rekey_progress mProgress;
+    void *mProgressArg;
+
+    std::atomic<bool> mCancel {false};
+    std::atomic<int> mDone {0}, mTotal {0};
+
+    std::thread mThread;
+    mutable std::mutex mMutex;
+    std::condition_variable mCondition;
+    bool mFinished = false;
+    int mResult = SQLITE_OK;
+};
+
+#endif //CRYPTOSQLITE_REKEYTASK_H
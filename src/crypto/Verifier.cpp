@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include "Verifier.h"
+#include "FileWrapper.h"
+#include "../csqlite/csqlite.h"
+#include "../file/StripedFile.h"
+#include "../memory/MemoryBudget.h"
+#include "../util/ThreadPool.h"
+#include "../vfs/VFS.h"
+
+namespace {
+    // bytes read and decrypted per task
+    const sqlite3_int64 VERIFY_CHUNK_SIZE = 4 * 1024 * 1024;
+    const int WAL_HEADER_SIZE = 32;
+    const char DB_HEADER[] = "SQLite format 3";
+
+    bool isHeader(const uint8_t *page) {
+        return memcmp(page, DB_HEADER, sizeof(DB_HEADER)) == 0;
+    }
+}
+
+Verifier::Verifier(const std::string &fileName, const void *fileKey, int keylen) : mFileName(fileName) {
+    mKey.write(fileKey, keylen, 0);
+}
+
+int Verifier::run(ThreadPool *pool) {
+    // same name as used by the VFS, so keyfile and key cache entry match open connections
+    sqlite3_vfs *vfs = VFS::instance()->underlying();
+    std::vector<char> fullName(vfs->mxPathname + 1);
+    if (vfs->xFullPathname(vfs, mFileName.c_str(), vfs->mxPathname + 1, fullName.data()) != SQLITE_OK)
+        return SQLITE_CANTOPEN;
+    std::string dbFileName = fullName.data();
+
+    // reading a missing keyfile would create it
+    if (!FileWrapper::exists(dbFileName) || !FileWrapper::exists(dbFileName + "-keyfile"))
+        return SQLITE_CANTOPEN;
+
+    try {
+        mCrypto.reset(new Crypto(dbFileName, mKey.const_data(), mKey.size(), 1));
+        mCrypto->decryptFirstPageCache();
+    } catch (const std::exception &) {
+        return SQLITE_CANTOPEN;
+    }
+    mKey.clear(true);
+
+    // cached first page decrypts to a database header unless the key is wrong
+    const uint8_t *header = mCrypto->pageBufferOut();
+    if (!isHeader(header))
+        return SQLITE_NOTADB;
+
+    mPageSize = (header[16] << 8) | header[17];
+    if (mPageSize == 1)
+        mPageSize = 65536;
+    if (mPageSize < 512 || (mPageSize & (mPageSize - 1)) != 0)
+        return SQLITE_NOTADB;
+
+    int rc = scan(pool, dbFileName, SQLITE_OPEN_MAIN_DB, 0, 0, mBadPages);
+    if (rc == SQLITE_OK && FileWrapper::exists(dbFileName + "-wal"))
+        rc = scan(pool, dbFileName + "-wal", SQLITE_OPEN_WAL, WAL_HEADER_SIZE, SQLITE_WAL_FRAMEHEADER_SIZE, mBadFrames);
+
+    if (rc == SQLITE_OK && (!mBadPages.empty() || !mBadFrames.empty()))
+        rc = SQLITE_CORRUPT;
+    return rc;
+}
+
+int Verifier::scan(ThreadPool *pool, const std::string &fileName, int openFlags, int headerSize, int frameHeaderSize,
+                   std::vector<sqlite3_int64> &bad) {
+    // pages of a striped database are read from their stripes, offsets and sizes are those of a single file
+    uint32_t stripes = openFlags == SQLITE_OPEN_MAIN_DB ? mCrypto->stripes() : 1;
+    sqlite3_int64 fileSize = 0;
+    {
+        StripedFile file(fileName, openFlags | SQLITE_OPEN_READONLY, stripes, mPageSize);
+        int rc = file.rc();
+        if (rc == SQLITE_OK)
+            rc = file.size(&fileSize);
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+
+    // a WAL may end in a torn frame which sqlite ignores, a torn database page is an error
+    sqlite3_int64 unitSize = frameHeaderSize + mPageSize;
+    sqlite3_int64 units = (std::max)(fileSize - headerSize, sqlite3_int64(0)) / unitSize;
+    if (frameHeaderSize == 0 && units * unitSize != fileSize)
+        bad.push_back(units + 1);
+
+    sqlite3_int64 unitsPerChunk = (std::max)(VERIFY_CHUNK_SIZE / unitSize, sqlite3_int64(1));
+    auto chunks = static_cast<size_t>((units + unitsPerChunk - 1) / unitsPerChunk);
+
+    std::atomic<int> error {SQLITE_OK};
+    pool->parallelFor(chunks, [&] (size_t chunk) {
+        sqlite3_int64 first = chunk * unitsPerChunk, count = (std::min)(unitsPerChunk, units - first);
+        auto chunkSize = static_cast<int>(count * unitSize);
+        std::vector<sqlite3_int64> chunkBad;
+
+        MemoryBudget::instance()->acquire(chunkSize, MemoryBudget::PRIORITY_BUFFER);
+        try {
+            // own file handle, plugin instance and buffers per task
+            StripedFile file(fileName, openFlags | SQLITE_OPEN_READONLY, stripes, mPageSize);
+            std::vector<uint8_t> data(chunkSize);
+            int rc = file.rc();
+            if (rc == SQLITE_OK)
+                rc = file.read(data.data(), chunkSize, headerSize + first * unitSize);
+            if (rc != SQLITE_OK)
+                throw cryptosqlite_exception("Read failed");
+
+            std::unique_ptr<IDataCrypt> dataCrypt;
+            mCrypto->makeDataCrypt(dataCrypt);
+
+            Buffer pageIn, pageOut;
+            pageOut.padd(mPageSize, 0);
+
+            for (sqlite3_int64 i = 0; i < count; i++) {
+                const uint8_t *unit = data.data() + i * unitSize;
+                uint32_t pageNo = frameHeaderSize ? csqlite3_get4byte(unit) : static_cast<uint32_t>(first + i + 1);
+
+                // unused frame
+                if (pageNo == 0)
+                    continue;
+
+                bool valid = true;
+                try {
+                    pageIn.write(unit + frameHeaderSize, mPageSize, 0);
+                    mCrypto->decryptPage(*dataCrypt, pageIn, pageOut, pageNo);
+                    valid = pageNo != 1 || isHeader(pageOut.const_data());
+                } catch (const std::exception &) {
+                    // plugin rejected the page
+                    valid = false;
+                }
+
+                if (!valid)
+                    chunkBad.push_back(first + i + 1);
+            }
+        } catch (const std::exception &) {
+            int expected = SQLITE_OK;
+            error.compare_exchange_strong(expected, SQLITE_IOERR);
+        }
+        MemoryBudget::instance()->release(chunkSize, MemoryBudget::PRIORITY_BUFFER);
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        bad.insert(bad.end(), chunkBad.begin(), chunkBad.end());
+    });
+
+    std::sort(bad.begin(), bad.end());
+    return error;
+}
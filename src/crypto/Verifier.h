@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRYPTOSQLITE_VERIFIER_H
+#define CRYPTOSQLITE_VERIFIER_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Crypto.h"
+
+extern "C" {
+#include <sqlite3.h>
+};
+
+class ThreadPool;
+
+/**
+ * Checks that every page of an encrypted database and its WAL decrypts and authenticates.
+ *
+ * Reads the files directly in large chunks, bypassing pager and B-tree, and decrypts the chunks on a thread pool.
+ * A page is bad if the crypto plugin rejects it. The database header on page 1 is checked as well.
+ */
+class Verifier {
+public:
+    /**
+     * @param fileName Database file name
+     * @param fileKey Key of the database
+     * @param keylen Key size
+     */
+    Verifier(const std::string &fileName, const void *fileKey, int keylen);
+
+    /**
+     * @param pool Pool to decrypt on, the calling thread takes part
+     * @return SQLITE_OK if all pages are valid, SQLITE_CORRUPT if bad pages were found, other error codes if the
+     *         files could not be scanned
+     */
+    int run(ThreadPool *pool);
+
+    /**
+     * @return Sorted numbers of bad pages in the database file
+     */
+    const std::vector<sqlite3_int64> &badPages() const {
+        return mBadPages;
+    }
+
+    /**
+     * @return Sorted numbers of bad frames in the WAL, counted from 1
+     */
+    const std::vector<sqlite3_int64> &badFrames() const {
+        return mBadFrames;
+    }
+
+protected:
+    /**
+     * Scans units (WAL frames or database pages) of frameHeaderSize + mPageSize bytes, starting at headerSize
+     */
+    int scan(ThreadPool *pool, const std::string &fileName, int openFlags, int headerSize, int frameHeaderSize,
+             std::vector<sqlite3_int64> &bad);
+
+    std::string mFileName;
+    Buffer mKey;
+    std::unique_ptr<Crypto> mCrypto;
+    int mPageSize = 0;
+
+    std::mutex mMutex;
+    std::vector<sqlite3_int64> mBadPages, mBadFrames;
+};
+
+#endif //CRYPTOSQLITE_VERIFIER_H
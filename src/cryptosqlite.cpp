@@ -17,10 +17,135 @@
  * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <cstring>
+#include <mutex>
 #include <cryptosqlite/cryptosqlite.h>
 #include "vfs/VFS.h"
+#include "csqlite/csqlite.h"
+#include "memory/MemoryBudget.h"
+#include "crypto/BlobStore.h"
+#include "crypto/FieldCrypt.h"
+#include "crypto/KeyCache.h"
+#include "crypto/RekeyTask.h"
+#include "crypto/Verifier.h"
+#include "file/Clone.h"
+#include "file/PageCache.h"
+#include "file/PageSync.h"
+#include "file/ParallelScan.h"
+#include "file/WalReplica.h"
+#include "file/WalTap.h"
+#include "util/IOTrace.h"
+#include "util/ThreadPool.h"
 
-cryptosqlite::CryptoFactory cryptosqlite::sFactoryCrypt;
+std::shared_ptr<const cryptosqlite::CryptoFactory> cryptosqlite::sFactoryCrypt;
+std::map<std::string, std::shared_ptr<const cryptosqlite::CryptoFactory>> cryptosqlite::sCiphers;
+
+namespace {
+    // registration may race with opens on other threads
+    std::mutex &factoryMutex() {
+        static std::mutex sMutex;
+        return sMutex;
+    }
+}
+
+void cryptosqlite::setCryptoFactory(CryptoFactory factory) {
+    auto shared = std::make_shared<const CryptoFactory>(std::move(factory));
+    std::lock_guard<std::mutex> lock(factoryMutex());
+    sFactoryCrypt = std::move(shared);
+}
+
+void cryptosqlite::makeDataCrypt(std::unique_ptr<IDataCrypt> &out) {
+    makeDataCrypt(out, "");
+}
+
+void cryptosqlite::registerCipher(const std::string &name, CryptoFactory factory) {
+    // an empty name in the keyfile selects the default factory
+    if (name.empty())
+        throw cryptosqlite_exception("Invalid cipher name.");
+
+    auto shared = std::make_shared<const CryptoFactory>(std::move(factory));
+    std::lock_guard<std::mutex> lock(factoryMutex());
+    sCiphers[name] = std::move(shared);
+}
+
+void cryptosqlite::unregisterCipher(const std::string &name) {
+    std::lock_guard<std::mutex> lock(factoryMutex());
+    sCiphers.erase(name);
+}
+
+void cryptosqlite::makeDataCrypt(std::unique_ptr<IDataCrypt> &out, const std::string &cipher) {
+    (*factory(cipher))(out);
+}
+
+std::shared_ptr<const cryptosqlite::CryptoFactory> cryptosqlite::factory(const std::string &cipher) {
+    std::shared_ptr<const CryptoFactory> found;
+    {
+        std::lock_guard<std::mutex> lock(factoryMutex());
+        if (cipher.empty())
+            found = sFactoryCrypt;
+        else {
+            auto it = sCiphers.find(cipher);
+            if (it != sCiphers.end())
+                found = it->second;
+        }
+    }
+
+    if (!found || !*found)
+        throw cryptosqlite_exception(cipher.empty() ? "No crypto factory set." : "Unknown cipher " + cipher + ".");
+    return found;
+}
+
+bool cryptosqlite::hasCiphers() {
+    std::lock_guard<std::mutex> lock(factoryMutex());
+    return !sCiphers.empty();
+}
+
+void cryptosqlite::setMemoryLimit(size_t limit) {
+    MemoryBudget::instance()->setLimit(limit);
+}
+
+size_t cryptosqlite::memoryUsage() {
+    return MemoryBudget::instance()->usage();
+}
+
+void cryptosqlite::lockStats(LockContention &registry, LockContention &connection) {
+    LockStats::registry().read(registry.acquisitions, registry.contended, registry.waitNanoseconds);
+    LockStats::connection().read(connection.acquisitions, connection.contended, connection.waitNanoseconds);
+}
+
+void cryptosqlite::resetLockStats() {
+    LockStats::registry().reset();
+    LockStats::connection().reset();
+}
+
+void cryptosqlite::setKeyCache(size_t capacity, std::chrono::seconds idleTimeout) {
+    KeyCache::instance()->configure(capacity, idleTimeout);
+}
+
+void cryptosqlite::keyCacheStats(uint64_t &hits, uint64_t &misses) {
+    KeyCache::instance()->stats(hits, misses);
+}
+
+void cryptosqlite::setReadAhead(uint32_t pages) {
+    Prefetcher::setDepth(pages);
+}
+
+void cryptosqlite::setBTreeReadAhead(uint32_t pages) {
+    Prefetcher::setSiblingDepth(pages);
+}
+
+void cryptosqlite::readAheadStats(uint64_t &read, uint64_t &used) {
+    Prefetcher::stats(read, used);
+}
+
+void cryptosqlite::setPageCache(const std::string &directory, uint32_t pages) {
+    PageCache::configure(directory, pages);
+}
+
+bool cryptosqlite::setIOTrace(const std::string &path) {
+    return IOTrace::start(path);
+}
 
 void sqlite3_prepare_open_encrypted(const void *zKey, int nKey) {
     VFS::instance()->prepare(zKey, nKey);
@@ -41,6 +166,37 @@ int sqlite3_open_encrypted(const char *zFilename, sqlite3 **ppDb, const void *zK
     return rc;
 }
 
+int sqlite3_open_encrypted_v2(const char *zFilename, sqlite3 **ppDb, int flags, const void *zKey, int nKey,
+                              const char *zCipher) {
+    return VFS::instance()->openNamed(zFilename, ppDb, zKey, nKey, flags, zCipher);
+}
+
+int sqlite3_open_encrypted_batch(sqlite3_encrypted_open *aOpen, int nOpen, int nThreads) {
+    if (aOpen == nullptr || nOpen <= 0)
+        return nOpen == 0 ? SQLITE_OK : SQLITE_MISUSE;
+
+    // keyfile reads and key unwrapping run on all workers
+    ThreadPool pool(static_cast<unsigned>((std::max)(nThreads, 0)));
+    pool.parallelFor(static_cast<size_t>(nOpen), [aOpen] (size_t i) {
+        sqlite3_encrypted_open &entry = aOpen[i];
+
+        entry.pDb = nullptr;
+        entry.rc = VFS::instance()->openNamed(entry.zFilename, &entry.pDb, entry.zKey, entry.nKey);
+
+        // do not hand out half opened handles
+        if (entry.rc != SQLITE_OK && entry.pDb) {
+            sqlite3_close(entry.pDb);
+            entry.pDb = nullptr;
+        }
+    });
+
+    // report first error
+    for (int i = 0; i < nOpen; i++)
+        if (aOpen[i].rc != SQLITE_OK)
+            return aOpen[i].rc;
+    return SQLITE_OK;
+}
+
 int sqlite3_rekey_encrypted(const char *zFilename, const void *zKeyOld, int nKeyOld, const void *zKeyNew, int nKeyNew) {
     // temp db
     sqlite3 *pDB;
@@ -49,8 +205,7 @@ int sqlite3_rekey_encrypted(const char *zFilename, const void *zKeyOld, int nKey
     int rc = sqlite3_open_encrypted(zFilename, &pDB, zKeyOld, nKeyOld);
     if (rc == SQLITE_OK) {
         // find main db file
-        const char *fileName = sqlite3_db_filename(pDB, "main");
-        File *mainDB = VFS::instance()->findMainDatabase(fileName);
+        File *mainDB = File::fromDatabase(pDB);
 
         // write keyfile with new file key
         if (mainDB && mainDB->mCrypto) {
@@ -65,13 +220,331 @@ int sqlite3_rekey_encrypted(const char *zFilename, const void *zKeyOld, int nKey
     return rc;
 }
 
+sqlite3_rekey_task *sqlite3_rekey_encrypted_async(const char *zFilename, const void *zKeyOld, int nKeyOld,
+        const void *zKeyNew, int nKeyNew, int flags, int nPagesPerSecond, sqlite3_rekey_progress xProgress, void *pArg) {
+    if (zFilename == nullptr || zKeyOld == nullptr || nKeyOld <= 0 || zKeyNew == nullptr || nKeyNew <= 0)
+        return nullptr;
+
+    // runs on a thread of its own, freed by sqlite3_rekey_wait
+    auto *task = new RekeyTask(zFilename, zKeyOld, nKeyOld, zKeyNew, nKeyNew, flags, nPagesPerSecond, xProgress, pArg);
+    task->start();
+    return reinterpret_cast<sqlite3_rekey_task *>(task);
+}
+
+int sqlite3_rekey_status(sqlite3_rekey_task *pTask, int *pnDone, int *pnTotal) {
+    if (!pTask)
+        return SQLITE_MISUSE;
+
+    // SQLITE_DONE once finished, the result is returned by sqlite3_rekey_wait
+    return reinterpret_cast<RekeyTask *>(pTask)->status(pnDone, pnTotal) ? SQLITE_DONE : SQLITE_OK;
+}
+
+void sqlite3_rekey_cancel(sqlite3_rekey_task *pTask) {
+    if (pTask)
+        reinterpret_cast<RekeyTask *>(pTask)->cancel();
+}
+
+int sqlite3_rekey_wait(sqlite3_rekey_task *pTask) {
+    if (!pTask)
+        return SQLITE_MISUSE;
+
+    auto *task = reinterpret_cast<RekeyTask *>(pTask);
+    int rc = task->wait();
+    delete task;
+    return rc;
+}
+
+int sqlite3_verify_encrypted(const char *zFilename, const void *zKey, int nKey, int nThreads,
+        sqlite3_verify_report xReport, void *pArg) {
+    if (zFilename == nullptr || zKey == nullptr || nKey <= 0)
+        return SQLITE_MISUSE;
+
+    // decrypt on the shared pool unless a thread count is given
+    std::unique_ptr<ThreadPool> pool;
+    if (nThreads > 0)
+        pool.reset(new ThreadPool(static_cast<unsigned>(nThreads)));
+
+    Verifier verifier(zFilename, zKey, nKey);
+    int rc = verifier.run(pool ? pool.get() : ThreadPool::shared());
+
+    // report in order on the calling thread
+    if (xReport) {
+        for (auto page : verifier.badPages())
+            xReport(pArg, 0, page);
+        for (auto frame : verifier.badFrames())
+            xReport(pArg, 1, frame);
+    }
+    return rc;
+}
+
+int sqlite3_integrity_root(sqlite3 *db, void *pRoot, int nRoot) {
+    File *mainDB = File::fromDatabase(db);
+    if (!mainDB || !mainDB->mCrypto || !mainDB->mCrypto->hasTree())
+        return 0;
+
+    // root over all pages written so far, store it elsewhere to detect rollback of the files
+    SQLite3Mutex mutex(csqlite3_get_mutex(db), &LockStats::connection());
+    SQLite3LockGuard lock(mutex);
+
+    const Buffer &root = mainDB->mCrypto->treeRoot();
+    if (pRoot && nRoot > 0)
+        memcpy(pRoot, root.const_data(), (std::min)(root.size(), static_cast<uint32_t>(nRoot)));
+    return static_cast<int>(root.size());
+}
+
+int sqlite3_integrity_rebuild(const char *zFilename, const void *zKey, int nKey) {
+    if (zFilename == nullptr || zKey == nullptr || nKey <= 0)
+        return SQLITE_MISUSE;
+
+    // the tree is rebuilt and saved while the database is attached
+    sqlite3 *db = nullptr;
+    VFS::instance()->prepareRebuild();
+    int rc = VFS::instance()->openNamed(zFilename, &db, zKey, nKey, SQLITE_OPEN_READWRITE);
+    sqlite3_close(db);
+    return rc;
+}
+
+int sqlite3_plaintext_tables(sqlite3 *db, const char *zTables) {
+    File *mainDB = File::fromDatabase(db);
+    if (!mainDB || !mainDB->mCrypto)
+        return SQLITE_ERROR;
+
+    // resolve root pages of the tables and their indices, reading the schema loads the key
+    std::vector<uint32_t> roots;
+    sqlite3_stmt *stmt = nullptr;
+    int rc = sqlite3_prepare_v2(db, "SELECT rootpage FROM main.sqlite_master WHERE tbl_name = ?1 COLLATE NOCASE",
+                                -1, &stmt, nullptr);
+
+    std::string tables = zTables ? zTables : "";
+    for (size_t begin = 0; rc == SQLITE_OK && begin < tables.size();) {
+        size_t end = (std::min)(tables.find(',', begin), tables.size());
+        size_t first = tables.find_first_not_of(' ', begin), last = tables.find_last_not_of(' ', end - 1);
+        if (first < end && last != std::string::npos && last >= first) {
+            sqlite3_bind_text(stmt, 1, tables.data() + first, static_cast<int>(last - first + 1), SQLITE_TRANSIENT);
+            while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+                roots.push_back(static_cast<uint32_t>(sqlite3_column_int64(stmt, 0)));
+            rc = rc == SQLITE_DONE ? sqlite3_reset(stmt) : rc;
+        }
+        begin = end + 1;
+    }
+    sqlite3_finalize(stmt);
+    stmt = nullptr;
+
+    // roots are only valid for this schema
+    int schemaCookie = 0;
+    if (rc == SQLITE_OK)
+        rc = sqlite3_prepare_v2(db, "PRAGMA main.schema_version", -1, &stmt, nullptr);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_step(stmt) == SQLITE_ROW ? SQLITE_OK : SQLITE_ERROR;
+        schemaCookie = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    SQLite3Mutex mutex(csqlite3_get_mutex(db), &LockStats::connection());
+    SQLite3LockGuard lock(mutex);
+
+    // the flag byte is reserved when the database is created
+    if (!mainDB->mCrypto->pageFlags())
+        return SQLITE_MISUSE;
+
+    std::unique_ptr<PlaintextPolicy> policy;
+    if (!roots.empty())
+        policy.reset(new PlaintextPolicy(roots, static_cast<uint32_t>(schemaCookie)));
+    mainDB->mCrypto->setPlaintextPolicy(std::move(policy));
+    return SQLITE_OK;
+}
+
+int sqlite3_blob_store_write(sqlite3 *db, const void *pData, sqlite3_int64 nData, sqlite3_int64 *piBlob) {
+    if (db == nullptr || piBlob == nullptr)
+        return SQLITE_MISUSE;
+
+    return BlobStore(db, ThreadPool::shared()).write(pData, nData, *piBlob);
+}
+
+int sqlite3_blob_store_read(sqlite3 *db, sqlite3_int64 iBlob, void *pData, sqlite3_int64 nData,
+                            sqlite3_int64 iOffset) {
+    if (db == nullptr)
+        return SQLITE_MISUSE;
+
+    return BlobStore(db, ThreadPool::shared()).read(iBlob, pData, nData, iOffset);
+}
+
+int sqlite3_blob_store_size(sqlite3 *db, sqlite3_int64 iBlob, sqlite3_int64 *pnSize) {
+    if (db == nullptr || pnSize == nullptr)
+        return SQLITE_MISUSE;
+
+    return BlobStore(db, ThreadPool::shared()).size(iBlob, *pnSize);
+}
+
+int sqlite3_blob_store_delete(sqlite3 *db, sqlite3_int64 iBlob) {
+    if (db == nullptr)
+        return SQLITE_MISUSE;
+
+    return BlobStore(db, ThreadPool::shared()).remove(iBlob);
+}
+
+int sqlite3_parallel_scan(sqlite3 *db, const char *zTable, int nThreads, sqlite3_scan_rows xRows, void *pArg) {
+    if (db == nullptr || zTable == nullptr || xRows == nullptr)
+        return SQLITE_MISUSE;
+
+    // read on the shared pool unless a thread count is given
+    std::unique_ptr<ThreadPool> pool;
+    if (nThreads > 0)
+        pool.reset(new ThreadPool(static_cast<unsigned>(nThreads)));
+
+    return ParallelScan(db, pool ? pool.get() : ThreadPool::shared()).run(zTable, xRows, pArg);
+}
+
+int sqlite3_sync_signature(const char *zStandby, int nThreads, sqlite3_sync_write xWrite, void *pArg) {
+    if (zStandby == nullptr || xWrite == nullptr)
+        return SQLITE_MISUSE;
+
+    // hash on the shared pool unless a thread count is given
+    std::unique_ptr<ThreadPool> pool;
+    if (nThreads > 0)
+        pool.reset(new ThreadPool(static_cast<unsigned>(nThreads)));
+
+    return PageSync(zStandby, pool ? pool.get() : ThreadPool::shared()).signature(xWrite, pArg);
+}
+
+int sqlite3_sync_delta(const char *zPrimary, int nThreads, sqlite3_sync_read xRead, void *pReadArg,
+                       sqlite3_sync_write xWrite, void *pWriteArg) {
+    if (zPrimary == nullptr || xRead == nullptr || xWrite == nullptr)
+        return SQLITE_MISUSE;
+
+    // hash on the shared pool unless a thread count is given
+    std::unique_ptr<ThreadPool> pool;
+    if (nThreads > 0)
+        pool.reset(new ThreadPool(static_cast<unsigned>(nThreads)));
+
+    return PageSync(zPrimary, pool ? pool.get() : ThreadPool::shared()).delta(xRead, pReadArg, xWrite, pWriteArg);
+}
+
+int sqlite3_sync_apply(const char *zStandby, sqlite3_sync_read xRead, void *pArg) {
+    if (zStandby == nullptr || xRead == nullptr)
+        return SQLITE_MISUSE;
+
+    return PageSync(zStandby, ThreadPool::shared()).apply(xRead, pArg);
+}
+
+int sqlite3_sync_encrypted(const char *zPrimary, const char *zStandby, int nThreads) {
+    if (zPrimary == nullptr || zStandby == nullptr)
+        return SQLITE_MISUSE;
+
+    // hash on the shared pool unless a thread count is given
+    std::unique_ptr<ThreadPool> pool;
+    if (nThreads > 0)
+        pool.reset(new ThreadPool(static_cast<unsigned>(nThreads)));
+
+    return PageSync(zPrimary, pool ? pool.get() : ThreadPool::shared()).copyTo(zStandby);
+}
+
+int sqlite3_wal_tap(sqlite3 *db, sqlite3_wal_frames xFrames, void *pArg) {
+    File *mainDB = File::fromDatabase(db);
+    if (!mainDB || !mainDB->mCrypto)
+        return SQLITE_ERROR;
+    // a replica has no tree covering the pages it checkpoints
+    if (mainDB->mCrypto->hasTree())
+        return SQLITE_MISUSE;
+
+    SQLite3Mutex mutex(csqlite3_get_mutex(db), &LockStats::connection());
+    SQLite3LockGuard lock(mutex);
+
+    delete mainDB->mTap;
+    mainDB->mTap = xFrames ? new WalTap(xFrames, pArg) : nullptr;
+    return SQLITE_OK;
+}
+
+int sqlite3_wal_apply(const char *zReplica, const void *pHeader, const void *pFrames, int iFrame, int nFrame,
+                      int nPageSize) {
+    if (zReplica == nullptr || pHeader == nullptr || pFrames == nullptr)
+        return SQLITE_MISUSE;
+
+    return WalReplica(zReplica).apply(static_cast<const uint8_t *>(pHeader), static_cast<const uint8_t *>(pFrames),
+                                      iFrame, nFrame, nPageSize);
+}
+
+int sqlite3_clone_encrypted(sqlite3 *db, const char *zTarget, const void *zKeyNew, int nKeyNew, int nThreads) {
+    if (db == nullptr || zTarget == nullptr || (zKeyNew != nullptr && nKeyNew <= 0))
+        return SQLITE_MISUSE;
+
+    // copy on the shared pool unless a thread count is given
+    std::unique_ptr<ThreadPool> pool;
+    if (nThreads > 0)
+        pool.reset(new ThreadPool(static_cast<unsigned>(nThreads)));
+
+    return Clone(db, pool ? pool.get() : ThreadPool::shared()).run(zTarget, zKeyNew, nKeyNew);
+}
+
+int sqlite3_vacuum_into_encrypted(sqlite3 *db, const char *zTarget, const void *zKey, int nKey, int nThreads) {
+    if (db == nullptr || zTarget == nullptr || (zKey != nullptr && nKey <= 0))
+        return SQLITE_MISUSE;
+
+    File *mainDB = File::fromDatabase(db);
+    if (mainDB == nullptr || mainDB->mCrypto->hasTree())
+        return SQLITE_MISUSE;
+    try {
+        // the target uses the same cipher and page layout
+        mainDB->mCrypto->loadKey();
+    } catch (const std::exception &) {
+        return SQLITE_NOTADB;
+    }
+
+    // encrypt on the shared pool unless a thread count is given
+    std::unique_ptr<ThreadPool> pool;
+    if (nThreads > 0)
+        pool.reset(new ThreadPool(static_cast<unsigned>(nThreads)));
+
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(db, "VACUUM main INTO ?;", -1, &stmt, nullptr);
+    if (rc != SQLITE_OK)
+        return rc;
+    sqlite3_bind_text(stmt, 1, zTarget, -1, SQLITE_STATIC);
+
+    // sqlite opens the target through the VFS of db while stepping, on this thread
+    VFS::instance()->prepareNamed(zKey, zKey ? nKey : 0, mainDB->mCrypto->cipher().c_str(),
+                                  mainDB->mCrypto->pageFlags());
+    VFS::instance()->prepareBulk(zKey ? nullptr : mainDB->mCrypto, pool ? pool.get() : ThreadPool::shared());
+    rc = sqlite3_step(stmt);
+    VFS::instance()->finishNamed();
+
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE)
+        return rc;
+
+    // values in side files, named like the target once opened
+    sqlite3_vfs *vfs = VFS::instance()->underlying();
+    std::vector<char> fullName(vfs->mxPathname + 1);
+    std::vector<std::string> blobs;
+    rc = vfs->xFullPathname(vfs, zTarget, vfs->mxPathname + 1, fullName.data());
+    if (rc == SQLITE_OK)
+        rc = BlobStore::copyFiles(db, fullName.data(), blobs);
+    if (rc != SQLITE_OK) {
+        for (const std::string &blob : blobs)
+            vfs->xDelete(vfs, blob.c_str(), 0);
+        return rc;
+    }
+
+    // the copied field key is still wrapped with the data key of db
+    if (zKey) {
+        sqlite3 *target = nullptr;
+        rc = VFS::instance()->openNamed(zTarget, &target, zKey, nKey, SQLITE_OPEN_READWRITE);
+        if (rc == SQLITE_OK)
+            rc = FieldCrypt::rewrapKey(db, target);
+        int closeRc = sqlite3_close(target);
+        return rc == SQLITE_OK ? closeRc : rc;
+    }
+    return SQLITE_OK;
+}
+
 int sqlite3_key(sqlite3* db, const void*, int) {
     // The key is only set for the main database, not the temp database
-    const char *fileName = sqlite3_db_filename(db, "main");
-
-    // attach to db
-    File *mainDB = VFS::instance()->findMainDatabase(fileName);
+    File *mainDB = File::fromDatabase(db);
     int rv = mainDB ? mainDB->attach(db, 0) : SQLITE_ERROR;
+    if (rv == SQLITE_OK)
+        rv = FieldCrypt::registerFunctions(db);
 
     // release VFS
     VFS::instance()->finish();
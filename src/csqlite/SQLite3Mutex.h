@@ -20,13 +20,20 @@
 #ifndef CRYPTOSQLITE_SQLITE3MUTEX_H
 #define CRYPTOSQLITE_SQLITE3MUTEX_H
 
+#include <chrono>
+#include "../util/LockStats.h"
+
 class SQLite3Mutex {
 public:
-    SQLite3Mutex() : mMutex(sqlite3_mutex_alloc(SQLITE_MUTEX_RECURSIVE)), mOwned(true) {
+    /**
+     * @param stats Contention counters to update, nullptr for none
+     */
+    explicit SQLite3Mutex(LockStats *stats = nullptr)
+            : mMutex(sqlite3_mutex_alloc(SQLITE_MUTEX_RECURSIVE)), mOwned(true), mStats(stats) {
         // TODO: errorhandling if !mMutex
     }
 
-    SQLite3Mutex(sqlite3_mutex *mutex) : mMutex(mutex) { }
+    SQLite3Mutex(sqlite3_mutex *mutex, LockStats *stats = nullptr) : mMutex(mutex), mStats(stats) { }
 
     ~SQLite3Mutex() {
         if (mOwned)
@@ -34,7 +41,20 @@ public:
     }
 
     void lock() {
+        if (!mStats) {
+            sqlite3_mutex_enter(mMutex);
+            return;
+        }
+
+        // only waiting is timed, so an uncontended lock costs no clock reads
+        if (sqlite3_mutex_try(mMutex) == SQLITE_OK) {
+            mStats->acquired(false, 0);
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
         sqlite3_mutex_enter(mMutex);
+        auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+        mStats->acquired(true, static_cast<uint64_t>(wait.count()));
     }
 
     void unlock() {
@@ -44,6 +64,7 @@ public:
 protected:
     sqlite3_mutex *mMutex;
     bool mOwned = false;
+    LockStats *mStats = nullptr;
 };
 
 class SQLite3LockGuard {
@@ -33,3 +33,45 @@ void csqlite3_reserve_page(sqlite3 *db, int nDb, int *pageSize, int reservedSize
 uint32_t csqlite3_get4byte(const uint8_t *data) {
     return sqlite3Get4byte(data);
 }
+
+const void *csqlite3_cached_page(sqlite3 *db, int nDb, uint32_t pageNo) {
+    Pager *pager = sqlite3BtreePager(db->aDb[nDb].pBt);
+    DbPage *page;
+    if (pager->eState < PAGER_READER || !(page = sqlite3PagerLookup(pager, pageNo)))
+        return 0;
+
+    /* release without unlocking the pager, the page stays cached until the next fetch */
+    sqlite3PcacheRelease(page);
+    return sqlite3PagerGetData(page);
+}
+
+int csqlite3_read_snapshot(sqlite3 *db, int nDb, uint32_t *mxFrame) {
+    Pager *pager = sqlite3BtreePager(db->aDb[nDb].pBt);
+    /* pages are only stable on disk while a read transaction without changes is open */
+    if (pager->eState != PAGER_READER)
+        return SQLITE_MISUSE;
+
+    /* the snapshot reads frames up to mxFrame from the WAL, all other pages from the database file */
+    *mxFrame = 0;
+#ifndef SQLITE_OMIT_WAL
+    /* a reader holding lock 0 ignores the WAL, which may be restarted meanwhile */
+    if (pagerUseWal(pager) && pager->pWal->readLock > 0)
+        *mxFrame = pager->pWal->hdr.mxFrame;
+#endif
+    return SQLITE_OK;
+}
+
+int csqlite3_file_handle(sqlite3_vfs *vfs, sqlite3_file *file) {
+#if SQLITE_OS_UNIX
+    /* descriptor of a file opened by one of the unix VFSes */
+    if (vfs->xOpen == unixOpen && file->pMethods)
+        return ((unixFile *) file)->h;
+#endif
+    return -1;
+}
+
+uint64_t csqlite3_schema_version(sqlite3 *db, int nDb) {
+    Schema *schema = db->aDb[nDb].pSchema;
+    /* the generation changes whenever the schema is discarded, e.g. when a schema change is rolled back */
+    return ((uint64_t) (uint32_t) schema->iGeneration << 32) | (uint32_t) schema->schema_cookie;
+}
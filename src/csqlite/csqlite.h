@@ -29,6 +29,10 @@ extern "C" {
 sqlite3_mutex *csqlite3_get_mutex(sqlite3 *db);
 void csqlite3_reserve_page(sqlite3 *db, int nDb, int *pageSize, int reservedSize);
 uint32_t csqlite3_get4byte(const uint8_t *data);
+const void *csqlite3_cached_page(sqlite3 *db, int nDb, uint32_t pageNo);
+int csqlite3_read_snapshot(sqlite3 *db, int nDb, uint32_t *mxFrame);
+int csqlite3_file_handle(sqlite3_vfs *vfs, sqlite3_file *file);
+uint64_t csqlite3_schema_version(sqlite3 *db, int nDb);
 
 #ifdef __cplusplus
 };
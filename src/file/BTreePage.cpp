@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "BTreePage.h"
+
+namespace {
+    // offset of the database header on page 1
+    const uint32_t DB_HEADER_SIZE = 100;
+
+}
+
+uint32_t BTreePage::getVarint(const uint8_t *in, const uint8_t *end, uint64_t &value) {
+    value = 0;
+    for (uint32_t i = 0; i < 9 && in + i < end; i++) {
+        if (i == 8) {
+            value = (value << 8) | in[i];
+            return 9;
+        }
+        value = (value << 7) | (in[i] & 0x7f);
+        if (!(in[i] & 0x80))
+            return i + 1;
+    }
+    return 0;
+}
+
+void BTreePage::links(const uint8_t *page, uint32_t pageNo, bool overflow, uint32_t usableSize,
+                      std::vector<Link> &links) {
+    // overflow pages start with the next page of the chain
+    if (overflow) {
+        uint32_t next = nextOverflow(page);
+        if (next != 0)
+            links.emplace_back(next, true);
+        return;
+    }
+
+    uint32_t header = pageNo == 1 ? DB_HEADER_SIZE : 0;
+    uint8_t type = page[header];
+    bool interior = type == INTERIOR_INDEX || type == INTERIOR_TABLE;
+    if (!interior && type != LEAF_INDEX && type != LEAF_TABLE)
+        return;
+
+    // payload sizes above which cells spill to overflow pages, see sqlite file format
+    uint32_t maxLocal = type == LEAF_TABLE ? usableSize - 35 : (usableSize - 12) * 64 / 255 - 23;
+    uint32_t minLocal = (usableSize - 12) * 32 / 255 - 23;
+
+    const uint8_t *end = page + usableSize;
+    uint32_t pointers = header + (interior ? 12 : 8);
+    uint32_t cells = get2byte(page + header + 3);
+
+    for (uint32_t i = 0; i < cells && pointers + 2 * i + 2 <= usableSize; i++) {
+        uint32_t offset = get2byte(page + pointers + 2 * i);
+        if (offset >= usableSize)
+            continue;
+
+        const uint8_t *cell = page + offset;
+        if (interior) {
+            if (cell + 4 > end)
+                continue;
+            uint32_t child = get4byte(cell);
+            if (child != 0)
+                links.emplace_back(child, false);
+            cell += 4;
+        }
+
+        // table interior cells only hold a key
+        if (type == INTERIOR_TABLE)
+            continue;
+
+        uint64_t payload, rowid;
+        uint32_t read = getVarint(cell, end, payload);
+        if (read == 0)
+            continue;
+        cell += read;
+        if (type == LEAF_TABLE) {
+            read = getVarint(cell, end, rowid);
+            if (read == 0)
+                continue;
+            cell += read;
+        }
+
+        if (payload <= maxLocal)
+            continue;
+
+        uint64_t local = minLocal + (payload - minLocal) % (usableSize - 4);
+        if (local > maxLocal)
+            local = minLocal;
+        if (cell + local + 4 <= end) {
+            uint32_t first = get4byte(cell + local);
+            if (first != 0)
+                links.emplace_back(first, true);
+        }
+    }
+
+    // right-most child follows the cells
+    if (interior) {
+        uint32_t right = get4byte(page + header + 8);
+        if (right != 0)
+            links.emplace_back(right, false);
+    }
+}
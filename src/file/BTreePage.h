@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRYPTOSQLITE_BTREEPAGE_H
+#define CRYPTOSQLITE_BTREEPAGE_H
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/**
+ * Reads page links of the sqlite file format from plaintext pages
+ */
+class BTreePage {
+public:
+    /**
+     * Page number and whether it is an overflow page instead of a B-tree page
+     */
+    using Link = std::pair<uint32_t, bool>;
+
+    // B-tree page types
+    static const uint8_t INTERIOR_INDEX = 2, INTERIOR_TABLE = 5, LEAF_INDEX = 10, LEAF_TABLE = 13;
+
+    /**
+     * Collects the child pages of an interior page, the first overflow page of each spilled cell and the next page
+     * of an overflow page, in key order. Malformed pages yield fewer links.
+     *
+     * @param overflow True if the page is an overflow page
+     * @param usableSize Page size without reserved bytes
+     */
+    static void links(const uint8_t *page, uint32_t pageNo, bool overflow, uint32_t usableSize,
+                      std::vector<Link> &links);
+
+    /**
+     * @return Next page of an overflow chain, 0 at its end
+     */
+    static uint32_t nextOverflow(const uint8_t *page) {
+        return get4byte(page);
+    }
+
+    /**
+     * @return Bytes read, 0 if the varint exceeds end
+     */
+    static uint32_t getVarint(const uint8_t *in, const uint8_t *end, uint64_t &value);
+
+    static uint32_t get2byte(const uint8_t *in) {
+        return (uint32_t(in[0]) << 8) | uint32_t(in[1]);
+    }
+    static uint32_t get4byte(const uint8_t *in) {
+        return (uint32_t(in[0]) << 24) | (uint32_t(in[1]) << 16) | (uint32_t(in[2]) << 8) | uint32_t(in[3]);
+    }
+};
+
+#endif //CRYPTOSQLITE_BTREEPAGE_H
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include "BulkWriter.h"
+#include "../crypto/Crypto.h"
+#include "../memory/MemoryBudget.h"
+
+namespace {
+    // bytes of pages encrypted and written at once
+    const uint32_t BULK_SIZE = 4 * 1024 * 1024;
+}
+
+BulkWriter::BulkWriter(sqlite3_file *file, Crypto *crypto, ThreadPool *pool)
+        : mFile(file), mCrypto(crypto), mPool(pool) {
+}
+
+BulkWriter::~BulkWriter() {
+    MemoryBudget::instance()->release(mPages.size(), MemoryBudget::PRIORITY_BUFFER);
+}
+
+int BulkWriter::write(const void *page, uint32_t pageSize, int pageNo) {
+    int rc = SQLITE_OK;
+    if (mCount > 0 && (pageSize != mPageSize || pageNo != mFirst + static_cast<int>(mCount)))
+        rc = flush();
+    if (rc != SQLITE_OK)
+        return rc;
+
+    if (pageSize != mPageSize) {
+        MemoryBudget::instance()->release(mPages.size(), MemoryBudget::PRIORITY_BUFFER);
+        mPageSize = pageSize;
+        mPages.assign(static_cast<size_t>((std::max)(BULK_SIZE / pageSize, 1u)) * pageSize, 0);
+        MemoryBudget::instance()->acquire(mPages.size(), MemoryBudget::PRIORITY_BUFFER);
+    }
+
+    if (mCount == 0)
+        mFirst = pageNo;
+    memcpy(&mPages[static_cast<size_t>(mCount) * pageSize], page, pageSize);
+    mCount++;
+
+    return mCount * pageSize == mPages.size() ? flush() : SQLITE_OK;
+}
+
+int BulkWriter::flush() {
+    if (mCount == 0)
+        return SQLITE_OK;
+
+    uint32_t count = mCount;
+    mCount = 0;
+    try {
+        mCrypto->encryptPages(mPool, mPages.data(), count, mPageSize, mFirst);
+    } catch (const std::exception &) {
+        return SQLITE_IOERR_WRITE;
+    }
+
+    auto offset = static_cast<sqlite3_int64>(mFirst - 1) * mPageSize;
+    return mFile->pMethods->xWrite(mFile, mPages.data(), static_cast<int>(count * mPageSize), offset);
+}
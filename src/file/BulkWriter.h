@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRYPTOSQLITE_BULKWRITER_H
+#define CRYPTOSQLITE_BULKWRITER_H
+
+#include <cstdint>
+#include <vector>
+
+extern "C" {
+#include <sqlite3.h>
+};
+
+class Crypto;
+class ThreadPool;
+
+/**
+ * Write path of a database that is written once from start to end, like the output of VACUUM INTO.
+ *
+ * Consecutive pages are collected, encrypted concurrently and written with a single large write. Any other access to
+ * the file must flush first.
+ */
+class BulkWriter {
+public:
+    /**
+     * @param file Underlying file
+     * @param pool Pool to encrypt on, the writing thread takes part
+     */
+    BulkWriter(sqlite3_file *file, Crypto *crypto, ThreadPool *pool);
+    ~BulkWriter();
+
+    /**
+     * Buffers the plaintext of a page, flushing first unless it continues the buffered pages
+     *
+     * @return Standard sqlite error code of a flush
+     */
+    int write(const void *page, uint32_t pageSize, int pageNo);
+
+    /**
+     * Encrypts and writes the buffered pages
+     *
+     * @return Standard sqlite error code
+     */
+    int flush();
+
+protected:
+    sqlite3_file *mFile;
+    Crypto *mCrypto;
+    ThreadPool *mPool;
+
+    std::vector<uint8_t> mPages;
+    uint32_t mPageSize = 0;
+    uint32_t mCount = 0;
+    int mFirst = 0;
+};
+
+#endif //CRYPTOSQLITE_BULKWRITER_H
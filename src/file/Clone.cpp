@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "Clone.h"
+#include "File.h"
+#include "RawFile.h"
+#include "WalReplica.h"
+#include "../crypto/BlobStore.h"
+#include "../crypto/FileWrapper.h"
+#include "../csqlite/csqlite.h"
+#include "../memory/MemoryBudget.h"
+#include "../util/ThreadPool.h"
+#include "../vfs/VFS.h"
+
+namespace {
+    // bytes copied per task when the file system can not copy itself
+    const sqlite3_int64 COPY_CHUNK_SIZE = 4 * 1024 * 1024;
+    const int WAL_HEADER_SIZE = 32;
+
+    /**
+     * Shares the extents of the source with the target, on file systems with reflinks
+     */
+    bool cloneFile(int source, int target) {
+#if defined(__linux__) && defined(FICLONE)
+        return source >= 0 && target >= 0 && ioctl(target, FICLONE, source) == 0;
+#else
+        (void) source;
+        (void) target;
+        return false;
+#endif
+    }
+
+    /**
+     * Copies in the kernel, which may still share extents or copy on the server for network file systems
+     */
+    bool copyFileRange(int source, int target, sqlite3_int64 size) {
+#if defined(__linux__) && defined(SYS_copy_file_range)
+        if (source < 0 || target < 0)
+            return false;
+
+        loff_t in = 0, out = 0;
+        while (in < size) {
+            // not supported between these files, the caller copies itself
+            if (syscall(SYS_copy_file_range, source, &in, target, &out, static_cast<size_t>(size - in), 0u) <= 0)
+                return false;
+        }
+        return true;
+#else
+        (void) source;
+        (void) target;
+        (void) size;
+        return false;
+#endif
+    }
+}
+
+Clone::Clone(sqlite3 *db, ThreadPool *pool) : mDB(db), mPool(pool) {
+}
+
+int Clone::run(const char *target, const void *fileKey, int keylen) {
+    mFile = File::fromDatabase(mDB);
+    if (!mFile || !mFile->mCrypto)
+        return SQLITE_ERROR;
+
+    // the copy has no tree covering its pages, and its files are copied as a single one
+    if (mFile->mCrypto->hasTree() || mFile->mCrypto->stripes() > 1)
+        return SQLITE_MISUSE;
+
+    // same name as used by the VFS, so the keyfile of the copy is found when opening it
+    sqlite3_vfs *vfs = VFS::instance()->underlying();
+    std::vector<char> fullName(vfs->mxPathname + 1);
+    if (vfs->xFullPathname(vfs, target, vfs->mxPathname + 1, fullName.data()) != SQLITE_OK)
+        return SQLITE_CANTOPEN;
+
+    // without a transaction of the caller, checkpoint first so the copy needs no frames, then read in a new one
+    bool own = sqlite3_get_autocommit(mDB) != 0;
+    int rc = SQLITE_OK;
+    if (own) {
+        sqlite3_exec(mDB, "PRAGMA main.wal_checkpoint(TRUNCATE)", nullptr, nullptr, nullptr);
+        rc = sqlite3_exec(mDB, "BEGIN", nullptr, nullptr, nullptr);
+    }
+    if (rc != SQLITE_OK)
+        return rc;
+
+    // reading the schema opens the read transaction
+    rc = sqlite3_exec(mDB, "SELECT 1 FROM main.sqlite_master LIMIT 1", nullptr, nullptr, nullptr);
+    if (rc == SQLITE_OK)
+        rc = copy(fullName.data(), fileKey, keylen);
+
+    if (own)
+        sqlite3_exec(mDB, "COMMIT", nullptr, nullptr, nullptr);
+    return rc;
+}
+
+int Clone::copy(const std::string &target, const void *fileKey, int keylen) {
+    uint32_t maxFrame = 0;
+    int rc = csqlite3_read_snapshot(mDB, 0, &maxFrame);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    // a leftover journal would be replayed into the copy
+    for (const char *suffix : {"-keyfile", "-journal", "-wal"})
+        if (FileWrapper::exists(target + suffix))
+            return SQLITE_CANTOPEN;
+
+    bool created;
+    {
+        RawFile source(mFile->mFileName, SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READONLY);
+        RawFile copy(target, SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_EXCLUSIVE);
+        created = copy.rc() == SQLITE_OK;
+
+        sqlite3_int64 size = 0;
+        rc = source.rc();
+        if (rc == SQLITE_OK)
+            rc = copy.rc();
+        if (rc == SQLITE_OK)
+            rc = source.size(&size);
+        if (rc == SQLITE_OK)
+            rc = copyFile(source, copy, target, size);
+        if (rc == SQLITE_OK && maxFrame > 0)
+            rc = copyWal(copy, maxFrame);
+        if (rc == SQLITE_OK)
+            rc = copy.sync();
+    }
+
+    // values in side files of the same snapshot
+    std::vector<std::string> blobs;
+    if (rc == SQLITE_OK)
+        rc = BlobStore::copyFiles(mDB, target, blobs);
+
+    if (rc == SQLITE_OK) {
+        try {
+            mFile->mCrypto->writeCloneKeyFile(target, fileKey, keylen);
+        } catch (const std::exception &) {
+            rc = SQLITE_IOERR_WRITE;
+        }
+    }
+    // the new names must survive a crash along with the synced contents
+    if (rc == SQLITE_OK && !FileWrapper::syncDirectory(target))
+        rc = SQLITE_IOERR_FSYNC;
+
+    // no partial copies
+    if (rc != SQLITE_OK && created) {
+        sqlite3_vfs *vfs = VFS::instance()->underlying();
+        vfs->xDelete(vfs, target.c_str(), 0);
+        vfs->xDelete(vfs, (target + "-keyfile").c_str(), 0);
+        for (const std::string &blob : blobs)
+            vfs->xDelete(vfs, blob.c_str(), 0);
+    }
+    return rc;
+}
+
+int Clone::copyFile(RawFile &source, RawFile &target, const std::string &targetName, sqlite3_int64 size) {
+    if (size == 0)
+        return SQLITE_OK;
+
+    // descriptors belong to the VFS and stay open, closing them would drop the locks of the connection
+    if (cloneFile(source.handle(), target.handle()) || copyFileRange(source.handle(), target.handle(), size))
+        return SQLITE_OK;
+    return copyChunks(targetName, size);
+}
+
+int Clone::copyChunks(const std::string &target, sqlite3_int64 size) {
+    auto chunks = static_cast<size_t>((size + COPY_CHUNK_SIZE - 1) / COPY_CHUNK_SIZE);
+
+    std::atomic<int> error {SQLITE_OK};
+    mPool->parallelFor(chunks, [&] (size_t chunk) {
+        sqlite3_int64 offset = chunk * COPY_CHUNK_SIZE;
+        auto chunkSize = static_cast<int>((std::min)(COPY_CHUNK_SIZE, size - offset));
+
+        // own file handles per task
+        MemoryBudget::instance()->acquire(chunkSize, MemoryBudget::PRIORITY_BUFFER);
+        {
+            RawFile source(mFile->mFileName, SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READONLY);
+            RawFile copy(target, SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READWRITE);
+            std::vector<uint8_t> data(chunkSize);
+            int rc = source.rc();
+            if (rc == SQLITE_OK)
+                rc = copy.rc();
+            if (rc == SQLITE_OK)
+                rc = source.read(data.data(), chunkSize, offset);
+            if (rc == SQLITE_OK)
+                rc = copy.write(data.data(), chunkSize, offset);
+
+            int expected = SQLITE_OK;
+            if (rc != SQLITE_OK)
+                error.compare_exchange_strong(expected, rc);
+        }
+        MemoryBudget::instance()->release(chunkSize, MemoryBudget::PRIORITY_BUFFER);
+    });
+    return error;
+}
+
+int Clone::copyWal(RawFile &target, uint32_t maxFrame) {
+    RawFile wal(std::string(mFile->mFileName) + "-wal", SQLITE_OPEN_WAL | SQLITE_OPEN_READONLY);
+    uint8_t header[WAL_HEADER_SIZE];
+    sqlite3_int64 walSize = 0;
+
+    int rc = wal.rc();
+    if (rc == SQLITE_OK)
+        rc = wal.size(&walSize);
+    if (rc == SQLITE_OK)
+        rc = wal.read(header, WAL_HEADER_SIZE, 0);
+
+    // frames of the snapshot can not be overwritten while it is open, pages are encrypted like in the database
+    if (rc == SQLITE_OK)
+        rc = WalReplica::checkpoint(target, wal, header, walSize, maxFrame);
+    return rc;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRYPTOSQLITE_CLONE_H
+#define CRYPTOSQLITE_CLONE_H
+
+#include <cstdint>
+#include <string>
+#include <cryptosqlite/cryptosqlite.h>
+
+struct File;
+class RawFile;
+class ThreadPool;
+
+/**
+ * Copies an open encrypted database to a new file, without decrypting it.
+ *
+ * The copy is the snapshot of a read transaction: the database file can only be changed by checkpoints of frames the
+ * snapshot includes while it is open, which are copied from the WAL afterwards. The file is cloned by reference where
+ * the file system supports it, copied in the kernel otherwise and as a last resort in parallel chunks. The copy gets
+ * its own keyfile with the same data key, optionally wrapped by another file key.
+ *
+ * Keeping the data key is what lets the copy read values of FieldCrypt, whose field key is stored wrapped by it, and
+ * the pages need no cipher work. Pages written to both afterwards must still never share a nonce: a new database
+ * counts its nonces up from zero, while the keyfile of a copy starts at a random offset in the upper half of the
+ * counter space, see Crypto::writeCloneKeyFile().
+ */
+class Clone {
+public:
+    /**
+     * @param db Connection of the database to copy
+     * @param pool Pool to copy chunks on, the calling thread takes part
+     */
+    Clone(sqlite3 *db, ThreadPool *pool);
+
+    /**
+     * Copies the snapshot of the read transaction open on the connection, or of a new one after a checkpoint
+     *
+     * @param target New database, which must not exist yet
+     * @param fileKey File key of the copy, nullptr to keep the current one
+     * @return Standard sqlite error code, SQLITE_CANTOPEN if the target exists
+     */
+    int run(const char *target, const void *fileKey, int keylen);
+
+protected:
+    int copy(const std::string &target, const void *fileKey, int keylen);
+
+    /**
+     * Copies the database file, trying a reference clone and a kernel copy first
+     */
+    int copyFile(RawFile &source, RawFile &target, const std::string &targetName, sqlite3_int64 size);
+    int copyChunks(const std::string &target, sqlite3_int64 size);
+
+    /**
+     * Copies the frames of the snapshot from the WAL into the copy
+     */
+    int copyWal(RawFile &target, uint32_t maxFrame);
+
+    sqlite3 *mDB;
+    ThreadPool *mPool;
+    File *mFile = nullptr;
+};
+
+#endif //CRYPTOSQLITE_CLONE_H
@@ -21,7 +21,12 @@
 #include <cassert>
 #include "../vfs/VFS.h"
 #include "../csqlite/csqlite.h"
+#include "../util/IOTrace.h"
+#include "../util/ThreadPool.h"
 #include "File.h"
+#include "BulkWriter.h"
+#include "RedoLog.h"
+#include "WalTap.h"
 
 sqlite3_io_methods File::gSQLiteIOMethods = {
         3,                          /* iVersion */
@@ -45,94 +50,336 @@ sqlite3_io_methods File::gSQLiteIOMethods = {
         sIoUnfetch,                /* xUnfetch */
 };
 
+File *File::fromDatabase(sqlite3 *db) {
+    sqlite3_file *file = nullptr;
+    if (sqlite3_file_control(db, "main", SQLITE_FCNTL_FILE_POINTER, &file) != SQLITE_OK || !file)
+        return nullptr;
+
+    return file->pMethods == &gSQLiteIOMethods ? reinterpret_cast<File *>(file) : nullptr;
+}
+
 int File::attach(sqlite3 *db, int nDb) {
     // lock while modifying page size
-    SQLite3Mutex mutex(csqlite3_get_mutex(db));
+    SQLite3Mutex mutex(csqlite3_get_mutex(db), &LockStats::connection());
     SQLite3LockGuard lock(mutex);
 
     // TODO: add support for attached dbs
 
+    mConnection = db;
+    mDbIndex = nDb;
+
     // Set page size to its default, but add our size to be reserved at the end of the page
-    csqlite3_reserve_page(db, nDb, &mPageSize, mCrypto->extraSize());
+    csqlite3_reserve_page(db, nDb, &mPageSize, mCrypto->reservedSize());
     mCrypto->resizePageBuffers(mPageSize);
-    return SQLITE_OK;
+
+    // pages read ahead are located with the page size they were created for
+    if (mPrefetcher && mPrefetcher->pageSize() != mPageSize) {
+        delete mPrefetcher;
+        mPrefetcher = nullptr;
+    }
+
+    // prefetched pages bypass the integrity tree
+    if (!mPrefetcher && !mCrypto->hasTree() && (Prefetcher::depth() > 0 || Prefetcher::siblingDepth() > 0))
+        mPrefetcher = new Prefetcher(mFileName, mPageSize, mCrypto, ThreadPool::shared());
+    return loadTree();
+}
+
+int File::loadTree() {
+    if (!mCrypto->hasTree())
+        return SQLITE_OK;
+
+    // the tree is authenticated with the data key, so it can not be loaded lazily
+    try {
+        mCrypto->loadKey();
+    } catch (const std::exception &) {
+        return SQLITE_CANTOPEN;
+    }
+
+    sqlite3_int64 fileSize = 0;
+    int rv = FILE_FORWARD(this, xFileSize, &fileSize);
+    if (rv != SQLITE_OK)
+        return rv;
+
+    // a tree that is missing or does not authenticate may hide replaced pages, it is only rebuilt on request
+    if (!mRebuildTree) {
+        try {
+            if (mCrypto->loadTree() || fileSize == 0)
+                return SQLITE_OK;
+        } catch (const std::exception &) { }
+        return SQLITE_CORRUPT;
+    }
+
+    // trust the pages on disk and cover them with a new tree
+    try {
+        mCrypto->rebuildTree();
+        for (sqlite3_int64 offset = 0; rv == SQLITE_OK && offset + mPageSize <= fileSize; offset += mPageSize) {
+            rv = FILE_FORWARD(this, xRead, mCrypto->pageBufferIn(), mPageSize, offset);
+            if (rv == SQLITE_OK)
+                mCrypto->updatePage(mCrypto->pageBufferIn(), mPageSize, offset / mPageSize + 1);
+        }
+        if (rv == SQLITE_OK)
+            mCrypto->syncTree();
+    } catch (const std::exception &) {
+        rv = SQLITE_IOERR_WRITE;
+    }
+    return rv;
+}
+
+bool File::isPlaintext(int pageNo) {
+    File *mainDB = mDB ? mDB : this;
+    if (!mainDB->mConnection)
+        return false;
+
+    return mCrypto->isPlaintext(pageNo, mPageSize, [mainDB] (uint32_t lookupNo) {
+        return static_cast<const uint8_t *>(csqlite3_cached_page(mainDB->mConnection, mainDB->mDbIndex, lookupNo));
+    });
 }
 
 int File::close() {
+    IOTrace::close(mTraceId, mDB ? mDB->mTraceId : 0, mOpenFlags);
+
     // clean from list
     if (mOpenFlags & SQLITE_OPEN_MAIN_DB)
         VFS::instance()->removeDatabase(this);
 
-    // cleanup state
+    // stop read-ahead before its crypto state goes away
+    delete mPrefetcher;
+    mPrefetcher = nullptr;
+
+    int rv = mBulk ? mBulk->flush() : SQLITE_OK;
+    delete mBulk;
+    mBulk = nullptr;
+    delete mRedo;
+    mRedo = nullptr;
+
+    // the tap reads committed frames back from the WAL
+    if (mDB && mDB->mTap)
+        mDB->mTap->closed(mUnderlying);
+    delete mTap;
+    mTap = nullptr;
+
+    // persist integrity tree if not synced, cleanup state
+    if (!mDB && mCrypto) {
+        try {
+            mCrypto->syncTree();
+        } catch (const std::exception &) { }
+    }
     if (!mDB) delete mCrypto;
     mCrypto = nullptr;
 
     // forward actual close
-    return mUnderlying->pMethods->xClose(mUnderlying);
+    int closeRv = mUnderlying->pMethods->xClose(mUnderlying);
+    return rv != SQLITE_OK ? rv : closeRv;
 }
 
 int File::read(void *buffer, int count, sqlite3_int64 offset) {
+    IOTrace::Scope trace(mTraceId, mDB ? mDB->mTraceId : 0, mOpenFlags, IOTrace::OP_READ, offset, count,
+                         tracePageNo(offset));
+    if (mPrefetcher && readPrefetched(buffer, count, offset))
+        return SQLITE_OK;
+
+    // pages still buffered are read back from the file
+    auto rv = mBulk ? mBulk->flush() : SQLITE_OK;
+    if (rv != SQLITE_OK)
+        return rv;
+
     // forward actual read
-    auto rv = FILE_FORWARD(this, xRead, buffer, count, offset);
+    rv = FILE_FORWARD(this, xRead, buffer, count, offset);
     if (rv != SQLITE_OK)
         return rv;
 
     if (mCrypto) {
-        switch (mOpenFlags & SQLITE_OPEN_MASK) {
-            case SQLITE_OPEN_MAIN_DB:
-                return readMainDB(buffer, count, offset);
+        try {
+            switch (mOpenFlags & SQLITE_OPEN_MASK) {
+                case SQLITE_OPEN_MAIN_DB:
+                    return readMainDB(buffer, count, offset);
+
+                case SQLITE_OPEN_MAIN_JOURNAL:
+                case SQLITE_OPEN_SUBJOURNAL:
+                    return readJournal(buffer, count, offset);
+
+                case SQLITE_OPEN_WAL:
+                    return readWal(buffer, count, offset);
+
+                case SQLITE_OPEN_TEMP_DB:
+                case SQLITE_OPEN_TRANSIENT_DB:
+                case SQLITE_OPEN_TEMP_JOURNAL:
+                    // TODO ?
+                    break;
+
+                case SQLITE_OPEN_MASTER_JOURNAL:
+                    /** Contains only administrative information, no encryption necessary. **/
+                default:
+                    break;
+            }
+        } catch (const std::exception &) {
+            // key is loaded on first access and may fail, do not unwind through sqlite
+            return SQLITE_IOERR_READ;
+        }
+    }
 
-            case SQLITE_OPEN_MAIN_JOURNAL:
-            case SQLITE_OPEN_SUBJOURNAL:
-                return readJournal(buffer, count, offset);
+    return rv;
+}
 
-            case SQLITE_OPEN_WAL:
-                return readWal(buffer, count, offset);
+int File::write(const void *buffer, int count, sqlite3_int64 offset) {
+    IOTrace::Scope trace(mTraceId, mDB ? mDB->mTraceId : 0, mOpenFlags, IOTrace::OP_WRITE, offset, count,
+                         tracePageNo(offset));
+    if (mCrypto) {
+        try {
+            switch (mOpenFlags & SQLITE_OPEN_MASK) {
+                case SQLITE_OPEN_MAIN_DB:
+                    return writeMainDB(buffer, count, offset);
+
+                case SQLITE_OPEN_MAIN_JOURNAL:
+                case SQLITE_OPEN_SUBJOURNAL:
+                    return writeJournal(buffer, count, offset);
+
+                case SQLITE_OPEN_WAL:
+                    return writeWal(buffer, count, offset);
+
+                case SQLITE_OPEN_TEMP_DB:
+                case SQLITE_OPEN_TRANSIENT_DB:
+                case SQLITE_OPEN_TEMP_JOURNAL:
+                    // TODO ?
+                    break;
+
+                case SQLITE_OPEN_MASTER_JOURNAL:
+                    /** Contains only administrative information, no encryption necessary. **/
+                default:
+                    break;
+            }
+        } catch (const std::exception &) {
+            return SQLITE_IOERR_WRITE;
+        }
+    }
 
-            case SQLITE_OPEN_TEMP_DB:
-            case SQLITE_OPEN_TRANSIENT_DB:
-            case SQLITE_OPEN_TEMP_JOURNAL:
-                // TODO ?
-                break;
+    // forward actual write
+    return FILE_FORWARD(this, xWrite, buffer, count, offset);
+}
 
-            case SQLITE_OPEN_MASTER_JOURNAL:
-                /** Contains only administrative information, no encryption necessary. **/
-            default:
-                break;
+int File::truncate(sqlite3_int64 size) {
+    IOTrace::Scope trace(mTraceId, mDB ? mDB->mTraceId : 0, mOpenFlags, IOTrace::OP_TRUNCATE, size, 0, 0);
+    if (mPrefetcher)
+        mPrefetcher->invalidate();
+    int rv = mBulk ? mBulk->flush() : SQLITE_OK;
+    if (rv == SQLITE_OK)
+        rv = FILE_FORWARD(this, xTruncate, size);
+
+    if (rv == SQLITE_OK && mCrypto && mPageSize > 0 && (mOpenFlags & SQLITE_OPEN_MAIN_DB)) {
+        try {
+            mCrypto->truncatePages(static_cast<uint32_t>((size + mPageSize - 1) / mPageSize));
+        } catch (const std::exception &) {
+            rv = SQLITE_IOERR_TRUNCATE;
         }
     }
-
     return rv;
 }
 
-int File::write(const void *buffer, int count, sqlite3_int64 offset) {
-    if (mCrypto) {
-        switch (mOpenFlags & SQLITE_OPEN_MASK) {
-            case SQLITE_OPEN_MAIN_DB:
-                return writeMainDB(buffer, count, offset);
+int File::sync(int flags) {
+    IOTrace::Scope trace(mTraceId, mDB ? mDB->mTraceId : 0, mOpenFlags, IOTrace::OP_SYNC, 0, 0, 0, flags);
+    int rv = mBulk ? mBulk->flush() : SQLITE_OK;
+    if (rv == SQLITE_OK)
+        rv = FILE_FORWARD(this, xSync, flags);
+
+    // the pages of a batch are durable, so its log is no longer needed
+    if (rv == SQLITE_OK && mRedo)
+        rv = mRedo->checkpoint();
+
+    // pages are durable, so the tree covering them can be persisted
+    if (rv == SQLITE_OK && mCrypto && (mOpenFlags & SQLITE_OPEN_MAIN_DB)) {
+        try {
+            mCrypto->syncTree();
+        } catch (const std::exception &) {
+            rv = SQLITE_IOERR_FSYNC;
+        }
+    }
+    return rv;
+}
 
-            case SQLITE_OPEN_MAIN_JOURNAL:
-            case SQLITE_OPEN_SUBJOURNAL:
-                return writeJournal(buffer, count, offset);
+int File::fileSize(sqlite3_int64 *size) {
+    int rv = mBulk ? mBulk->flush() : SQLITE_OK;
+    if (rv == SQLITE_OK)
+        rv = FILE_FORWARD(this, xFileSize, size);
+    return rv;
+}
 
-            case SQLITE_OPEN_WAL:
-                return writeWal(buffer, count, offset);
+int File::lock(int level) {
+    // other connections may have written since the last transaction
+    if (mPrefetcher && level == SQLITE_LOCK_SHARED)
+        mPrefetcher->invalidate();
+    int rv = FILE_FORWARD(this, xLock, level);
 
-            case SQLITE_OPEN_TEMP_DB:
-            case SQLITE_OPEN_TRANSIENT_DB:
-            case SQLITE_OPEN_TEMP_JOURNAL:
-                // TODO ?
-                break;
+    // a commit interrupted by a crash is completed before its database is read, like sqlite does with hot journals
+    if (rv == SQLITE_OK && level == SQLITE_LOCK_SHARED && mRedo) {
+        rv = mRedo->recover(mUnderlying, *mCrypto);
+        if (rv != SQLITE_OK)
+            FILE_FORWARD(this, xUnlock, SQLITE_LOCK_NONE);
+    }
+    return rv;
+}
 
-            case SQLITE_OPEN_MASTER_JOURNAL:
-                /** Contains only administrative information, no encryption necessary. **/
+int File::fileControl(int op, void *arg) {
+    // batch atomic writes are implemented here, the underlying file does not see them
+    if (mRedo) {
+        switch (op) {
+            case SQLITE_FCNTL_BEGIN_ATOMIC_WRITE:
+                mRedo->begin();
+                return SQLITE_OK;
+            case SQLITE_FCNTL_COMMIT_ATOMIC_WRITE:
+                return mRedo->commit(mUnderlying, *mCrypto, ThreadPool::shared());
+            case SQLITE_FCNTL_ROLLBACK_ATOMIC_WRITE:
+                mRedo->rollback();
+                return SQLITE_OK;
             default:
                 break;
         }
     }
+    return FILE_FORWARD(this, xFileControl, op, arg);
+}
 
-    // forward actual write
-    return FILE_FORWARD(this, xWrite, buffer, count, offset);
+int File::deviceCharacteristics() {
+    int characteristics = FILE_FORWARD(this, xDeviceCharacteristics);
+    // lets sqlite keep its rollback journal in memory, see RedoLog
+    if (mRedo && !mBulk)
+        characteristics |= SQLITE_IOCAP_BATCH_ATOMIC;
+    return characteristics;
+}
+
+int File::shmLock(int offset, int n, int flags) {
+    // WAL transactions take locks in shared memory instead, a checkpoint may have written since
+    if (mPrefetcher && (flags & SQLITE_SHM_LOCK))
+        mPrefetcher->invalidate();
+    int rv = FILE_FORWARD(this, xShmLock, offset, n, flags);
+
+    // releasing the write lock ends a write transaction, its frames are committed or rolled back by now
+    bool writeUnlock = offset == SQLITE_WAL_WRITE_LOCK && flags == (SQLITE_SHM_UNLOCK | SQLITE_SHM_EXCLUSIVE);
+    if (mTap && rv == SQLITE_OK && writeUnlock)
+        mTap->deliver(mPageSize);
+    return rv;
+}
+
+bool File::readPrefetched(void *buffer, int count, sqlite3_int64 offset) {
+    int dOffset = mPageSize > 0 ? static_cast<int>(offset % mPageSize) : 0;
+    if (mPageSize == 0 || dOffset + count > mPageSize)
+        return false;
+
+    int pageNo = offset / mPageSize + 1;
+    Buffer page;
+    if (!mPrefetcher->take(pageNo, page))
+        return false;
+
+    memcpy(buffer, page.const_data(dOffset), count);
+    if (count == mPageSize)
+        mCrypto->observePage(page.const_data(), mPageSize, pageNo);
+    mPrefetcher->observe(pageNo, page.const_data());
+    page.clear(true);
+    return true;
+}
+
+uint32_t File::tracePageNo(sqlite3_int64 offset) const {
+    if (!(mOpenFlags & SQLITE_OPEN_MAIN_DB) || mPageSize == 0)
+        return 0;
+    return static_cast<uint32_t>(offset / mPageSize + 1);
 }
 
 int File::readMainDB(void *buffer, int count, sqlite3_int64 offset) {
@@ -140,6 +387,13 @@ int File::readMainDB(void *buffer, int count, sqlite3_int64 offset) {
 
     // special case: read database header
     if (offset == 0 && count < 512 && mPageSize == 0) {
+        // probed on open, answer it like for a new database without loading the key. attach fixes the page size to
+        // the default, so it matches the real header which sqlite reads with page 1 on first access.
+        if (!mCrypto->keyLoaded()) {
+            memset(buffer, 0, count);
+            return rv;
+        }
+
         mCrypto->decryptFirstPageCache();
         memcpy(buffer, mCrypto->pageBufferOut(), count);
         return rv;
@@ -158,9 +412,13 @@ int File::readMainDB(void *buffer, int count, sqlite3_int64 offset) {
         if (rv != SQLITE_OK)
             return rv;
 
-        // calculate page number and decrypt
+        // calculate page number, authenticate and decrypt
         int pageNo = prevOffset / mPageSize + 1;
+        if (!mCrypto->checkPage(mCrypto->pageBufferIn(), mPageSize, pageNo))
+            return SQLITE_IOERR_DATA;
         mCrypto->decryptPage(nullptr, mPageSize, pageNo);
+        if (mPrefetcher)
+            mPrefetcher->observe(pageNo, mCrypto->pageBufferOut());
 
         // return data
         memcpy(buffer, mCrypto->pageBufferOut() + dOffset, count);
@@ -170,7 +428,12 @@ int File::readMainDB(void *buffer, int count, sqlite3_int64 offset) {
         assert(count == mPageSize);
 
         int pageNo = offset / mPageSize + 1;
+        if (!mCrypto->checkPage(buffer, mPageSize, pageNo))
+            return SQLITE_IOERR_DATA;
         mCrypto->decryptPage(buffer, mPageSize, pageNo);
+        mCrypto->observePage(buffer, mPageSize, pageNo);
+        if (mPrefetcher)
+            mPrefetcher->observe(pageNo, static_cast<const uint8_t *>(buffer));
     }
 
     return rv;
@@ -180,6 +443,8 @@ int File::readJournal(void *buffer, int count, sqlite3_int64) {
     if (count == mPageSize && mPageNo != 0) {
         // decrypt page buffer
         mCrypto->decryptPage(buffer, mPageSize, mPageNo);
+        // the page is written back while the cache is being rolled back, keep it encrypted
+        if (mDB) mDB->mReplayPage = mPageNo;
         mPageNo = 0;
     }
     else if (count == 4) {
@@ -199,20 +464,64 @@ int File::readWal(void *buffer, int count, sqlite_int64 offset) {
 
         rv = FILE_FORWARD(this, xRead, temp, 4, offset - SQLITE_WAL_FRAMEHEADER_SIZE);
         if (rv == SQLITE_OK && (pageNo = csqlite3_get4byte(temp)) != 0) {
+            // a checkpoint writes the frame to the main db next, keep the decision made for the frame
+            if (mDB) {
+                mDB->mWalPage = pageNo;
+                mDB->mWalPlaintext = mCrypto->isPlaintextPage(buffer, mPageSize);
+            }
+
             // decrypt page buffer
             mCrypto->decryptPage(buffer, mPageSize, pageNo);
+            mCrypto->observePage(buffer, mPageSize, pageNo);
         }
     }
+    else if (count == SQLITE_WAL_FRAMEHEADER_SIZE + mPageSize) {
+        // recovery reads whole frames to verify their checksums, which cover the plaintext
+        auto *frame = static_cast<uint8_t *>(buffer);
+        int pageNo = csqlite3_get4byte(frame);
+        if (pageNo != 0)
+            mCrypto->decryptPage(frame + SQLITE_WAL_FRAMEHEADER_SIZE, mPageSize, pageNo);
+    }
 
     return rv;
 }
 
 int File::writeMainDB(const void *buffer, int count, sqlite3_int64 offset) {
+    // databases attached by sqlite itself, like the output of VACUUM INTO, learn the page size from the first page
+    if (mPageSize == 0) {
+        mPageSize = count;
+        mCrypto->resizePageBuffers(mPageSize);
+    }
+
     // only full page writes
     assert(offset % mPageSize == 0 && count == mPageSize);
 
     int pageNo = offset / mPageSize + 1;
-    buffer = mCrypto->encryptPage(buffer, mPageSize, pageNo);
+    if (mBulk)
+        return mBulk->write(buffer, mPageSize, pageNo);
+    if (mPrefetcher)
+        mPrefetcher->invalidate();
+
+    bool plaintext;
+    if (pageNo == mWalPage)
+        plaintext = mWalPlaintext;
+    else
+        plaintext = pageNo != mReplayPage && isPlaintext(pageNo);
+    mReplayPage = mWalPage = 0;
+
+    mCrypto->observePage(buffer, mPageSize, pageNo);
+    if (mRedo && mRedo->active()) {
+        mRedo->add(buffer, mPageSize, pageNo, plaintext);
+        return SQLITE_OK;
+    }
+
+    // a logged batch must not be written again over pages written without the log
+    int rv = mRedo ? mRedo->checkpoint() : SQLITE_OK;
+    if (rv != SQLITE_OK)
+        return rv;
+
+    buffer = mCrypto->encryptPage(buffer, mPageSize, pageNo, plaintext);
+    mCrypto->updatePage(buffer, mPageSize, pageNo);
 
     return FILE_FORWARD(this, xWrite, buffer, mPageSize, offset);
 }
@@ -222,7 +531,7 @@ int File::writeJournal(const void *buffer, int count, sqlite3_int64 offset) {
 
     if (count == mPageSize && mPageNo != 0) {
         // encrypt full page buffer
-        buffer = mCrypto->encryptPage(buffer, mPageSize, mPageNo);
+        buffer = mCrypto->encryptLogPage(buffer, mPageSize, mPageNo);
         rv = FILE_FORWARD(this, xWrite, buffer, mPageSize, offset);
     }
     else {
@@ -252,12 +561,15 @@ int File::writeWal(const void *buffer, int count, sqlite3_int64 offset) {
         assert(pageNo != 0);
 
         // encrypt full page buffer
-        buffer = mCrypto->encryptPage(buffer, mPageSize, pageNo);
+        mCrypto->observePage(buffer, mPageSize, pageNo);
+        buffer = mCrypto->encryptLogPage(buffer, mPageSize, pageNo, isPlaintext(pageNo));
         rv = FILE_FORWARD(this, xWrite, buffer, mPageSize, offset);
     }
     else {
         // write partial non-page data without encryption
         rv = FILE_FORWARD(this, xWrite, buffer, count, offset);
+        if (rv == SQLITE_OK && mDB && mDB->mTap)
+            mDB->mTap->written(mUnderlying, buffer, count, offset, mPageSize);
     }
 
     return rv;
@@ -24,6 +24,11 @@
 #include <vector>
 #include <string>
 #include "../crypto/Crypto.h"
+#include "Prefetcher.h"
+
+class BulkWriter;
+class RedoLog;
+class WalTap;
 
 extern "C" {
 #include <sqlite3.h>
@@ -39,18 +44,52 @@ const int SQLITE_OPEN_MASK = SQLITE_OPEN_MAIN_DB |
                              SQLITE_OPEN_WAL;
 
 const int SQLITE_WAL_FRAMEHEADER_SIZE = 24;
+// shared memory lock held by the writer of the WAL
+const int SQLITE_WAL_WRITE_LOCK = 0;
 
 class File {
 public:
     /* Constructor/destructor can not be used because sqlite3 manages this memory */
 
+    /**
+     * @param db Database connection
+     * @return Main database file of the connection, nullptr if it was not opened by our VFS
+     */
+    static File *fromDatabase(sqlite3 *db);
+
     int attach(sqlite3 *db, int nDB);
 
     int close();
     int read(void* buffer, int count, sqlite3_int64 offset);
     int write(const void* buffer, int count, sqlite3_int64 offset);
+    int truncate(sqlite3_int64 size);
+    int sync(int flags);
+    int fileSize(sqlite3_int64 *size);
+    int lock(int level);
+    int fileControl(int op, void *arg);
+    int deviceCharacteristics();
+    int shmLock(int offset, int n, int flags);
 
 protected:
+    int loadTree();
+
+    /**
+     * @return True if the plaintext policy allows writing the page unencrypted
+     */
+    bool isPlaintext(int pageNo);
+
+    /**
+     * Serves a read of the main db from the prefetcher
+     *
+     * @return True if the page was prefetched
+     */
+    bool readPrefetched(void *buffer, int count, sqlite3_int64 offset);
+
+    /**
+     * @return Number of the page at the offset for the I/O trace, 0 if this is not the main db
+     */
+    uint32_t tracePageNo(sqlite3_int64 offset) const;
+
     int readMainDB(void *buffer, int count, sqlite3_int64 offset);
     int readJournal(void *buffer, int count, sqlite3_int64 offset);
     int readWal(void *buffer, int count, sqlite3_int64 offset);
@@ -70,6 +109,25 @@ public:
     File *mDB;
     int mPageSize;
     int mPageNo;
+    // connection of the main db, set by attach
+    sqlite3 *mConnection;
+    int mDbIndex;
+    // main db: page last replayed from a journal, and page and flag of the WAL frame last read for a checkpoint
+    int mReplayPage;
+    int mWalPage;
+    bool mWalPlaintext;
+    // main db: read-ahead of overflow chains, nullptr if disabled
+    Prefetcher *mPrefetcher;
+    // main db: subscriber to committed WAL frames, nullptr if none
+    WalTap *mTap;
+    // main db: encrypts and writes pages in batches when written from start to end, nullptr otherwise
+    BulkWriter *mBulk;
+    // main db: log of transactions written as a batch instead of through the rollback journal
+    RedoLog *mRedo;
+    // main db: build the integrity tree from the pages on disk instead of loading it
+    bool mRebuildTree;
+    // id of the file in I/O traces
+    uint32_t mTraceId;
 
     static sqlite3_io_methods gSQLiteIOMethods;
 };
@@ -88,16 +146,16 @@ namespace {
         return reinterpret_cast<File *>(pFile)->write(buf,iAmt,iOfst);
     }
     int sIoTruncate(sqlite3_file* pFile, sqlite3_int64 size) {
-        return FILE_FORWARD(pFile, xTruncate, size);
+        return reinterpret_cast<File *>(pFile)->truncate(size);
     }
     int sIoSync(sqlite3_file* pFile, int flags) {
-        return FILE_FORWARD(pFile, xSync, flags);
+        return reinterpret_cast<File *>(pFile)->sync(flags);
     }
     int sIoFileSize(sqlite3_file* pFile, sqlite3_int64* pSize) {
-        return FILE_FORWARD(pFile, xFileSize, pSize);
+        return reinterpret_cast<File *>(pFile)->fileSize(pSize);
     }
     int sIoLock(sqlite3_file* pFile, int lock) {
-        return FILE_FORWARD(pFile, xLock, lock);
+        return reinterpret_cast<File *>(pFile)->lock(lock);
     }
     int sIoUnlock(sqlite3_file* pFile, int lock) {
         return FILE_FORWARD(pFile, xUnlock, lock);
@@ -106,19 +164,19 @@ namespace {
         return FILE_FORWARD(pFile, xCheckReservedLock, pResOut);
     }
     int sIoFileControl(sqlite3_file* pFile, int op, void *pArg) {
-        return FILE_FORWARD(pFile, xFileControl, op, pArg);
+        return reinterpret_cast<File *>(pFile)->fileControl(op, pArg);
     }
     int sIoSectorSize(sqlite3_file* pFile) {
         return FILE_FORWARD(pFile, xSectorSize);
     }
     int sIoDeviceCharacteristics(sqlite3_file* pFile) {
-        return FILE_FORWARD(pFile, xDeviceCharacteristics);
+        return reinterpret_cast<File *>(pFile)->deviceCharacteristics();
     }
     int sIoShmMap(sqlite3_file* pFile, int iPg, int pgsz, int map, void volatile** p) {
         return FILE_FORWARD(pFile, xShmMap, iPg, pgsz, map, p);
     }
     int sIoShmLock(sqlite3_file* pFile, int offset, int n, int flags) {
-        return FILE_FORWARD(pFile, xShmLock, offset, n, flags);
+        return reinterpret_cast<File *>(pFile)->shmLock(offset, n, flags);
     }
     void sIoShmBarrier(sqlite3_file* pFile) {
         return FILE_FORWARD(pFile, xShmBarrier);
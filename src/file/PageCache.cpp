@@ -0,0 +1,331 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "PageCache.h"
+#include "RawFile.h"
+
+#define CACHE(f) reinterpret_cast<PageCache::Handle *>(f)->cache
+#define CACHE_FORWARD(f, fn, ...) CACHE(f)->underlying()->pMethods->fn(CACHE(f)->underlying(), ## __VA_ARGS__)
+
+namespace {
+    // WAL index region size, offsets of the salts in the first copy of its header and of the backfill count, see wal.c
+    const int WAL_INDEX_REGION = 32768;
+    const int WAL_SALT_OFFSET = 32, WAL_SALT_SIZE = 8;
+    const int WAL_BACKFILL_OFFSET = 96, WAL_BACKFILL_SIZE = 4;
+
+    int sIoClose(sqlite3_file *pFile) {
+        PageCache *cache = CACHE(pFile);
+        int rc = cache->close();
+        delete cache;
+        return rc;
+    }
+    int sIoRead(sqlite3_file *pFile, void *buffer, int count, sqlite3_int64 offset) {
+        return CACHE(pFile)->read(buffer, count, offset);
+    }
+    int sIoWrite(sqlite3_file *pFile, const void *buffer, int count, sqlite3_int64 offset) {
+        return CACHE(pFile)->write(buffer, count, offset);
+    }
+    int sIoTruncate(sqlite3_file *pFile, sqlite3_int64 size) {
+        return CACHE(pFile)->truncate(size);
+    }
+    int sIoSync(sqlite3_file *pFile, int flags) {
+        return CACHE_FORWARD(pFile, xSync, flags);
+    }
+    int sIoFileSize(sqlite3_file *pFile, sqlite3_int64 *pSize) {
+        return CACHE_FORWARD(pFile, xFileSize, pSize);
+    }
+    int sIoLock(sqlite3_file *pFile, int lock) {
+        return CACHE(pFile)->lock(lock);
+    }
+    int sIoUnlock(sqlite3_file *pFile, int lock) {
+        return CACHE(pFile)->unlock(lock);
+    }
+    int sIoCheckReservedLock(sqlite3_file *pFile, int *pResOut) {
+        return CACHE_FORWARD(pFile, xCheckReservedLock, pResOut);
+    }
+    int sIoFileControl(sqlite3_file *pFile, int op, void *pArg) {
+        return CACHE_FORWARD(pFile, xFileControl, op, pArg);
+    }
+    int sIoSectorSize(sqlite3_file *pFile) {
+        return CACHE_FORWARD(pFile, xSectorSize);
+    }
+    int sIoDeviceCharacteristics(sqlite3_file *pFile) {
+        return CACHE_FORWARD(pFile, xDeviceCharacteristics);
+    }
+    int sIoShmMap(sqlite3_file *pFile, int iPg, int pgsz, int map, void volatile **p) {
+        return CACHE_FORWARD(pFile, xShmMap, iPg, pgsz, map, p);
+    }
+    int sIoShmLock(sqlite3_file *pFile, int offset, int n, int flags) {
+        return CACHE(pFile)->shmLock(offset, n, flags);
+    }
+    void sIoShmBarrier(sqlite3_file *pFile) {
+        CACHE_FORWARD(pFile, xShmBarrier);
+    }
+    int sIoShmUnmap(sqlite3_file *pFile, int deleteFlag) {
+        return CACHE_FORWARD(pFile, xShmUnmap, deleteFlag);
+    }
+    int sIoFetch(sqlite3_file *, sqlite3_int64, int, void **pp) {
+        // mapped pages would bypass the cache
+        *pp = nullptr;
+        return SQLITE_OK;
+    }
+    int sIoUnfetch(sqlite3_file *, sqlite3_int64, void *) {
+        return SQLITE_OK;
+    }
+}
+
+sqlite3_io_methods PageCache::gMethods = {
+        3,                          /* iVersion */
+        sIoClose,                   /* xClose */
+        sIoRead,                    /* xRead */
+        sIoWrite,                   /* xWrite */
+        sIoTruncate,                /* xTruncate */
+        sIoSync,                    /* xSync */
+        sIoFileSize,                /* xFileSize */
+        sIoLock,                    /* xLock */
+        sIoUnlock,                  /* xUnlock */
+        sIoCheckReservedLock,       /* xCheckReservedLock */
+        sIoFileControl,             /* xFileControl */
+        sIoSectorSize,              /* xSectorSize */
+        sIoDeviceCharacteristics,   /* xDeviceCharacteristics */
+        sIoShmMap,                  /* xShmMap */
+        sIoShmLock,                 /* xShmLock */
+        sIoShmBarrier,              /* xShmBarrier */
+        sIoShmUnmap,                /* xShmUnmap */
+        sIoFetch,                   /* xFetch */
+        sIoUnfetch,                 /* xUnfetch */
+};
+
+std::mutex PageCache::sMutex;
+std::string PageCache::sDirectory;
+uint32_t PageCache::sCapacity = 0;
+
+PageCache::PageCache(sqlite3_file *underlying, const int &pageSize, const std::string &directory, uint32_t capacity)
+        : mHandle({{&gMethods}, this}), mUnderlying(underlying), mPageSize(pageSize), mCapacity(capacity) {
+    // unique name, the file is removed from the directory as soon as it is open
+    uint8_t random[8];
+    sqlite3_randomness(sizeof(random), random);
+    std::string name = directory + "/cryptosqlite-";
+    for (uint8_t byte : random)
+        name += "0123456789abcdef"[byte >> 4], name += "0123456789abcdef"[byte & 0xf];
+
+    mCache.reset(new RawFile(name + ".cache", SQLITE_OPEN_TEMP_DB | SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                                              SQLITE_OPEN_EXCLUSIVE | SQLITE_OPEN_DELETEONCLOSE));
+    mRc = mCache->rc();
+}
+
+PageCache::~PageCache() = default;
+
+int PageCache::read(void *buffer, int count, sqlite3_int64 offset) {
+    // partial reads only happen before the page size is known
+    if (mPageSize == 0 || count != mPageSize || offset % mPageSize != 0)
+        return mUnderlying->pMethods->xRead(mUnderlying, buffer, count, offset);
+    if (mSlotSize != mPageSize) {
+        drop(1);
+        mSlotSize = mPageSize;
+    }
+
+    auto pageNo = static_cast<uint32_t>(offset / mPageSize + 1);
+    auto it = mSlots.find(pageNo);
+    if (it != mSlots.end()) {
+        uint32_t slot = it->second;
+        if (mCache->read(buffer, count, static_cast<sqlite3_int64>(slot) * mSlotSize) == SQLITE_OK) {
+            mReferenced[slot] = true;
+            return SQLITE_OK;
+        }
+        erase(pageNo);
+    }
+
+    int rc = mUnderlying->pMethods->xRead(mUnderlying, buffer, count, offset);
+    if (rc == SQLITE_OK)
+        store(pageNo, buffer);
+    return rc;
+}
+
+int PageCache::write(const void *buffer, int count, sqlite3_int64 offset) {
+    int rc = mUnderlying->pMethods->xWrite(mUnderlying, buffer, count, offset);
+    mWrote = true;
+    if (mPageSize == 0 || (mSlots.empty() && rc != SQLITE_OK))
+        return rc;
+    if (mSlotSize != mPageSize) {
+        drop(1);
+        mSlotSize = mPageSize;
+    }
+
+    // pages written completely are cached, the others may be stale now
+    auto *in = static_cast<const uint8_t *>(buffer);
+    for (sqlite3_int64 pageStart = offset - offset % mPageSize; pageStart < offset + count; pageStart += mPageSize) {
+        auto pageNo = static_cast<uint32_t>(pageStart / mPageSize + 1);
+        if (rc == SQLITE_OK && pageStart >= offset && pageStart + mPageSize <= offset + count)
+            store(pageNo, in + (pageStart - offset));
+        else
+            erase(pageNo);
+    }
+    return rc;
+}
+
+int PageCache::truncate(sqlite3_int64 size) {
+    int rc = mUnderlying->pMethods->xTruncate(mUnderlying, size);
+    mWrote = true;
+    if (mPageSize > 0)
+        drop(static_cast<uint32_t>((size + mPageSize - 1) / mPageSize + 1));
+    return rc;
+}
+
+int PageCache::lock(int level) {
+    int rc = mUnderlying->pMethods->xLock(mUnderlying, level);
+    if (rc == SQLITE_OK && level == SQLITE_LOCK_SHARED)
+        validate(false);
+    return rc;
+}
+
+int PageCache::unlock(int level) {
+    // while the lock is held, no other connection changed the database
+    if (mWrote)
+        restamp(false);
+    return mUnderlying->pMethods->xUnlock(mUnderlying, level);
+}
+
+int PageCache::shmLock(int offset, int n, int flags) {
+    // WAL transactions start with a shared lock on a read mark, a checkpoint writes under exclusive locks
+    if ((flags & SQLITE_SHM_UNLOCK) && mWrote)
+        restamp(true);
+
+    int rc = mUnderlying->pMethods->xShmLock(mUnderlying, offset, n, flags);
+    if (rc == SQLITE_OK && flags == (SQLITE_SHM_LOCK | SQLITE_SHM_SHARED))
+        validate(true);
+    return rc;
+}
+
+int PageCache::close() {
+    mCache.reset();
+    return mUnderlying->pMethods->xClose(mUnderlying);
+}
+
+void PageCache::configure(const std::string &directory, uint32_t pages) {
+    std::lock_guard<std::mutex> lock(sMutex);
+    sDirectory = directory;
+    sCapacity = pages;
+}
+
+bool PageCache::enabled(std::string &directory, uint32_t &pages) {
+    std::lock_guard<std::mutex> lock(sMutex);
+    directory = sDirectory;
+    pages = sCapacity;
+    return !directory.empty() && pages > 0;
+}
+
+std::vector<uint8_t> PageCache::marker(bool wal) {
+    std::vector<uint8_t> marker;
+    if (wal) {
+        // region 0 is mapped while sqlite holds a WAL lock
+        void volatile *index = nullptr;
+        if (mUnderlying->pMethods->xShmMap(mUnderlying, 0, WAL_INDEX_REGION, 0, &index) == SQLITE_OK && index) {
+            auto *header = static_cast<volatile uint8_t *>(index);
+            for (int i = 0; i < WAL_SALT_SIZE; i++)
+                marker.push_back(static_cast<uint8_t>(header[WAL_SALT_OFFSET + i]));
+            for (int i = 0; i < WAL_BACKFILL_SIZE; i++)
+                marker.push_back(static_cast<uint8_t>(header[WAL_BACKFILL_OFFSET + i]));
+        }
+    }
+    else if (mPageSize > 0) {
+        // encrypted, but changes with the file change counter. A short read of an empty database reads zeros
+        marker.resize(mPageSize);
+        mUnderlying->pMethods->xRead(mUnderlying, marker.data(), mPageSize, 0);
+    }
+    return marker;
+}
+
+void PageCache::validate(bool wal) {
+    // a connection that wrote holds the lock that keeps others from writing
+    if (mWrote)
+        return;
+
+    std::vector<uint8_t> current = marker(wal), &known = wal ? mWalMarker : mFileMarker;
+    if (current.empty() || current != known) {
+        drop(1);
+        known.swap(current);
+    }
+}
+
+void PageCache::restamp(bool wal) {
+    (wal ? mWalMarker : mFileMarker) = marker(wal);
+    mWrote = false;
+}
+
+void PageCache::store(uint32_t pageNo, const void *page) {
+    auto it = mSlots.find(pageNo);
+    uint32_t slot = it != mSlots.end() ? it->second : claim();
+
+    if (mCache->write(page, mSlotSize, static_cast<sqlite3_int64>(slot) * mSlotSize) != SQLITE_OK) {
+        // the cache is best effort, e.g. its device may be full
+        if (it != mSlots.end())
+            erase(pageNo);
+        else
+            mFree.push_back(slot);
+        return;
+    }
+
+    mSlots[pageNo] = slot;
+    mSlotPages[slot] = pageNo;
+    mReferenced[slot] = true;
+}
+
+void PageCache::erase(uint32_t pageNo) {
+    auto it = mSlots.find(pageNo);
+    if (it == mSlots.end())
+        return;
+
+    mSlotPages[it->second] = 0;
+    mFree.push_back(it->second);
+    mSlots.erase(it);
+}
+
+void PageCache::drop(uint32_t pageNo) {
+    for (uint32_t slot = 0; slot < mSlotPages.size(); slot++) {
+        if (mSlotPages[slot] >= pageNo)
+            erase(mSlotPages[slot]);
+    }
+}
+
+uint32_t PageCache::claim() {
+    if (!mFree.empty()) {
+        uint32_t slot = mFree.back();
+        mFree.pop_back();
+        return slot;
+    }
+    if (mSlotPages.size() < mCapacity) {
+        mSlotPages.push_back(0);
+        mReferenced.push_back(false);
+        return static_cast<uint32_t>(mSlotPages.size() - 1);
+    }
+
+    // every slot is in use, evict the first one not referenced since the hand last passed it
+    while (mReferenced[mHand]) {
+        mReferenced[mHand] = false;
+        mHand = (mHand + 1) % mCapacity;
+    }
+    uint32_t slot = mHand;
+    mHand = (mHand + 1) % mCapacity;
+
+    mSlots.erase(mSlotPages[slot]);
+    mSlotPages[slot] = 0;
+    return slot;
+}
@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CRYPTOSQLITE_PAGECACHE_H
+#define CRYPTOSQLITE_PAGECACHE_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#include <sqlite3.h>
+};
+
+class RawFile;
+
+/**
+ * Second level cache of a main db's pages in a file on a fast local device, for databases on slow storage.
+ *
+ * Pages are kept as they are on disk, encrypted, so the cache file reveals nothing the database file does not, and
+ * pages read from it are authenticated like any other. Every full page read or written goes through the cache, which
+ * evicts pages in CLOCK order once full. Writes go to the database first, truncation drops the pages beyond the new
+ * end. Other connections write to the database directly, so the whole cache is dropped at the start of a transaction
+ * if the database changed since this connection last wrote it: in rollback mode, every commit rewrites the file change
+ * counter on page 1, in WAL mode the database is only written by checkpoints, which advance the backfill count in the
+ * WAL index or restart the WAL with new salts. The cache file is deleted when the database is closed.
+ */
+class PageCache {
+public:
+    /**
+     * Takes over an open database file, to be used as the underlying file of the main db. Closing the returned file()
+     * closes the database file and deletes this object.
+     *
+     * @param underlying Database file, possibly striped
+     * @param pageSize Page size of the database, 0 until known, when all requests bypass the cache
+     * @param directory Directory to create the cache file in
+     * @param capacity Maximum number of cached pages
+     */
+    PageCache(sqlite3_file *underlying, const int &pageSize, const std::string &directory, uint32_t capacity);
+    ~PageCache();
+
+    PageCache(const PageCache &) = delete;
+    PageCache &operator=(const PageCache &) = delete;
+
+    /**
+     * @return Standard sqlite error code of creating the cache file
+     */
+    int rc() const {
+        return mRc;
+    }
+    /**
+     * @return Handle to be used in place of the database file
+     */
+    sqlite3_file *file() {
+        return &mHandle.base;
+    }
+    sqlite3_file *underlying() const {
+        return mUnderlying;
+    }
+
+    int read(void *buffer, int count, sqlite3_int64 offset);
+    int write(const void *buffer, int count, sqlite3_int64 offset);
+    int truncate(sqlite3_int64 size);
+    int lock(int level);
+    int unlock(int level);
+    int shmLock(int offset, int n, int flags);
+    int close();
+
+    /**
+     * @param directory Directory of the cache files, empty disables the cache (default)
+     * @param pages Pages per connection, 0 disables the cache
+     */
+    static void configure(const std::string &directory, uint32_t pages);
+    /**
+     * @return True if connections opened now get a cache, directory and capacity to use then
+     */
+    static bool enabled(std::string &directory, uint32_t &pages);
+
+    struct Handle {
+        sqlite3_file base;
+        PageCache *cache;
+    };
+
+    static sqlite3_io_methods gMethods;
+
+protected:
+    /**
+     * @param wal Read the marker of WAL mode from the WAL index, which must be mapped, instead of page 1
+     * @return Bytes that change whenever another connection writes the database: page 1 as stored, or the salts and
+     *         backfill count of the WAL index
+     */
+    std::vector<uint8_t> marker(bool wal);
+    /**
+     * Drops all pages if another connection wrote the database since the last check, called with a lock held
+     */
+    void validate(bool wal);
+    /**
+     * Accepts the current state of the database after this connection wrote it, before releasing its lock
+     */
+    void restamp(bool wal);
+
+    void store(uint32_t pageNo, const void *page);
+    void erase(uint32_t pageNo);
+    /**
+     * Drops all pages from pageNo on
+     */
+    void drop(uint32_t pageNo);
+    /**
+     * @return Free slot, the least recently used one if the cache is full
+     */
+    uint32_t claim();
+
+    Handle mHandle;
+
+    // not owned until close
+    sqlite3_file *mUnderlying;
+    const int &mPageSize;
+    // page size of the cached pages
+    int mSlotSize = 0;
+    uint32_t mCapacity;
+    std::unique_ptr<RawFile> mCache;
+
+    // slot of each cached page, page of each slot or 0 if free, and CLOCK state
+    std::unordered_map<uint32_t, uint32_t> mSlots;
+    std::vector<uint32_t> mSlotPages;
+    std::vector<bool> mReferenced;
+    std::vector<uint32_t> mFree;
+    uint32_t mHand = 0;
+
+    // markers of rollback and WAL mode at the last check
+    std::vector<uint8_t> mFileMarker, mWalMarker;
+    // written since the last check, other connections can not write until this one unlocks
+    bool mWrote = false;
+    int mRc = SQLITE_OK;
+
+    static std::mutex sMutex;
+    static std::string sDirectory;
+    static uint32_t sCapacity;
+};
+
+#endif //CRYPTOSQLITE_PAGECACHE_H
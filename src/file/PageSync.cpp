@@ -0,0 +1,495 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include "PageSync.h"
+#include "RawFile.h"
+#include "StripedFile.h"
+#include "../crypto/BlobStore.h"
+#include "../crypto/Crypto.h"
+#include "../crypto/FileWrapper.h"
+#include "../memory/MemoryBudget.h"
+#include "../util/Sha256.h"
+#include "../util/ThreadPool.h"
+#include "../vfs/VFS.h"
+
+namespace {
+    const char SIGNATURE_MAGIC[] = "cSQLsig1", DELTA_MAGIC[] = "cSQLdlt1";
+    const size_t MAGIC_SIZE = 8;
+    // truncated SHA-256 of the ciphertext of each page
+    const size_t DIGEST_SIZE = 16;
+    // bytes read and hashed per task
+    const uint32_t DIGEST_CHUNK_SIZE = 4 * 1024 * 1024;
+    // bytes passed to a stream callback at once
+    const size_t STREAM_BLOCK_SIZE = 1024 * 1024;
+    // bounds for values read from a stream, see SQLITE_MAX_PAGE_COUNT
+    const uint32_t MAX_PAGE_COUNT = 0xfffffffe;
+    const uint32_t MAX_KEYFILE_OVERHEAD = 64 * 1024;
+    // the standby is replaced by a copy with the names of a key rotation, see Crypto::recoverRotation()
+    const char STAGED_SUFFIX[] = "-rotate";
+
+    int put(sqlite3_sync_write write, void *arg, const void *data, size_t size) {
+        auto *in = static_cast<const uint8_t *>(data);
+        int rc = SQLITE_OK;
+        for (size_t done = 0; rc == SQLITE_OK && done < size;) {
+            auto count = static_cast<int>((std::min)(size - done, STREAM_BLOCK_SIZE));
+            rc = write(arg, in + done, count);
+            done += count;
+        }
+        return rc;
+    }
+
+    int get(sqlite3_sync_read read, void *arg, void *data, size_t size) {
+        auto *out = static_cast<uint8_t *>(data);
+        int rc = SQLITE_OK;
+        for (size_t done = 0; rc == SQLITE_OK && done < size;) {
+            auto count = static_cast<int>((std::min)(size - done, STREAM_BLOCK_SIZE));
+            rc = read(arg, out + done, count);
+            done += count;
+        }
+        return rc;
+    }
+
+    int put32(sqlite3_sync_write write, void *arg, uint32_t value) {
+        uint8_t bytes[4] = {static_cast<uint8_t>(value >> 24), static_cast<uint8_t>(value >> 16),
+                            static_cast<uint8_t>(value >> 8), static_cast<uint8_t>(value)};
+        return put(write, arg, bytes, sizeof(bytes));
+    }
+
+    int get32(sqlite3_sync_read read, void *arg, uint32_t &value) {
+        uint8_t bytes[4];
+        int rc = get(read, arg, bytes, sizeof(bytes));
+        value = (uint32_t(bytes[0]) << 24) | (uint32_t(bytes[1]) << 16) | (uint32_t(bytes[2]) << 8) | bytes[3];
+        return rc;
+    }
+
+    int getMagic(sqlite3_sync_read read, void *arg, const char *magic) {
+        char bytes[MAGIC_SIZE];
+        int rc = get(read, arg, bytes, MAGIC_SIZE);
+        return rc == SQLITE_OK && memcmp(bytes, magic, MAGIC_SIZE) != 0 ? SQLITE_CORRUPT : rc;
+    }
+}
+
+PageSync::PageSync(const std::string &fileName, ThreadPool *pool) : mFileName(fileName), mPool(pool) {
+}
+
+int PageSync::signature(sqlite3_sync_write write, void *arg) {
+    Buffer keyFile;
+    uint32_t pageSize = 0, count = 0;
+    std::vector<uint8_t> pages;
+
+    int rc = resolve();
+    if (rc == SQLITE_OK)
+        rc = readKeyFile(keyFile, pageSize);
+
+    // a standby without keyfile or database receives all pages
+    if (rc == SQLITE_OK && pageSize > 0 && FileWrapper::exists(mFileName)) {
+        RawFile file(mFileName, SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READONLY);
+        rc = file.rc();
+        if (rc == SQLITE_OK)
+            rc = file.lock(false);
+        if (rc == SQLITE_OK)
+            rc = pageCount(file, pageSize, count);
+        if (rc == SQLITE_OK)
+            rc = digests(pageSize, count, pages);
+    }
+
+    if (rc == SQLITE_OK)
+        rc = put(write, arg, SIGNATURE_MAGIC, MAGIC_SIZE);
+    if (rc == SQLITE_OK)
+        rc = put32(write, arg, pageSize);
+    if (rc == SQLITE_OK)
+        rc = put32(write, arg, count);
+    if (rc == SQLITE_OK)
+        rc = put(write, arg, pages.data(), pages.size());
+    return rc;
+}
+
+int PageSync::delta(sqlite3_sync_read read, void *readArg, sqlite3_sync_write write, void *writeArg) {
+    Buffer keyFile;
+    uint32_t pageSize = 0;
+
+    int rc = resolve();
+    if (rc == SQLITE_OK)
+        rc = readKeyFile(keyFile, pageSize);
+    if (rc == SQLITE_OK && pageSize == 0)
+        rc = SQLITE_CANTOPEN;
+    if (rc != SQLITE_OK)
+        return rc;
+
+    // pages may not change until the delta is written, nor be moved into the database from a WAL after it was checked
+    RawFile file(mFileName, SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READONLY);
+    rc = file.rc();
+    if (rc == SQLITE_OK)
+        rc = file.lock(false);
+    if (rc == SQLITE_OK)
+        rc = checkWal();
+
+    // the whole signature is read first, so both directions of one pipe never wait for each other
+    uint32_t targetPageSize = 0, targetCount = 0;
+    std::vector<uint8_t> target;
+    if (rc == SQLITE_OK)
+        rc = getMagic(read, readArg, SIGNATURE_MAGIC);
+    if (rc == SQLITE_OK)
+        rc = get32(read, readArg, targetPageSize);
+    if (rc == SQLITE_OK)
+        rc = get32(read, readArg, targetCount);
+    if (rc == SQLITE_OK && targetCount > MAX_PAGE_COUNT)
+        rc = SQLITE_CORRUPT;
+    if (rc == SQLITE_OK) {
+        target.resize(static_cast<size_t>(targetCount) * DIGEST_SIZE);
+        rc = get(read, readArg, target.data(), target.size());
+    }
+
+    uint32_t count = 0;
+    std::vector<uint8_t> source;
+    if (rc == SQLITE_OK)
+        rc = pageCount(file, pageSize, count);
+    if (rc == SQLITE_OK)
+        rc = digests(pageSize, count, source);
+
+    // a standby with another page size receives all pages
+    if (targetPageSize != pageSize)
+        targetCount = 0;
+
+    if (rc == SQLITE_OK)
+        rc = put(write, writeArg, DELTA_MAGIC, MAGIC_SIZE);
+    if (rc == SQLITE_OK)
+        rc = put32(write, writeArg, pageSize);
+    if (rc == SQLITE_OK)
+        rc = put32(write, writeArg, count);
+    if (rc == SQLITE_OK)
+        rc = put32(write, writeArg, static_cast<uint32_t>(keyFile.size()));
+    if (rc == SQLITE_OK)
+        rc = put(write, writeArg, keyFile.const_data(), keyFile.size());
+
+    std::vector<uint8_t> page(pageSize);
+    for (uint32_t i = 0; rc == SQLITE_OK && i < count; i++) {
+        if (i < targetCount && memcmp(&source[i * DIGEST_SIZE], &target[i * DIGEST_SIZE], DIGEST_SIZE) == 0)
+            continue;
+
+        rc = file.read(page.data(), static_cast<int>(pageSize), i * static_cast<sqlite3_int64>(pageSize));
+        if (rc == SQLITE_OK)
+            rc = put32(write, writeArg, i + 1);
+        if (rc == SQLITE_OK)
+            rc = put(write, writeArg, page.data(), page.size());
+    }
+
+    // page 0 ends the delta
+    if (rc == SQLITE_OK)
+        rc = put32(write, writeArg, 0);
+    return rc;
+}
+
+int PageSync::apply(sqlite3_sync_read read, void *arg) {
+    uint32_t pageSize = 0, count = 0, keyFileSize = 0;
+
+    int rc = resolve();
+    if (rc != SQLITE_OK)
+        return rc;
+
+    // the lock keeps connections out until the standby is replaced, checking the WAL before would race with them
+    RawFile file(mFileName, SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+    rc = file.rc();
+    if (rc == SQLITE_OK)
+        rc = file.lock(true);
+    if (rc == SQLITE_OK)
+        rc = checkWal();
+    if (rc == SQLITE_OK)
+        rc = getMagic(read, arg, DELTA_MAGIC);
+    if (rc == SQLITE_OK)
+        rc = get32(read, arg, pageSize);
+    if (rc == SQLITE_OK)
+        rc = get32(read, arg, count);
+    if (rc == SQLITE_OK)
+        rc = get32(read, arg, keyFileSize);
+    if (rc == SQLITE_OK && (pageSize < 512 || pageSize > 65536 || (pageSize & (pageSize - 1)) != 0 ||
+                            count > MAX_PAGE_COUNT || keyFileSize > pageSize + MAX_KEYFILE_OVERHEAD))
+        rc = SQLITE_CORRUPT;
+
+    Buffer keyFile;
+    if (rc == SQLITE_OK) {
+        keyFile.padd(keyFileSize, 0);
+        rc = get(read, arg, keyFile.data(), keyFileSize);
+    }
+
+    std::unique_ptr<RawFile> staged;
+    if (rc == SQLITE_OK)
+        rc = stage(file, count * static_cast<sqlite3_int64>(pageSize), staged);
+
+    std::vector<uint8_t> page(pageSize);
+    for (uint32_t pageNo; rc == SQLITE_OK;) {
+        rc = get32(read, arg, pageNo);
+        if (rc != SQLITE_OK || pageNo == 0)
+            break;
+        if (pageNo > count)
+            rc = SQLITE_CORRUPT;
+
+        if (rc == SQLITE_OK)
+            rc = get(read, arg, page.data(), page.size());
+        sqlite3_int64 offset = (pageNo - 1) * static_cast<sqlite3_int64>(pageSize);
+        if (rc == SQLITE_OK)
+            rc = staged->write(page.data(), static_cast<int>(pageSize), offset);
+    }
+
+    if (rc == SQLITE_OK)
+        rc = finish(std::move(staged), pageSize, count, keyFile);
+    else
+        discard();
+    return rc;
+}
+
+int PageSync::copyTo(const std::string &target) {
+    PageSync standby(target, mPool);
+    Buffer keyFile, targetKeyFile;
+    uint32_t pageSize = 0, targetPageSize = 0;
+
+    int rc = resolve();
+    if (rc == SQLITE_OK)
+        rc = standby.resolve();
+    if (rc == SQLITE_OK)
+        rc = readKeyFile(keyFile, pageSize);
+    if (rc == SQLITE_OK && pageSize == 0)
+        rc = SQLITE_CANTOPEN;
+    if (rc == SQLITE_OK)
+        rc = standby.readKeyFile(targetKeyFile, targetPageSize);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    RawFile file(mFileName, SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READONLY);
+    RawFile targetFile(standby.mFileName, SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+    rc = file.rc() != SQLITE_OK ? file.rc() : targetFile.rc();
+    if (rc == SQLITE_OK)
+        rc = file.lock(false);
+    if (rc == SQLITE_OK)
+        rc = targetFile.lock(true);
+    if (rc == SQLITE_OK)
+        rc = checkWal();
+    if (rc == SQLITE_OK)
+        rc = standby.checkWal();
+
+    uint32_t count = 0, targetCount = 0;
+    std::vector<uint8_t> source, destination;
+    if (rc == SQLITE_OK)
+        rc = pageCount(file, pageSize, count);
+    if (rc == SQLITE_OK)
+        rc = digests(pageSize, count, source);
+
+    // a standby with another page size or a torn page receives all pages
+    if (rc == SQLITE_OK && targetPageSize == pageSize &&
+        standby.pageCount(targetFile, pageSize, targetCount) == SQLITE_OK)
+        rc = standby.digests(pageSize, targetCount, destination);
+    targetCount = static_cast<uint32_t>(destination.size() / DIGEST_SIZE);
+
+    std::unique_ptr<RawFile> staged;
+    if (rc == SQLITE_OK)
+        rc = standby.stage(targetFile, static_cast<sqlite3_int64>(targetCount) * pageSize, staged);
+
+    std::vector<uint8_t> page(pageSize);
+    for (uint32_t i = 0; rc == SQLITE_OK && i < count; i++) {
+        if (i < targetCount && memcmp(&source[i * DIGEST_SIZE], &destination[i * DIGEST_SIZE], DIGEST_SIZE) == 0)
+            continue;
+
+        sqlite3_int64 offset = i * static_cast<sqlite3_int64>(pageSize);
+        rc = file.read(page.data(), static_cast<int>(pageSize), offset);
+        if (rc == SQLITE_OK)
+            rc = staged->write(page.data(), static_cast<int>(pageSize), offset);
+    }
+
+    if (rc == SQLITE_OK)
+        rc = standby.finish(std::move(staged), pageSize, count, keyFile);
+    else
+        standby.discard();
+    return rc;
+}
+
+int PageSync::resolve() {
+    // same name as used by the VFS, so the keyfile names match
+    sqlite3_vfs *vfs = VFS::instance()->underlying();
+    std::vector<char> fullName(vfs->mxPathname + 1);
+    if (vfs->xFullPathname(vfs, mFileName.c_str(), vfs->mxPathname + 1, fullName.data()) != SQLITE_OK)
+        return SQLITE_CANTOPEN;
+
+    mFileName = fullName.data();
+    // a sync or rotation interrupted after replacing the database is finished first, staging would remove its keyfile
+    try {
+        Crypto::recoverRotation(mFileName);
+    } catch (const std::exception &) {
+        return SQLITE_IOERR;
+    }
+
+    // pages are addressed by their offset in a single file, values in side files would not be transferred
+    return StripedFile::exists(mFileName) || BlobStore::hasFiles(mFileName) ? SQLITE_MISUSE : SQLITE_OK;
+}
+
+int PageSync::readKeyFile(Buffer &content, uint32_t &pageSize) const {
+    pageSize = 0;
+    std::string fileName = mFileName + "-keyfile";
+    if (!FileWrapper::exists(fileName))
+        return SQLITE_OK;
+
+    RawFile keyFile(fileName, SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READONLY);
+    int rc = keyFile.rc();
+    if (rc == SQLITE_OK)
+        rc = keyFile.lock(false);
+    if (rc == SQLITE_OK)
+        rc = keyFile.readAll(content);
+    if (rc == SQLITE_OK)
+        pageSize = Crypto::keyFilePageSize(content);
+    return rc;
+}
+
+int PageSync::checkWal() const {
+    std::string fileName = mFileName + "-wal";
+    if (!FileWrapper::exists(fileName))
+        return SQLITE_OK;
+
+    RawFile wal(fileName, SQLITE_OPEN_WAL | SQLITE_OPEN_READONLY);
+    sqlite3_int64 size = 0;
+    int rc = wal.rc();
+    if (rc == SQLITE_OK)
+        rc = wal.size(&size);
+    return rc == SQLITE_OK && size > 0 ? SQLITE_BUSY : rc;
+}
+
+int PageSync::pageCount(RawFile &file, uint32_t pageSize, uint32_t &count) const {
+    sqlite3_int64 size = 0;
+    int rc = file.size(&size);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    if (size % pageSize != 0 || size / pageSize > MAX_PAGE_COUNT)
+        return SQLITE_CORRUPT;
+    count = static_cast<uint32_t>(size / pageSize);
+    return SQLITE_OK;
+}
+
+int PageSync::digests(uint32_t pageSize, uint32_t count, std::vector<uint8_t> &digests) const {
+    digests.assign(static_cast<size_t>(count) * DIGEST_SIZE, 0);
+
+    uint32_t pagesPerTask = (std::max)(DIGEST_CHUNK_SIZE / pageSize, 1u);
+    size_t tasks = (static_cast<size_t>(count) + pagesPerTask - 1) / pagesPerTask;
+
+    std::atomic<int> error {SQLITE_OK};
+    mPool->parallelFor(tasks, [&] (size_t task) {
+        auto first = static_cast<uint32_t>(task * pagesPerTask);
+        uint32_t pages = (std::min)(pagesPerTask, count - first);
+        int chunkSize = static_cast<int>(pages * pageSize);
+
+        // own file handle per task
+        MemoryBudget::instance()->acquire(chunkSize, MemoryBudget::PRIORITY_BUFFER);
+        {
+            RawFile file(mFileName, SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READONLY);
+            std::vector<uint8_t> data(chunkSize);
+            int rc = file.rc();
+            if (rc == SQLITE_OK)
+                rc = file.read(data.data(), chunkSize, first * static_cast<sqlite3_int64>(pageSize));
+
+            uint8_t digest[Sha256::DIGEST_SIZE];
+            for (uint32_t i = 0; rc == SQLITE_OK && i < pages; i++) {
+                Sha256::digest(data.data() + static_cast<size_t>(i) * pageSize, pageSize, digest);
+                memcpy(&digests[(static_cast<size_t>(first) + i) * DIGEST_SIZE], digest, DIGEST_SIZE);
+            }
+
+            int expected = SQLITE_OK;
+            if (rc != SQLITE_OK)
+                error.compare_exchange_strong(expected, rc);
+        }
+        MemoryBudget::instance()->release(chunkSize, MemoryBudget::PRIORITY_BUFFER);
+    });
+    return error;
+}
+
+int PageSync::stage(RawFile &file, sqlite3_int64 size, std::unique_ptr<RawFile> &staged) const {
+    // leftovers of an earlier sync or rotation are outdated, the delta replaces database and keyfile
+    std::remove((mFileName + STAGED_SUFFIX).c_str());
+    std::remove((mFileName + STAGED_SUFFIX + "-keyfile").c_str());
+    std::remove((mFileName + STAGED_SUFFIX + "-merkle").c_str());
+
+    staged.reset(new RawFile(mFileName + STAGED_SUFFIX, SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE));
+    sqlite3_int64 existing = 0;
+    int rc = staged->rc();
+    if (rc == SQLITE_OK)
+        rc = file.size(&existing);
+    existing = (std::min)(existing, size);
+
+    // pages missing from the delta are the same on both sides
+    auto chunkSize = static_cast<int>((std::min)(existing, static_cast<sqlite3_int64>(DIGEST_CHUNK_SIZE)));
+    MemoryBudget::instance()->acquire(chunkSize, MemoryBudget::PRIORITY_BUFFER);
+    {
+        std::vector<uint8_t> chunk(chunkSize);
+        for (sqlite3_int64 offset = 0; rc == SQLITE_OK && offset < existing; offset += chunkSize) {
+            auto count = static_cast<int>((std::min)(existing - offset, static_cast<sqlite3_int64>(chunkSize)));
+            rc = file.read(chunk.data(), count, offset);
+            if (rc == SQLITE_OK)
+                rc = staged->write(chunk.data(), count, offset);
+        }
+    }
+    MemoryBudget::instance()->release(chunkSize, MemoryBudget::PRIORITY_BUFFER);
+    return rc;
+}
+
+int PageSync::finish(std::unique_ptr<RawFile> staged, uint32_t pageSize, uint32_t count, const Buffer &keyFile) const {
+    std::string stagedName = mFileName + STAGED_SUFFIX, stagedKeyFile = stagedName + "-keyfile";
+    int rc = staged->truncate(count * static_cast<sqlite3_int64>(pageSize));
+    if (rc == SQLITE_OK)
+        rc = staged->sync();
+    staged.reset();
+
+    // the keyfile holds the encrypted first page of the primary. the primary keeps counting from its nonce counter,
+    // so the standby continues from a random offset once it is written to
+    Buffer standbyKeyFile;
+    standbyKeyFile.write(keyFile, 0);
+    if (rc == SQLITE_OK && !Crypto::separateNonces(standbyKeyFile))
+        rc = SQLITE_CORRUPT;
+    if (rc == SQLITE_OK) {
+        RawFile target(stagedKeyFile, SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+        rc = target.rc();
+        if (rc == SQLITE_OK)
+            rc = target.writeAll(standbyKeyFile);
+        if (rc == SQLITE_OK)
+            rc = target.sync();
+    }
+
+    // replace the database first, like a key rotation. Crypto::recoverRotation() finishes the keyfile when
+    // interrupted in between, so the standby is either old or new.
+    if (rc == SQLITE_OK && std::rename(stagedName.c_str(), mFileName.c_str()) != 0)
+        rc = SQLITE_IOERR;
+    if (rc == SQLITE_OK && std::rename(stagedKeyFile.c_str(), (mFileName + "-keyfile").c_str()) != 0)
+        rc = SQLITE_IOERR;
+    if (rc == SQLITE_OK && !FileWrapper::syncDirectory(mFileName))
+        rc = SQLITE_IOERR_FSYNC;
+
+    if (rc != SQLITE_OK)
+        discard();
+    return rc;
+}
+
+void PageSync::discard() const {
+    // once the database was replaced, the staged keyfile must be kept for Crypto::recoverRotation()
+    std::string stagedName = mFileName + STAGED_SUFFIX;
+    if (FileWrapper::exists(stagedName)) {
+        std::remove(stagedName.c_str());
+        std::remove((stagedName + "-keyfile").c_str());
+    }
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CRYPTOSQLITE_PAGESYNC_H
+#define CRYPTOSQLITE_PAGESYNC_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cryptosqlite/cryptosqlite.h>
+#include <secure_memory/Buffer.h>
+
+class RawFile;
+class ThreadPool;
+
+/**
+ * Brings a standby copy of an encrypted database up to date by transferring only the pages that differ.
+ *
+ * Works on ciphertext, so neither side needs the key: pages that were not written since the copy was made are
+ * identical on disk. The standby sends a signature with a digest of each page, the primary answers with a delta of
+ * the pages whose digest differs, its page count and its keyfile. The standby applies it to a copy of itself, which
+ * then replaces its database and keyfile, so a crash leaves either the old or the new standby. The standby must not
+ * be open while the delta is applied, and the primary must not have an unchecked WAL.
+ */
+class PageSync {
+public:
+    /**
+     * @param fileName Database on this side of the sync
+     * @param pool Pool to compute digests on, the calling thread takes part
+     */
+    PageSync(const std::string &fileName, ThreadPool *pool);
+
+    /**
+     * Standby: writes the digests of its pages
+     *
+     * @return Standard sqlite error code
+     */
+    int signature(sqlite3_sync_write write, void *arg);
+
+    /**
+     * Primary: reads the signature of a standby and writes the delta bringing it up to date
+     *
+     * @return Standard sqlite error code, SQLITE_BUSY if the database has a WAL that was not checkpointed
+     */
+    int delta(sqlite3_sync_read read, void *readArg, sqlite3_sync_write write, void *writeArg);
+
+    /**
+     * Standby: applies a delta
+     *
+     * @return Standard sqlite error code, SQLITE_CORRUPT for a malformed delta
+     */
+    int apply(sqlite3_sync_read read, void *arg);
+
+    /**
+     * Brings a local standby up to date without streams
+     */
+    int copyTo(const std::string &target);
+
+protected:
+    int resolve();
+
+    /**
+     * Reads the keyfile, its page size is 0 if there is no keyfile
+     */
+    int readKeyFile(Buffer &content, uint32_t &pageSize) const;
+
+    /**
+     * @return SQLITE_BUSY if the database has a non-empty WAL, its pages are not all in the database file
+     */
+    int checkWal() const;
+
+    int pageCount(RawFile &file, uint32_t pageSize, uint32_t &count) const;
+    int digests(uint32_t pageSize, uint32_t count, std::vector<uint8_t> &digests) const;
+
+    /**
+     * Copies up to size bytes of the database to the file that receives the pages of a delta
+     */
+    int stage(RawFile &file, sqlite3_int64 size, std::unique_ptr<RawFile> &staged) const;
+
+    /**
+     * Truncates the staged copy to count pages and replaces the database with it, then the keyfile
+     */
+    int finish(std::unique_ptr<RawFile> staged, uint32_t pageSize, uint32_t count, const Buffer &keyFile) const;
+
+    /**
+     * Removes the staged copy of a failed sync
+     */
+    void discard() const;
+
+    std::string mFileName;
+    ThreadPool *mPool;
+};
+
+#endif //CRYPTOSQLITE_PAGESYNC_H
@@ -0,0 +1,439 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include "ParallelScan.h"
+#include "BTreePage.h"
+#include "File.h"
+#include "RawFile.h"
+#include "StripedFile.h"
+#include "../crypto/Crypto.h"
+#include "../csqlite/csqlite.h"
+#include "../util/ThreadPool.h"
+
+namespace {
+    // pages read and decrypted per task
+    const size_t PAGES_PER_TASK = 64;
+    // sqlite refuses deeper B-trees as corrupt, see BTCURSOR_MAX_DEPTH
+    const int MAX_DEPTH = 20;
+    // payloads above SQLITE_MAX_LENGTH can not be stored
+    const uint64_t MAX_PAYLOAD = 0x7fffffff;
+    const int WAL_HEADER_SIZE = 32;
+    // offset of the database header on page 1
+    const uint32_t DB_HEADER_SIZE = 100;
+
+    /**
+     * @return Bytes of a value with the given record serial type, see sqlite file format
+     */
+    uint64_t serialLength(uint64_t type) {
+        static const uint64_t lengths[] = {0, 1, 2, 3, 4, 6, 8, 8, 0, 0, 0, 0};
+        return type < 12 ? lengths[type] : (type - 12) / 2;
+    }
+
+    /**
+     * @return True if a column declared with this type has REAL affinity, see sqlite datatypes
+     */
+    bool isReal(const char *declared) {
+        std::string type = declared ? declared : "";
+        std::transform(type.begin(), type.end(), type.begin(), ::toupper);
+        auto contains = [&type] (const char *part) {
+            return type.find(part) != std::string::npos;
+        };
+
+        if (contains("INT") || contains("CHAR") || contains("CLOB") || contains("TEXT") || contains("BLOB"))
+            return false;
+        return contains("REAL") || contains("FLOA") || contains("DOUB");
+    }
+
+    uint64_t getInteger(const uint8_t *in, uint64_t length) {
+        // sign extend from the first byte
+        uint64_t value = in[0] & 0x80 ? ~uint64_t(0) : 0;
+        for (uint64_t i = 0; i < length; i++)
+            value = (value << 8) | in[i];
+        return value;
+    }
+}
+
+struct ParallelScan::Reader {
+    // pages of a striped database are read from their stripes
+    Reader(const std::string &fileName, bool wal, uint32_t stripes, int pageSize)
+            : db(fileName, SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READONLY, stripes, pageSize) {
+        if (wal)
+            this->wal.reset(new RawFile(fileName + "-wal", SQLITE_OPEN_WAL | SQLITE_OPEN_READONLY));
+    }
+
+    int rc() const {
+        return db.rc() != SQLITE_OK ? db.rc() : wal ? wal->rc() : SQLITE_OK;
+    }
+
+    StripedFile db;
+    std::unique_ptr<RawFile> wal;
+    std::unique_ptr<IDataCrypt> dataCrypt;
+    Buffer pageIn, page, overflow;
+};
+
+ParallelScan::ParallelScan(sqlite3 *db, ThreadPool *pool) : mDB(db), mPool(pool) {
+}
+
+int ParallelScan::run(const char *table, sqlite3_scan_rows callback, void *arg) {
+    mFile = File::fromDatabase(mDB);
+    if (!mFile || !mFile->mCrypto)
+        return SQLITE_ERROR;
+
+    // pages read outside the pager are not verified against the integrity tree
+    if (mFile->mCrypto->hasTree())
+        return SQLITE_MISUSE;
+
+    // without a transaction of the caller, the scan reads in its own
+    bool own = sqlite3_get_autocommit(mDB) != 0;
+    int rc = own ? sqlite3_exec(mDB, "BEGIN", nullptr, nullptr, nullptr) : SQLITE_OK;
+    if (rc != SQLITE_OK)
+        return rc;
+
+    // reading the schema opens the read transaction
+    rc = resolve(table);
+    if (rc == SQLITE_OK)
+        rc = snapshot();
+
+    std::vector<uint32_t> level {mRoot}, children;
+    for (int depth = 0; rc == SQLITE_OK && !level.empty(); depth++) {
+        if (depth >= MAX_DEPTH || level.size() > mPageCount) {
+            rc = SQLITE_CORRUPT;
+            break;
+        }
+
+        children.clear();
+        rc = scanLevel(level, children, callback, arg);
+        level.swap(children);
+    }
+
+    // nothing was written, but do not leave the transaction open
+    if (own)
+        sqlite3_exec(mDB, rc == SQLITE_OK ? "COMMIT" : "ROLLBACK", nullptr, nullptr, nullptr);
+    return rc;
+}
+
+int ParallelScan::resolve(const char *table) {
+    sqlite3_stmt *stmt = nullptr;
+    int rc = sqlite3_prepare_v2(mDB, "SELECT rootpage FROM main.sqlite_master WHERE type = 'table' AND name = ?1 "
+                                     "COLLATE NOCASE", -1, &stmt, nullptr);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, table, -1, SQLITE_TRANSIENT);
+        rc = sqlite3_step(stmt);
+        if (rc == SQLITE_ROW) {
+            // virtual tables have no pages
+            mRoot = static_cast<uint32_t>(sqlite3_column_int64(stmt, 0));
+            rc = mRoot != 0 ? SQLITE_OK : SQLITE_MISUSE;
+        }
+        else if (rc == SQLITE_DONE)
+            rc = SQLITE_NOTFOUND;
+    }
+    sqlite3_finalize(stmt);
+    stmt = nullptr;
+
+    // records hold all columns but virtual generated ones, an INTEGER PRIMARY KEY is stored as NULL
+    if (rc == SQLITE_OK)
+        rc = sqlite3_prepare_v2(mDB, "SELECT type, pk, hidden FROM pragma_table_xinfo(?1, 'main')", -1, &stmt,
+                                nullptr);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, table, -1, SQLITE_TRANSIENT);
+
+        int keys = 0, key = -1;
+        bool integerKey = false;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            if (sqlite3_column_int(stmt, 2) == 2)
+                continue;
+
+            auto type = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+            mReal.push_back(isReal(type));
+            if (sqlite3_column_int(stmt, 1) > 0) {
+                integerKey = type && sqlite3_stricmp(type, "INTEGER") == 0;
+                key = mColumns;
+                keys++;
+            }
+            mColumns++;
+        }
+        mRowidColumn = keys == 1 && integerKey ? key : -1;
+        rc = rc == SQLITE_DONE ? SQLITE_OK : rc;
+    }
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+int ParallelScan::snapshot() {
+    uint32_t maxFrame = 0;
+    int rc = csqlite3_read_snapshot(mDB, 0, &maxFrame);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    // the key is usually loaded by reading the schema, but must not throw to the caller if it was not
+    try {
+        mFile->mCrypto->loadKey();
+    } catch (const std::exception &) {
+        return SQLITE_NOTADB;
+    }
+    mPageSize = static_cast<uint32_t>(mFile->mPageSize);
+    mUsableSize = mPageSize - mFile->mCrypto->reservedSize();
+
+    // logical size over all stripes
+    sqlite3_int64 fileSize = 0;
+    {
+        StripedFile file(mFile->mFileName, SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READONLY, mFile->mCrypto->stripes(),
+                         static_cast<int>(mPageSize));
+        rc = file.rc();
+        if (rc == SQLITE_OK)
+            rc = file.size(&fileSize);
+    }
+    mPageCount = static_cast<uint32_t>(fileSize / mPageSize);
+
+    // later frames of a page replace earlier ones
+    if (rc == SQLITE_OK && maxFrame > 0) {
+        RawFile wal(std::string(mFile->mFileName) + "-wal", SQLITE_OPEN_WAL | SQLITE_OPEN_READONLY);
+        sqlite3_int64 frameSize = SQLITE_WAL_FRAMEHEADER_SIZE + mPageSize;
+        uint8_t frameHeader[4];
+
+        rc = wal.rc();
+        for (uint32_t frame = 1; rc == SQLITE_OK && frame <= maxFrame; frame++) {
+            rc = wal.read(frameHeader, sizeof(frameHeader), WAL_HEADER_SIZE + (frame - 1) * frameSize);
+            uint32_t pageNo = BTreePage::get4byte(frameHeader);
+            mFrames[pageNo] = frame;
+            mPageCount = (std::max)(mPageCount, pageNo);
+        }
+    }
+    return rc;
+}
+
+int ParallelScan::scanLevel(const std::vector<uint32_t> &pages, std::vector<uint32_t> &children,
+                            sqlite3_scan_rows callback, void *arg) {
+    size_t tasks = (pages.size() + PAGES_PER_TASK - 1) / PAGES_PER_TASK;
+    std::vector<std::vector<uint32_t>> taskChildren(tasks);
+    std::atomic<int> error {SQLITE_OK};
+
+    mPool->parallelFor(tasks, [&] (size_t task) {
+        size_t first = task * PAGES_PER_TASK, last = (std::min)(first + PAGES_PER_TASK, pages.size());
+        int rc;
+
+        try {
+            Reader reader(mFile->mFileName, !mFrames.empty(), mFile->mCrypto->stripes(), mPageSize);
+            rc = reader.rc();
+            mFile->mCrypto->makeDataCrypt(reader.dataCrypt);
+            reader.pageIn.padd(mPageSize, 0);
+            reader.page.padd(mPageSize, 0);
+            reader.overflow.padd(mPageSize, 0);
+
+            std::vector<BTreePage::Link> links;
+            for (size_t i = first; rc == SQLITE_OK && i < last && error == SQLITE_OK; i++) {
+                rc = readPage(reader, pages[i], reader.page);
+                if (rc != SQLITE_OK)
+                    break;
+
+                const uint8_t *page = reader.page.const_data();
+                uint8_t type = page[pages[i] == 1 ? DB_HEADER_SIZE : 0];
+                if (type == BTreePage::INTERIOR_TABLE) {
+                    links.clear();
+                    BTreePage::links(page, pages[i], false, mUsableSize, links);
+                    for (auto &link : links)
+                        taskChildren[task].push_back(link.first);
+                }
+                else if (type == BTreePage::LEAF_TABLE)
+                    rc = readLeaf(reader, pages[i], page, callback, arg);
+                else
+                    // WITHOUT ROWID tables are stored as indices
+                    rc = type == BTreePage::INTERIOR_INDEX || type == BTreePage::LEAF_INDEX ? SQLITE_MISUSE
+                                                                                           : SQLITE_CORRUPT;
+            }
+        } catch (const std::exception &) {
+            // no plugin
+            rc = SQLITE_ERROR;
+        }
+
+        if (rc != SQLITE_OK) {
+            int expected = SQLITE_OK;
+            error.compare_exchange_strong(expected, rc);
+        }
+    });
+
+    // children of the next level stay in key order
+    for (auto &list : taskChildren)
+        children.insert(children.end(), list.begin(), list.end());
+    return error;
+}
+
+int ParallelScan::readPage(Reader &reader, uint32_t pageNo, Buffer &page) const {
+    if (pageNo == 0 || pageNo > mPageCount)
+        return SQLITE_CORRUPT;
+
+    int rc;
+    auto frame = mFrames.find(pageNo);
+    if (frame == mFrames.end())
+        rc = reader.db.read(reader.pageIn.data(), mPageSize, (pageNo - 1) * static_cast<sqlite3_int64>(mPageSize));
+    else
+        rc = reader.wal->read(reader.pageIn.data(), mPageSize, WAL_HEADER_SIZE + SQLITE_WAL_FRAMEHEADER_SIZE +
+                (frame->second - 1) * static_cast<sqlite3_int64>(SQLITE_WAL_FRAMEHEADER_SIZE + mPageSize));
+    if (rc != SQLITE_OK)
+        return rc;
+
+    try {
+        mFile->mCrypto->decryptPage(*reader.dataCrypt, reader.pageIn, page, pageNo);
+    } catch (const std::exception &) {
+        // plugin rejected the page
+        return SQLITE_CORRUPT;
+    }
+    return SQLITE_OK;
+}
+
+int ParallelScan::readLeaf(Reader &reader, uint32_t pageNo, const uint8_t *page, sqlite3_scan_rows callback,
+                           void *arg) const {
+    uint32_t header = pageNo == 1 ? DB_HEADER_SIZE : 0;
+    uint32_t pointers = header + 8, cells = BTreePage::get2byte(page + header + 3);
+    if (pointers + 2 * cells > mUsableSize)
+        return SQLITE_CORRUPT;
+
+    // payload sizes above which cells spill to overflow pages, see sqlite file format
+    uint32_t maxLocal = mUsableSize - 35, minLocal = (mUsableSize - 12) * 32 / 255 - 23;
+    const uint8_t *end = page + mUsableSize;
+
+    std::vector<sqlite3_int64> rowids(cells);
+    std::vector<sqlite3_scan_value> values(static_cast<size_t>(cells) * mColumns);
+    // spilled payloads are assembled outside the page, values point into them until the callback returned
+    std::deque<std::vector<uint8_t>> spilled;
+
+    for (uint32_t i = 0; i < cells; i++) {
+        uint32_t offset = BTreePage::get2byte(page + pointers + 2 * i), read;
+        uint64_t payload, rowid;
+        const uint8_t *cell = page + offset;
+        if (offset >= mUsableSize || (read = BTreePage::getVarint(cell, end, payload)) == 0)
+            return SQLITE_CORRUPT;
+        cell += read;
+        if ((read = BTreePage::getVarint(cell, end, rowid)) == 0 || payload > MAX_PAYLOAD)
+            return SQLITE_CORRUPT;
+        cell += read;
+
+        uint64_t local = payload;
+        if (payload > maxLocal) {
+            local = minLocal + (payload - minLocal) % (mUsableSize - 4);
+            if (local > maxLocal)
+                local = minLocal;
+        }
+        if (local + (local < payload ? 4 : 0) > static_cast<uint64_t>(end - cell))
+            return SQLITE_CORRUPT;
+
+        const uint8_t *record = cell;
+        if (local < payload) {
+            spilled.emplace_back(cell, cell + local);
+            int rc = readOverflow(reader, BTreePage::get4byte(cell + local), payload, spilled.back());
+            if (rc != SQLITE_OK)
+                return rc;
+            record = spilled.back().data();
+        }
+
+        rowids[i] = static_cast<sqlite3_int64>(rowid);
+        if (!decode(record, payload, rowids[i], values.data() + static_cast<size_t>(i) * mColumns))
+            return SQLITE_CORRUPT;
+    }
+
+    if (cells > 0 && callback(arg, static_cast<int>(cells), mColumns, rowids.data(), values.data()) != 0)
+        return SQLITE_ABORT;
+    return SQLITE_OK;
+}
+
+int ParallelScan::readOverflow(Reader &reader, uint32_t first, uint64_t size, std::vector<uint8_t> &payload) const {
+    payload.reserve(size);
+
+    // bounded by the payload size, so corrupt chains can not cause a cycle
+    for (uint32_t next = first; payload.size() < size;) {
+        if (next == 0)
+            return SQLITE_CORRUPT;
+
+        int rc = readPage(reader, next, reader.overflow);
+        if (rc != SQLITE_OK)
+            return rc;
+
+        const uint8_t *page = reader.overflow.const_data();
+        auto length = static_cast<size_t>((std::min)(size - payload.size(), uint64_t(mUsableSize - 4)));
+        payload.insert(payload.end(), page + 4, page + 4 + length);
+        next = BTreePage::nextOverflow(page);
+    }
+    return SQLITE_OK;
+}
+
+bool ParallelScan::decode(const uint8_t *record, uint64_t size, sqlite3_int64 rowid,
+                          sqlite3_scan_value *values) const {
+    const uint8_t *end = record + size;
+    uint64_t headerSize;
+    uint32_t read = BTreePage::getVarint(record, end, headerSize);
+    if (read == 0 || headerSize < read || headerSize > size)
+        return false;
+
+    const uint8_t *types = record + read, *typesEnd = record + headerSize, *body = typesEnd;
+    for (int i = 0; i < mColumns; i++) {
+        sqlite3_scan_value &value = values[i];
+        memset(&value, 0, sizeof(value));
+        value.eType = SQLITE_NULL;
+
+        // columns added after the row was written are missing, their defaults are not applied
+        uint64_t type = 0;
+        if (types < typesEnd) {
+            if ((read = BTreePage::getVarint(types, typesEnd, type)) == 0 || type == 10 || type == 11)
+                return false;
+            types += read;
+        }
+
+        uint64_t length = serialLength(type);
+        if (length > static_cast<uint64_t>(end - body))
+            return false;
+
+        if (type >= 1 && type <= 6) {
+            value.eType = SQLITE_INTEGER;
+            value.iValue = static_cast<sqlite3_int64>(getInteger(body, length));
+        }
+        else if (type == 7) {
+            uint64_t bits = getInteger(body, length);
+            value.eType = SQLITE_FLOAT;
+            memcpy(&value.rValue, &bits, sizeof(bits));
+        }
+        else if (type == 8 || type == 9) {
+            value.eType = SQLITE_INTEGER;
+            value.iValue = type - 8;
+        }
+        else if (type >= 12) {
+            value.eType = type % 2 == 0 ? SQLITE_BLOB : SQLITE_TEXT;
+            value.pData = body;
+            value.nData = static_cast<int>(length);
+        }
+        body += length;
+
+        // sqlite stores integral REAL values as integers
+        if (mReal[i] && value.eType == SQLITE_INTEGER) {
+            value.eType = SQLITE_FLOAT;
+            value.rValue = static_cast<double>(value.iValue);
+        }
+        else if (i == mRowidColumn && value.eType == SQLITE_NULL) {
+            value.eType = SQLITE_INTEGER;
+            value.iValue = rowid;
+        }
+    }
+    return true;
+}
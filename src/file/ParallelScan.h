@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CRYPTOSQLITE_PARALLELSCAN_H
+#define CRYPTOSQLITE_PARALLELSCAN_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <cryptosqlite/cryptosqlite.h>
+#include <secure_memory/Buffer.h>
+
+struct File;
+class RawFile;
+class ThreadPool;
+
+/**
+ * Reads all rows of a rowid table without going through the pager, for scans scaling across cores.
+ *
+ * The scan pins a read transaction of the connection: pages of that snapshot are read from the WAL up to its last
+ * frame and from the database file otherwise, neither of which may change while the transaction is open. The B-tree
+ * is walked level by level, all pages of a level are read, decrypted and parsed in parallel, and the rows of each
+ * leaf are handed to the callback as one batch.
+ */
+class ParallelScan {
+public:
+    /**
+     * @param db Connection whose read transaction is scanned
+     * @param pool Pool to read pages on, the calling thread takes part
+     */
+    ParallelScan(sqlite3 *db, ThreadPool *pool);
+
+    /**
+     * Scans a table in the read transaction open on the connection, or in a new one for the duration of the scan
+     *
+     * @return Standard sqlite error code, SQLITE_NOTFOUND for an unknown table, SQLITE_ABORT if the callback returned
+     *         non-zero
+     */
+    int run(const char *table, sqlite3_scan_rows callback, void *arg);
+
+protected:
+    /**
+     * Page source of one task, with its own file handles, plugin instance and buffers
+     */
+    struct Reader;
+
+    int resolve(const char *table);
+    int snapshot();
+    int scanLevel(const std::vector<uint32_t> &pages, std::vector<uint32_t> &children, sqlite3_scan_rows callback,
+                  void *arg);
+
+    int readPage(Reader &reader, uint32_t pageNo, Buffer &page) const;
+
+    /**
+     * Decodes the rows of a decrypted leaf page and hands them to the callback
+     */
+    int readLeaf(Reader &reader, uint32_t pageNo, const uint8_t *page, sqlite3_scan_rows callback, void *arg) const;
+
+    /**
+     * Appends the rest of a payload from its overflow chain
+     */
+    int readOverflow(Reader &reader, uint32_t first, uint64_t size, std::vector<uint8_t> &payload) const;
+
+    /**
+     * Decodes a record into mColumns values pointing into the record
+     */
+    bool decode(const uint8_t *record, uint64_t size, sqlite3_int64 rowid, sqlite3_scan_value *values) const;
+
+    sqlite3 *mDB;
+    ThreadPool *mPool;
+    File *mFile = nullptr;
+
+    uint32_t mRoot = 0;
+    int mColumns = 0;
+    // column aliasing the rowid, stored as NULL in records
+    int mRowidColumn = -1;
+    // columns with REAL affinity
+    std::vector<bool> mReal;
+
+    uint32_t mPageSize = 0;
+    uint32_t mUsableSize = 0;
+    uint32_t mPageCount = 0;
+    // last frame of each page in the WAL of the snapshot
+    std::unordered_map<uint32_t, uint32_t> mFrames;
+};
+
+#endif //CRYPTOSQLITE_PARALLELSCAN_H
@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <cryptosqlite/cryptosqlite.h>
+#include "Prefetcher.h"
+#include "BTreePage.h"
+#include "StripedFile.h"
+#include "../crypto/Crypto.h"
+#include "../util/ThreadPool.h"
+
+namespace {
+    // bounds for the known overflow and interior pages, they are cleared when reached
+    const size_t MAX_OVERFLOW_PAGES = 65536;
+    const size_t MAX_INTERIOR_PAGES = 4096;
+}
+
+std::atomic<uint32_t> Prefetcher::sDepth {0};
+std::atomic<uint32_t> Prefetcher::sSiblingDepth {0};
+std::atomic<uint64_t> Prefetcher::sRead {0}, Prefetcher::sUsed {0};
+
+Prefetcher::Prefetcher(const std::string &fileName, int pageSize, Crypto *crypto, ThreadPool *pool)
+        : mFileName(fileName), mPageSize(pageSize), mCrypto(crypto), mPool(pool) {
+    MemoryBudget::instance()->addConsumer(this, MemoryBudget::PRIORITY_READAHEAD);
+}
+
+Prefetcher::~Prefetcher() {
+    MemoryBudget::instance()->removeConsumer(this);
+
+    // workers use the crypto state of the connection. a read that did not start yet is removed from the queue, as
+    // waiting for it would deadlock when closing on a worker of the same pool.
+    std::unique_lock<std::mutex> lock(mMutex);
+    mEpoch++;
+    if (mReading && mPool->cancel(mTask))
+        mReading = false;
+    mIdle.wait(lock, [this] { return !mReading; });
+    dropPages();
+}
+
+bool Prefetcher::take(uint32_t pageNo, Buffer &page) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mPages.find(pageNo);
+    if (it == mPages.end())
+        return false;
+
+    page.write(it->second, 0);
+    it->second.clear(true);
+    mPages.erase(it);
+    MemoryBudget::instance()->release(mPageSize, MemoryBudget::PRIORITY_READAHEAD);
+    sUsed++;
+    return true;
+}
+
+void Prefetcher::observe(uint32_t pageNo, const uint8_t *page) {
+    // read-ahead was disabled since the connection was opened, the page is not parsed
+    if (sDepth == 0 && sSiblingDepth == 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    // hints only, a page may have been reused since
+    if (mOverflow.count(pageNo))
+        return followChain(page);
+
+    std::vector<BTreePage::Link> links;
+    BTreePage::links(page, pageNo, false, mPageSize - mCrypto->reservedSize(), links);
+    learn(pageNo, links);
+
+    if (sSiblingDepth > 0)
+        readSiblings(pageNo);
+}
+
+void Prefetcher::invalidate() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mEpoch++;
+    dropPages();
+}
+
+void Prefetcher::shrink(size_t) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    dropPages();
+}
+
+void Prefetcher::learn(uint32_t pageNo, const std::vector<BTreePage::Link> &links) {
+    std::vector<uint32_t> children;
+    for (auto &link : links) {
+        // remember where overflow chains start, reading them is up to sqlite
+        if (link.second) {
+            if (mOverflow.size() >= MAX_OVERFLOW_PAGES)
+                mOverflow.clear();
+            mOverflow.insert(link.first);
+        }
+        else if (sSiblingDepth > 0)
+            children.push_back(link.first);
+    }
+
+    // interior page, remember its children in key order
+    if (!children.empty()) {
+        if (mChildren.size() >= MAX_INTERIOR_PAGES) {
+            mChildren.clear();
+            mParents.clear();
+        }
+        for (uint32_t child : children)
+            mParents[child] = pageNo;
+        mChildren[pageNo] = std::move(children);
+    }
+}
+
+void Prefetcher::followChain(const uint8_t *page) {
+    // sqlite follows a chain, skip the pages already decrypted ahead of it
+    uint32_t next = BTreePage::nextOverflow(page), ahead = 0;
+    if (next != 0)
+        mOverflow.insert(next);
+    for (auto it = mPages.end(); next != 0 && (it = mPages.find(next)) != mPages.end(); ahead++)
+        next = BTreePage::nextOverflow(it->second.const_data());
+
+    // refill once half of the read-ahead was consumed
+    uint32_t depth = sDepth;
+    if (depth > 0 && next != 0 && ahead <= depth / 2)
+        submit({next}, depth - ahead - 1);
+}
+
+void Prefetcher::readSiblings(uint32_t pageNo) {
+    auto parent = mParents.find(pageNo);
+    if (parent == mParents.end())
+        return;
+    auto children = mChildren.find(parent->second);
+    if (children == mChildren.end())
+        return;
+
+    const std::vector<uint32_t> &siblings = children->second;
+    auto it = std::find(siblings.begin(), siblings.end(), pageNo);
+    if (it == siblings.end())
+        return;
+    auto index = static_cast<int64_t>(it - siblings.begin());
+
+    // scans move backwards if sqlite went to an earlier child of the same parent
+    int64_t direction = parent->second == mLastParent && index < mLastIndex ? -1 : 1;
+    mLastParent = parent->second;
+    mLastIndex = index;
+
+    uint32_t depth = sSiblingDepth, ahead = 0;
+    std::vector<uint32_t> pages;
+    for (int64_t i = index + direction; i >= 0 && i < static_cast<int64_t>(siblings.size()) &&
+                                        std::abs(i - index) <= depth; i += direction) {
+        if (mPages.count(siblings[i]))
+            ahead++;
+        else
+            pages.push_back(siblings[i]);
+    }
+
+    if (!pages.empty() && ahead <= depth / 2)
+        submit(std::move(pages), 0);
+}
+
+void Prefetcher::submit(std::vector<uint32_t> pages, uint32_t chainLength) {
+    // one read per connection at a time
+    if (mReading)
+        return;
+
+    mReading = true;
+    uint64_t epoch = mEpoch;
+    mTask = mPool->submit([this, pages, chainLength, epoch] {
+        readPages(pages, chainLength, epoch);
+    });
+}
+
+void Prefetcher::readPages(const std::vector<uint32_t> &pages, uint32_t chainLength, uint64_t epoch) {
+    try {
+        // own file handle, plugin instance and buffers, the connection may read concurrently
+        StripedFile file(mFileName, SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READONLY, mCrypto->stripes(), mPageSize);
+        std::unique_ptr<IDataCrypt> dataCrypt;
+        mCrypto->makeDataCrypt(dataCrypt);
+
+        Buffer pageIn, pageOut;
+        pageIn.padd(mPageSize, 0);
+        pageOut.padd(mPageSize, 0);
+
+        size_t index = 0;
+        uint32_t pageNo = 0, next = 0;
+        while (file.rc() == SQLITE_OK) {
+            // the listed pages, then the overflow chain continuing after the last one
+            if (index < pages.size())
+                pageNo = pages[index++];
+            else if (chainLength > 0 && next != 0) {
+                pageNo = next;
+                chainLength--;
+            }
+            else
+                break;
+
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                if (epoch != mEpoch)
+                    break;
+
+                auto cached = mPages.find(pageNo);
+                if (cached != mPages.end()) {
+                    next = BTreePage::nextOverflow(cached->second.const_data());
+                    continue;
+                }
+            }
+            if (!MemoryBudget::instance()->acquire(mPageSize, MemoryBudget::PRIORITY_READAHEAD, this))
+                break;
+
+            bool read = file.read(pageIn.data(), mPageSize, (pageNo - 1) * static_cast<sqlite3_int64>(mPageSize))
+                        == SQLITE_OK;
+            try {
+                if (read)
+                    mCrypto->decryptPage(*dataCrypt, pageIn, pageOut, pageNo);
+            } catch (const std::exception &) {
+                // left to sqlite, which reports the error
+                read = false;
+            }
+
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (!read || epoch != mEpoch) {
+                MemoryBudget::instance()->release(mPageSize, MemoryBudget::PRIORITY_READAHEAD);
+                break;
+            }
+
+            mPages[pageNo].write(pageOut, 0);
+            sRead++;
+            next = BTreePage::nextOverflow(pageOut.const_data());
+            if (chainLength > 0 && next != 0)
+                mOverflow.insert(next);
+        }
+    } catch (const std::exception &) {
+        // no plugin, nothing is prefetched
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    mReading = false;
+    mIdle.notify_all();
+}
+
+void Prefetcher::dropPages() {
+    for (auto &page : mPages)
+        page.second.clear(true);
+    MemoryBudget::instance()->release(mPages.size() * mPageSize, MemoryBudget::PRIORITY_READAHEAD);
+    mPages.clear();
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRYPTOSQLITE_PREFETCHER_H
+#define CRYPTOSQLITE_PREFETCHER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <secure_memory/Buffer.h>
+#include "BTreePage.h"
+#include "../memory/MemoryBudget.h"
+
+class Crypto;
+class ThreadPool;
+
+/**
+ * Reads and decrypts pages of the main db ahead of sqlite on a thread pool.
+ *
+ * sqlite learns the next page of an overflow chain only after the current one was decrypted, so I/O and decryption
+ * of large values never overlap. The prefetcher learns which pages start overflow chains from the B-tree pages sqlite
+ * reads, and once sqlite reads an overflow page it follows the chain on a worker, keeping up to depth() pages
+ * decrypted ahead. Optionally, it also remembers the children of interior pages, and once sqlite descends into one
+ * of them it reads up to siblingDepth() of the following children in scan direction. Prefetched pages are handed out
+ * once. All of them are dropped whenever the file may have changed,
+ * which is at the start of every read transaction and on every write.
+ */
+class Prefetcher : public MemoryBudget::Consumer {
+public:
+    /**
+     * @param fileName Main db file name
+     * @param pageSize Page size of the main db
+     */
+    Prefetcher(const std::string &fileName, int pageSize, Crypto *crypto, ThreadPool *pool);
+    ~Prefetcher() override;
+
+    int pageSize() const {
+        return mPageSize;
+    }
+
+    /**
+     * @param pages Pages to read ahead of sqlite per connection, 0 disables read-ahead of new connections (default)
+     */
+    static void setDepth(uint32_t pages) {
+        sDepth = pages;
+    }
+    static uint32_t depth() {
+        return sDepth;
+    }
+
+    /**
+     * @param pages Sibling pages to read ahead of B-tree scans per connection, 0 disables it (default)
+     */
+    static void setSiblingDepth(uint32_t pages) {
+        sSiblingDepth = pages;
+    }
+    static uint32_t siblingDepth() {
+        return sSiblingDepth;
+    }
+
+    /**
+     * @param read Pages read and decrypted ahead of sqlite by all connections since the process started
+     * @param used Pages of those that sqlite read afterwards
+     */
+    static void stats(uint64_t &read, uint64_t &used) {
+        read = sRead;
+        used = sUsed;
+    }
+
+    /**
+     * Moves a prefetched page to page and forgets it
+     *
+     * @return True if the page was prefetched
+     */
+    bool take(uint32_t pageNo, Buffer &page);
+
+    /**
+     * Learns from a full plaintext page read by sqlite and schedules read-ahead
+     */
+    void observe(uint32_t pageNo, const uint8_t *page);
+
+    /**
+     * Drops all prefetched pages, including those of running reads
+     */
+    void invalidate();
+
+    void shrink(size_t bytes) override;
+
+protected:
+    /* called with mMutex held */
+    void learn(uint32_t pageNo, const std::vector<BTreePage::Link> &links);
+    void followChain(const uint8_t *page);
+    void readSiblings(uint32_t pageNo);
+    void submit(std::vector<uint32_t> pages, uint32_t chainLength);
+    void dropPages();
+
+    /**
+     * Worker reading the given pages, then following the overflow chain of the last one for chainLength pages
+     */
+    void readPages(const std::vector<uint32_t> &pages, uint32_t chainLength, uint64_t epoch);
+
+    std::string mFileName;
+    int mPageSize;
+    Crypto *mCrypto;
+    ThreadPool *mPool;
+
+    std::mutex mMutex;
+    std::condition_variable mIdle;
+    // decrypted pages, pages known to belong to overflow chains
+    std::unordered_map<uint32_t, Buffer> mPages;
+    std::unordered_set<uint32_t> mOverflow;
+    // children of interior pages in key order, parent of each child, last child sqlite descended into
+    std::unordered_map<uint32_t, std::vector<uint32_t>> mChildren;
+    std::unordered_map<uint32_t, uint32_t> mParents;
+    uint32_t mLastParent = 0;
+    int64_t mLastIndex = 0;
+    // incremented by invalidate(), results of older reads are discarded
+    uint64_t mEpoch = 0;
+    // a read is queued or running, id of the queued task
+    bool mReading = false;
+    uint64_t mTask = 0;
+
+    static std::atomic<uint32_t> sDepth;
+    static std::atomic<uint32_t> sSiblingDepth;
+    static std::atomic<uint64_t> sRead, sUsed;
+};
+
+#endif //CRYPTOSQLITE_PREFETCHER_H
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include "RawFile.h"
+#include "../csqlite/csqlite.h"
+#include "../vfs/VFS.h"
+
+namespace {
+    // lock attempts and delay between them in milliseconds
+    const int LOCK_RETRIES = 5000;
+    const int LOCK_RETRY_DELAY = 1;
+    // VFS implementations only expect requests up to the maximum page size
+    const int MAX_IO_SIZE = 65536;
+}
+
+RawFile::RawFile(const std::string &fileName, int flags) : mVFS(VFS::instance()->underlying()) {
+    mName = sqlite3_create_filename(fileName.c_str(), "", "", 0, nullptr);
+    mFile = static_cast<sqlite3_file *>(sqlite3_malloc(mVFS->szOsFile));
+    if (!mName || !mFile)
+        return;
+
+    memset(mFile, 0, mVFS->szOsFile);
+    mRc = mVFS->xOpen(mVFS, mName, mFile, flags, nullptr);
+}
+
+RawFile::~RawFile() {
+    if (mLocked)
+        unlock();
+    if (mFile && mFile->pMethods)
+        mFile->pMethods->xClose(mFile);
+    sqlite3_free(mFile);
+    sqlite3_free_filename(mName);
+}
+
+int RawFile::size(sqlite3_int64 *size) {
+    return mFile->pMethods->xFileSize(mFile, size);
+}
+
+int RawFile::read(void *buffer, int count, sqlite3_int64 offset) {
+    int rc = SQLITE_OK;
+    for (int done = 0; rc == SQLITE_OK && done < count; done += MAX_IO_SIZE) {
+        int size = (std::min)(count - done, MAX_IO_SIZE);
+        rc = mFile->pMethods->xRead(mFile, static_cast<uint8_t *>(buffer) + done, size, offset + done);
+    }
+    return rc;
+}
+
+int RawFile::write(const void *buffer, int count, sqlite3_int64 offset) {
+    int rc = SQLITE_OK;
+    for (int done = 0; rc == SQLITE_OK && done < count; done += MAX_IO_SIZE) {
+        int size = (std::min)(count - done, MAX_IO_SIZE);
+        rc = mFile->pMethods->xWrite(mFile, static_cast<const uint8_t *>(buffer) + done, size, offset + done);
+    }
+    return rc;
+}
+
+int RawFile::truncate(sqlite3_int64 size) {
+    return mFile->pMethods->xTruncate(mFile, size);
+}
+
+int RawFile::sync() {
+    return mFile->pMethods->xSync(mFile, SQLITE_SYNC_NORMAL);
+}
+
+int RawFile::readAll(Buffer &contents) {
+    sqlite3_int64 fileSize = 0;
+    int rc = size(&fileSize);
+
+    contents.clear();
+    if (rc == SQLITE_OK && fileSize > 0) {
+        contents.padd(static_cast<uint32_t>(fileSize), 0);
+        rc = read(contents.data(), static_cast<int>(fileSize), 0);
+    }
+    return rc;
+}
+
+int RawFile::writeAll(const Buffer &contents) {
+    int rc = write(contents.const_data(), static_cast<int>(contents.size()), 0);
+    if (rc == SQLITE_OK)
+        rc = truncate(contents.size());
+    return rc;
+}
+
+int RawFile::lock(bool exclusive) {
+    int rc = SQLITE_BUSY;
+    for (int i = 0; i < LOCK_RETRIES && rc == SQLITE_BUSY; i++) {
+        rc = mFile->pMethods->xLock(mFile, SQLITE_LOCK_SHARED);
+        if (rc == SQLITE_OK && exclusive) {
+            rc = mFile->pMethods->xLock(mFile, SQLITE_LOCK_EXCLUSIVE);
+            if (rc != SQLITE_OK)
+                mFile->pMethods->xUnlock(mFile, SQLITE_LOCK_NONE);
+        }
+
+        if (rc == SQLITE_BUSY)
+            sqlite3_sleep(LOCK_RETRY_DELAY);
+    }
+
+    mLocked = rc == SQLITE_OK;
+    return rc;
+}
+
+void RawFile::unlock() {
+    mFile->pMethods->xUnlock(mFile, SQLITE_LOCK_NONE);
+    mLocked = false;
+}
+
+int RawFile::handle() const {
+    return csqlite3_file_handle(mVFS, mFile);
+}
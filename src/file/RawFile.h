@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRYPTOSQLITE_RAWFILE_H
+#define CRYPTOSQLITE_RAWFILE_H
+
+#include <string>
+#include <secure_memory/Buffer.h>
+
+extern "C" {
+#include <sqlite3.h>
+};
+
+/**
+ * File opened through the underlying VFS, bypassing encryption.
+ *
+ * Using the VFS instead of plain descriptors keeps the POSIX locks of other connections to the same file intact and
+ * provides portable byte-range locking between processes.
+ */
+class RawFile {
+public:
+    /**
+     * @param fileName File name
+     * @param flags SQLITE_OPEN_* flags, including the file type
+     */
+    RawFile(const std::string &fileName, int flags);
+    ~RawFile();
+
+    RawFile(const RawFile &) = delete;
+    RawFile &operator=(const RawFile &) = delete;
+
+    /**
+     * @return Result code of opening the file
+     */
+    int rc() const {
+        return mRc;
+    }
+
+    int size(sqlite3_int64 *size);
+    int read(void *buffer, int count, sqlite3_int64 offset);
+    int write(const void *buffer, int count, sqlite3_int64 offset);
+    int truncate(sqlite3_int64 size);
+    int sync();
+
+    /**
+     * Reads the whole file
+     */
+    int readAll(Buffer &contents);
+
+    /**
+     * Replaces the file contents
+     */
+    int writeAll(const Buffer &contents);
+
+    /**
+     * Takes a shared or exclusive lock, waiting while other processes hold a conflicting one
+     *
+     * @return Standard sqlite error code, SQLITE_BUSY if the lock could not be taken in time
+     */
+    int lock(bool exclusive);
+    void unlock();
+
+    /**
+     * @return Operating system descriptor of the file, -1 if the underlying VFS does not use descriptors. It must not
+     *         be closed, that would release the POSIX locks of all connections to the file.
+     */
+    int handle() const;
+
+protected:
+    sqlite3_vfs *mVFS;
+    sqlite3_filename mName = nullptr;
+    sqlite3_file *mFile = nullptr;
+    int mRc = SQLITE_NOMEM;
+    bool mLocked = false;
+};
+
+#endif //CRYPTOSQLITE_RAWFILE_H
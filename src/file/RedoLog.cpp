@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <climits>
+#include <cstring>
+#include "RedoLog.h"
+#include "RawFile.h"
+#include "../crypto/Crypto.h"
+#include "../crypto/FileWrapper.h"
+#include "../memory/MemoryBudget.h"
+
+namespace {
+    const char REDO_MAGIC[] = "cSQLredo";
+    const size_t MAGIC_SIZE = 8;
+    // magic, page size, page count and checksum, followed by the page numbers and the pages
+    const size_t HEADER_SIZE = MAGIC_SIZE + 4 + 4 + 8;
+
+    void put32(uint8_t *out, uint32_t value) {
+        for (int i = 0; i < 4; i++)
+            out[i] = static_cast<uint8_t>(value >> (24 - 8 * i));
+    }
+
+    uint32_t get32(const uint8_t *in) {
+        return (uint32_t(in[0]) << 24) | (uint32_t(in[1]) << 16) | (uint32_t(in[2]) << 8) | in[3];
+    }
+
+    // FNV-1a, detects a log torn by a crash while writing it
+    uint64_t checksum(uint64_t hash, const uint8_t *data, size_t size) {
+        for (size_t i = 0; i < size; i++)
+            hash = (hash ^ data[i]) * 0x100000001b3ull;
+        return hash;
+    }
+
+    const uint64_t CHECKSUM_INIT = 0xcbf29ce484222325ull;
+}
+
+RedoLog::RedoLog(const std::string &dbFileName, bool readOnly)
+        : mFileName(dbFileName + "-redo"), mReadOnly(readOnly) {
+}
+
+RedoLog::~RedoLog() {
+    rollback();
+}
+
+void RedoLog::begin() {
+    rollback();
+    mActive = true;
+}
+
+void RedoLog::add(const void *page, uint32_t pageSize, int pageNo, bool plaintext) {
+    mPageSize = pageSize;
+    mPageNos.push_back(pageNo);
+    mPlaintext.push_back(plaintext);
+    // buffers are never refused, the budget shrinks caches instead
+    MemoryBudget::instance()->acquire(pageSize, MemoryBudget::PRIORITY_BUFFER);
+    mPages.insert(mPages.end(), static_cast<const uint8_t *>(page), static_cast<const uint8_t *>(page) + pageSize);
+}
+
+int RedoLog::commit(sqlite3_file *db, Crypto &crypto, ThreadPool *pool) {
+    mActive = false;
+    auto count = static_cast<uint32_t>(mPageNos.size());
+    if (count == 0)
+        return SQLITE_OK;
+    // too large for a single write, sqlite retries with its journal
+    if (mPages.size() > INT_MAX) {
+        rollback();
+        return SQLITE_IOERR_WRITE;
+    }
+
+    try {
+        crypto.encryptPages(pool, mPages.data(), mPageSize, mPageNos, mPlaintext);
+    } catch (const std::exception &) {
+        rollback();
+        return SQLITE_IOERR_WRITE;
+    }
+
+    std::vector<uint8_t> header(HEADER_SIZE + count * 4);
+    memcpy(header.data(), REDO_MAGIC, MAGIC_SIZE);
+    put32(&header[MAGIC_SIZE], mPageSize);
+    put32(&header[MAGIC_SIZE + 4], count);
+    for (uint32_t i = 0; i < count; i++)
+        put32(&header[HEADER_SIZE + i * 4], static_cast<uint32_t>(mPageNos[i]));
+
+    uint64_t hash = checksum(CHECKSUM_INIT, &header[HEADER_SIZE], count * 4);
+    hash = checksum(hash, mPages.data(), mPages.size());
+    put32(&header[MAGIC_SIZE + 8], static_cast<uint32_t>(hash >> 32));
+    put32(&header[MAGIC_SIZE + 12], static_cast<uint32_t>(hash));
+
+    // the transaction is committed once its log is durable
+    int rc = open(true);
+    mPending = true;
+    if (rc == SQLITE_OK)
+        rc = mFile->write(header.data(), static_cast<int>(header.size()), 0);
+    if (rc == SQLITE_OK)
+        rc = mFile->write(mPages.data(), static_cast<int>(mPages.size()), static_cast<sqlite3_int64>(header.size()));
+    if (rc == SQLITE_OK)
+        rc = mFile->sync();
+    if (rc != SQLITE_OK) {
+        // the database is untouched, sqlite retries with its journal
+        checkpoint();
+        rollback();
+        return (rc & 0xff) == SQLITE_IOERR ? rc : SQLITE_IOERR_WRITE;
+    }
+
+    // a failure from here on leaves the log to be written again by recovery
+    for (uint32_t i = 0; rc == SQLITE_OK && i < count; i++)
+        rc = db->pMethods->xWrite(db, &mPages[static_cast<size_t>(i) * mPageSize], static_cast<int>(mPageSize),
+                                  static_cast<sqlite3_int64>(mPageNos[i] - 1) * mPageSize);
+    rollback();
+    return rc;
+}
+
+void RedoLog::rollback() {
+    mActive = false;
+    MemoryBudget::instance()->release(mPages.size(), MemoryBudget::PRIORITY_BUFFER);
+    mPageNos.clear();
+    mPlaintext.clear();
+    mPages.clear();
+    mPages.shrink_to_fit();
+}
+
+int RedoLog::checkpoint() {
+    if (!mPending)
+        return SQLITE_OK;
+
+    int rc = mFile->truncate(0);
+    if (rc == SQLITE_OK)
+        rc = mFile->sync();
+    if (rc == SQLITE_OK)
+        mPending = false;
+    return rc;
+}
+
+int RedoLog::recover(sqlite3_file *db, Crypto &crypto) {
+    // without a log file there is nothing to do, once it exists it is kept open to check its size
+    if (!mFile && !FileWrapper::exists(mFileName))
+        return SQLITE_OK;
+    if (!mFile && open(false) != SQLITE_OK)
+        return SQLITE_OK;
+
+    sqlite3_int64 size = 0;
+    int rc = mFile->size(&size);
+    if (rc != SQLITE_OK || size == 0)
+        return rc;
+    if (mReadOnly)
+        return SQLITE_READONLY_ROLLBACK;
+
+    // the crashed writer released its locks, readers of the database must not see it half written
+    rc = db->pMethods->xLock(db, SQLITE_LOCK_EXCLUSIVE);
+    if (rc == SQLITE_OK) {
+        // another connection may have recovered in the meantime
+        rc = mFile->size(&size);
+        if (rc == SQLITE_OK && size > 0)
+            rc = replay(db, crypto, size);
+    }
+    db->pMethods->xUnlock(db, SQLITE_LOCK_SHARED);
+    return rc;
+}
+
+int RedoLog::open(bool create) {
+    if (mFile)
+        return SQLITE_OK;
+
+    int flags = mReadOnly ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE | (create ? SQLITE_OPEN_CREATE : 0);
+    std::unique_ptr<RawFile> file(new RawFile(mFileName, flags | SQLITE_OPEN_MAIN_JOURNAL));
+    int rc = file->rc();
+    if (rc == SQLITE_OK)
+        mFile = std::move(file);
+    return rc;
+}
+
+int RedoLog::replay(sqlite3_file *db, Crypto &crypto, sqlite3_int64 size) {
+    uint8_t header[HEADER_SIZE] = {};
+    int rc = size >= static_cast<sqlite3_int64>(HEADER_SIZE) ? mFile->read(header, HEADER_SIZE, 0) : SQLITE_OK;
+
+    // a log is complete if its checksum matches, otherwise the crash happened before the database was written
+    uint32_t pageSize = get32(header + MAGIC_SIZE), count = get32(header + MAGIC_SIZE + 4);
+    bool valid = rc == SQLITE_OK && size >= static_cast<sqlite3_int64>(HEADER_SIZE) &&
+                 memcmp(header, REDO_MAGIC, MAGIC_SIZE) == 0 && pageSize >= 512 && pageSize <= 65536 &&
+                 (pageSize & (pageSize - 1)) == 0 &&
+                 static_cast<uint64_t>(count) * (4 + pageSize) <= INT_MAX &&
+                 size >= static_cast<sqlite3_int64>(HEADER_SIZE) + static_cast<sqlite3_int64>(count) * (4 + pageSize);
+
+    std::vector<uint8_t> contents;
+    if (valid) {
+        contents.resize(static_cast<size_t>(count) * (4 + pageSize));
+        rc = mFile->read(contents.data(), static_cast<int>(contents.size()), HEADER_SIZE);
+        uint64_t hash = (static_cast<uint64_t>(get32(header + MAGIC_SIZE + 8)) << 32) | get32(header + MAGIC_SIZE + 12);
+        valid = rc == SQLITE_OK && checksum(CHECKSUM_INIT, contents.data(), contents.size()) == hash;
+        for (uint32_t i = 0; valid && i < count; i++)
+            valid = get32(&contents[i * 4]) != 0;
+    }
+
+    // the interrupted commit may not have saved the tree, so it learns the pages like from a regular write
+    const uint8_t *pages = contents.data() + static_cast<size_t>(count) * 4;
+    for (uint32_t i = 0; valid && rc == SQLITE_OK && i < count; i++) {
+        auto pageNo = static_cast<int>(get32(&contents[i * 4]));
+        const uint8_t *page = pages + static_cast<size_t>(i) * pageSize;
+        rc = db->pMethods->xWrite(db, page, static_cast<int>(pageSize), static_cast<sqlite3_int64>(pageNo - 1) * pageSize);
+        try {
+            if (rc == SQLITE_OK)
+                crypto.updatePage(page, pageSize, pageNo);
+        } catch (const std::exception &) {
+            rc = SQLITE_IOERR_WRITE;
+        }
+    }
+    if (valid && rc == SQLITE_OK)
+        rc = db->pMethods->xSync(db, SQLITE_SYNC_NORMAL);
+    if (valid && rc == SQLITE_OK) {
+        try {
+            crypto.syncTree();
+        } catch (const std::exception &) {
+            rc = SQLITE_IOERR_FSYNC;
+        }
+    }
+
+    if (rc == SQLITE_OK) {
+        mPending = true;
+        rc = checkpoint();
+    }
+    return rc;
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CRYPTOSQLITE_REDOLOG_H
+#define CRYPTOSQLITE_REDOLOG_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <sqlite3.h>
+};
+
+class Crypto;
+class RawFile;
+class ThreadPool;
+
+/**
+ * Makes the pages of a rollback mode transaction atomic without a rollback journal, see SQLITE_IOCAP_BATCH_ATOMIC.
+ *
+ * sqlite keeps the journal in memory and hands the pages of the transaction to the database between
+ * SQLITE_FCNTL_BEGIN_ATOMIC_WRITE and SQLITE_FCNTL_COMMIT_ATOMIC_WRITE. They are collected here and encrypted
+ * concurrently at commit. Their ciphertext is written to <db>-redo and synced in one go, then to the database. The log
+ * is emptied once the database is synced. A complete log left by a crash is written into the database again before
+ * the next transaction reads it, an incomplete one is discarded as the database was not touched yet.
+ *
+ * Batches are opt-in per connection, and only connections writing batches look for a log left by a crash. A database
+ * written with batches must therefore always be opened with them. The pages of a batch are held twice until commit,
+ * by sqlite's journal and here, and are charged to the MemoryBudget as buffers.
+ */
+class RedoLog {
+public:
+    /**
+     * @param readOnly The database is opened read-only, a log left by a crash is reported instead of written
+     */
+    RedoLog(const std::string &dbFileName, bool readOnly);
+    ~RedoLog();
+
+    /**
+     * Starts collecting the pages of a transaction
+     */
+    void begin();
+    bool active() const {
+        return mActive;
+    }
+
+    /**
+     * Buffers the plaintext of a page of the transaction
+     *
+     * @param plaintext Store the page without encryption, see Crypto::encryptPage()
+     */
+    void add(const void *page, uint32_t pageSize, int pageNo, bool plaintext);
+
+    /**
+     * Encrypts the collected pages on the pool, logs them and writes them into the database
+     *
+     * @return Standard sqlite error code, an SQLITE_IOERR lets sqlite fall back to its journal
+     */
+    int commit(sqlite3_file *db, Crypto &crypto, ThreadPool *pool);
+    void rollback();
+
+    /**
+     * Empties the log of a commit, after the database has been synced. Also called before the database is written
+     * without the log.
+     */
+    int checkpoint();
+
+    /**
+     * Writes a complete log left by an interrupted commit into the database, called with a shared lock on it. The
+     * pages are entered into the integrity tree of the database, which the interrupted commit may not have saved.
+     *
+     * @return Standard sqlite error code, SQLITE_BUSY if other connections are reading the database,
+     * SQLITE_READONLY_ROLLBACK if there is a log but the database is read-only
+     */
+    int recover(sqlite3_file *db, Crypto &crypto);
+
+protected:
+    int open(bool create);
+    int replay(sqlite3_file *db, Crypto &crypto, sqlite3_int64 size);
+
+    std::string mFileName;
+    bool mReadOnly;
+    std::unique_ptr<RawFile> mFile;
+
+    bool mActive = false;
+    // the log may hold a commit
+    bool mPending = false;
+    uint32_t mPageSize = 0;
+    std::vector<int> mPageNos;
+    std::vector<bool> mPlaintext;
+    std::vector<uint8_t> mPages;
+};
+
+#endif //CRYPTOSQLITE_REDOLOG_H
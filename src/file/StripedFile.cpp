@@ -0,0 +1,276 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include "StripedFile.h"
+#include "RawFile.h"
+#include "../crypto/FileWrapper.h"
+#include "../util/ThreadPool.h"
+
+#define STRIPED(f) reinterpret_cast<StripedFile::Handle *>(f)->striped
+#define STRIPED_FORWARD(f, fn, ...) STRIPED(f)->first()->pMethods->fn(STRIPED(f)->first(), ## __VA_ARGS__)
+
+namespace {
+    int sIoClose(sqlite3_file *pFile) {
+        StripedFile *file = STRIPED(pFile);
+        int rc = file->close();
+        delete file;
+        return rc;
+    }
+    int sIoRead(sqlite3_file *pFile, void *buffer, int count, sqlite3_int64 offset) {
+        return STRIPED(pFile)->read(buffer, count, offset);
+    }
+    int sIoWrite(sqlite3_file *pFile, const void *buffer, int count, sqlite3_int64 offset) {
+        return STRIPED(pFile)->write(buffer, count, offset);
+    }
+    int sIoTruncate(sqlite3_file *pFile, sqlite3_int64 size) {
+        return STRIPED(pFile)->truncate(size);
+    }
+    int sIoSync(sqlite3_file *pFile, int flags) {
+        return STRIPED(pFile)->sync(flags);
+    }
+    int sIoFileSize(sqlite3_file *pFile, sqlite3_int64 *pSize) {
+        return STRIPED(pFile)->size(pSize);
+    }
+    int sIoLock(sqlite3_file *pFile, int lock) {
+        return STRIPED_FORWARD(pFile, xLock, lock);
+    }
+    int sIoUnlock(sqlite3_file *pFile, int lock) {
+        return STRIPED_FORWARD(pFile, xUnlock, lock);
+    }
+    int sIoCheckReservedLock(sqlite3_file *pFile, int *pResOut) {
+        return STRIPED_FORWARD(pFile, xCheckReservedLock, pResOut);
+    }
+    int sIoFileControl(sqlite3_file *pFile, int op, void *pArg) {
+        // the lengths of the stripes make up the size of the database, space allocated ahead would count as pages
+        if (op == SQLITE_FCNTL_CHUNK_SIZE || op == SQLITE_FCNTL_SIZE_HINT)
+            return SQLITE_NOTFOUND;
+        return STRIPED_FORWARD(pFile, xFileControl, op, pArg);
+    }
+    int sIoSectorSize(sqlite3_file *pFile) {
+        return STRIPED_FORWARD(pFile, xSectorSize);
+    }
+    int sIoDeviceCharacteristics(sqlite3_file *pFile) {
+        return STRIPED_FORWARD(pFile, xDeviceCharacteristics);
+    }
+    int sIoShmMap(sqlite3_file *pFile, int iPg, int pgsz, int map, void volatile **p) {
+        return STRIPED_FORWARD(pFile, xShmMap, iPg, pgsz, map, p);
+    }
+    int sIoShmLock(sqlite3_file *pFile, int offset, int n, int flags) {
+        return STRIPED_FORWARD(pFile, xShmLock, offset, n, flags);
+    }
+    void sIoShmBarrier(sqlite3_file *pFile) {
+        STRIPED_FORWARD(pFile, xShmBarrier);
+    }
+    int sIoShmUnmap(sqlite3_file *pFile, int deleteFlag) {
+        return STRIPED_FORWARD(pFile, xShmUnmap, deleteFlag);
+    }
+    int sIoFetch(sqlite3_file *, sqlite3_int64, int, void **pp) {
+        // stripe 0 does not hold consecutive pages, never map it
+        *pp = nullptr;
+        return SQLITE_OK;
+    }
+    int sIoUnfetch(sqlite3_file *, sqlite3_int64, void *) {
+        return SQLITE_OK;
+    }
+}
+
+sqlite3_io_methods StripedFile::gMethods = {
+        3,                          /* iVersion */
+        sIoClose,                   /* xClose */
+        sIoRead,                    /* xRead */
+        sIoWrite,                   /* xWrite */
+        sIoTruncate,                /* xTruncate */
+        sIoSync,                    /* xSync */
+        sIoFileSize,                /* xFileSize */
+        sIoLock,                    /* xLock */
+        sIoUnlock,                  /* xUnlock */
+        sIoCheckReservedLock,       /* xCheckReservedLock */
+        sIoFileControl,             /* xFileControl */
+        sIoSectorSize,              /* xSectorSize */
+        sIoDeviceCharacteristics,   /* xDeviceCharacteristics */
+        sIoShmMap,                  /* xShmMap */
+        sIoShmLock,                 /* xShmLock */
+        sIoShmBarrier,              /* xShmBarrier */
+        sIoShmUnmap,                /* xShmUnmap */
+        sIoFetch,                   /* xFetch */
+        sIoUnfetch,                 /* xUnfetch */
+};
+
+StripedFile::StripedFile(sqlite3_file *first, const std::string &dbFileName, int flags, uint32_t count,
+                         const int &pageSize, ThreadPool *pool)
+        : mHandle({{&gMethods}, this}), mFirst(first), mCount(count), mOwnPageSize(0), mPageSize(pageSize),
+          mPool(pool) {
+    int stripeFlags = SQLITE_OPEN_MAIN_DB | (flags & (SQLITE_OPEN_READONLY | SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE));
+
+    for (uint32_t i = 1; mRc == SQLITE_OK && i < count; i++) {
+        mFiles.emplace_back(new RawFile(stripeName(dbFileName, i), stripeFlags));
+        mRc = mFiles.back()->rc();
+    }
+}
+
+StripedFile::StripedFile(const std::string &dbFileName, int flags, uint32_t count, int pageSize)
+        : mHandle({{&gMethods}, this}), mFirst(nullptr), mCount(count), mOwnPageSize(pageSize),
+          mPageSize(mOwnPageSize), mPool(nullptr) {
+    for (uint32_t i = 0; mRc == SQLITE_OK && i < count; i++) {
+        mFiles.emplace_back(new RawFile(i == 0 ? dbFileName : stripeName(dbFileName, i), flags));
+        mRc = mFiles.back()->rc();
+    }
+}
+
+StripedFile::~StripedFile() = default;
+
+int StripedFile::read(void *buffer, int count, sqlite3_int64 offset) {
+    auto *out = static_cast<uint8_t *>(buffer);
+    return run(split(count, offset), [this, out] (const Piece &piece) {
+        return stripeRead(piece.stripe, out + piece.bufferOffset, piece.count, piece.offset);
+    });
+}
+
+int StripedFile::write(const void *buffer, int count, sqlite3_int64 offset) {
+    auto *in = static_cast<const uint8_t *>(buffer);
+    return run(split(count, offset), [this, in] (const Piece &piece) {
+        return stripeWrite(piece.stripe, in + piece.bufferOffset, piece.count, piece.offset);
+    });
+}
+
+int StripedFile::truncate(sqlite3_int64 size) {
+    if (mPageSize == 0)
+        return stripeTruncate(0, size);
+
+    // pages 1 to pages, of which stripe i holds every count-th starting at page i + 1
+    sqlite3_int64 pages = (size + mPageSize - 1) / mPageSize;
+    int rc = SQLITE_OK;
+    for (uint32_t i = 0; rc == SQLITE_OK && i < mCount; i++) {
+        sqlite3_int64 stripePages = pages > i ? (pages - i + mCount - 1) / mCount : 0;
+        rc = stripeTruncate(i, stripePages * mPageSize);
+    }
+    return rc;
+}
+
+int StripedFile::sync(int flags) {
+    std::vector<Piece> pieces;
+    for (uint32_t i = 0; i < mCount; i++)
+        pieces.push_back({i, 0, 0, 0});
+    return run(pieces, [this, flags] (const Piece &piece) {
+        return stripeSync(piece.stripe, flags);
+    });
+}
+
+int StripedFile::size(sqlite3_int64 *size) {
+    if (mPageSize == 0)
+        return stripeSize(0, size);
+
+    // the last page of the database is the last page of one of the stripes
+    sqlite3_int64 pages = 0;
+    int rc = SQLITE_OK;
+    for (uint32_t i = 0; rc == SQLITE_OK && i < mCount; i++) {
+        sqlite3_int64 stripeBytes = 0;
+        rc = stripeSize(i, &stripeBytes);
+        sqlite3_int64 stripePages = stripeBytes / mPageSize;
+        if (stripePages > 0)
+            pages = (std::max)(pages, (stripePages - 1) * mCount + i + 1);
+    }
+    *size = pages * mPageSize;
+    return rc;
+}
+
+int StripedFile::close() {
+    mFiles.clear();
+    return mFirst ? mFirst->pMethods->xClose(mFirst) : SQLITE_OK;
+}
+
+std::string StripedFile::stripeName(const std::string &dbFileName, uint32_t stripe) {
+    return dbFileName + "-stripe" + std::to_string(stripe);
+}
+
+bool StripedFile::exists(const std::string &dbFileName) {
+    return FileWrapper::exists(stripeName(dbFileName, 1));
+}
+
+std::vector<StripedFile::Piece> StripedFile::split(int count, sqlite3_int64 offset) const {
+    // a single file, or a page size not known yet: requests at the start of the database
+    if (mCount == 1 || mPageSize == 0)
+        return {{0, 0, count, offset}};
+
+    std::vector<Piece> pieces;
+    for (int done = 0; done < count;) {
+        sqlite3_int64 pageIndex = (offset + done) / mPageSize;
+        int inPage = static_cast<int>((offset + done) % mPageSize);
+        int size = (std::min)(count - done, mPageSize - inPage);
+
+        auto stripe = static_cast<uint32_t>(pageIndex % mCount);
+        pieces.push_back({stripe, done, size, pageIndex / mCount * mPageSize + inPage});
+        done += size;
+    }
+    return pieces;
+}
+
+int StripedFile::run(const std::vector<Piece> &pieces, const std::function<int(const Piece &)> &fn) {
+    std::vector<int> rcs(mCount, SQLITE_OK);
+    auto stripe = [&] (size_t i) {
+        for (const Piece &piece : pieces)
+            if (piece.stripe == i && rcs[i] == SQLITE_OK)
+                rcs[i] = fn(piece);
+    };
+
+    // one task per stripe, each accessing its file in order
+    if (mPool && pieces.size() > 1)
+        mPool->parallelFor(mCount, stripe);
+    else
+        for (size_t i = 0; i < mCount; i++)
+            stripe(i);
+
+    int rc = SQLITE_OK;
+    for (int stripeRc : rcs)
+        if (stripeRc != SQLITE_OK && (rc == SQLITE_OK || rc == SQLITE_IOERR_SHORT_READ))
+            rc = stripeRc;
+    return rc;
+}
+
+int StripedFile::stripeRead(uint32_t stripe, void *buffer, int count, sqlite3_int64 offset) {
+    if (mFirst && stripe == 0)
+        return mFirst->pMethods->xRead(mFirst, buffer, count, offset);
+    return mFiles[mFirst ? stripe - 1 : stripe]->read(buffer, count, offset);
+}
+
+int StripedFile::stripeWrite(uint32_t stripe, const void *buffer, int count, sqlite3_int64 offset) {
+    if (mFirst && stripe == 0)
+        return mFirst->pMethods->xWrite(mFirst, buffer, count, offset);
+    return mFiles[mFirst ? stripe - 1 : stripe]->write(buffer, count, offset);
+}
+
+int StripedFile::stripeTruncate(uint32_t stripe, sqlite3_int64 size) {
+    if (mFirst && stripe == 0)
+        return mFirst->pMethods->xTruncate(mFirst, size);
+    return mFiles[mFirst ? stripe - 1 : stripe]->truncate(size);
+}
+
+int StripedFile::stripeSync(uint32_t stripe, int flags) {
+    if (mFirst && stripe == 0)
+        return mFirst->pMethods->xSync(mFirst, flags);
+    return mFiles[mFirst ? stripe - 1 : stripe]->sync();
+}
+
+int StripedFile::stripeSize(uint32_t stripe, sqlite3_int64 *size) {
+    if (mFirst && stripe == 0)
+        return mFirst->pMethods->xFileSize(mFirst, size);
+    return mFiles[mFirst ? stripe - 1 : stripe]->size(size);
+}
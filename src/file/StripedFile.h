@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CRYPTOSQLITE_STRIPEDFILE_H
+#define CRYPTOSQLITE_STRIPEDFILE_H
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <sqlite3.h>
+};
+
+class RawFile;
+class ThreadPool;
+
+/**
+ * Pages of a main db distributed round-robin over several files, which may be placed on different devices.
+ *
+ * Page n is stored in stripe (n - 1) % count at offset (n - 1) / count * pageSize. Stripe 0 is the database file
+ * itself, which also keeps sqlite's locks and shared memory, the others are <db>-stripe1 to <db>-stripe<count - 1>.
+ * Sizes are logical: the size of the database as if it was a single file. Requests covering several pages access the
+ * stripes concurrently. SQLITE_FCNTL_CHUNK_SIZE and SQLITE_FCNTL_SIZE_HINT are rejected, a stripe grown ahead of its
+ * last page would add pages to that size.
+ */
+class StripedFile {
+public:
+    /**
+     * Takes over an open database file as stripe 0 and opens the others, to be used as the underlying file of the main
+     * db. Closing the returned file() closes all stripes and deletes this object.
+     *
+     * @param first Database file opened by the underlying VFS
+     * @param flags Open flags of the stripes, the stripes of an existing database must not be created again
+     * @param pageSize Page size of the database, 0 until known, when all requests go to stripe 0
+     * @param pool Pool to access stripes concurrently on
+     */
+    StripedFile(sqlite3_file *first, const std::string &dbFileName, int flags, uint32_t count, const int &pageSize,
+                ThreadPool *pool);
+    /**
+     * Opens all stripes of a database with their own handles, e.g. for reading on another thread
+     */
+    StripedFile(const std::string &dbFileName, int flags, uint32_t count, int pageSize);
+    ~StripedFile();
+
+    StripedFile(const StripedFile &) = delete;
+    StripedFile &operator=(const StripedFile &) = delete;
+
+    /**
+     * @return Standard sqlite error code of opening the stripes
+     */
+    int rc() const {
+        return mRc;
+    }
+    /**
+     * @return Handle to be used in place of the database file
+     */
+    sqlite3_file *file() {
+        return &mHandle.base;
+    }
+    /**
+     * @return Stripe 0 if taken over, which serves all requests other than page I/O
+     */
+    sqlite3_file *first() const {
+        return mFirst;
+    }
+
+    int read(void *buffer, int count, sqlite3_int64 offset);
+    int write(const void *buffer, int count, sqlite3_int64 offset);
+    int truncate(sqlite3_int64 size);
+    int sync(int flags);
+    int size(sqlite3_int64 *size);
+    int close();
+
+    static std::string stripeName(const std::string &dbFileName, uint32_t stripe);
+    /**
+     * @return True if the database has stripe files, without reading its keyfile
+     */
+    static bool exists(const std::string &dbFileName);
+
+    struct Handle {
+        sqlite3_file base;
+        StripedFile *striped;
+    };
+
+    static sqlite3_io_methods gMethods;
+
+protected:
+    // part of a request served by a single stripe
+    struct Piece {
+        uint32_t stripe;
+        int bufferOffset;
+        int count;
+        sqlite3_int64 offset;
+    };
+
+    std::vector<Piece> split(int count, sqlite3_int64 offset) const;
+    /**
+     * Runs fn for the pieces of each stripe in turn, for several stripes concurrently
+     *
+     * @return First error, a short read only if no other error occurred
+     */
+    int run(const std::vector<Piece> &pieces, const std::function<int(const Piece &)> &fn);
+
+    int stripeRead(uint32_t stripe, void *buffer, int count, sqlite3_int64 offset);
+    int stripeWrite(uint32_t stripe, const void *buffer, int count, sqlite3_int64 offset);
+    int stripeTruncate(uint32_t stripe, sqlite3_int64 size);
+    int stripeSync(uint32_t stripe, int flags);
+    int stripeSize(uint32_t stripe, sqlite3_int64 *size);
+
+    Handle mHandle;
+
+    // stripe 0 if taken over, not owned
+    sqlite3_file *mFirst;
+    // the other stripes, all of them if none was taken over
+    std::vector<std::unique_ptr<RawFile>> mFiles;
+    uint32_t mCount;
+    int mOwnPageSize;
+    const int &mPageSize;
+    ThreadPool *mPool;
+    int mRc = SQLITE_OK;
+};
+
+#endif //CRYPTOSQLITE_STRIPEDFILE_H
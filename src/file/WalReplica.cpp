@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <map>
+#include <vector>
+#include "WalReplica.h"
+#include "File.h"
+#include "RawFile.h"
+#include "StripedFile.h"
+#include "../crypto/FileWrapper.h"
+#include "../csqlite/csqlite.h"
+#include "../vfs/VFS.h"
+
+namespace {
+    const int WAL_HEADER_SIZE = 32;
+    // the lowest bit selects the byte order of the checksums
+    const uint32_t WAL_MAGIC = 0x377f0682;
+
+    bool isHeader(const uint8_t *header, uint32_t pageSize) {
+        return (csqlite3_get4byte(header) & ~1u) == WAL_MAGIC && csqlite3_get4byte(header + 8) == pageSize;
+    }
+
+    bool isPageSize(uint32_t pageSize) {
+        return pageSize >= 512 && pageSize <= 65536 && (pageSize & (pageSize - 1)) == 0;
+    }
+}
+
+WalReplica::WalReplica(const std::string &fileName) : mFileName(fileName) {
+}
+
+int WalReplica::apply(const uint8_t *header, const uint8_t *frames, int first, int count, int pageSize) {
+    sqlite3_int64 frameSize = SQLITE_WAL_FRAMEHEADER_SIZE + pageSize;
+    if (first < 1 || count < 1 || !isPageSize(pageSize) || count * frameSize > INT_MAX)
+        return SQLITE_MISUSE;
+    if (!isHeader(header, pageSize))
+        return SQLITE_CORRUPT;
+
+    int rc = resolve();
+    if (rc != SQLITE_OK)
+        return rc;
+
+    // connections to the replica hold a shared lock on the database while it is in WAL mode
+    RawFile db(mFileName, SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+    rc = db.rc();
+    if (rc == SQLITE_OK)
+        rc = db.lock(true);
+
+    RawFile wal(mFileName + "-wal", SQLITE_OPEN_WAL | SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+    sqlite3_int64 walSize = 0;
+    if (rc == SQLITE_OK)
+        rc = wal.rc();
+    if (rc == SQLITE_OK)
+        rc = wal.size(&walSize);
+
+    uint8_t current[WAL_HEADER_SIZE] = {};
+    if (rc == SQLITE_OK && walSize >= WAL_HEADER_SIZE)
+        rc = wal.read(current, WAL_HEADER_SIZE, 0);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    if (walSize >= WAL_HEADER_SIZE && memcmp(current, header, WAL_HEADER_SIZE) == 0) {
+        // continues the current log, frames may be delivered again after a failure
+        if (first - 1 > (walSize - WAL_HEADER_SIZE) / frameSize)
+            return SQLITE_ERROR;
+    }
+    else {
+        // a new log starts with its first frame, the previous one is moved into the database before it is replaced
+        if (first != 1)
+            return SQLITE_ERROR;
+        if (walSize >= WAL_HEADER_SIZE)
+            rc = checkpoint(db, wal, current, walSize);
+        if (rc == SQLITE_OK)
+            rc = wal.truncate(0);
+        if (rc == SQLITE_OK)
+            rc = wal.write(header, WAL_HEADER_SIZE, 0);
+    }
+
+    sqlite3_int64 offset = WAL_HEADER_SIZE + (first - 1) * frameSize, size = count * frameSize;
+    if (rc == SQLITE_OK)
+        rc = wal.write(frames, static_cast<int>(size), offset);
+    // frames after these belong to a delivery that is repeated now
+    if (rc == SQLITE_OK)
+        rc = wal.truncate(offset + size);
+    if (rc == SQLITE_OK)
+        rc = wal.sync();
+    return rc;
+}
+
+int WalReplica::resolve() {
+    // same name as used by the VFS, so the WAL found by sqlite matches
+    sqlite3_vfs *vfs = VFS::instance()->underlying();
+    std::vector<char> fullName(vfs->mxPathname + 1);
+    if (vfs->xFullPathname(vfs, mFileName.c_str(), vfs->mxPathname + 1, fullName.data()) != SQLITE_OK)
+        return SQLITE_CANTOPEN;
+
+    mFileName = fullName.data();
+    // frames are checkpointed by their offset in a single file, and without the key that authenticates the tree
+    if (StripedFile::exists(mFileName) || FileWrapper::exists(mFileName + "-merkle"))
+        return SQLITE_MISUSE;
+    return SQLITE_OK;
+}
+
+int WalReplica::checkpoint(RawFile &db, RawFile &wal, const uint8_t *header, sqlite3_int64 walSize,
+                           uint32_t maxFrame) {
+    uint32_t pageSize = csqlite3_get4byte(header + 8);
+    if (!isHeader(header, pageSize) || !isPageSize(pageSize))
+        return SQLITE_OK;
+
+    // last frame of each page up to the last commit, a torn transaction at the end is ignored like in recovery
+    std::map<uint32_t, sqlite3_int64> pending, committed;
+    uint32_t dbSize = 0;
+    sqlite3_int64 frameSize = SQLITE_WAL_FRAMEHEADER_SIZE + pageSize;
+    uint8_t frameHeader[SQLITE_WAL_FRAMEHEADER_SIZE];
+
+    sqlite3_int64 end = (std::min)(walSize, WAL_HEADER_SIZE + maxFrame * frameSize);
+    for (sqlite3_int64 offset = WAL_HEADER_SIZE; offset + frameSize <= end; offset += frameSize) {
+        int rc = wal.read(frameHeader, SQLITE_WAL_FRAMEHEADER_SIZE, offset);
+        if (rc != SQLITE_OK)
+            return rc;
+
+        // frames left over from an earlier log carry its salts
+        uint32_t pageNo = csqlite3_get4byte(frameHeader);
+        if (pageNo == 0 || memcmp(frameHeader + 8, header + 16, 8) != 0)
+            break;
+        pending[pageNo] = offset + SQLITE_WAL_FRAMEHEADER_SIZE;
+
+        uint32_t commitSize = csqlite3_get4byte(frameHeader + 4);
+        if (commitSize != 0) {
+            for (auto &frame : pending)
+                committed[frame.first] = frame.second;
+            pending.clear();
+            dbSize = commitSize;
+        }
+    }
+    if (dbSize == 0)
+        return SQLITE_OK;
+
+    std::vector<uint8_t> page(pageSize);
+    int rc = SQLITE_OK;
+    for (auto it = committed.begin(); rc == SQLITE_OK && it != committed.end() && it->first <= dbSize; ++it) {
+        rc = wal.read(page.data(), static_cast<int>(pageSize), it->second);
+        if (rc == SQLITE_OK)
+            rc = db.write(page.data(), static_cast<int>(pageSize), (it->first - 1) * static_cast<sqlite3_int64>(pageSize));
+    }
+
+    if (rc == SQLITE_OK)
+        rc = db.truncate(dbSize * static_cast<sqlite3_int64>(pageSize));
+    if (rc == SQLITE_OK)
+        rc = db.sync();
+    return rc;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRYPTOSQLITE_WALREPLICA_H
+#define CRYPTOSQLITE_WALREPLICA_H
+
+#include <cstdint>
+#include <string>
+#include <cryptosqlite/cryptosqlite.h>
+
+class RawFile;
+
+/**
+ * Applies WAL frames streamed from a primary to the WAL of a replica, as they are on disk and without the key.
+ *
+ * Frames of the current log are written to their position in the replica's WAL, sqlite recovers them when the replica
+ * is opened. A new log starts when the primary restarted its WAL after a checkpoint: the frames of the previous log up to
+ * its last commit are copied into the replica's database first, which is what a checkpoint would do. The replica must
+ * not be open while frames are applied. Striped replicas and replicas with an integrity tree are rejected, the tree
+ * could not be updated without the key.
+ */
+class WalReplica {
+public:
+    explicit WalReplica(const std::string &fileName);
+
+    /**
+     * @param header WAL header of the primary
+     * @param frames Consecutive frames, each a frame header and the page
+     * @param first Number of the first frame in the log, starting at 1
+     * @return Standard sqlite error code, SQLITE_ERROR if earlier frames of the log are missing
+     */
+    int apply(const uint8_t *header, const uint8_t *frames, int first, int count, int pageSize);
+
+    /**
+     * Copies the committed frames of a WAL into a database, as they are on disk
+     *
+     * @param header Header of the WAL
+     * @param maxFrame Last frame of the snapshot to copy, which must be a commit frame
+     */
+    static int checkpoint(RawFile &db, RawFile &wal, const uint8_t *header, sqlite3_int64 walSize,
+                          uint32_t maxFrame = UINT32_MAX);
+
+protected:
+    int resolve();
+
+    std::string mFileName;
+};
+
+#endif //CRYPTOSQLITE_WALREPLICA_H
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <vector>
+#include "WalTap.h"
+#include "File.h"
+#include "../csqlite/csqlite.h"
+
+namespace {
+    const int WAL_HEADER_SIZE = 32;
+    // bytes of frames passed to the subscriber at once
+    const int DELIVER_CHUNK_SIZE = 1024 * 1024;
+}
+
+WalTap::WalTap(sqlite3_wal_frames frames, void *arg) : mFrames(frames), mArg(arg), mDelivered(WAL_HEADER_SIZE) {
+}
+
+void WalTap::written(sqlite3_file *wal, const void *buffer, int count, sqlite3_int64 offset, int pageSize) {
+    mWal = wal;
+
+    if (offset == 0 && count == WAL_HEADER_SIZE) {
+        // log restarted, following frames overwrite the delivered ones
+        mDelivered = WAL_HEADER_SIZE;
+        mCommitted = 0;
+    }
+    else if (count == SQLITE_WAL_FRAMEHEADER_SIZE) {
+        // database size after the commit is only set in the last frame of a transaction
+        if (csqlite3_get4byte(static_cast<const uint8_t *>(buffer) + 4) != 0)
+            mCommitted = (std::max)(mCommitted, offset + SQLITE_WAL_FRAMEHEADER_SIZE + pageSize);
+    }
+}
+
+void WalTap::closed(sqlite3_file *wal) {
+    if (mWal == wal)
+        mWal = nullptr;
+}
+
+void WalTap::deliver(int pageSize) {
+    if (!mWal || mCommitted <= mDelivered || pageSize <= 0)
+        return;
+
+    uint8_t header[WAL_HEADER_SIZE];
+    if (mWal->pMethods->xRead(mWal, header, WAL_HEADER_SIZE, 0) != SQLITE_OK)
+        return;
+
+    int frameSize = SQLITE_WAL_FRAMEHEADER_SIZE + pageSize;
+    int framesPerChunk = (std::max)(DELIVER_CHUNK_SIZE / frameSize, 1);
+    std::vector<uint8_t> frames;
+
+    while (mDelivered < mCommitted) {
+        auto count = static_cast<int>((std::min)(static_cast<sqlite3_int64>(framesPerChunk),
+                                                 (mCommitted - mDelivered) / frameSize));
+        if (count == 0)
+            break;
+
+        frames.resize(static_cast<size_t>(count) * frameSize);
+        if (mWal->pMethods->xRead(mWal, frames.data(), static_cast<int>(frames.size()), mDelivered) != SQLITE_OK)
+            return;
+
+        auto first = static_cast<int>((mDelivered - WAL_HEADER_SIZE) / frameSize + 1);
+        if (mFrames(mArg, header, frames.data(), first, count, pageSize) != SQLITE_OK)
+            return;
+        mDelivered += static_cast<sqlite3_int64>(count) * frameSize;
+    }
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRYPTOSQLITE_WALTAP_H
+#define CRYPTOSQLITE_WALTAP_H
+
+#include <cryptosqlite/cryptosqlite.h>
+
+/**
+ * Streams the frames committed to the WAL of a database to a subscriber, as they are on disk.
+ *
+ * Frames are encrypted, so shipping them to a replica costs no cipher work. The tap follows the writes of the WAL:
+ * the header starts a new log and a commit frame ends a transaction. When the connection releases the WAL write lock,
+ * the frames committed since the last delivery are read back from the WAL and passed on in order, each time with the
+ * current header. Only writes through the connection the tap is installed on are seen.
+ */
+class WalTap {
+public:
+    WalTap(sqlite3_wal_frames frames, void *arg);
+
+    /**
+     * Follows a write of the WAL other than a page
+     *
+     * @param wal Underlying WAL file
+     */
+    void written(sqlite3_file *wal, const void *buffer, int count, sqlite3_int64 offset, int pageSize);
+
+    /**
+     * Forgets a WAL file that is closed
+     */
+    void closed(sqlite3_file *wal);
+
+    /**
+     * Delivers the frames committed since the last delivery. Frames a subscriber failed on are delivered again with
+     * the next transaction.
+     */
+    void deliver(int pageSize);
+
+protected:
+    sqlite3_wal_frames mFrames;
+    void *mArg;
+    sqlite3_file *mWal = nullptr;
+    // end of the frames delivered and of the last commit frame in the WAL
+    sqlite3_int64 mDelivered;
+    sqlite3_int64 mCommitted = 0;
+};
+
+#endif //CRYPTOSQLITE_WALTAP_H
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include "MemoryBudget.h"
+
+MemoryBudget MemoryBudget::sInstance;
+
+void MemoryBudget::setLimit(size_t limit) {
+    mLimit = limit;
+
+    // make room if the new limit is already exceeded
+    size_t used = usage();
+    if (limit != 0 && used > limit)
+        shrinkConsumers(used - limit, PRIORITY_READAHEAD, nullptr);
+}
+
+void MemoryBudget::addConsumer(Consumer *consumer, Priority priority) {
+    SQLite3LockGuard lock(mMutex);
+    mConsumers.push_back({consumer, priority});
+}
+
+void MemoryBudget::removeConsumer(Consumer *consumer) {
+    SQLite3LockGuard lock(mMutex);
+    mConsumers.erase(std::remove_if(mConsumers.begin(), mConsumers.end(), [consumer] (const Entry &entry) {
+        return entry.consumer == consumer;
+    }), mConsumers.end());
+}
+
+bool MemoryBudget::acquire(size_t bytes, Priority priority, Consumer *requester) {
+    size_t limit = mLimit;
+    bool shrunk = false;
+
+    // reserve with compare-and-swap, so concurrent callers can not overshoot the limit together
+    size_t used = mTotal;
+    for (;;) {
+        if (limit != 0 && used + bytes > limit) {
+            // try once to make room if the limit would be exceeded
+            if (!shrunk) {
+                shrinkConsumers(used + bytes - limit, priority, requester);
+                shrunk = true;
+                used = mTotal;
+                continue;
+            }
+
+            // refuse everything but working buffers if there still is not enough room
+            if (priority != PRIORITY_BUFFER)
+                return false;
+        }
+        if (mTotal.compare_exchange_weak(used, used + bytes))
+            break;
+    }
+
+    mUsage[priority] += bytes;
+    return true;
+}
+
+void MemoryBudget::release(size_t bytes, Priority priority) {
+    mUsage[priority] -= bytes;
+    mTotal -= bytes;
+}
+
+void MemoryBudget::shrinkConsumers(size_t bytes, Priority maxPriority, Consumer *requester) {
+    // lock is held while shrinking, so consumers can not be removed concurrently
+    SQLite3LockGuard lock(mMutex);
+
+    // ask lowest priorities first, working buffers can not shrink
+    for (int priority = PRIORITY_CACHE; priority <= maxPriority && priority < PRIORITY_BUFFER; priority++) {
+        for (auto &entry : mConsumers) {
+            if (entry.priority != priority || entry.consumer == requester)
+                continue;
+
+            size_t before = usage();
+            entry.consumer->shrink(bytes);
+
+            // stop as soon as enough memory was released
+            size_t released = before > usage() ? before - usage() : 0;
+            if (released >= bytes)
+                return;
+            bytes -= released;
+        }
+    }
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRYPTOSQLITE_MEMORYBUDGET_H
+#define CRYPTOSQLITE_MEMORYBUDGET_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+#include <sqlite3.h>
+#include "../csqlite/SQLite3Mutex.h"
+
+/**
+ * Process-wide memory ceiling for all codec allocations (page buffers, caches, queues).
+ *
+ * Every allocation is registered with a priority. If an allocation would exceed the limit, registered consumers are
+ * asked to shrink in priority order: caches are dropped first, read-ahead shrinks next. Working buffers required for
+ * page I/O are always granted, everything else is refused if not enough memory could be freed (backpressure).
+ */
+class MemoryBudget {
+public:
+    enum Priority {
+        // decrypted page and key caches, dropped first
+        PRIORITY_CACHE = 0,
+        // read-ahead buffers, shrink under pressure
+        PRIORITY_READAHEAD,
+        // working buffers required for page I/O, never refused
+        PRIORITY_BUFFER,
+
+        PRIORITY_COUNT
+    };
+
+    class Consumer {
+    public:
+        virtual ~Consumer() = default;
+
+        /**
+         * Called under memory pressure. Implementations free memory and report it using MemoryBudget::release().
+         * Must not call MemoryBudget::acquire().
+         *
+         * @param bytes Amount of memory the budget would like to get back
+         */
+        virtual void shrink(size_t bytes) = 0;
+    };
+
+    static MemoryBudget *instance() {
+        return &sInstance;
+    }
+
+    /**
+     * @param limit Maximum number of bytes for all codec allocations, 0 for unlimited
+     */
+    void setLimit(size_t limit);
+    size_t limit() const {
+        return mLimit;
+    }
+
+    size_t usage() const {
+        return mTotal;
+    }
+    size_t usage(Priority priority) const {
+        return mUsage[priority];
+    }
+
+    /**
+     * Registers a consumer that is asked to shrink under memory pressure.
+     * Consumers must not hold their own locks while calling acquire(), as shrinking may lock other consumers.
+     *
+     * @param consumer Consumer to register
+     * @param priority Priority of the memory held by the consumer
+     */
+    void addConsumer(Consumer *consumer, Priority priority);
+    void removeConsumer(Consumer *consumer);
+
+    /**
+     * Registers an allocation, shrinking consumers of the same or lower priority if the limit would be exceeded
+     *
+     * @param bytes Size of the allocation
+     * @param priority Priority of the allocation
+     * @param requester Optional consumer doing the allocation, it will not be asked to shrink
+     * @return True if the allocation may proceed, false if the caller must not allocate
+     */
+    bool acquire(size_t bytes, Priority priority, Consumer *requester = nullptr);
+    void release(size_t bytes, Priority priority);
+
+protected:
+    MemoryBudget() = default;
+
+    void shrinkConsumers(size_t bytes, Priority maxPriority, Consumer *requester);
+
+    struct Entry {
+        Consumer *consumer;
+        Priority priority;
+    };
+
+    SQLite3Mutex mMutex;
+    std::vector<Entry> mConsumers;
+    std::atomic<size_t> mLimit {0};
+    std::atomic<size_t> mUsage[PRIORITY_COUNT] {};
+    // sum of all priorities, allocations are reserved against it
+    std::atomic<size_t> mTotal {0};
+
+    static MemoryBudget sInstance;
+};
+
+#endif //CRYPTOSQLITE_MEMORYBUDGET_H
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <cstdio>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+#include "IOTrace.h"
+
+extern "C" {
+#include <sqlite3.h>
+};
+
+std::atomic<bool> IOTrace::sActive {false};
+std::atomic<uint32_t> IOTrace::sNextId {1};
+thread_local uint64_t IOTrace::sCipherNs = 0;
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    // records are collected and written in blocks of this size
+    const size_t FLUSH_SIZE = 1 << 20;
+
+    std::mutex sMutex;
+    FILE *sFile = nullptr;
+    Clock::time_point sStart;
+    std::vector<uint8_t> sBuffer;
+    // files that already have their open record in the current trace
+    std::unordered_set<uint32_t> sSeen;
+
+    void put(std::vector<uint8_t> &out, uint64_t value, int bytes) {
+        for (int i = bytes - 1; i >= 0; i--)
+            out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+
+    uint32_t saturate(uint64_t value) {
+        return value > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(value);
+    }
+
+    void flush() {
+        if (sFile && !sBuffer.empty())
+            fwrite(sBuffer.data(), 1, sBuffer.size(), sFile);
+        sBuffer.clear();
+    }
+}
+
+bool IOTrace::start(const std::string &path) {
+    std::lock_guard<std::mutex> lock(sMutex);
+    sActive = false;
+    if (sFile) {
+        flush();
+        fclose(sFile);
+        sFile = nullptr;
+    }
+    sSeen.clear();
+    if (path.empty())
+        return true;
+
+    sFile = fopen(path.c_str(), "wb");
+    if (!sFile)
+        return false;
+
+    sBuffer.insert(sBuffer.end(), {'C', 'S', 'Q', 'T', 'R', 'A', 'C', 'E'});
+    put(sBuffer, VERSION, 4);
+    put(sBuffer, RECORD_SIZE, 4);
+    sStart = Clock::now();
+    sActive = true;
+    return true;
+}
+
+void IOTrace::close(uint32_t id, uint32_t mainId, int openFlags) {
+    uint8_t fileRole = role(openFlags);
+    if (!active() || fileRole == 0)
+        return;
+
+    Clock::time_point now = Clock::now();
+    record(id, mainId, fileRole, OP_CLOSE, 0, 0, 0, 0, now, 0, 0);
+}
+
+IOTrace::Scope::Scope(uint32_t id, uint32_t mainId, int openFlags, Op op, int64_t offset, int size, uint32_t pageNo,
+                      int flags)
+        : mId(id), mMainId(mainId), mRole(0), mOp(op), mOffset(offset), mSize(size), mPageNo(pageNo), mFlags(flags) {
+    if (!active())
+        return;
+
+    mRole = role(openFlags);
+    if (mRole != 0) {
+        sCipherNs = 0;
+        mStart = Clock::now();
+    }
+}
+
+IOTrace::Scope::~Scope() {
+    if (mRole == 0)
+        return;
+
+    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - mStart).count();
+    record(mId, mMainId, mRole, mOp, static_cast<uint16_t>(mFlags), mPageNo, static_cast<uint32_t>(mSize), mOffset,
+           mStart, static_cast<uint64_t>(duration), sCipherNs);
+}
+
+uint8_t IOTrace::role(int openFlags) {
+    if (openFlags & SQLITE_OPEN_MAIN_DB)
+        return ROLE_MAIN_DB;
+    if (openFlags & SQLITE_OPEN_MAIN_JOURNAL)
+        return ROLE_JOURNAL;
+    if (openFlags & SQLITE_OPEN_SUBJOURNAL)
+        return ROLE_SUBJOURNAL;
+    if (openFlags & SQLITE_OPEN_WAL)
+        return ROLE_WAL;
+    return 0;
+}
+
+void IOTrace::record(uint32_t id, uint32_t mainId, uint8_t role, Op op, uint16_t flags, uint32_t pageNo,
+                     uint32_t size, int64_t offset, Clock::time_point start, uint64_t durationNs, uint64_t cipherNs) {
+    std::lock_guard<std::mutex> lock(sMutex);
+    if (!sFile)
+        return;
+
+    auto write = [role] (uint32_t id, Op op, uint16_t flags, uint32_t pageNo, uint32_t size, int64_t offset,
+                         uint64_t time, uint64_t durationNs, uint64_t cipherNs) {
+        put(sBuffer, time, 8);
+        put(sBuffer, id, 4);
+        put(sBuffer, role, 1);
+        put(sBuffer, op, 1);
+        put(sBuffer, flags, 2);
+        put(sBuffer, pageNo, 4);
+        put(sBuffer, size, 4);
+        put(sBuffer, static_cast<uint64_t>(offset), 8);
+        put(sBuffer, saturate(durationNs), 4);
+        put(sBuffer, saturate(cipherNs), 4);
+    };
+
+    // operations that started before the trace count from its start
+    uint64_t time = start > sStart ? std::chrono::duration_cast<std::chrono::nanoseconds>(start - sStart).count() : 0;
+    // files opened before the trace started are introduced by their first operation
+    bool seen = sSeen.count(id) != 0;
+    if (!seen && op != OP_CLOSE) {
+        sSeen.insert(id);
+        write(id, OP_OPEN, 0, role == ROLE_MAIN_DB ? 0 : mainId, 0, 0, time, 0, 0);
+    }
+    if (op == OP_CLOSE) {
+        if (!seen)
+            return;
+        sSeen.erase(id);
+    }
+
+    write(id, op, flags, pageNo, size, offset, time, durationNs, cipherNs);
+    if (sBuffer.size() >= FLUSH_SIZE)
+        flush();
+}
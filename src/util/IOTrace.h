@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CRYPTOSQLITE_IOTRACE_H
+#define CRYPTOSQLITE_IOTRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/**
+ * Records the file operations of the codec into a binary trace, to replay production I/O patterns offline.
+ *
+ * The trace starts with a header of 16 bytes: the magic "CSQTRACE", the version and the record size, both as 4 byte
+ * big-endian numbers. It is followed by records of RECORD_SIZE bytes, in the order the operations ended, with
+ * big-endian fields:
+ *
+ *   8 byte  start of the operation in nanoseconds since the trace started
+ *   4 byte  id of the file, unique while the process runs
+ *   1 byte  Role of the file
+ *   1 byte  Op
+ *   2 byte  sync flags for OP_SYNC, 0 otherwise
+ *   4 byte  page number for the main database, id of the main database for OP_OPEN of other files, 0 otherwise
+ *   4 byte  size of a read or write
+ *   8 byte  offset of a read or write, new size for OP_TRUNCATE
+ *   4 byte  duration of the operation in nanoseconds, saturated
+ *   4 byte  time spent in the cipher during the operation in nanoseconds, saturated
+ *
+ * A file's first record in a trace is an OP_OPEN, which is also written for files opened before the trace started.
+ */
+class IOTrace {
+public:
+    enum Role : uint8_t {
+        ROLE_MAIN_DB = 1,
+        ROLE_JOURNAL = 2,
+        ROLE_SUBJOURNAL = 3,
+        ROLE_WAL = 4,
+    };
+
+    enum Op : uint8_t {
+        OP_OPEN = 1,
+        OP_CLOSE = 2,
+        OP_READ = 3,
+        OP_WRITE = 4,
+        OP_SYNC = 5,
+        OP_TRUNCATE = 6,
+    };
+
+    static const uint32_t VERSION = 1;
+    static const uint32_t HEADER_SIZE = 16;
+    static const uint32_t RECORD_SIZE = 40;
+
+    /**
+     * Starts writing a new trace, replacing the file, or stops tracing if the path is empty
+     *
+     * @return False if the trace file could not be created, tracing is stopped then
+     */
+    static bool start(const std::string &path);
+
+    static bool active() {
+        return sActive.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @return Id for a newly opened file
+     */
+    static uint32_t nextId() {
+        return sNextId.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * Records the close of a file if it was traced
+     */
+    static void close(uint32_t id, uint32_t mainId, int openFlags);
+
+    /**
+     * Times an operation on a file and records it when it goes out of scope. Files without encrypted pages are not
+     * traced.
+     */
+    class Scope {
+    public:
+        Scope(uint32_t id, uint32_t mainId, int openFlags, Op op, int64_t offset, int size, uint32_t pageNo,
+              int flags = 0);
+        ~Scope();
+
+    protected:
+        uint32_t mId, mMainId;
+        uint8_t mRole;
+        Op mOp;
+        int64_t mOffset;
+        int mSize;
+        uint32_t mPageNo;
+        int mFlags;
+        std::chrono::steady_clock::time_point mStart;
+    };
+
+    /**
+     * Adds the time until it goes out of scope to the cipher time of the operation running on this thread
+     */
+    class CipherScope {
+    public:
+        CipherScope() : mActive(IOTrace::active()) {
+            if (mActive)
+                mStart = std::chrono::steady_clock::now();
+        }
+        ~CipherScope() {
+            if (mActive)
+                sCipherNs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - mStart).count();
+        }
+
+    protected:
+        bool mActive;
+        std::chrono::steady_clock::time_point mStart;
+    };
+
+protected:
+    /**
+     * @return Role of a file with the given open flags, 0 if it is not traced
+     */
+    static uint8_t role(int openFlags);
+
+    static void record(uint32_t id, uint32_t mainId, uint8_t role, Op op, uint16_t flags, uint32_t pageNo,
+                       uint32_t size, int64_t offset, std::chrono::steady_clock::time_point start, uint64_t durationNs,
+                       uint64_t cipherNs);
+
+    static std::atomic<bool> sActive;
+    static std::atomic<uint32_t> sNextId;
+    static thread_local uint64_t sCipherNs;
+};
+
+#endif //CRYPTOSQLITE_IOTRACE_H
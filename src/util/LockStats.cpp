@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "LockStats.h"
+
+void LockStats::read(uint64_t &acquisitions, uint64_t &contended, uint64_t &waitNs) const {
+    acquisitions = mAcquisitions.load(std::memory_order_relaxed);
+    contended = mContended.load(std::memory_order_relaxed);
+    waitNs = mWaitNs.load(std::memory_order_relaxed);
+}
+
+void LockStats::reset() {
+    mAcquisitions = 0;
+    mContended = 0;
+    mWaitNs = 0;
+}
+
+LockStats &LockStats::registry() {
+    static LockStats stats;
+    return stats;
+}
+
+LockStats &LockStats::connection() {
+    static LockStats stats;
+    return stats;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CRYPTOSQLITE_LOCKSTATS_H
+#define CRYPTOSQLITE_LOCKSTATS_H
+
+#include <atomic>
+#include <cstdint>
+
+/**
+ * Contention counters of a codec lock, updated by SQLite3Mutex
+ */
+class LockStats {
+public:
+    /**
+     * @param waitNs Time spent waiting for the lock, only measured if another thread held it
+     */
+    void acquired(bool contended, uint64_t waitNs) {
+        mAcquisitions.fetch_add(1, std::memory_order_relaxed);
+        if (contended) {
+            mContended.fetch_add(1, std::memory_order_relaxed);
+            mWaitNs.fetch_add(waitNs, std::memory_order_relaxed);
+        }
+    }
+
+    void read(uint64_t &acquisitions, uint64_t &contended, uint64_t &waitNs) const;
+    void reset();
+
+    /**
+     * @return Counters of the lock guarding the list of open databases in the VFS
+     */
+    static LockStats &registry();
+    /**
+     * @return Counters of connection mutexes taken by the codec, e.g. when attaching a database
+     */
+    static LockStats &connection();
+
+protected:
+    std::atomic<uint64_t> mAcquisitions {0}, mContended {0}, mWaitNs {0};
+};
+
+#endif //CRYPTOSQLITE_LOCKSTATS_H
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CRYPTOSQLITE_SHA256_H
+#define CRYPTOSQLITE_SHA256_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * SHA-256 for digests of data that is already encrypted, where no key and no crypto plugin is available
+ */
+class Sha256 {
+public:
+    static const size_t DIGEST_SIZE = 32;
+
+    Sha256();
+
+    void update(const void *data, size_t size);
+
+    /**
+     * Writes the digest, the instance can not be updated afterwards
+     */
+    void finish(uint8_t *digest);
+
+    static void digest(const void *data, size_t size, uint8_t *digest) {
+        Sha256 sha;
+        sha.update(data, size);
+        sha.finish(digest);
+    }
+
+protected:
+    void transform(const uint8_t *block);
+
+    uint32_t mState[8];
+    uint8_t mBlock[64];
+    size_t mBlockSize = 0;
+    uint64_t mLength = 0;
+};
+
+#endif //CRYPTOSQLITE_SHA256_H
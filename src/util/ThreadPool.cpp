@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(unsigned threads) {
+    if (threads == 0)
+        threads = (std::max)(1u, std::thread::hardware_concurrency());
+
+    for (unsigned i = 0; i < threads; i++)
+        mThreads.emplace_back(&ThreadPool::run, this);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStop = true;
+    }
+    mCondition.notify_all();
+
+    for (auto &thread : mThreads)
+        thread.join();
+}
+
+ThreadPool *ThreadPool::shared() {
+    static ThreadPool sShared;
+    return &sShared;
+}
+
+uint64_t ThreadPool::submit(std::function<void()> task) {
+    uint64_t id;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        id = mNextId++;
+        mTasks.emplace_back(id, std::move(task));
+    }
+    mCondition.notify_one();
+    return id;
+}
+
+bool ThreadPool::cancel(uint64_t id) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = std::find_if(mTasks.begin(), mTasks.end(), [id] (const std::pair<uint64_t, std::function<void()>> &task) {
+        return task.first == id;
+    });
+    if (it == mTasks.end())
+        return false;
+
+    mTasks.erase(it);
+    return true;
+}
+
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t)> &fn) {
+    if (count == 0)
+        return;
+
+    // shared between caller and helpers, helpers may still hold it after the caller returned
+    struct State {
+        std::atomic<size_t> next {0};
+        size_t done = 0;
+        std::mutex mutex;
+        std::condition_variable condition;
+    };
+    auto state = std::make_shared<State>();
+
+    auto work = [state, count, &fn] () {
+        size_t finished = 0;
+        for (size_t i; (i = state->next++) < count; finished++)
+            fn(i);
+
+        if (finished > 0) {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->done += finished;
+            if (state->done == count)
+                state->condition.notify_all();
+        }
+    };
+
+    // helpers that start after all indices were taken return immediately without touching fn
+    size_t helpers = (std::min)(count - 1, mThreads.size());
+    for (size_t i = 0; i < helpers; i++)
+        submit(work);
+
+    work();
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->condition.wait(lock, [&state, count] { return state->done == count; });
+}
+
+void ThreadPool::run() {
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCondition.wait(lock, [this] { return mStop || !mTasks.empty(); });
+
+            if (mStop && mTasks.empty())
+                return;
+
+            task = std::move(mTasks.front().second);
+            mTasks.pop_front();
+        }
+        task();
+    }
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2023 The ViaDuck Project
+ *
+ * This file is part of cryptoSQLite.
+ *
+ * cryptoSQLite is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cryptoSQLite is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRYPTOSQLITE_THREADPOOL_H
+#define CRYPTOSQLITE_THREADPOOL_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Fixed size pool of worker threads owned by the codec
+ */
+class ThreadPool {
+public:
+    /**
+     * @param threads Number of worker threads, 0 for one per hardware thread
+     */
+    explicit ThreadPool(unsigned threads = 0);
+    ~ThreadPool();
+
+    /**
+     * @return Pool shared by all codec components, created on first use
+     */
+    static ThreadPool *shared();
+
+    unsigned size() const {
+        return static_cast<unsigned>(mThreads.size());
+    }
+
+    /**
+     * Queues a task for asynchronous execution on a worker thread
+     *
+     * @return Id of the task for cancel()
+     */
+    uint64_t submit(std::function<void()> task);
+
+    /**
+     * Removes a task that no worker started yet
+     *
+     * @return True if the task was removed and will not run
+     */
+    bool cancel(uint64_t id);
+
+    /**
+     * Calls fn(i) for every i in [0, count) on the workers and the calling thread. Returns when all calls finished.
+     * The calling thread takes part, so this makes progress even if all workers are busy.
+     */
+    void parallelFor(size_t count, const std::function<void(size_t)> &fn);
+
+protected:
+    void run();
+
+    std::vector<std::thread> mThreads;
+    // queued tasks with their ids
+    std::deque<std::pair<uint64_t, std::function<void()>>> mTasks;
+    uint64_t mNextId = 0;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    bool mStop = false;
+};
+
+#endif //CRYPTOSQLITE_THREADPOOL_H
@@ -19,10 +19,24 @@
 
 #include <algorithm>
 #include "VFS.h"
+#include "../crypto/FieldCrypt.h"
+#include "../file/BulkWriter.h"
+#include "../file/PageCache.h"
+#include "../file/RedoLog.h"
+#include "../file/StripedFile.h"
+#include "../util/IOTrace.h"
+#include "../util/ThreadPool.h"
 
 VFS VFS::sInstance;
+thread_local const void *VFS::sFileKey = nullptr;
+thread_local int VFS::sFileKeySize = 0;
+thread_local const char *VFS::sCipher = nullptr;
+thread_local bool VFS::sPageFlags = false;
+thread_local Crypto *VFS::sKeySource = nullptr;
+thread_local ThreadPool *VFS::sBulkPool = nullptr;
+thread_local bool VFS::sRebuildTree = false;
 
-VFS::VFS() : mBase(), mDBs(new std::vector<File *>()) {
+VFS::VFS() : mBase(), mMutex(&LockStats::registry()), mDBs(new std::vector<File *>()) {
     // find default VFS
     mUnderlying = sqlite3_vfs_find(nullptr);
 
@@ -60,9 +74,20 @@ VFS::~VFS() {
 void VFS::prepare(const void *zKey, int nKey) {
     // make custom VFS default before opening
     sqlite3_vfs_register(base(), 1);
-    // cache key in instance for open()
-    mFileKey = zKey;
-    mFileKeySize = nKey;
+    // cache key for open() on this thread
+    sFileKey = zKey;
+    sFileKeySize = nKey;
+}
+
+void VFS::prepareNamed(const void *zKey, int nKey, const char *zCipher, bool pageFlags) {
+    // register custom VFS without changing the default
+    if (sqlite3_vfs_find(name()) != base())
+        sqlite3_vfs_register(base(), 0);
+    // cache key and cipher for open() on this thread
+    sFileKey = zKey;
+    sFileKeySize = nKey;
+    sCipher = zCipher;
+    sPageFlags = pageFlags;
 }
 
 int VFS::open(const char *zName, sqlite3_file *pFile, int flags, int *pOutFlags) {
@@ -74,7 +99,19 @@ int VFS::open(const char *zName, sqlite3_file *pFile, int flags, int *pOutFlags)
     db->mOpenFlags = flags;
     db->mCrypto = nullptr;
     db->mDB = nullptr;
+    db->mPageSize = 0;
     db->mPageNo = 0;
+    db->mConnection = nullptr;
+    db->mDbIndex = 0;
+    db->mReplayPage = 0;
+    db->mWalPage = 0;
+    db->mWalPlaintext = false;
+    db->mPrefetcher = nullptr;
+    db->mTap = nullptr;
+    db->mBulk = nullptr;
+    db->mRedo = nullptr;
+    db->mRebuildTree = false;
+    db->mTraceId = IOTrace::nextId();
 
     if (zName) {
         switch (flags & SQLITE_OPEN_MASK) {
@@ -83,16 +120,36 @@ int VFS::open(const char *zName, sqlite3_file *pFile, int flags, int *pOutFlags)
             case SQLITE_OPEN_TEMP_DB:
                 break;
 
-            case SQLITE_OPEN_MAIN_DB:
+            case SQLITE_OPEN_MAIN_DB: {
                 VFS_REAL(this)->xAccess(VFS_REAL(this),zName,SQLITE_ACCESS_EXISTS,&db->mExists);
-                db->mCrypto = new Crypto(db->mFileName, mFileKey, mFileKeySize, db->mExists);
+                const char *cipher = sCipher ? sCipher : sqlite3_uri_parameter(zName, "cipher");
+                bool pageFlags = sPageFlags || sqlite3_uri_boolean(zName, "selective", 0);
+                auto stripes = static_cast<uint32_t>((std::max)(sqlite3_uri_int64(zName, "stripes", 1), sqlite3_int64(1)));
+                try {
+                    db->mCrypto = new Crypto(db->mFileName, sFileKey, sFileKeySize, db->mExists, cipher ? cipher : "",
+                                             pageFlags, stripes);
+                    if (sKeySource)
+                        db->mCrypto->shareKey(*sKeySource);
+                    db->mRebuildTree = sRebuildTree;
+                } catch (const std::exception &) {
+                    // do not unwind through sqlite
+                    delete db->mCrypto;
+                    db->mCrypto = nullptr;
+                    return SQLITE_CANTOPEN;
+                }
+                // the log is only looked for by connections writing batches
+                if (sqlite3_uri_boolean(zName, "batch_atomic", 0))
+                    db->mRedo = new RedoLog(zName, flags & SQLITE_OPEN_READONLY);
                 break;
+            }
 
             case SQLITE_OPEN_MAIN_JOURNAL:
             case SQLITE_OPEN_SUBJOURNAL:
             case SQLITE_OPEN_WAL:
                 db->mDB = findMainDatabase(zName);
                 db->mCrypto = db->mDB->mCrypto;
+                // pages are encrypted like the main db's, which is attached and has a fixed page size by now
+                db->mPageSize = db->mDB->mPageSize;
                 break;
 
             case SQLITE_OPEN_TRANSIENT_DB:
@@ -105,20 +162,91 @@ int VFS::open(const char *zName, sqlite3_file *pFile, int flags, int *pOutFlags)
         }
     }
     int ret =  VFS_REAL(this)->xOpen(VFS_REAL(this),zName,db->mUnderlying, flags, pOutFlags);
+    if (ret == SQLITE_OK && db->mCrypto && (flags & SQLITE_OPEN_MAIN_DB) && db->mCrypto->stripes() > 1) {
+        // pages go through the stripes from now on, stripe files are only created with a new database
+        auto *striped = new StripedFile(db->mUnderlying, db->mFileName, db->mExists ? flags & ~SQLITE_OPEN_CREATE : flags,
+                                        db->mCrypto->stripes(), db->mPageSize, ThreadPool::shared());
+        ret = striped->rc();
+        if (ret == SQLITE_OK)
+            db->mUnderlying = striped->file();
+        else {
+            striped->close();
+            delete striped;
+        }
+    }
+    std::string cacheDirectory;
+    uint32_t cachePages = 0;
+    if (ret == SQLITE_OK && db->mCrypto && (flags & SQLITE_OPEN_MAIN_DB) && !sBulkPool &&
+        PageCache::enabled(cacheDirectory, cachePages)) {
+        // the cache is optional, the database is used without it if the cache file can not be created
+        auto *cache = new PageCache(db->mUnderlying, db->mPageSize, cacheDirectory, cachePages);
+        if (cache->rc() == SQLITE_OK)
+            db->mUnderlying = cache->file();
+        else
+            delete cache;
+    }
+
     if (ret == SQLITE_OK) {
         pFile->pMethods = &File::gSQLiteIOMethods;
 
-        if (flags & SQLITE_OPEN_MAIN_DB)
+        if (flags & SQLITE_OPEN_MAIN_DB) {
+            if (sBulkPool)
+                db->mBulk = new BulkWriter(db->mUnderlying, db->mCrypto, sBulkPool);
             addDatabase(db);
+        }
+    }
+    else if (flags & SQLITE_OPEN_MAIN_DB) {
+        delete db->mRedo;
+        delete db->mCrypto;
     }
     return ret;
 }
 
 void VFS::finish() {
-    mFileKey = nullptr;
-    mFileKeySize = 0;
-    // unregister custom VFS after opening
-    sqlite3_vfs_unregister(VFS::instance()->base());
+    sFileKey = nullptr;
+    sFileKeySize = 0;
+    // remove custom VFS as default after opening, keep it available by name for concurrent named opens
+    sqlite3_vfs_register(base(), 0);
+}
+
+void VFS::prepareBulk(Crypto *keySource, ThreadPool *pool) {
+    sKeySource = keySource;
+    sBulkPool = pool;
+}
+
+void VFS::prepareRebuild() {
+    sRebuildTree = true;
+}
+
+void VFS::finishNamed() {
+    sFileKey = nullptr;
+    sFileKeySize = 0;
+    sCipher = nullptr;
+    sPageFlags = false;
+    sKeySource = nullptr;
+    sBulkPool = nullptr;
+    sRebuildTree = false;
+}
+
+int VFS::openNamed(const char *zFilename, sqlite3 **ppDb, const void *zKey, int nKey, int flags,
+                   const char *zCipher, bool pageFlags) {
+    // no key specified
+    if (zKey == nullptr || nKey <= 0)
+        return sqlite3_open_v2(zFilename, ppDb, flags, underlying()->zName);
+
+    // prepare the call to open on this thread only
+    prepareNamed(zKey, nKey, zCipher, pageFlags);
+
+    int rc = sqlite3_open_v2(zFilename, ppDb, flags, name());
+    if (rc == SQLITE_OK) {
+        File *mainDB = File::fromDatabase(*ppDb);
+        rc = mainDB ? mainDB->attach(*ppDb, 0) : SQLITE_ERROR;
+    }
+    if (rc == SQLITE_OK)
+        rc = FieldCrypt::registerFunctions(*ppDb);
+
+    finishNamed();
+    return rc;
 }
 
 File *VFS::findMainDatabase(const char *name) {
@@ -132,6 +260,16 @@ File *VFS::findMainDatabase(const char *name) {
     return (it != mDBs->end()) ? *it : nullptr;
 }
 
+size_t VFS::countMainDatabases(const char *name) {
+    // compare by content, other connections use their own file name buffers
+    std::string dbFileName = sqlite3_filename_database(name);
+
+    SQLite3LockGuard lock(mMutex);
+    return std::count_if(mDBs->begin(), mDBs->end(), [&dbFileName] (auto *db) {
+        return dbFileName == db->mFileName;
+    });
+}
+
 void VFS::addDatabase(File *db) {
     SQLite3LockGuard lock(mMutex);
     mDBs->push_back(db);
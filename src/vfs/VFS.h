@@ -23,6 +23,8 @@
 #include "../file/File.h"
 #include "../csqlite/SQLite3Mutex.h"
 
+class ThreadPool;
+
 class VFS {
 public:
     static VFS *instance() {
@@ -38,6 +40,17 @@ public:
      */
     void prepare(const void *zKey, int nKey);
 
+    /**
+     * Thread-safe variant of prepare(), which registers this VFS by name without making it default.
+     * Open the main db with sqlite3_open_v2() passing name() as VFS, then call finishNamed() on the same thread.
+     *
+     * @param zKey Optional key pointer
+     * @param nKey Optional key size
+     * @param zCipher Optional cipher name, overrides the "cipher" URI parameter
+     * @param pageFlags Create a new db with page flags for plaintext tables, like the "selective" URI parameter
+     */
+    void prepareNamed(const void *zKey, int nKey, const char *zCipher = nullptr, bool pageFlags = false);
+
     /**
      * Automatically called on opening any file (db, journal, wal, ...)
      *
@@ -51,13 +64,49 @@ public:
 
     /**
      * Call after opening the main db to finish setup and clean up resources
-     * Removes this VFS as default.
-     *
-     * @param db Database pointer that was just opened
-     * @param nDb Database number for attached databases
+     * Removes this VFS as default, but keeps it registered by name.
      */
     void finish();
 
+    /**
+     * Prepares the next main db opened on this thread, after prepareNamed(), as the output of a copy written from
+     * start to end like VACUUM INTO. Its pages are encrypted in batches on the pool.
+     *
+     * @param keySource Database whose data key is shared instead of generating one, nullptr to generate one
+     */
+    void prepareBulk(Crypto *keySource, ThreadPool *pool);
+
+    /**
+     * Prepares the next main db opened on this thread, after prepareNamed(), to rebuild its integrity tree from the
+     * pages on disk instead of loading it
+     */
+    void prepareRebuild();
+
+    /**
+     * Call after opening the main db prepared by prepareNamed()
+     */
+    void finishNamed();
+
+    /**
+     * Thread-safe open of an encrypted main db using prepareNamed() and finishNamed()
+     *
+     * @param zFilename Database file name
+     * @param ppDb Database handle output
+     * @param zKey Key pointer, nullptr to open without encryption
+     * @param nKey Key size
+     * @param flags sqlite3_open_v2() flags
+     * @param zCipher Optional cipher name
+     * @param pageFlags Create a new db with page flags
+     * @return Standard sqlite error code
+     */
+    int openNamed(const char *zFilename, sqlite3 **ppDb, const void *zKey, int nKey,
+                  int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, const char *zCipher = nullptr,
+                  bool pageFlags = false);
+
+    const char *name() const {
+        return mBase.zName;
+    }
+
     sqlite3_vfs *base() {
         return &mBase;
     }
@@ -66,6 +115,12 @@ public:
     }
 
     File *findMainDatabase(const char *name);
+
+    /**
+     * @param name Database file name as returned by sqlite3_db_filename()
+     * @return Number of open connections to the main db across all connections of this process
+     */
+    size_t countMainDatabases(const char *name);
     void removeDatabase(File *db);
 
 protected:
@@ -78,8 +133,15 @@ protected:
     sqlite3_vfs *mUnderlying;
     SQLite3Mutex mMutex;
     std::vector<File *> *mDBs;
-    const void *mFileKey;
-    int mFileKeySize;
+
+    // key and cipher prepared for the next open on this thread
+    static thread_local const void *sFileKey;
+    static thread_local int sFileKeySize;
+    static thread_local const char *sCipher;
+    static thread_local bool sPageFlags;
+    static thread_local Crypto *sKeySource;
+    static thread_local ThreadPool *sBulkPool;
+    static thread_local bool sRebuildTree;
 
     static VFS sInstance;
 };
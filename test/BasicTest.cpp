@@ -19,6 +19,17 @@
 
 #include "BasicTest.h"
 
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <set>
+#include <thread>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
 #include <secure_memory/String.h>
 #include <cryptosqlite/cryptosqlite.h>
 #include <cryptosqlite/crypto/PlaintextCrypt.h>
@@ -104,6 +115,1570 @@ TEST_F(BasicTest, testTestCryptTransactRekey) {
     testRead(newkey, newlen);
 }
 
+TEST_F(BasicTest, testMemoryUsage) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+
+    const char *key = "42424242";
+    int keylen = strlen(key);
+    size_t before = cryptosqlite::memoryUsage();
+
+    // open database allocates page buffers
+    sqlite3 *db;
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    ASSERT_LT(before, cryptosqlite::memoryUsage());
+
+    // working buffers are granted even if the limit is too small
+    cryptosqlite::setMemoryLimit(1);
+    ASSERT_OK(sqlite3_exec(db, "create table 'test' (id INTEGER PRIMARY KEY);", nullptr, nullptr, nullptr));
+    cryptosqlite::setMemoryLimit(0);
+
+    // closing releases everything
+    ASSERT_OK(sqlite3_close(db));
+    ASSERT_EQ(before, cryptosqlite::memoryUsage());
+}
+
+TEST_F(BasicTest, testTestCryptKeyCacheRekey) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+    cryptosqlite::setKeyCache(16);
+
+    const char *key = "42424242", *newkey = "8921897129818";
+    int keylen = strlen(key), newlen = strlen(newkey);
+
+    // second read is served from cache
+    testWrite(key, keylen, true);
+    testRead(key, keylen);
+    testRead(key, keylen);
+
+    testRekey(key, keylen, newkey, newlen);
+    testRead(newkey, newlen);
+    testRead(newkey, newlen);
+
+    cryptosqlite::setKeyCache(0);
+}
+
+TEST_F(BasicTest, testTestCryptKeyCacheHits) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+    cryptosqlite::setKeyCache(16);
+
+    const char *key = "42424242", *wrongkey = "24242424";
+    int keylen = strlen(key);
+    uint64_t hits, misses, hitsBefore, missesBefore;
+    cryptosqlite::keyCacheStats(hitsBefore, missesBefore);
+
+    // creating does not look up, the first read misses and the second hits
+    testWrite(key, keylen);
+    testRead(key, keylen);
+    testRead(key, keylen);
+    cryptosqlite::keyCacheStats(hits, misses);
+    EXPECT_EQ(1u, hits - hitsBefore);
+    EXPECT_EQ(1u, misses - missesBefore);
+
+    // another key is not answered from the cache
+    sqlite3 *db;
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, wrongkey, keylen));
+    sqlite3_exec(db, "select * from 'test';", nullptr, nullptr, nullptr);
+    ASSERT_OK(sqlite3_close(db));
+    cryptosqlite::keyCacheStats(hits, misses);
+    EXPECT_EQ(1u, hits - hitsBefore);
+    EXPECT_EQ(2u, misses - missesBefore);
+
+    // idle keys are evicted when their database is closed, not only on the next lookup
+    cryptosqlite::setKeyCache(0);
+    cryptosqlite::setKeyCache(16, std::chrono::seconds(0));
+    size_t usage = cryptosqlite::memoryUsage();
+    testRead(key, keylen);
+    EXPECT_EQ(usage, cryptosqlite::memoryUsage());
+
+    cryptosqlite::setKeyCache(0);
+}
+
+TEST_F(BasicTest, testTestCryptKeyCacheRecreate) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+    cryptosqlite::setKeyCache(16);
+
+    const char *key = "42424242";
+    int keylen = strlen(key);
+    uint64_t hits, misses, hitsBefore, missesBefore;
+
+    testWrite(key, keylen);
+    testRead(key, keylen);
+
+    // a new database at the same path with the same passphrase gets a new data key
+    std::remove("test.db");
+    std::remove("test.db-keyfile");
+    testWrite(key, keylen);
+    cryptosqlite::keyCacheStats(hitsBefore, missesBefore);
+    testRead(key, keylen);
+    testRead(key, keylen);
+    cryptosqlite::keyCacheStats(hits, misses);
+    EXPECT_EQ(1u, hits - hitsBefore);
+    EXPECT_EQ(1u, misses - missesBefore);
+
+    cryptosqlite::setKeyCache(0);
+}
+
+TEST_F(BasicTest, testTestCryptLazyKey) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+
+    const char *key = "42424242";
+    int keylen = strlen(key);
+
+    testWrite(key, keylen);
+    ASSERT_EQ(0, std::rename("test.db-keyfile", "test.db-keyfile-moved"));
+
+    // opening does not touch the keyfile, the first page access fails without it
+    sqlite3 *db;
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    ASSERT_NE(SQLITE_OK, sqlite3_exec(db, "select * from 'test';", nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_close(db));
+
+    ASSERT_EQ(0, std::rename("test.db-keyfile-moved", "test.db-keyfile"));
+    testRead(key, keylen);
+}
+
+TEST_F(BasicTest, testTestCryptBatchOpen) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+
+    const char *key = "42424242";
+    int keylen = strlen(key);
+
+    std::vector<std::string> names;
+    for (int i = 0; i < 16; i++) {
+        names.push_back("test-batch" + std::to_string(i) + ".db");
+        std::remove(names.back().c_str());
+        std::remove((names.back() + "-keyfile").c_str());
+    }
+
+    // create and fill all databases
+    std::vector<sqlite3_encrypted_open> entries(names.size());
+    for (size_t i = 0; i < names.size(); i++)
+        entries[i] = {names[i].c_str(), key, keylen, nullptr, SQLITE_ERROR};
+    ASSERT_OK(sqlite3_open_encrypted_batch(entries.data(), entries.size(), 4));
+
+    for (auto &entry : entries) {
+        ASSERT_OK(entry.rc);
+        ASSERT_OK(sqlite3_exec(entry.pDb, "create table 'test' (id INTEGER PRIMARY KEY); insert into 'test' VALUES (42);",
+                               nullptr, nullptr, nullptr));
+        ASSERT_OK(sqlite3_close(entry.pDb));
+    }
+
+    // reopen and read back
+    ASSERT_OK(sqlite3_open_encrypted_batch(entries.data(), entries.size(), 4));
+    for (auto &entry : entries) {
+        int count = 0;
+        ASSERT_OK(entry.rc);
+        ASSERT_OK(sqlite3_exec(entry.pDb, "select * from 'test';", [] (void *data, int, char **argv, char **) -> int {
+            EXPECT_STREQ("42", argv[0]);
+            (*static_cast<int *>(data))++;
+            return 0;
+        }, &count, nullptr));
+        ASSERT_EQ(1, count);
+        ASSERT_OK(sqlite3_close(entry.pDb));
+    }
+}
+
+TEST_F(BasicTest, testTestCryptRekeyAsync) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+
+    const char *key = "42424242", *newkey = "8921897129818", *rotatekey = "1337";
+    int keylen = strlen(key), newlen = strlen(newkey), rotatelen = strlen(rotatekey);
+
+    testWrite(key, keylen, true);
+
+    // rewrap only
+    sqlite3_rekey_task *task = sqlite3_rekey_encrypted_async("test.db", key, keylen, newkey, newlen, 0, 0, nullptr, nullptr);
+    ASSERT_NE(nullptr, task);
+    ASSERT_OK(sqlite3_rekey_wait(task));
+    testRead(newkey, newlen);
+
+    // re-encrypt all pages with a fresh data key, counting progress reports
+    int reports = 0;
+    task = sqlite3_rekey_encrypted_async("test.db", newkey, newlen, rotatekey, rotatelen, CRYPTOSQLITE_REKEY_ROTATE,
+            0, [] (void *arg, int, int) -> int {
+        (*static_cast<int *>(arg))++;
+        return 0;
+    }, &reports);
+    ASSERT_OK(sqlite3_rekey_wait(task));
+    ASSERT_LT(0, reports);
+    testRead(rotatekey, rotatelen);
+
+    // cancelled from the progress callback, database is unchanged
+    task = sqlite3_rekey_encrypted_async("test.db", rotatekey, rotatelen, key, keylen, CRYPTOSQLITE_REKEY_ROTATE,
+            0, [] (void *, int, int) -> int { return 1; }, nullptr);
+    ASSERT_EQ(SQLITE_INTERRUPT, sqlite3_rekey_wait(task));
+    testRead(rotatekey, rotatelen);
+
+    // throttled to one page per second: holds the database lock, but no worker of the shared pool
+    task = sqlite3_rekey_encrypted_async("test.db", rotatekey, rotatelen, key, keylen, CRYPTOSQLITE_REKEY_ROTATE,
+            1, nullptr, nullptr);
+    int done = 0;
+    for (int i = 0; i < 500 && done == 0; i++) {
+        ASSERT_OK(sqlite3_rekey_status(task, &done, nullptr));
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ASSERT_LT(0, done);
+
+    sqlite3 *db;
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, rotatekey, rotatelen));
+    ASSERT_EQ(SQLITE_BUSY, sqlite3_exec(db, "INSERT INTO test VALUES (100000, 'busy');", nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_close(db));
+
+    ASSERT_OK(sqlite3_verify_encrypted("test.db", rotatekey, rotatelen, 0, nullptr, nullptr));
+    ASSERT_OK(sqlite3_rekey_status(task, nullptr, nullptr));
+
+    sqlite3_rekey_cancel(task);
+    ASSERT_EQ(SQLITE_INTERRUPT, sqlite3_rekey_wait(task));
+    testRead(rotatekey, rotatelen);
+}
+
+TEST_F(BasicTest, testTestCryptVerify) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+
+    const char *key = "42424242", *wrongkey = "8921897129818";
+    int keylen = strlen(key), wronglen = strlen(wrongkey);
+
+    testWrite(key, keylen, false, 2000);
+
+    std::vector<sqlite3_int64> bad;
+    auto report = [] (void *arg, int wal, sqlite3_int64 page) {
+        EXPECT_EQ(0, wal);
+        static_cast<std::vector<sqlite3_int64> *>(arg)->push_back(page);
+    };
+
+    ASSERT_OK(sqlite3_verify_encrypted("test.db", key, keylen, 4, report, &bad));
+    ASSERT_TRUE(bad.empty());
+    ASSERT_EQ(SQLITE_NOTADB, sqlite3_verify_encrypted("test.db", wrongkey, wronglen, 0, report, &bad));
+
+    // damage the database header on disk
+    FILE *file = fopen("test.db", "r+b");
+    ASSERT_NE(nullptr, file);
+    int first = fgetc(file);
+    fseek(file, 0, SEEK_SET);
+    fputc(first ^ 0xFF, file);
+    fclose(file);
+
+    ASSERT_EQ(SQLITE_CORRUPT, sqlite3_verify_encrypted("test.db", key, keylen, 4, report, &bad));
+    ASSERT_EQ(std::vector<sqlite3_int64>({1}), bad);
+}
+
+TEST_F(BasicTest, testTaggedTestCryptIntegrityTree) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TaggedTestCrypt());
+    });
+
+    const char *key = "42424242";
+    int keylen = strlen(key);
+
+    testReadWrite(key, keylen);
+
+    // keep the current database content
+    std::vector<char> old;
+    FILE *file = fopen("test.db", "rb");
+    ASSERT_NE(nullptr, file);
+    for (int c; (c = fgetc(file)) != EOF; )
+        old.push_back(static_cast<char>(c));
+    fclose(file);
+
+    // root changes with every write and is stable across reopening
+    sqlite3 *db;
+    uint64_t root = 0, newRoot = 0;
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    ASSERT_EQ(8, sqlite3_integrity_root(db, &root, sizeof(root)));
+    ASSERT_OK(sqlite3_exec(db, "update 'test' set name = 'changed';", nullptr, nullptr, nullptr));
+    sqlite3_integrity_root(db, &newRoot, sizeof(newRoot));
+    ASSERT_NE(root, newRoot);
+    ASSERT_OK(sqlite3_close(db));
+
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    sqlite3_integrity_root(db, &root, sizeof(root));
+    ASSERT_EQ(newRoot, root);
+    ASSERT_OK(sqlite3_close(db));
+
+    // roll back the database file, pages still authenticate but do not match the tree
+    file = fopen("test.db", "wb");
+    ASSERT_NE(nullptr, file);
+    fwrite(old.data(), 1, old.size(), file);
+    fclose(file);
+
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    ASSERT_NE(SQLITE_OK, sqlite3_exec(db, "select * from 'test';", nullptr, nullptr, nullptr));
+    ASSERT_EQ(SQLITE_IOERR_DATA, sqlite3_extended_errcode(db));
+    sqlite3_close(db);
+
+    // a tampered tree does not authenticate and fails to open
+    std::string tree = readFile("test.db-merkle");
+    std::string tampered = tree;
+    tampered.back() ^= 0xFF;
+    writeFile("test.db-merkle", tampered);
+
+    ASSERT_EQ(SQLITE_CORRUPT, sqlite3_open_encrypted("test.db", &db, key, keylen));
+    sqlite3_close(db);
+
+    // as does a tree torn by a crash, or a missing one
+    writeFile("test.db-merkle", tree.substr(0, tree.size() / 2));
+    ASSERT_EQ(SQLITE_CORRUPT, sqlite3_open_encrypted("test.db", &db, key, keylen));
+    sqlite3_close(db);
+
+    remove("test.db-merkle");
+    ASSERT_EQ(SQLITE_CORRUPT, sqlite3_open_encrypted("test.db", &db, key, keylen));
+    sqlite3_close(db);
+
+    // rebuilding trusts the pages on disk, the root kept outside detects the rollback
+    ASSERT_EQ(SQLITE_MISUSE, sqlite3_integrity_rebuild("test.db", nullptr, 0));
+    ASSERT_OK(sqlite3_integrity_rebuild("test.db", key, keylen));
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    ASSERT_OK(sqlite3_exec(db, "select * from 'test';", nullptr, nullptr, nullptr));
+    sqlite3_integrity_root(db, &root, sizeof(root));
+    ASSERT_NE(newRoot, root);
+    ASSERT_OK(sqlite3_exec(db, "update 'test' set name = 'again';", nullptr, nullptr, nullptr));
+    sqlite3_integrity_root(db, &newRoot, sizeof(newRoot));
+    ASSERT_OK(sqlite3_close(db));
+
+    // changes are saved in place and the tree stays stable across reopening
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    sqlite3_integrity_root(db, &root, sizeof(root));
+    ASSERT_EQ(newRoot, root);
+    ASSERT_OK(sqlite3_exec(db, "select * from 'test';", nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_close(db));
+
+    // a crash after the journal of a save was synced completes the save on the next open. the journal replaces the
+    // whole file here: magic, file size, entry count and FNV-1a checksum, then offset, size and bytes of the entry.
+    std::string saved = readFile("test.db-merkle");
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    ASSERT_OK(sqlite3_exec(db, "update 'test' set name = 'journaled';", nullptr, nullptr, nullptr));
+    sqlite3_integrity_root(db, &newRoot, sizeof(newRoot));
+    ASSERT_OK(sqlite3_close(db));
+    ASSERT_EQ(0, fileSize("test.db-merkle-journal"));
+    std::string updated = readFile("test.db-merkle");
+
+    auto bigEndian = [] (uint64_t value, int size) {
+        std::string out;
+        for (int i = size - 1; i >= 0; i--)
+            out.push_back(static_cast<char>(value >> (8 * i)));
+        return out;
+    };
+    std::string entry = bigEndian(0, 8) + bigEndian(updated.size(), 4) + updated;
+    uint64_t checksum = 0xcbf29ce484222325ull;
+    for (char c : entry)
+        checksum = (checksum ^ static_cast<uint8_t>(c)) * 0x100000001b3ull;
+    writeFile("test.db-merkle-journal", std::string("cSQLmkj1") + bigEndian(updated.size(), 8) + bigEndian(1, 4) +
+                                        bigEndian(checksum, 8) + entry);
+    writeFile("test.db-merkle", saved.substr(0, saved.size() / 2));
+
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    sqlite3_integrity_root(db, &root, sizeof(root));
+    ASSERT_EQ(newRoot, root);
+    ASSERT_OK(sqlite3_exec(db, "select * from 'test';", nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_close(db));
+}
+
+TEST_F(BasicTest, testNonceTestCryptUnique) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new NonceTestCrypt());
+    });
+    NonceTestCrypt::nonces().clear();
+
+    const char *key = "42424242";
+    int keylen = strlen(key);
+
+    // two connections writing alternately reserve disjoint nonce blocks
+    sqlite3 *db1, *db2;
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db1, key, keylen));
+    ASSERT_OK(sqlite3_exec(db1, "create table 'test' (id INTEGER PRIMARY KEY, name TEXT);", nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db2, key, keylen));
+
+    for (int i = 0; i < 100; i++) {
+        std::string insert = "insert into 'test' VALUES (" + std::to_string(i) + ", 'hanswurst" + std::to_string(i) + "');";
+        ASSERT_OK(sqlite3_exec(i % 2 ? db2 : db1, insert.c_str(), nullptr, nullptr, nullptr));
+    }
+    ASSERT_OK(sqlite3_close(db1));
+    ASSERT_OK(sqlite3_close(db2));
+
+    // counter continues after reopening
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db1, key, keylen));
+    ASSERT_OK(sqlite3_exec(db1, "update 'test' set name = 'changed';", nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_close(db1));
+
+    auto nonces = NonceTestCrypt::nonces();
+    ASSERT_LT(100u, nonces.size());
+    std::sort(nonces.begin(), nonces.end());
+    ASSERT_EQ(nonces.end(), std::adjacent_find(nonces.begin(), nonces.end()));
+}
+
+TEST_F(BasicTest, testCipherRegistry) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+    cryptosqlite::registerCipher("plain", [] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new PlaintextCrypt());
+    });
+    cryptosqlite::registerCipher("test", [] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+
+    const char *key = "42424242";
+    int keylen = strlen(key);
+    const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+
+    // new database selects the cipher
+    sqlite3 *db;
+    ASSERT_OK(sqlite3_open_encrypted_v2("test.db", &db, flags, key, keylen, "plain"));
+    ASSERT_OK(sqlite3_exec(db, "create table 'test' (id INTEGER PRIMARY KEY); insert into 'test' VALUES (42);",
+                           nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_close(db));
+
+    std::ifstream file("test.db", std::ios::binary);
+    std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    ASSERT_EQ(0u, content.find("SQLite format 3"));
+
+    // reopening uses the cipher recorded in the keyfile, also if it is only named in the URI
+    int count = 0;
+    ASSERT_OK(sqlite3_open_encrypted_v2("test.db", &db, flags, key, keylen, nullptr));
+    ASSERT_OK(sqlite3_exec(db, "select * from 'test';", countRows, &count, nullptr));
+    ASSERT_OK(sqlite3_close(db));
+    ASSERT_OK(sqlite3_open_encrypted_v2("file:test.db?cipher=plain", &db, flags | SQLITE_OPEN_URI, key, keylen,
+                                        nullptr));
+    ASSERT_OK(sqlite3_exec(db, "select * from 'test';", countRows, &count, nullptr));
+    ASSERT_OK(sqlite3_close(db));
+    ASSERT_EQ(2, count);
+
+    // another cipher is rejected on first access, an unknown one on open
+    ASSERT_OK(sqlite3_open_encrypted_v2("test.db", &db, flags, key, keylen, "test"));
+    ASSERT_NE(SQLITE_OK, sqlite3_exec(db, "select * from 'test';", nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_close(db));
+    ASSERT_EQ(SQLITE_CANTOPEN, sqlite3_open_encrypted_v2("test.db", &db, flags, key, keylen, "unknown"));
+    sqlite3_close(db);
+
+    // with a cached key, the cipher is taken from the cache
+    uint64_t hits, misses, newHits;
+    cryptosqlite::setKeyCache(4);
+    cryptosqlite::keyCacheStats(hits, misses);
+    for (int i = 0; i < 2; i++) {
+        ASSERT_OK(sqlite3_open_encrypted_v2("test.db", &db, flags, key, keylen, nullptr));
+        ASSERT_OK(sqlite3_exec(db, "select * from 'test';", countRows, &count, nullptr));
+        ASSERT_OK(sqlite3_close(db));
+    }
+    cryptosqlite::keyCacheStats(newHits, misses);
+    cryptosqlite::setKeyCache(0);
+    ASSERT_EQ(hits + 1, newHits);
+    ASSERT_EQ(4, count);
+
+    // removed ciphers are unknown, connections already open keep creating plugin instances for their tasks
+    ASSERT_OK(sqlite3_open_encrypted_v2("test.db", &db, flags, key, keylen, nullptr));
+    cryptosqlite::unregisterCipher("plain");
+    sqlite3_int64 blob;
+    ASSERT_OK(sqlite3_blob_store_write(db, "value", 5, &blob));
+    ASSERT_OK(sqlite3_blob_store_delete(db, blob));
+    ASSERT_OK(sqlite3_exec(db, "select * from 'test';", countRows, &count, nullptr));
+    ASSERT_OK(sqlite3_close(db));
+    ASSERT_EQ(SQLITE_CANTOPEN, sqlite3_open_encrypted_v2("test.db", &db, flags, key, keylen, nullptr));
+    sqlite3_close(db);
+}
+
+TEST_F(BasicTest, testPlaintextTables) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+
+    const char *key = "42424242";
+    int keylen = strlen(key);
+    const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI;
+
+    // page flags are reserved when the database is created
+    sqlite3 *db;
+    ASSERT_OK(sqlite3_open_encrypted_v2("file:test.db?selective=1", &db, flags, key, keylen, nullptr));
+    ASSERT_OK(sqlite3_exec(db, "create table 'public' (name TEXT); create table 'secret' (name TEXT);",
+                           nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_plaintext_tables(db, "public"));
+    ASSERT_OK(sqlite3_exec(db, "insert into 'public' VALUES ('visible-value'); "
+                               "insert into 'secret' VALUES ('hidden-value');", nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_close(db));
+
+    std::ifstream file("test.db", std::ios::binary);
+    std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    ASSERT_NE(std::string::npos, content.find("visible-value"));
+    ASSERT_EQ(std::string::npos, content.find("hidden-value"));
+
+    // mixed pages read back transparently
+    int count = 0;
+    ASSERT_OK(sqlite3_open_encrypted_v2("test.db", &db, flags, key, keylen, nullptr));
+    ASSERT_OK(sqlite3_exec(db, "select * from 'public' where name = 'visible-value';", countRows, &count, nullptr));
+    ASSERT_OK(sqlite3_exec(db, "select * from 'secret' where name = 'hidden-value';", countRows, &count, nullptr));
+    ASSERT_OK(sqlite3_close(db));
+    ASSERT_EQ(2, count);
+
+    // a plaintext page placed where the keyfile expects an encrypted one is rejected, here the root of 'secret'
+    ASSERT_OK(sqlite3_open_encrypted_v2("test.db", &db, flags, key, keylen, nullptr));
+    auto pageSize = static_cast<size_t>(queryInt(db, "pragma page_size;"));
+    ASSERT_OK(sqlite3_close(db));
+    std::string forged = readFile("test.db");
+    forged.replace(2 * pageSize, pageSize, forged.substr(pageSize, pageSize));
+    writeFile("test.db", forged);
+    testQuery("test.db", key, keylen, "select count(*) from 'public';", 1);
+    ASSERT_OK(sqlite3_open_encrypted_v2("test.db", &db, flags, key, keylen, nullptr));
+    EXPECT_NE(SQLITE_OK, sqlite3_exec(db, "select * from 'secret';", nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_close(db));
+
+    // databases without page flags are always encrypted
+    std::remove("test-encrypted.db");
+    std::remove("test-encrypted.db-keyfile");
+    ASSERT_OK(sqlite3_open_encrypted_v2("test-encrypted.db", &db, flags, key, keylen, nullptr));
+    ASSERT_OK(sqlite3_exec(db, "create table 'public' (name TEXT);", nullptr, nullptr, nullptr));
+    ASSERT_EQ(SQLITE_MISUSE, sqlite3_plaintext_tables(db, "public"));
+    ASSERT_OK(sqlite3_close(db));
+    std::remove("test-encrypted.db");
+    std::remove("test-encrypted.db-keyfile");
+}
+
+TEST_F(BasicTest, testTestCryptBlobStore) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+
+    const char *key = "42424242";
+    int keylen = strlen(key);
+
+    // spans several chunks, the last one partially
+    std::vector<uint8_t> value(3 * 1024 * 1024 + 1234);
+    for (size_t i = 0; i < value.size(); i++)
+        value[i] = static_cast<uint8_t>(i * 7 + i / 4096);
+
+    sqlite3 *db;
+    sqlite3_int64 id = 0, size = 0;
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    ASSERT_OK(sqlite3_blob_store_write(db, value.data(), value.size(), &id));
+    ASSERT_OK(sqlite3_close(db));
+
+    // whole value and a range across a chunk boundary
+    std::vector<uint8_t> read(value.size());
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    ASSERT_OK(sqlite3_blob_store_size(db, id, &size));
+    ASSERT_EQ(static_cast<sqlite3_int64>(value.size()), size);
+    ASSERT_OK(sqlite3_blob_store_read(db, id, read.data(), size, 0));
+    ASSERT_TRUE(read == value);
+    ASSERT_OK(sqlite3_blob_store_read(db, id, read.data(), 100, 1024 * 1024 - 50));
+    ASSERT_EQ(0, memcmp(read.data(), value.data() + 1024 * 1024 - 50, 100));
+    ASSERT_EQ(SQLITE_ERROR, sqlite3_blob_store_read(db, id, read.data(), 2, size - 1));
+
+    // a shortened side file is detected
+    std::string blobFile = "test.db-blob-" + std::to_string(id);
+    std::ifstream in(blobFile, std::ios::binary);
+    std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    std::ofstream(blobFile, std::ios::binary | std::ios::trunc).write(content.data(), content.size() - 100);
+    ASSERT_EQ(SQLITE_CORRUPT, sqlite3_blob_store_read(db, id, read.data(), 100, 0));
+
+    ASSERT_OK(sqlite3_blob_store_delete(db, id));
+    ASSERT_EQ(SQLITE_NOTFOUND, sqlite3_blob_store_size(db, id, &size));
+
+    // side files of a rolled back transaction are removed by the next write
+    sqlite3_int64 first = 0, second = 0;
+    ASSERT_OK(sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_blob_store_write(db, "first", 5, &first));
+    ASSERT_OK(sqlite3_blob_store_write(db, "second", 6, &second));
+    ASSERT_OK(sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr));
+    std::string orphan = "test.db-blob-" + std::to_string(second);
+    ASSERT_TRUE(std::ifstream(orphan).good());
+    ASSERT_OK(sqlite3_blob_store_write(db, "value", 5, &id));
+    ASSERT_NE(second, id);
+    ASSERT_FALSE(std::ifstream(orphan).good());
+
+    // copies carry the side files, page-level sync would miss them
+    ASSERT_OK(sqlite3_clone_encrypted(db, "test-clone.db", nullptr, 0, 0));
+    ASSERT_OK(sqlite3_vacuum_into_encrypted(db, "test-vacuum.db", "1234", 4, 0));
+    ASSERT_EQ(SQLITE_MISUSE, sqlite3_sync_encrypted("test.db", "test-standby.db", 0));
+    ASSERT_OK(sqlite3_blob_store_delete(db, id));
+    ASSERT_OK(sqlite3_close(db));
+
+    auto readCopy = [id] (const char *fileName, const char *copyKey) {
+        sqlite3 *copy;
+        char buffer[5];
+        ASSERT_OK(sqlite3_open_encrypted(fileName, &copy, copyKey, strlen(copyKey)));
+        ASSERT_OK(sqlite3_blob_store_read(copy, id, buffer, 5, 0));
+        ASSERT_EQ(0, memcmp(buffer, "value", 5));
+        ASSERT_OK(sqlite3_blob_store_delete(copy, id));
+        ASSERT_OK(sqlite3_close(copy));
+    };
+    readCopy("test-clone.db", key);
+    readCopy("test-vacuum.db", "1234");
+    removeDatabase("test-clone.db");
+    removeDatabase("test-vacuum.db");
+}
+
+TEST_F(BasicTest, testTestCryptReadAhead) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+
+    const char *key = "42424242";
+    int keylen = strlen(key);
+
+    // values spanning long overflow chains
+    std::vector<std::vector<uint8_t>> values(2, std::vector<uint8_t>(1536 * 1024));
+    for (size_t v = 0; v < values.size(); v++)
+        for (size_t i = 0; i < values[v].size(); i++)
+            values[v][i] = static_cast<uint8_t>(i * (v + 3) + i / 1000);
+
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    ASSERT_OK(sqlite3_exec(db, "create table 'test' (id INTEGER PRIMARY KEY, value BLOB);", nullptr, nullptr,
+                           nullptr));
+    ASSERT_OK(sqlite3_prepare_v2(db, "insert into 'test' VALUES (?, ?);", -1, &stmt, nullptr));
+    for (size_t v = 0; v < values.size(); v++) {
+        sqlite3_bind_int(stmt, 1, static_cast<int>(v));
+        sqlite3_bind_blob(stmt, 2, values[v].data(), static_cast<int>(values[v].size()), SQLITE_STATIC);
+        ASSERT_EQ(SQLITE_DONE, sqlite3_step(stmt));
+        ASSERT_OK(sqlite3_reset(stmt));
+    }
+    ASSERT_OK(sqlite3_finalize(stmt));
+    ASSERT_OK(sqlite3_close(db));
+
+    auto check = [&values] (sqlite3 *db) {
+        sqlite3_stmt *stmt;
+        ASSERT_OK(sqlite3_prepare_v2(db, "select id, value from 'test' order by id;", -1, &stmt, nullptr));
+        for (size_t v = 0; v < values.size(); v++) {
+            ASSERT_EQ(SQLITE_ROW, sqlite3_step(stmt));
+            ASSERT_EQ(static_cast<int>(values[v].size()), sqlite3_column_bytes(stmt, 1));
+            ASSERT_EQ(0, memcmp(values[v].data(), sqlite3_column_blob(stmt, 1), values[v].size()));
+        }
+        ASSERT_EQ(SQLITE_DONE, sqlite3_step(stmt));
+        ASSERT_OK(sqlite3_finalize(stmt));
+    };
+
+    // read-ahead is opt-in
+    uint64_t read, used, newRead, newUsed;
+    cryptosqlite::readAheadStats(read, used);
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    check(db);
+    ASSERT_OK(sqlite3_close(db));
+    cryptosqlite::readAheadStats(newRead, newUsed);
+    ASSERT_EQ(read, newRead);
+
+    // sqlite reads pages decrypted ahead of it
+    cryptosqlite::setReadAhead(16);
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    check(db);
+    cryptosqlite::readAheadStats(newRead, newUsed);
+    ASSERT_LT(used, newUsed);
+    ASSERT_LE(newUsed - used, newRead - read);
+
+    // pages read ahead are dropped when the value changes
+    std::reverse(values[0].begin(), values[0].end());
+    ASSERT_OK(sqlite3_prepare_v2(db, "update 'test' set value = ? where id = 0;", -1, &stmt, nullptr));
+    sqlite3_bind_blob(stmt, 1, values[0].data(), static_cast<int>(values[0].size()), SQLITE_STATIC);
+    ASSERT_EQ(SQLITE_DONE, sqlite3_step(stmt));
+    ASSERT_OK(sqlite3_finalize(stmt));
+    check(db);
+    ASSERT_OK(sqlite3_close(db));
+    cryptosqlite::setReadAhead(0);
+}
+
+TEST_F(BasicTest, testTestCryptBTreeReadAhead) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+    cryptosqlite::setBTreeReadAhead(8);
+
+    const char *key = "42424242";
+    int keylen = strlen(key);
+    const int rowCount = 20000;
+
+    // table and index spanning many leaves below their interior pages
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    ASSERT_OK(sqlite3_exec(db, "create table 'test' (id INTEGER PRIMARY KEY, name TEXT);"
+                               "create index 'test_name' on 'test' (name);", nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_exec(db, "BEGIN TRANSACTION;", nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_prepare_v2(db, "insert into 'test' VALUES (?, printf('name-%08d', ?));", -1, &stmt, nullptr));
+    for (int i = 0; i < rowCount; i++) {
+        sqlite3_bind_int(stmt, 1, i);
+        sqlite3_bind_int(stmt, 2, rowCount - i);
+        ASSERT_EQ(SQLITE_DONE, sqlite3_step(stmt));
+        ASSERT_OK(sqlite3_reset(stmt));
+    }
+    ASSERT_OK(sqlite3_finalize(stmt));
+    ASSERT_OK(sqlite3_exec(db, "END TRANSACTION;", nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_close(db));
+
+    // scans in both directions over the table and the index
+    const char *queries[] = {
+            "select count(*), sum(id) from 'test' where id >= 1000;",
+            "select count(*), sum(id) from (select id from 'test' where id >= 1000 order by id desc);",
+            "select count(*), sum(id) from (select id from 'test' where name >= 'name-00001000' order by name);",
+            "select count(*), sum(id) from (select id from 'test' where name >= 'name-00001000' order by name desc);"
+    };
+    const sqlite3_int64 counts[] = {rowCount - 1000, rowCount - 1000, rowCount - 999, rowCount - 999};
+    const sqlite3_int64 sums[] = {
+            static_cast<sqlite3_int64>(rowCount - 1) * rowCount / 2 - 999 * 1000 / 2,
+            static_cast<sqlite3_int64>(rowCount - 1) * rowCount / 2 - 999 * 1000 / 2,
+            static_cast<sqlite3_int64>(rowCount - 999) * (rowCount - 1000) / 2,
+            static_cast<sqlite3_int64>(rowCount - 999) * (rowCount - 1000) / 2
+    };
+
+    uint64_t read, used, newRead, newUsed;
+    cryptosqlite::readAheadStats(read, used);
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    for (size_t q = 0; q < sizeof(queries) / sizeof(queries[0]); q++) {
+        ASSERT_OK(sqlite3_prepare_v2(db, queries[q], -1, &stmt, nullptr));
+        ASSERT_EQ(SQLITE_ROW, sqlite3_step(stmt));
+        EXPECT_EQ(counts[q], sqlite3_column_int64(stmt, 0));
+        EXPECT_EQ(sums[q], sqlite3_column_int64(stmt, 1));
+        ASSERT_OK(sqlite3_finalize(stmt));
+    }
+    ASSERT_OK(sqlite3_close(db));
+
+    // only siblings are read ahead, the rows have no overflow pages
+    cryptosqlite::readAheadStats(newRead, newUsed);
+    ASSERT_LT(used, newUsed);
+    ASSERT_LE(newUsed - used, newRead - read);
+
+    cryptosqlite::setBTreeReadAhead(0);
+}
+
+TEST_F(BasicTest, testTestCryptParallelScan) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+
+    const char *key = "42424242";
+    int keylen = strlen(key);
+    const int rowCount = 5000;
+
+    // some rows spill to overflow pages
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    ASSERT_OK(sqlite3_exec(db, "create table 'test' (id INTEGER PRIMARY KEY, name TEXT, value REAL, data BLOB);",
+                           nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_exec(db, "BEGIN TRANSACTION;", nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_prepare_v2(db, "insert into 'test' VALUES (?1, printf('name-%d', ?1), ?1 * 0.5, "
+                                     "zeroblob(CASE WHEN ?1 % 100 = 0 THEN 10000 ELSE ?1 % 7 END));", -1, &stmt,
+                                 nullptr));
+    for (int i = 1; i <= rowCount; i++) {
+        sqlite3_bind_int(stmt, 1, i);
+        ASSERT_EQ(SQLITE_DONE, sqlite3_step(stmt));
+        ASSERT_OK(sqlite3_reset(stmt));
+    }
+    ASSERT_OK(sqlite3_finalize(stmt));
+    ASSERT_OK(sqlite3_exec(db, "END TRANSACTION;", nullptr, nullptr, nullptr));
+
+    struct Result {
+        std::mutex mutex;
+        sqlite3_int64 rows = 0, sum = 0;
+        int bad = 0;
+    } result;
+
+    auto rows = [] (void *arg, int nRow, int nCol, const sqlite3_int64 *aRowid, const sqlite3_scan_value *aValue) {
+        auto result = static_cast<Result *>(arg);
+        int bad = 0;
+        for (int r = 0; r < nRow; r++) {
+            const sqlite3_scan_value *row = aValue + r * nCol;
+            std::string name = "name-" + std::to_string(aRowid[r]);
+            size_t size = aRowid[r] % 100 == 0 ? 10000 : aRowid[r] % 7;
+
+            bool valid = nCol == 4 && row[0].eType == SQLITE_INTEGER && row[0].iValue == aRowid[r] &&
+                         row[1].eType == SQLITE_TEXT && std::string(static_cast<const char *>(row[1].pData),
+                                                                    row[1].nData) == name &&
+                         row[2].eType == SQLITE_FLOAT && row[2].rValue == aRowid[r] * 0.5 &&
+                         row[3].eType == SQLITE_BLOB && static_cast<size_t>(row[3].nData) == size;
+            for (int i = 0; valid && i < row[3].nData; i++)
+                valid = static_cast<const uint8_t *>(row[3].pData)[i] == 0;
+            bad += !valid;
+        }
+
+        std::lock_guard<std::mutex> lock(result->mutex);
+        result->rows += nRow;
+        for (int r = 0; r < nRow; r++)
+            result->sum += aRowid[r];
+        result->bad += bad;
+        return 0;
+    };
+
+    ASSERT_OK(sqlite3_parallel_scan(db, "test", 4, rows, &result));
+    EXPECT_EQ(rowCount, result.rows);
+    EXPECT_EQ(static_cast<sqlite3_int64>(rowCount) * (rowCount + 1) / 2, result.sum);
+    EXPECT_EQ(0, result.bad);
+
+    // aborted by the callback, unknown tables
+    ASSERT_EQ(SQLITE_ABORT, sqlite3_parallel_scan(db, "test", 0, [] (void *, int, int, const sqlite3_int64 *,
+            const sqlite3_scan_value *) { return 1; }, nullptr));
+    ASSERT_EQ(SQLITE_NOTFOUND, sqlite3_parallel_scan(db, "missing", 0, rows, &result));
+    ASSERT_NE(0, sqlite3_get_autocommit(db));
+    ASSERT_OK(sqlite3_close(db));
+
+    // a wrong key fails the scan without leaving its transaction open
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, "wrong", 5));
+    ASSERT_NE(SQLITE_OK, sqlite3_parallel_scan(db, "test", 0, rows, &result));
+    ASSERT_NE(0, sqlite3_get_autocommit(db));
+    ASSERT_OK(sqlite3_close(db));
+}
+
+TEST_F(BasicTest, testTestCryptSync) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+
+    const char *key = "42424242";
+    int keylen = strlen(key);
+
+    sqlite3 *db;
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    ASSERT_OK(sqlite3_exec(db, "create table 'test' (id INTEGER PRIMARY KEY, name TEXT);"
+                               "with recursive n(i) as (select 1 union all select i + 1 from n where i < 50000) "
+                               "insert into 'test' select i, printf('name-%08d', i) from n;", nullptr, nullptr,
+                           nullptr));
+    ASSERT_OK(sqlite3_close(db));
+
+    // standby is a copy of the primary
+    for (const char *suffix : {"", "-keyfile"}) {
+        std::ifstream in(std::string("test.db") + suffix, std::ios::binary);
+        std::ofstream(std::string("test-standby.db") + suffix, std::ios::binary) << in.rdbuf();
+    }
+
+    auto change = [key, keylen] (const char *sql) {
+        sqlite3 *db;
+        ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+        ASSERT_OK(sqlite3_exec(db, sql, nullptr, nullptr, nullptr));
+        ASSERT_OK(sqlite3_close(db));
+    };
+
+    // streams through memory, as they would go through a pipe
+    struct Stream {
+        std::string data;
+        size_t offset = 0;
+    } signature, delta;
+    auto write = [] (void *arg, const void *data, int size) {
+        static_cast<Stream *>(arg)->data.append(static_cast<const char *>(data), size);
+        return SQLITE_OK;
+    };
+    auto read = [] (void *arg, void *data, int size) {
+        auto stream = static_cast<Stream *>(arg);
+        if (stream->offset + size > stream->data.size())
+            return SQLITE_IOERR_SHORT_READ;
+        memcpy(data, stream->data.data() + stream->offset, size);
+        stream->offset += size;
+        return SQLITE_OK;
+    };
+
+    change("update 'test' set name = 'changed' where id % 10000 = 0;");
+    ASSERT_OK(sqlite3_sync_signature("test-standby.db", 2, write, &signature));
+    ASSERT_OK(sqlite3_sync_delta("test.db", 2, read, &signature, write, &delta));
+    ASSERT_OK(sqlite3_sync_apply("test-standby.db", read, &delta));
+
+    // only the changed pages were transferred
+    std::ifstream primary("test.db", std::ios::binary | std::ios::ate);
+    EXPECT_LT(delta.data.size(), static_cast<size_t>(primary.tellg()) / 4);
+    testQuery("test-standby.db", key, keylen, "select count(*) from 'test' where name = 'changed';", 5);
+
+    // a delta cut short by a broken stream leaves the standby as it was
+    change("update 'test' set name = 'changed' where id % 1000 = 0;");
+    Stream cutSignature, cutDelta;
+    ASSERT_OK(sqlite3_sync_signature("test-standby.db", 2, write, &cutSignature));
+    ASSERT_OK(sqlite3_sync_delta("test.db", 2, read, &cutSignature, write, &cutDelta));
+    cutDelta.data.resize(cutDelta.data.size() / 2);
+    EXPECT_EQ(SQLITE_IOERR_SHORT_READ, sqlite3_sync_apply("test-standby.db", read, &cutDelta));
+    EXPECT_FALSE(std::ifstream("test-standby.db-rotate").good());
+    testQuery("test-standby.db", key, keylen, "select count(*) from 'test' where name = 'changed';", 5);
+
+    // a sync interrupted after replacing the database is finished before the next one stages its copy
+    writeFile("test-standby.db-rotate-keyfile", readFile("test-standby.db-keyfile"));
+    writeFile("test-standby.db-keyfile", "");
+    Stream pendingSignature, pendingDelta;
+    ASSERT_OK(sqlite3_sync_signature("test-standby.db", 2, write, &pendingSignature));
+    ASSERT_OK(sqlite3_sync_delta("test.db", 2, read, &pendingSignature, write, &pendingDelta));
+    pendingDelta.data.resize(pendingDelta.data.size() / 2);
+    EXPECT_EQ(SQLITE_IOERR_SHORT_READ, sqlite3_sync_apply("test-standby.db", read, &pendingDelta));
+    testQuery("test-standby.db", key, keylen, "select count(*) from 'test' where name = 'changed';", 5);
+
+    // local sync, the primary grows
+    change("with recursive n(i) as (select 50001 union all select i + 1 from n where i < 80000) "
+           "insert into 'test' select i, printf('name-%08d', i) from n;");
+    ASSERT_OK(sqlite3_sync_encrypted("test.db", "test-standby.db", 0));
+    testQuery("test-standby.db", key, keylen, "select count(*) from 'test';", 80000);
+    // the standby does not count nonces from where the primary does
+    EXPECT_NE(readFile("test.db-keyfile"), readFile("test-standby.db-keyfile"));
+
+    removeDatabase("test-standby.db");
+}
+
+TEST_F(BasicTest, testTestCryptWalTap) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+
+    const char *key = "42424242";
+    int keylen = strlen(key);
+
+    sqlite3 *db;
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    ASSERT_OK(sqlite3_exec(db, "pragma journal_mode = wal; pragma wal_autocheckpoint = 0;"
+                               "create table 'test' (id INTEGER PRIMARY KEY, name TEXT);"
+                               "with recursive n(i) as (select 1 union all select i + 1 from n where i < 1000) "
+                               "insert into 'test' select i, printf('name-%08d', i) from n;"
+                               "pragma wal_checkpoint(TRUNCATE);", nullptr, nullptr, nullptr));
+
+    // replica is a copy of the checkpointed primary, frames are applied as they are committed
+    ASSERT_OK(sqlite3_sync_encrypted("test.db", "test-replica.db", 0));
+    struct Replica {
+        int frames = 0;
+        int rc = SQLITE_OK;
+    } replica;
+    ASSERT_OK(sqlite3_wal_tap(db, [] (void *arg, const void *header, const void *frames, int first, int count,
+                                      int pageSize) {
+        auto replica = static_cast<Replica *>(arg);
+        replica->frames += count;
+        replica->rc = sqlite3_wal_apply("test-replica.db", header, frames, first, count, pageSize);
+        return replica->rc;
+    }, &replica));
+
+    ASSERT_OK(sqlite3_exec(db, "with recursive n(i) as (select 1001 union all select i + 1 from n where i < 3000) "
+                               "insert into 'test' select i, printf('name-%08d', i) from n;"
+                               "update 'test' set name = 'changed' where id % 100 = 0;", nullptr, nullptr, nullptr));
+    EXPECT_EQ(SQLITE_OK, replica.rc);
+    EXPECT_GT(replica.frames, 0);
+    testQuery("test-replica.db", key, keylen, "select count(*) from 'test';", 3000, SQLITE_OPEN_READONLY);
+    testQuery("test-replica.db", key, keylen, "select count(*) from 'test' where name = 'changed';", 30,
+              SQLITE_OPEN_READONLY);
+
+    // frames are shipped encrypted
+    std::ifstream in("test-replica.db-wal", std::ios::binary);
+    std::string wal((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    EXPECT_GT(wal.size(), 0u);
+    EXPECT_EQ(std::string::npos, wal.find("name-"));
+
+    // the log restarts after a checkpoint, the replica moves the previous one into its database first
+    ASSERT_OK(sqlite3_exec(db, "pragma wal_checkpoint(RESTART); delete from 'test' where id > 2000;", nullptr, nullptr,
+                           nullptr));
+    EXPECT_EQ(SQLITE_OK, replica.rc);
+    testQuery("test-replica.db", key, keylen, "select count(*) from 'test';", 2000, SQLITE_OPEN_READONLY);
+    testQuery("test-replica.db", key, keylen, "select count(*) from 'test' where name = 'changed';", 20,
+              SQLITE_OPEN_READONLY);
+    ASSERT_OK(sqlite3_close(db));
+
+    // frames can not be checkpointed into a replica with an integrity tree
+    const int pageSize = 4096;
+    std::vector<uint8_t> header(32), frames(24 + pageSize);
+    header[0] = 0x37, header[1] = 0x7f, header[2] = 0x06, header[3] = 0x82, header[10] = pageSize >> 8;
+    std::ofstream("test-replica.db-merkle").put(0);
+    ASSERT_EQ(SQLITE_MISUSE, sqlite3_wal_apply("test-replica.db", header.data(), frames.data(), 1, 1, pageSize));
+
+    removeDatabase("test-replica.db");
+}
+
+TEST_F(BasicTest, testTestCryptClone) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+
+    const char *key = "42424242", *newkey = "8921897129818";
+    int keylen = strlen(key), newlen = strlen(newkey);
+
+    sqlite3 *db;
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    ASSERT_OK(sqlite3_exec(db, "create table 'test' (id INTEGER PRIMARY KEY, name TEXT);"
+                               "with recursive n(i) as (select 1 union all select i + 1 from n where i < 20000) "
+                               "insert into 'test' select i, printf('name-%08d', i) from n;", nullptr, nullptr,
+                           nullptr));
+
+    // same file key, the copy is independent of the original
+    ASSERT_OK(sqlite3_clone_encrypted(db, "test-clone.db", nullptr, 0, 0));
+    ASSERT_EQ(SQLITE_CANTOPEN, sqlite3_clone_encrypted(db, "test-clone.db", nullptr, 0, 0));
+    ASSERT_OK(sqlite3_exec(db, "delete from 'test' where id > 10000;", nullptr, nullptr, nullptr));
+    testQuery("test-clone.db", key, keylen, "select count(*) from 'test';", 20000);
+    testQuery("test.db", key, keylen, "select count(*) from 'test';", 10000);
+
+    // snapshot of the caller's read transaction, with another file key
+    sqlite3_stmt *stmt;
+    ASSERT_OK(sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_prepare_v2(db, "select count(*) from 'test';", -1, &stmt, nullptr));
+    ASSERT_EQ(SQLITE_ROW, sqlite3_step(stmt));
+    ASSERT_OK(sqlite3_finalize(stmt));
+    ASSERT_OK(sqlite3_clone_encrypted(db, "test-clone2.db", newkey, newlen, 2));
+    ASSERT_OK(sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_close(db));
+
+    testQuery("test-clone2.db", newkey, newlen, "select count(*) from 'test';", 10000);
+    ASSERT_OK(sqlite3_verify_encrypted("test-clone2.db", newkey, newlen, 0, nullptr, nullptr));
+    ASSERT_EQ(SQLITE_NOTADB, sqlite3_verify_encrypted("test-clone2.db", key, keylen, 0, nullptr, nullptr));
+
+    removeDatabase("test-clone.db");
+    removeDatabase("test-clone2.db");
+}
+
+TEST_F(BasicTest, testNonceTestCryptClone) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new NonceTestCrypt());
+    });
+
+    const char *key = "42424242";
+    int keylen = strlen(key);
+
+    sqlite3 *db, *clone;
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    ASSERT_OK(sqlite3_exec(db, "create table 'test' (id INTEGER PRIMARY KEY, name TEXT);"
+                               "with recursive n(i) as (select 1 union all select i + 1 from n where i < 1000) "
+                               "insert into 'test' select i, printf('name-%08d', i) from n;", nullptr, nullptr,
+                           nullptr));
+    ASSERT_OK(sqlite3_clone_encrypted(db, "test-clone.db", nullptr, 0, 0));
+    ASSERT_OK(sqlite3_close(db));
+
+    // both keep the data key and write the same pages afterwards, alternately. the original reserves a new block of
+    // nonces after its last one, which the copy must not have been given.
+    NonceTestCrypt::nonces().clear();
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    ASSERT_OK(sqlite3_open_encrypted("test-clone.db", &clone, key, keylen));
+    for (int i = 0; i < 20; i++) {
+        std::string update = "update 'test' set name = 'changed-" + std::to_string(i) + "' where id % 20 = " +
+                             std::to_string(i) + ";";
+        ASSERT_OK(sqlite3_exec(db, update.c_str(), nullptr, nullptr, nullptr));
+        ASSERT_OK(sqlite3_exec(clone, update.c_str(), nullptr, nullptr, nullptr));
+    }
+    EXPECT_EQ(1000, queryInt(clone, "select count(*) from 'test' where name like 'changed-%';"));
+    ASSERT_OK(sqlite3_close(clone));
+    ASSERT_OK(sqlite3_close(db));
+
+    auto nonces = NonceTestCrypt::nonces();
+    ASSERT_LT(40u, nonces.size());
+    std::sort(nonces.begin(), nonces.end());
+    EXPECT_EQ(nonces.end(), std::adjacent_find(nonces.begin(), nonces.end()));
+
+    removeDatabase("test-clone.db");
+}
+
+TEST_F(BasicTest, testTestCryptVacuumInto) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+
+    const char *key = "42424242", *newkey = "8921897129818";
+    int keylen = strlen(key), newlen = strlen(newkey);
+
+    sqlite3 *db;
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    ASSERT_OK(sqlite3_exec(db, "create table 'test' (id INTEGER PRIMARY KEY, name TEXT);"
+                               "with recursive n(i) as (select 1 union all select i + 1 from n where i < 20000) "
+                               "insert into 'test' select i, printf('name-%08d', i) from n;"
+                               "delete from 'test' where id % 4 != 0;", nullptr, nullptr, nullptr));
+
+    // sharing the keys of the source
+    ASSERT_OK(sqlite3_vacuum_into_encrypted(db, "test-vacuum.db", nullptr, 0, 2));
+    // with a fresh data key under another file key
+    ASSERT_OK(sqlite3_vacuum_into_encrypted(db, "test-vacuum2.db", newkey, newlen, 0));
+    ASSERT_OK(sqlite3_close(db));
+
+    testQuery("test-vacuum.db", key, keylen, "select count(*) from 'test';", 5000);
+    testQuery("test-vacuum2.db", newkey, newlen, "select count(*) from 'test';", 5000);
+    EXPECT_LT(fileSize("test-vacuum.db"), fileSize("test.db"));
+    EXPECT_EQ(fileSize("test-vacuum.db"), fileSize("test-vacuum2.db"));
+
+    ASSERT_OK(sqlite3_verify_encrypted("test-vacuum.db", key, keylen, 0, nullptr, nullptr));
+    ASSERT_OK(sqlite3_verify_encrypted("test-vacuum2.db", newkey, newlen, 0, nullptr, nullptr));
+    ASSERT_EQ(SQLITE_NOTADB, sqlite3_verify_encrypted("test-vacuum2.db", key, keylen, 0, nullptr, nullptr));
+
+    removeDatabase("test-vacuum.db");
+    removeDatabase("test-vacuum2.db");
+}
+
+TEST_F(BasicTest, testTestCryptBatchAtomicWrite) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+
+    const char *key = "42424242";
+    int keylen = strlen(key);
+
+    const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI;
+    sqlite3 *db;
+    sqlite3_file *file;
+
+    // batches are opt-in
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    ASSERT_OK(sqlite3_file_control(db, "main", SQLITE_FCNTL_FILE_POINTER, &file));
+    EXPECT_FALSE(file->pMethods->xDeviceCharacteristics(file) & SQLITE_IOCAP_BATCH_ATOMIC);
+    ASSERT_OK(sqlite3_close(db));
+
+    ASSERT_OK(sqlite3_open_encrypted_v2("file:test.db?batch_atomic=1", &db, flags, key, keylen, nullptr));
+    ASSERT_OK(sqlite3_exec(db, "create table 'test' (id INTEGER PRIMARY KEY, name TEXT);"
+                               "with recursive n(i) as (select 1 union all select i + 1 from n where i < 2000) "
+                               "insert into 'test' select i, printf('name-%08d', i) from n;", nullptr, nullptr,
+                           nullptr));
+
+    // rollback mode transactions can be committed as a batch
+    ASSERT_OK(sqlite3_file_control(db, "main", SQLITE_FCNTL_FILE_POINTER, &file));
+    ASSERT_TRUE(file->pMethods->xDeviceCharacteristics(file) & SQLITE_IOCAP_BATCH_ATOMIC);
+
+    sqlite3_stmt *stmt;
+    ASSERT_OK(sqlite3_prepare_v2(db, "pragma page_size;", -1, &stmt, nullptr));
+    ASSERT_EQ(SQLITE_ROW, sqlite3_step(stmt));
+    int pageSize = sqlite3_column_int(stmt, 0);
+    ASSERT_OK(sqlite3_finalize(stmt));
+
+    // write pages 2 and 3 again as a batch, the way sqlite commits
+    ASSERT_OK(sqlite3_exec(db, "BEGIN EXCLUSIVE;", nullptr, nullptr, nullptr));
+    std::vector<uint8_t> pages(2 * pageSize);
+    ASSERT_OK(file->pMethods->xRead(file, pages.data(), pageSize, pageSize));
+    ASSERT_OK(file->pMethods->xRead(file, pages.data() + pageSize, pageSize, 2 * pageSize));
+    auto batch = [&] () {
+        ASSERT_OK(file->pMethods->xFileControl(file, SQLITE_FCNTL_BEGIN_ATOMIC_WRITE, nullptr));
+        ASSERT_OK(file->pMethods->xWrite(file, pages.data(), pageSize, pageSize));
+        ASSERT_OK(file->pMethods->xWrite(file, pages.data() + pageSize, pageSize, 2 * pageSize));
+    };
+
+    batch();
+    ASSERT_OK(file->pMethods->xFileControl(file, SQLITE_FCNTL_ROLLBACK_ATOMIC_WRITE, nullptr));
+    EXPECT_EQ(0, fileSize("test.db-redo"));
+
+    // the log holds the batch until the database is synced
+    batch();
+    ASSERT_OK(file->pMethods->xFileControl(file, SQLITE_FCNTL_COMMIT_ATOMIC_WRITE, nullptr));
+    std::string log = readFile("test.db-redo");
+    EXPECT_GT(log.size(), pages.size());
+    ASSERT_OK(file->pMethods->xSync(file, SQLITE_SYNC_NORMAL));
+    EXPECT_EQ(0, fileSize("test.db-redo"));
+    ASSERT_OK(sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_close(db));
+
+    // a crash after the log was synced: the pages in the database are lost, the log is written again on the next read
+    {
+        std::fstream dbFile("test.db", std::ios::binary | std::ios::in | std::ios::out);
+        std::vector<char> zeros(2 * pageSize, 0);
+        dbFile.seekp(pageSize);
+        dbFile.write(zeros.data(), zeros.size());
+        writeFile("test.db-redo", log);
+    }
+
+    // only connections writing batches look for the log
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    ASSERT_OK(sqlite3_close(db));
+    EXPECT_EQ(log, readFile("test.db-redo"));
+
+    ASSERT_OK(sqlite3_open_encrypted_v2("file:test.db?batch_atomic=1", &db, flags, key, keylen, nullptr));
+    EXPECT_EQ(2000, queryInt(db, "select count(*) from 'test';"));
+    EXPECT_EQ(0, fileSize("test.db-redo"));
+    ASSERT_OK(sqlite3_close(db));
+    ASSERT_OK(sqlite3_verify_encrypted("test.db", key, keylen, 0, nullptr, nullptr));
+
+    // a log torn by the crash is discarded
+    writeFile("test.db-redo", log.substr(0, log.size() / 2));
+    ASSERT_OK(sqlite3_open_encrypted_v2("file:test.db?batch_atomic=1", &db, flags, key, keylen, nullptr));
+    EXPECT_EQ(2000, queryInt(db, "select count(*) from 'test';"));
+    EXPECT_EQ(0, fileSize("test.db-redo"));
+    ASSERT_OK(sqlite3_close(db));
+
+}
+
+TEST_F(BasicTest, testTaggedTestCryptBatchAtomicRecovery) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TaggedTestCrypt());
+    });
+
+    const char *key = "42424242";
+    int keylen = strlen(key);
+    const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI;
+
+    sqlite3 *db;
+    ASSERT_OK(sqlite3_open_encrypted_v2("file:test.db?batch_atomic=1", &db, flags, key, keylen, nullptr));
+    ASSERT_OK(sqlite3_exec(db, "create table 'test' (id INTEGER PRIMARY KEY, name TEXT);"
+                               "with recursive n(i) as (select 1 union all select i + 1 from n where i < 2000) "
+                               "insert into 'test' select i, printf('name-%08d', i) from n;", nullptr, nullptr,
+                           nullptr));
+    ASSERT_OK(sqlite3_close(db));
+    std::string oldDb = readFile("test.db"), oldTree = readFile("test.db-merkle");
+
+    // the pages of a later transaction
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    ASSERT_OK(sqlite3_exec(db, "update 'test' set name = 'changed';", nullptr, nullptr, nullptr));
+    auto pageSize = static_cast<int>(queryInt(db, "pragma page_size;"));
+    auto pageCount = static_cast<int>(queryInt(db, "pragma page_count;"));
+    sqlite3_file *file;
+    ASSERT_OK(sqlite3_file_control(db, "main", SQLITE_FCNTL_FILE_POINTER, &file));
+    std::vector<uint8_t> pages(static_cast<size_t>(pageCount) * pageSize);
+    for (int i = 0; i < pageCount; i++)
+        ASSERT_OK(file->pMethods->xRead(file, &pages[static_cast<size_t>(i) * pageSize], pageSize,
+                                        static_cast<sqlite3_int64>(i) * pageSize));
+    ASSERT_OK(sqlite3_close(db));
+
+    // commit them as a batch on top of the old database, the crash comes before the tree is saved
+    writeFile("test.db", oldDb);
+    writeFile("test.db-merkle", oldTree);
+    ASSERT_OK(sqlite3_open_encrypted_v2("file:test.db?batch_atomic=1", &db, flags, key, keylen, nullptr));
+    ASSERT_OK(sqlite3_exec(db, "BEGIN EXCLUSIVE;", nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_file_control(db, "main", SQLITE_FCNTL_FILE_POINTER, &file));
+    ASSERT_OK(file->pMethods->xFileControl(file, SQLITE_FCNTL_BEGIN_ATOMIC_WRITE, nullptr));
+    for (int i = 0; i < pageCount; i++)
+        ASSERT_OK(file->pMethods->xWrite(file, &pages[static_cast<size_t>(i) * pageSize], pageSize,
+                                         static_cast<sqlite3_int64>(i) * pageSize));
+    ASSERT_OK(file->pMethods->xFileControl(file, SQLITE_FCNTL_COMMIT_ATOMIC_WRITE, nullptr));
+    std::string crashedDb = readFile("test.db"), log = readFile("test.db-redo");
+    ASSERT_FALSE(log.empty());
+    ASSERT_OK(sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_close(db));
+    writeFile("test.db", crashedDb);
+    writeFile("test.db-redo", log);
+    writeFile("test.db-merkle", oldTree);
+
+    // the log is replayed into the tree as well, so the pages authenticate
+    ASSERT_OK(sqlite3_open_encrypted_v2("file:test.db?batch_atomic=1", &db, flags, key, keylen, nullptr));
+    EXPECT_EQ(2000, queryInt(db, "select count(*) from 'test' where name = 'changed';"));
+    EXPECT_TRUE(readFile("test.db-redo").empty());
+    ASSERT_OK(sqlite3_close(db));
+    ASSERT_OK(sqlite3_verify_encrypted("test.db", key, keylen, 0, nullptr, nullptr));
+    EXPECT_NE(oldTree, readFile("test.db-merkle"));
+}
+
+TEST_F(BasicTest, testTestCryptStripes) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+
+    const char *key = "42424242";
+    int keylen = strlen(key);
+    const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI;
+
+    // all names are intact
+    const char *count = "select count(*) from 'test' where length(name) = 13;";
+    std::remove("test.db-stripe1");
+    std::remove("test.db-stripe2");
+
+    // the number of stripes is chosen when creating the database
+    sqlite3 *db;
+    ASSERT_OK(sqlite3_open_encrypted_v2("file:test.db?stripes=3", &db, flags, key, keylen, nullptr));
+    // stripes are not grown in chunks, which would count as pages
+    int chunkSize = 1024 * 1024;
+    ASSERT_EQ(SQLITE_NOTFOUND, sqlite3_file_control(db, "main", SQLITE_FCNTL_CHUNK_SIZE, &chunkSize));
+    ASSERT_OK(sqlite3_exec(db, "create table 'test' (id INTEGER PRIMARY KEY, name TEXT);"
+                               "with recursive n(i) as (select 1 union all select i + 1 from n where i < 5000) "
+                               "insert into 'test' select i, printf('name-%08d', i) from n;", nullptr, nullptr,
+                           nullptr));
+    ASSERT_EQ(SQLITE_MISUSE, sqlite3_clone_encrypted(db, "test-clone.db", nullptr, 0, 0));
+    ASSERT_OK(sqlite3_close(db));
+
+    // pages are distributed evenly
+    long total = fileSize("test.db") + fileSize("test.db-stripe1") + fileSize("test.db-stripe2");
+    EXPECT_GT(fileSize("test.db-stripe2"), 0);
+    EXPECT_LE(fileSize("test.db") - fileSize("test.db-stripe2"), total / 3);
+    testQuery("test.db", key, keylen, count, 5000, flags);
+    ASSERT_OK(sqlite3_verify_encrypted("test.db", key, keylen, 0, nullptr, nullptr));
+
+    // parallel scans read all stripes
+    std::atomic<sqlite3_int64> rows {0};
+    ASSERT_OK(sqlite3_open_encrypted_v2("test.db", &db, flags, key, keylen, nullptr));
+    ASSERT_OK(sqlite3_parallel_scan(db, "test", 4, [] (void *arg, int nRow, int, const sqlite3_int64 *,
+            const sqlite3_scan_value *) {
+        *static_cast<std::atomic<sqlite3_int64> *>(arg) += nRow;
+        return 0;
+    }, &rows));
+    ASSERT_OK(sqlite3_close(db));
+    EXPECT_EQ(5000, rows.load());
+
+    // shrinking truncates all stripes, the WAL is checkpointed into them
+    ASSERT_OK(sqlite3_open_encrypted_v2("test.db", &db, flags, key, keylen, nullptr));
+    ASSERT_OK(sqlite3_exec(db, "delete from 'test' where id > 1000; VACUUM; pragma journal_mode=WAL;"
+                               "insert into 'test' (name) values ('name-extra001');"
+                               "pragma wal_checkpoint(TRUNCATE);", nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_close(db));
+    EXPECT_LT(fileSize("test.db") + fileSize("test.db-stripe1") + fileSize("test.db-stripe2"), total);
+    testQuery("test.db", key, keylen, count, 1001, flags);
+    ASSERT_OK(sqlite3_verify_encrypted("test.db", key, keylen, 0, nullptr, nullptr));
+
+    // a missing stripe is not created again
+    std::remove("test.db-stripe2");
+    EXPECT_NE(SQLITE_OK, sqlite3_open_encrypted_v2("test.db", &db, flags, key, keylen, nullptr));
+    sqlite3_close(db);
+
+    std::remove("test.db-stripe1");
+    std::remove("test.db-wal");
+    std::remove("test.db-shm");
+}
+
+TEST_F(BasicTest, testTestCryptPageCache) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+
+    const char *key = "42424242";
+    int keylen = strlen(key);
+    const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+
+    // far fewer pages than the database has, so pages are evicted
+    cryptosqlite::setPageCache(".", 16);
+    sqlite3 *cached;
+    ASSERT_OK(sqlite3_open_encrypted_v2("test.db", &cached, flags, key, keylen, nullptr));
+    ASSERT_OK(sqlite3_exec(cached, "pragma cache_size=4; create table 'test' (id INTEGER PRIMARY KEY, name TEXT);"
+                                   "with recursive n(i) as (select 1 union all select i + 1 from n where i < 3000) "
+                                   "insert into 'test' select i, printf('name-%08d', i) from n;", nullptr, nullptr,
+                           nullptr));
+    EXPECT_EQ(3000, queryInt(cached, "select count(*) from 'test' where name like 'name-%';"));
+
+    // writes go through the cache, truncation drops pages. Afterwards, all pages fit into the cache
+    ASSERT_OK(sqlite3_exec(cached, "delete from 'test' where id > 2000; VACUUM;", nullptr, nullptr, nullptr));
+    EXPECT_EQ(2000, queryInt(cached, "select count(*) from 'test' where name like 'name-%';"));
+
+    // a connection without the cache writes
+    cryptosqlite::setPageCache("", 0);
+    sqlite3 *direct;
+    ASSERT_OK(sqlite3_open_encrypted_v2("test.db", &direct, flags, key, keylen, nullptr));
+    ASSERT_OK(sqlite3_exec(direct, "update 'test' set name = printf('othr-%08d', id) where id % 2 = 0;", nullptr,
+                           nullptr, nullptr));
+    EXPECT_EQ(1000, queryInt(cached, "select count(*) from 'test' where name like 'othr-%';"));
+
+#ifdef __linux__
+    // detected by the change counter, also if size and modification time of the file stay the same
+    struct stat before {};
+    ASSERT_EQ(0, stat("test.db", &before));
+    ASSERT_OK(sqlite3_exec(direct, "update 'test' set name = printf('same-%08d', id) where id % 2 = 1;", nullptr,
+                           nullptr, nullptr));
+    struct timespec times[2] = {before.st_atim, before.st_mtim};
+    ASSERT_EQ(0, utimensat(AT_FDCWD, "test.db", times, 0));
+    EXPECT_EQ(1000, queryInt(cached, "select count(*) from 'test' where name like 'same-%';"));
+#else
+    ASSERT_OK(sqlite3_exec(direct, "update 'test' set name = printf('same-%08d', id) where id % 2 = 1;", nullptr,
+                           nullptr, nullptr));
+#endif
+
+    // in WAL mode, another connection's checkpoint writes the database
+    ASSERT_OK(sqlite3_exec(cached, "pragma journal_mode=WAL;", nullptr, nullptr, nullptr));
+    EXPECT_EQ(1000, queryInt(cached, "select count(*) from 'test' where name like 'othr-%';"));
+    ASSERT_OK(sqlite3_exec(direct, "update 'test' set name = printf('last-%08d', id) where id <= 500;"
+                                   "pragma wal_checkpoint(TRUNCATE);", nullptr, nullptr, nullptr));
+    EXPECT_EQ(500, queryInt(cached, "select count(*) from 'test' where name like 'last-%';"));
+    EXPECT_EQ(750, queryInt(cached, "select count(*) from 'test' where name like 'same-%';"));
+
+    ASSERT_OK(sqlite3_close(direct));
+    ASSERT_OK(sqlite3_close(cached));
+
+    std::remove("test.db-wal");
+    std::remove("test.db-shm");
+}
+
+TEST_F(BasicTest, testNonceTestCryptFieldFunctions) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new NonceTestCrypt());
+    });
+
+    const char *key = "42424242";
+    int keylen = strlen(key);
+    const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+
+    auto query = [] (sqlite3 *db, const char *sql) {
+        sqlite3_stmt *stmt;
+        std::string result;
+        EXPECT_EQ(SQLITE_OK, sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr));
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            for (int i = 0; i < sqlite3_column_count(stmt); i++) {
+                auto *text = sqlite3_column_text(stmt, i);
+                result += std::string(text ? reinterpret_cast<const char *>(text) : "NULL") + "|";
+            }
+        }
+        EXPECT_EQ(SQLITE_OK, sqlite3_finalize(stmt));
+        return result;
+    };
+
+    sqlite3 *db;
+    ASSERT_OK(sqlite3_open_encrypted_v2("test.db", &db, flags, key, keylen, nullptr));
+    ASSERT_OK(sqlite3_exec(db, "create table 'test' (id INTEGER PRIMARY KEY, secret BLOB);", nullptr, nullptr,
+                           nullptr));
+    // opening created the field key in a transaction of its own, it survives a rollback of the first use
+    EXPECT_EQ(1, queryInt(db, "select count(*) from main.cryptosqlite_fields;"));
+    ASSERT_OK(sqlite3_exec(db, "begin; select csq_encrypt('lost'); rollback;", nullptr, nullptr, nullptr));
+    EXPECT_EQ(1, queryInt(db, "select count(*) from main.cryptosqlite_fields;"));
+    ASSERT_OK(sqlite3_exec(db, "insert into 'test' values (1, csq_encrypt('text')), (2, csq_encrypt(-42)), "
+                               "(3, csq_encrypt(2.5)), (4, csq_encrypt(x'00ff')), (5, csq_encrypt(NULL)), "
+                               "(6, csq_encrypt(''));"
+                               "with recursive n(i) as (select 7 union all select i + 1 from n where i < 1006) "
+                               "insert into 'test' select i, csq_encrypt(printf('secret-%d', i)) from n;", nullptr,
+                           nullptr, nullptr));
+    ASSERT_OK(sqlite3_close(db));
+
+    // values keep their type, are stored as blobs without their plaintext and differ for the same plaintext
+    ASSERT_OK(sqlite3_open_encrypted_v2("test.db", &db, flags, key, keylen, nullptr));
+    EXPECT_EQ("text|text|integer|-42|real|2.5|blob|00FF|null|NULL|text||",
+              query(db, "select typeof(csq_decrypt(secret)), case typeof(csq_decrypt(secret)) when 'blob' then "
+                        "hex(csq_decrypt(secret)) else csq_decrypt(secret) end from 'test' where id <= 6 order by id;"));
+    EXPECT_EQ("1000|0|1000|", query(db, "select count(*), sum(instr(secret, 'secret-') > 0), "
+                                        "sum(csq_decrypt(secret) = printf('secret-%d', id)) from 'test' "
+                                        "where typeof(secret) = 'blob' and id > 6;"));
+    EXPECT_EQ("1|", query(db, "select csq_encrypt('same') != csq_encrypt('same');"));
+
+    // no decryption from the schema, malformed values are rejected
+    ASSERT_OK(sqlite3_exec(db, "create view 'plain' as select csq_decrypt(secret) from 'test';", nullptr, nullptr,
+                           nullptr));
+    EXPECT_NE(SQLITE_OK, sqlite3_exec(db, "select * from 'plain';", nullptr, nullptr, nullptr));
+    EXPECT_NE(SQLITE_OK, sqlite3_exec(db, "select csq_decrypt('text');", nullptr, nullptr, nullptr));
+    EXPECT_NE(SQLITE_OK, sqlite3_exec(db, "select csq_decrypt(substr(secret, 1, 20)) from 'test' where id = 1;",
+                                      nullptr, nullptr, nullptr));
+
+    // the stored key is wrapped, copies with a fresh data key wrap it again
+    std::string stored = query(db, "select hex(key) from main.cryptosqlite_fields;");
+    ASSERT_OK(sqlite3_vacuum_into_encrypted(db, "test-vacuum.db", "1234", 4, 0));
+    ASSERT_OK(sqlite3_close(db));
+
+    const char *check = "select count(*) from 'test' where csq_decrypt(secret) = printf('secret-%d', id);";
+    testQuery("test-vacuum.db", "1234", 4, check, 1000);
+    ASSERT_OK(sqlite3_open_encrypted_v2("test-vacuum.db", &db, flags, "1234", 4, nullptr));
+    EXPECT_NE(stored, query(db, "select hex(key) from main.cryptosqlite_fields;"));
+    ASSERT_OK(sqlite3_close(db));
+    removeDatabase("test-vacuum.db");
+
+    sqlite3_rekey_task *task = sqlite3_rekey_encrypted_async("test.db", key, keylen, key, keylen,
+                                                             CRYPTOSQLITE_REKEY_ROTATE, 0, nullptr, nullptr);
+    ASSERT_OK(sqlite3_rekey_wait(task));
+    testQuery("test.db", key, keylen, check, 1000);
+
+    // the nonces of the counter do not fit the page number of plugins without nonces
+    removeDatabase("test.db");
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+    ASSERT_OK(sqlite3_open_encrypted_v2("test.db", &db, flags, key, keylen, nullptr));
+    EXPECT_EQ(SQLITE_MISUSE, sqlite3_exec(db, "select csq_encrypt('text');", nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_close(db));
+}
+
+TEST_F(BasicTest, testTestCryptLockStats) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+
+    const char *key = "42424242";
+    int keylen = strlen(key);
+
+    // opening registers the database and attaches it under the connection mutex
+    cryptosqlite::resetLockStats();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; i++) {
+        threads.emplace_back([key, keylen] {
+            sqlite3 *db;
+            EXPECT_EQ(SQLITE_OK, sqlite3_open_encrypted_v2("test.db", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                                                           key, keylen, nullptr));
+            EXPECT_EQ(SQLITE_OK, sqlite3_close(db));
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+
+    cryptosqlite::LockContention registry {}, connection {};
+    cryptosqlite::lockStats(registry, connection);
+    EXPECT_GE(registry.acquisitions, 8u);
+    EXPECT_LE(registry.contended, registry.acquisitions);
+    EXPECT_EQ(4u, connection.acquisitions);
+    EXPECT_LE(connection.contended, connection.acquisitions);
+
+    cryptosqlite::resetLockStats();
+    cryptosqlite::lockStats(registry, connection);
+    EXPECT_EQ(0u, registry.acquisitions + registry.contended + registry.waitNanoseconds + connection.acquisitions);
+}
+
+TEST_F(BasicTest, testTestCryptIOTrace) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+
+    const char *key = "42424242";
+    int keylen = strlen(key);
+
+    sqlite3 *db;
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    ASSERT_OK(sqlite3_exec(db, "CREATE TABLE t (a TEXT);", nullptr, nullptr, nullptr));
+
+    // the connection was opened before tracing started
+    ASSERT_TRUE(cryptosqlite::setIOTrace("test-trace.bin"));
+    ASSERT_OK(sqlite3_exec(db, "INSERT INTO t VALUES ('traced'); SELECT * FROM t;", nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_close(db));
+    ASSERT_TRUE(cryptosqlite::setIOTrace(""));
+
+    std::ifstream in("test-trace.bin", std::ios::binary);
+    std::vector<uint8_t> trace((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    ASSERT_GT(trace.size(), 16u);
+    EXPECT_EQ(0, memcmp(trace.data(), "CSQTRACE", 8));
+    EXPECT_EQ(0u, (trace.size() - 16) % 40);
+
+    // role and op of each record, and the cipher time of page writes to the main db
+    std::set<std::pair<int, int>> seen;
+    bool cipherTimed = false;
+    for (size_t i = 16; i + 40 <= trace.size(); i += 40) {
+        const uint8_t *record = trace.data() + i;
+        seen.emplace(record[12], record[13]);
+        uint32_t cipher = (uint32_t(record[36]) << 24) | (uint32_t(record[37]) << 16) | (uint32_t(record[38]) << 8) |
+                          record[39];
+        if (record[12] == 1 && record[13] == 4 && cipher > 0)
+            cipherTimed = true;
+    }
+    // main db opened, read, written, synced and closed, journal opened and written
+    for (int op : {1, 2, 3, 4, 5})
+        EXPECT_EQ(1u, seen.count({1, op})) << op;
+    EXPECT_EQ(1u, seen.count({2, 1}));
+    EXPECT_EQ(1u, seen.count({2, 4}));
+    EXPECT_TRUE(cipherTimed);
+    std::remove("test-trace.bin");
+}
+
+TEST_F(BasicTest, testTestCryptJournalEncrypted) {
+    cryptosqlite::setCryptoFactory([] (std::unique_ptr<IDataCrypt> &crypt) {
+        crypt.reset(new TestCrypt());
+    });
+
+    const char *key = "42424242";
+    int keylen = strlen(key);
+    const char *marker = "journal-plaintext-marker";
+    auto contains = [marker] (const char *fileName) {
+        std::ifstream in(fileName, std::ios::binary);
+        std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        return content.find(marker) != std::string::npos;
+    };
+
+    // the old page with the marker goes to the rollback journal, which is kept
+    sqlite3 *db;
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    ASSERT_OK(sqlite3_exec(db, "PRAGMA journal_mode=PERSIST; CREATE TABLE t (a TEXT);"
+                               "INSERT INTO t VALUES ('journal-plaintext-marker');"
+                               "UPDATE t SET a = 'changed';", nullptr, nullptr, nullptr));
+    EXPECT_FALSE(contains("test.db-journal"));
+
+    // the journal's copy of page 1 is the old page, the keyfile must keep the first page of the database
+    std::string keyFile = readFile("test.db-keyfile");
+    ASSERT_OK(sqlite3_exec(db, "BEGIN; CREATE TABLE u (a);", nullptr, nullptr, nullptr));
+    EXPECT_EQ(keyFile, readFile("test.db-keyfile"));
+    ASSERT_OK(sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr));
+    ASSERT_OK(sqlite3_close(db));
+    std::remove("test.db-journal");
+
+    // frames stay in the WAL while the connection is open, page 1 reaches the keyfile at the checkpoint
+    ASSERT_OK(sqlite3_open_encrypted("test.db", &db, key, keylen));
+    ASSERT_OK(sqlite3_exec(db, "PRAGMA journal_mode=WAL; PRAGMA wal_autocheckpoint=0;", nullptr, nullptr, nullptr));
+    keyFile = readFile("test.db-keyfile");
+    ASSERT_OK(sqlite3_exec(db, "INSERT INTO t VALUES ('journal-plaintext-marker'); CREATE TABLE u (a);", nullptr,
+                           nullptr, nullptr));
+    EXPECT_FALSE(contains("test.db-wal"));
+    EXPECT_EQ(keyFile, readFile("test.db-keyfile"));
+    int count = 0;
+    ASSERT_OK(sqlite3_exec(db, "SELECT * FROM t WHERE a = 'journal-plaintext-marker';", [] (void *data, int, char **,
+                                                                                           char **) -> int {
+        (*static_cast<int *>(data))++;
+        return 0;
+    }, &count, nullptr));
+    EXPECT_EQ(1, count);
+    ASSERT_OK(sqlite3_close(db));
+}
+
 void BasicTest::testWrite(const char *key, int keylen, bool transact, int insertCount) {
     // test params
     const char* dbName = "test.db";
@@ -192,3 +1767,44 @@ void BasicTest::testRekey(const char *oldkey, int oldkeylen, const char *newkey,
     // open DB
     ASSERT_OK(sqlite3_rekey_encrypted(dbName, oldkey, oldkeylen, newkey, newkeylen));
 }
+
+void BasicTest::testQuery(const char *fileName, const char *key, int keylen, const char *sql, sqlite3_int64 expected,
+                          int flags) {
+    sqlite3 *db;
+    ASSERT_OK(sqlite3_open_encrypted_v2(fileName, &db, flags, key, keylen, nullptr));
+    EXPECT_EQ(expected, queryInt(db, sql)) << sql;
+    ASSERT_OK(sqlite3_close(db));
+}
+
+sqlite3_int64 BasicTest::queryInt(sqlite3 *db, const char *sql) {
+    sqlite3_stmt *stmt;
+    EXPECT_EQ(SQLITE_OK, sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr));
+    EXPECT_EQ(SQLITE_ROW, sqlite3_step(stmt));
+    sqlite3_int64 result = sqlite3_column_int64(stmt, 0);
+    EXPECT_EQ(SQLITE_OK, sqlite3_finalize(stmt));
+    return result;
+}
+
+int BasicTest::countRows(void *count, int, char **, char **) {
+    (*static_cast<int *>(count))++;
+    return 0;
+}
+
+long BasicTest::fileSize(const char *fileName) {
+    std::ifstream file(fileName, std::ios::binary | std::ios::ate);
+    return file ? static_cast<long>(file.tellg()) : 0L;
+}
+
+std::string BasicTest::readFile(const char *fileName) {
+    std::ifstream file(fileName, std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+void BasicTest::writeFile(const char *fileName, const std::string &contents) {
+    std::ofstream(fileName, std::ios::binary).write(contents.data(), contents.size());
+}
+
+void BasicTest::removeDatabase(const char *fileName) {
+    for (const char *suffix : {"", "-keyfile", "-journal", "-wal", "-shm", "-merkle", "-merkle-journal"})
+        std::remove((std::string(fileName) + suffix).c_str());
+}
@@ -20,8 +20,10 @@
 #ifndef CRYPTOSQLITE_BASICTEST_H
 #define CRYPTOSQLITE_BASICTEST_H
 
+#include <string>
 #include <gtest/gtest.h>
 #include <sqlite3.h>
+#include <cryptosqlite/cryptosqlite.h>
 #include <cryptosqlite/crypto/PlaintextCrypt.h>
 #include "TestCrypt.h"
 
@@ -30,6 +32,14 @@ protected:
     virtual void SetUp() override {
         std::remove("test.db");
         std::remove("test.db-keyfile");
+        std::remove("test.db-merkle");
+        std::remove("test.db-redo");
+    }
+
+    virtual void TearDown() override {
+        // ciphers registered by a test must not change how later tests open databases
+        cryptosqlite::unregisterCipher("plain");
+        cryptosqlite::unregisterCipher("test");
     }
 
     void testReadWrite(const char *key, int keylen, bool transact = false, int insertCount = 1000) {
@@ -41,6 +51,34 @@ protected:
     void testRead(const char *key, int keylen, int insertCount = 1000);
     void testRekey(const char *oldkey, int oldkeylen, const char *newkey, int newkeylen);
     void testOpenFail(const char *key, int keylen);
+
+    /**
+     * Opens a database, expects a query to return a single value and closes the database again
+     */
+    void testQuery(const char *fileName, const char *key, int keylen, const char *sql, sqlite3_int64 expected,
+                   int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+
+    /**
+     * @return First column of the first row of a query
+     */
+    static sqlite3_int64 queryInt(sqlite3 *db, const char *sql);
+
+    /**
+     * sqlite3_exec() callback, counts the rows into an int
+     */
+    static int countRows(void *count, int, char **, char **);
+
+    /**
+     * @return Size of a file, 0 if it does not exist
+     */
+    static long fileSize(const char *fileName);
+    static std::string readFile(const char *fileName);
+    static void writeFile(const char *fileName, const std::string &contents);
+
+    /**
+     * Removes a database and the files kept next to it
+     */
+    static void removeDatabase(const char *fileName);
 };
 
 
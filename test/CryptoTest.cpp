@@ -17,9 +17,13 @@
  * along with cryptoSQLite.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <cstring>
+#include <string>
 #include <secure_memory/String.h>
 #include "CryptoTest.h"
 #include "TestCrypt.h"
+#include "../src/util/Sha256.h"
 
 TEST_F(CryptoTest, testTestCrypt) {
     String test1("kajlskjalksalsdjlkasdjlkasjdlkajsdlkjalejoiquoaijlakjdlksajdlkjaierojlkasiue3jwlalkajlskjalksalsdjlk"
@@ -43,4 +47,40 @@ TEST_F(CryptoTest, testTestCrypt) {
     testCrypt.decrypt(2, tmp, test2, key);
 
     ASSERT_EQ(test1, test2);
-}
\ No newline at end of file
+}
+
+TEST_F(CryptoTest, testSha256) {
+    auto hex = [] (const std::string &message, size_t chunk) {
+        // feed in chunks to cover block boundaries of update()
+        Sha256 sha;
+        for (size_t i = 0; i < message.size(); i += chunk)
+            sha.update(message.data() + i, std::min(chunk, message.size() - i));
+
+        uint8_t digest[Sha256::DIGEST_SIZE];
+        sha.finish(digest);
+        std::string result;
+        for (uint8_t byte : digest) {
+            result += "0123456789abcdef"[byte >> 4];
+            result += "0123456789abcdef"[byte & 0xf];
+        }
+        return result;
+    };
+
+    // known answers of FIPS 180-2, appendix B
+    for (size_t chunk : {1, 7, 64, 1000000}) {
+        EXPECT_EQ("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855", hex("", chunk));
+        EXPECT_EQ("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", hex("abc", chunk));
+        EXPECT_EQ("248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+                  hex("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", chunk));
+        EXPECT_EQ("cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0",
+                  hex(std::string(1000000, 'a'), chunk));
+    }
+
+    // the one-shot helper matches
+    uint8_t digest[Sha256::DIGEST_SIZE], expected[Sha256::DIGEST_SIZE];
+    Sha256::digest("abc", 3, digest);
+    Sha256 sha;
+    sha.update("abc", 3);
+    sha.finish(expected);
+    EXPECT_EQ(0, memcmp(expected, digest, sizeof(digest)));
+}
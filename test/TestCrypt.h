@@ -20,6 +20,11 @@
 #ifndef CRYPTOSQLITE_TESTCRYPT_H
 #define CRYPTOSQLITE_TESTCRYPT_H
 
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <vector>
+#include <cryptosqlite/cryptosqlite.h>
 #include <cryptosqlite/crypto/IDataCrypt.h>
 
 class TestCrypt : public IDataCrypt {
@@ -62,4 +67,79 @@ protected:
     }
 };
 
+/**
+ * TestCrypt with a checksum tag in the reserved bytes and a keyed digest, which enables the integrity tree
+ */
+class TaggedTestCrypt : public TestCrypt {
+public:
+    void encrypt(uint32_t page, const Buffer &source, Buffer &destination, const Buffer &key) const override {
+        TestCrypt::encrypt(page, source, destination, key);
+
+        uint64_t tag = checksum(page, destination.const_data(), source.size() - sizeof(tag), key);
+        memcpy(destination.data(source.size() - sizeof(tag)), &tag, sizeof(tag));
+    }
+
+    void decrypt(uint32_t page, const Buffer &source, Buffer &destination, const Buffer &key) const override {
+        uint64_t tag;
+        memcpy(&tag, source.const_data(source.size() - sizeof(tag)), sizeof(tag));
+        if (tag != checksum(page, source.const_data(), source.size() - sizeof(tag), key))
+            throw cryptosqlite_exception("Page authentication failed");
+
+        TestCrypt::decrypt(page, source, destination, key);
+    }
+
+    uint32_t digestSize() const override { return sizeof(uint64_t); }
+
+    void digest(const Buffer &source, Buffer &destination, const Buffer &key) const override {
+        uint64_t hash = checksum(0, source.const_data(), source.size(), key);
+        destination.write(&hash, sizeof(hash), 0);
+    }
+
+protected:
+    static uint64_t checksum(uint32_t page, const uint8_t *data, uint32_t size, const Buffer &key) {
+        // FNV-1a over key, page number and data
+        uint64_t hash = 14695981039346656037ull ^ page;
+        for (uint32_t i = 0; i < key.size(); i++)
+            hash = (hash ^ *key.const_data(i)) * 1099511628211ull;
+        for (uint32_t i = 0; i < size; i++)
+            hash = (hash ^ data[i]) * 1099511628211ull;
+        return hash;
+    }
+};
+
+/**
+ * TestCrypt storing the nonce provided by the codec in the reserved bytes, records all nonces it was given. Keys are
+ * random, so copies with a fresh data key can be told apart.
+ */
+class NonceTestCrypt : public TestCrypt {
+public:
+    void generateKey(Buffer &destination) const override {
+        std::random_device random;
+        for (int i = 0; i < 16; i++)
+            destination.appendValue(static_cast<uint8_t>(random()));
+    }
+
+    bool usesNonce() const override { return true; }
+
+    void encryptWithNonce(uint32_t page, uint64_t nonce, const Buffer &source, Buffer &destination,
+                          const Buffer &key) const override {
+        TestCrypt::encrypt(page, source, destination, key);
+        memcpy(destination.data(source.size() - sizeof(nonce)), &nonce, sizeof(nonce));
+
+        std::lock_guard<std::mutex> lock(mutex());
+        nonces().push_back(nonce);
+    }
+
+    static std::vector<uint64_t> &nonces() {
+        static std::vector<uint64_t> sNonces;
+        return sNonces;
+    }
+
+protected:
+    static std::mutex &mutex() {
+        static std::mutex sMutex;
+        return sMutex;
+    }
+};
+
 #endif //CRYPTOSQLITE_TESTCRYPT_H